@@ -27,6 +27,7 @@
 #include <keymaster/key_blob_utils/ae.h>
 #include <keymaster/key_factory.h>
 #include <keymaster/keymaster_context.h>
+#include <keymaster/km_openssl/hmac_sha256_multibuffer.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/operation.h>
 #include <keymaster/operation_table.h>
@@ -36,7 +37,7 @@ namespace keymaster {
 namespace {
 
 const uint8_t MAJOR_VER = 2;
-const uint8_t MINOR_VER = 0;
+const uint8_t MINOR_VER = 1;
 const uint8_t SUBMINOR_VER = 0;
 
 keymaster_error_t CheckVersionInfo(const AuthorizationSet& tee_enforced,
@@ -58,6 +59,13 @@ keymaster_error_t CheckVersionInfo(const AuthorizationSet& tee_enforced,
     return KM_ERROR_OK;
 }
 
+// An authorized HMAC-SHA256 record of a BatchComputeMacs() request, waiting for its MAC.
+struct PendingMac {
+    KeymasterKeyBlob key;
+    size_t mac_length;
+    MacRecordResult* result;
+};
+
 }  // anonymous namespace
 
 AndroidKeymaster::AndroidKeymaster(KeymasterContext* context, size_t operation_table_size)
@@ -207,6 +215,18 @@ AndroidKeymaster::VerifyAuthorization(const VerifyAuthorizationRequest& request)
     return policy->VerifyAuthorization(request);
 }
 
+BatchVerifyAuthorizationResponse
+AndroidKeymaster::BatchVerifyAuthorization(const BatchVerifyAuthorizationRequest& request) {
+    KeymasterEnforcement* policy = context_->enforcement_policy();
+    if (!policy) {
+        BatchVerifyAuthorizationResponse response;
+        response.error = KM_ERROR_UNIMPLEMENTED;
+        return response;
+    }
+
+    return policy->BatchVerifyAuthorization(request);
+}
+
 void AndroidKeymaster::AddRngEntropy(const AddEntropyRequest& request,
                                      AddEntropyResponse* response) {
     response->error = context_->AddRngEntropy(request.random_data.peek_read(),
@@ -299,29 +319,48 @@ void AndroidKeymaster::BeginOperation(const BeginOperationRequest& request,
     response->error = operation_table_->Add(move(operation));
 }
 
+keymaster_error_t
+AndroidKeymaster::AuthorizeContinuedOperation(keymaster_operation_handle_t op_handle,
+                                              const AuthorizationSet& additional_params,
+                                              Operation** operation) {
+    *operation = operation_table_->Find(op_handle);
+    if (*operation == nullptr)
+        return KM_ERROR_INVALID_OPERATION_HANDLE;
+
+    if (context_->enforcement_policy()) {
+        keymaster_error_t error = context_->enforcement_policy()->AuthorizeOperation(
+            (*operation)->purpose(), (*operation)->key_id(), (*operation)->authorizations(),
+            additional_params, op_handle, false /* is_begin_operation */);
+        if (error != KM_ERROR_OK) {
+            operation_table_->Delete(op_handle);
+            return error;
+        }
+    }
+    return KM_ERROR_OK;
+}
+
 void AndroidKeymaster::UpdateOperation(const UpdateOperationRequest& request,
                                        UpdateOperationResponse* response) {
     if (response == nullptr)
         return;
 
-    response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
-    Operation* operation = operation_table_->Find(request.op_handle);
-    if (operation == nullptr)
+    Operation* operation;
+    response->error =
+        AuthorizeContinuedOperation(request.op_handle, request.additional_params, &operation);
+    if (response->error != KM_ERROR_OK)
         return;
 
-    if (context_->enforcement_policy()) {
-        response->error = context_->enforcement_policy()->AuthorizeOperation(
-            operation->purpose(), operation->key_id(), operation->authorizations(),
-            request.additional_params, request.op_handle, false /* is_begin_operation */);
-        if (response->error != KM_ERROR_OK) {
-            operation_table_->Delete(request.op_handle);
-            return;
-        }
+    if (request.num_input_segments == 0) {
+        response->error =
+            operation->Update(request.additional_params, request.input, &response->output_params,
+                              &response->output, &response->input_consumed);
+    } else if (request.input.available_read() > 0) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+    } else {
+        response->error = operation->UpdateSegments(
+            request.additional_params, request.input_segments, request.num_input_segments,
+            &response->output_params, &response->output, &response->input_consumed);
     }
-
-    response->error =
-        operation->Update(request.additional_params, request.input, &response->output_params,
-                          &response->output, &response->input_consumed);
     if (response->error != KM_ERROR_OK) {
         // Any error invalidates the operation.
         operation_table_->Delete(request.op_handle);
@@ -333,26 +372,61 @@ void AndroidKeymaster::FinishOperation(const FinishOperationRequest& request,
     if (response == nullptr)
         return;
 
-    response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
-    Operation* operation = operation_table_->Find(request.op_handle);
-    if (operation == nullptr)
+    Operation* operation;
+    response->error =
+        AuthorizeContinuedOperation(request.op_handle, request.additional_params, &operation);
+    if (response->error != KM_ERROR_OK)
         return;
 
-    if (context_->enforcement_policy()) {
-        response->error = context_->enforcement_policy()->AuthorizeOperation(
-            operation->purpose(), operation->key_id(), operation->authorizations(),
-            request.additional_params, request.op_handle, false /* is_begin_operation */);
-        if (response->error != KM_ERROR_OK) {
-            operation_table_->Delete(request.op_handle);
-            return;
-        }
+    if (request.num_input_segments == 0) {
+        response->error =
+            operation->Finish(request.additional_params, request.input, request.signature,
+                              &response->output_params, &response->output);
+    } else if (request.input.available_read() > 0) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+    } else {
+        response->error = operation->FinishSegments(
+            request.additional_params, request.input_segments, request.num_input_segments,
+            request.signature, &response->output_params, &response->output);
     }
-
-    response->error = operation->Finish(request.additional_params, request.input, request.signature,
-                                        &response->output_params, &response->output);
     operation_table_->Delete(request.op_handle);
 }
 
+keymaster_error_t
+AndroidKeymaster::UpdateOperationInPlace(keymaster_operation_handle_t op_handle,
+                                         const AuthorizationSet& additional_params, uint8_t* data,
+                                         size_t data_length, AuthorizationSet* output_params) {
+    Operation* operation;
+    keymaster_error_t error = AuthorizeContinuedOperation(op_handle, additional_params, &operation);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    error = operation->UpdateInPlace(additional_params, data, data_length, output_params);
+    // Operations that can't work in place reject the call before touching any state, so the
+    // caller may carry on with UpdateOperation() instead.  Any other error invalidates the
+    // operation.
+    if (error != KM_ERROR_OK && error != KM_ERROR_UNIMPLEMENTED)
+        operation_table_->Delete(op_handle);
+    return error;
+}
+
+keymaster_error_t
+AndroidKeymaster::FinishOperationInPlace(keymaster_operation_handle_t op_handle,
+                                         const AuthorizationSet& additional_params, uint8_t* data,
+                                         size_t data_length, size_t data_capacity,
+                                         AuthorizationSet* output_params, size_t* output_length) {
+    Operation* operation;
+    keymaster_error_t error = AuthorizeContinuedOperation(op_handle, additional_params, &operation);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    error = operation->FinishInPlace(additional_params, data, data_length, data_capacity,
+                                     output_params, output_length);
+    if (error != KM_ERROR_UNIMPLEMENTED)
+        operation_table_->Delete(op_handle);
+    return error;
+}
+
 void AndroidKeymaster::AbortOperation(const AbortOperationRequest& request,
                                       AbortOperationResponse* response) {
     if (!response)
@@ -368,6 +442,339 @@ void AndroidKeymaster::AbortOperation(const AbortOperationRequest& request,
     operation_table_->Delete(request.op_handle);
 }
 
+void AndroidKeymaster::BatchAeadOperation(const BatchAeadOperationRequest& request,
+                                          BatchAeadOperationResponse* response) {
+    if (!response)
+        return;
+
+    keymaster_block_mode_t block_mode;
+    response->error = KM_ERROR_UNSUPPORTED_BLOCK_MODE;
+    if (!request.additional_params.GetTagValue(TAG_BLOCK_MODE, &block_mode) ||
+        (block_mode != KM_MODE_GCM && block_mode != KM_MODE_CHACHA20_POLY1305))
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
+    if (request.purpose != KM_PURPOSE_ENCRYPT && request.purpose != KM_PURPOSE_DECRYPT) return;
+
+    const KeyFactory* key_factory;
+    UniquePtr<Key> key;
+    response->error = LoadKey(request.key_blob, request.additional_params, &key_factory, &key);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    keymaster_algorithm_t key_algorithm;
+    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm) ||
+        key_algorithm != KM_ALGORITHM_AES)
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
+    OperationFactory* factory = key_factory->GetOperationFactory(request.purpose);
+    if (!factory) return;
+
+    // A single operation, restarted for each record, processes the whole batch so that the key is
+    // loaded and its schedule computed only once.  It never enters the operation table.
+    OperationPtr operation(
+        factory->CreateOperation(move(*key), request.additional_params, &response->error));
+    if (operation.get() == nullptr) return;
+
+    if (context_->enforcement_policy()) {
+        km_id_t key_id;
+        response->error = KM_ERROR_UNKNOWN_ERROR;
+        if (!context_->enforcement_policy()->CreateKeyId(request.key_blob, &key_id)) return;
+        operation->set_key_id(key_id);
+    }
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->AllocateResults(request.num_records)) return;
+
+    bool begun = false;
+    AuthorizationSet record_params;
+    for (size_t i = 0; i < request.num_records; ++i) {
+        const AeadRecord& record = request.records[i];
+        AeadRecordResult* result = &response->results[i];
+
+        // Each record gets the parameters a separate Begin/Finish pair for it would have carried.
+        result->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        if (!record_params.Reinitialize(request.additional_params)) continue;
+        if (record.nonce.available_read() &&
+            !record_params.push_back(TAG_NONCE, record.nonce.peek_read(),
+                                     record.nonce.available_read()))
+            continue;
+        if (record.aad.available_read() &&
+            !record_params.push_back(TAG_ASSOCIATED_DATA, record.aad.peek_read(),
+                                     record.aad.available_read()))
+            continue;
+
+        result->error = ProcessAeadRecord(record_params, record, operation.get(), &begun, result);
+    }
+
+    response->error = KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::BeginBatchRecord(const AuthorizationSet& record_params,
+                                                     Operation* operation, bool* begun,
+                                                     AuthorizationSet* output_params) {
+    KeymasterEnforcement* policy = context_->enforcement_policy();
+    keymaster_error_t error;
+    if (policy) {
+        error = policy->AuthorizeOperation(operation->purpose(), operation->key_id(),
+                                           operation->authorizations(), record_params,
+                                           0 /* op_handle */, true /* is_begin_operation */);
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    if (*begun)
+        error = operation->Restart(record_params, output_params);
+    else
+        error = operation->Begin(record_params, output_params);
+    if (error != KM_ERROR_OK) return error;
+    *begun = true;
+
+    if (policy) {
+        error = policy->AuthorizeOperation(operation->purpose(), operation->key_id(),
+                                           operation->authorizations(), record_params,
+                                           operation->operation_handle(),
+                                           false /* is_begin_operation */);
+        if (error != KM_ERROR_OK) return error;
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::ProcessAeadRecord(const AuthorizationSet& record_params,
+                                                      const AeadRecord& record,
+                                                      Operation* operation, bool* begun,
+                                                      AeadRecordResult* result) {
+    AuthorizationSet output_params;
+    keymaster_error_t error = BeginBatchRecord(record_params, operation, begun, &output_params);
+    if (error != KM_ERROR_OK) return error;
+
+    // Encryption reports the nonce it used, which may have been generated.
+    keymaster_blob_t nonce;
+    if (!output_params.GetTagValue(TAG_NONCE, &nonce)) {
+        nonce.data = record.nonce.peek_read();
+        nonce.data_length = record.nonce.available_read();
+    }
+    if (!result->nonce.Reinitialize(nonce.data, nonce.data_length))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    Buffer signature;
+    output_params.Clear();
+    return operation->Finish(record_params, record.input, signature, &output_params,
+                             &result->output);
+}
+
+void AndroidKeymaster::BatchVerifySignatures(const BatchVerifySignaturesRequest& request,
+                                             BatchVerifySignaturesResponse* response) {
+    if (!response)
+        return;
+
+    const KeyFactory* key_factory;
+    UniquePtr<Key> key;
+    response->error = LoadKey(request.key_blob, request.additional_params, &key_factory, &key);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    keymaster_algorithm_t key_algorithm;
+    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm) ||
+        (key_algorithm != KM_ALGORITHM_RSA && key_algorithm != KM_ALGORITHM_EC &&
+         key_algorithm != KM_ALGORITHM_ED25519))
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
+    OperationFactory* factory = key_factory->GetOperationFactory(KM_PURPOSE_VERIFY);
+    if (!factory) return;
+
+    // As for BatchAeadOperation(), one operation, restarted for each record, verifies the whole
+    // batch so that the key is parsed and the digest context set up only once.
+    OperationPtr operation(
+        factory->CreateOperation(move(*key), request.additional_params, &response->error));
+    if (operation.get() == nullptr) return;
+
+    if (context_->enforcement_policy()) {
+        km_id_t key_id;
+        response->error = KM_ERROR_UNKNOWN_ERROR;
+        if (!context_->enforcement_policy()->CreateKeyId(request.key_blob, &key_id)) return;
+        operation->set_key_id(key_id);
+    }
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->AllocateResults(request.num_records)) return;
+
+    bool begun = false;
+    AuthorizationSet output_params;
+    Buffer output;
+    for (size_t i = 0; i < request.num_records; ++i) {
+        const SignatureRecord& record = request.records[i];
+        output_params.Clear();
+        keymaster_error_t error =
+            BeginBatchRecord(request.additional_params, operation.get(), &begun, &output_params);
+        if (error == KM_ERROR_OK)
+            error = operation->Finish(request.additional_params, record.input, record.signature,
+                                      &output_params, &output);
+        response->results[i] = error;
+    }
+
+    response->error = KM_ERROR_OK;
+}
+
+void AndroidKeymaster::BatchComputeMacs(const BatchComputeMacsRequest& request,
+                                        BatchComputeMacsResponse* response) {
+    if (!response)
+        return;
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->AllocateResults(request.num_records)) return;
+
+    // Every record is loaded and authorized on its own, but HMAC-SHA256 records are then MACed
+    // together, several per SIMD pass, by ComputeHmacSha256s().
+    UniquePtr<PendingMac[]> pending(new (std::nothrow) PendingMac[request.num_records]);
+    UniquePtr<HmacSha256Job[]> jobs(new (std::nothrow) HmacSha256Job[request.num_records]);
+    if (!pending.get() || !jobs.get()) return;
+
+    size_t job_count = 0;
+    for (size_t i = 0; i < request.num_records; ++i) {
+        const MacRecord& record = request.records[i];
+        MacRecordResult* result = &response->results[i];
+        PendingMac* next = &pending[job_count];
+        result->error = ComputeMacRecord(request.additional_params, record, &result->mac,
+                                         &next->key, &next->mac_length);
+        if (result->error != KM_ERROR_OK || next->mac_length == 0) continue;
+
+        next->result = result;
+        HmacSha256Job* job = &jobs[job_count++];
+        job->key = next->key.key_material;
+        job->key_length = next->key.key_material_size;
+        job->message = record.input.peek_read();
+        job->message_length = record.input.available_read();
+    }
+
+    ComputeHmacSha256s(jobs.get(), job_count);
+    for (size_t i = 0; i < job_count; ++i) {
+        if (!pending[i].result->mac.Reinitialize(jobs[i].mac, pending[i].mac_length))
+            pending[i].result->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    response->error = KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::ComputeMacRecord(const AuthorizationSet& additional_params,
+                                                     const MacRecord& record, Buffer* mac,
+                                                     KeymasterKeyBlob* sha256_key,
+                                                     size_t* sha256_mac_length) {
+    *sha256_mac_length = 0;
+
+    const KeyFactory* key_factory;
+    UniquePtr<Key> key;
+    keymaster_error_t error = LoadKey(record.key_blob, additional_params, &key_factory, &key);
+    if (error != KM_ERROR_OK) return error;
+
+    keymaster_algorithm_t key_algorithm;
+    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm) ||
+        key_algorithm != KM_ALGORITHM_HMAC)
+        return KM_ERROR_UNSUPPORTED_ALGORITHM;
+
+    OperationFactory* factory = key_factory->GetOperationFactory(KM_PURPOSE_SIGN);
+    if (!factory) return KM_ERROR_UNSUPPORTED_PURPOSE;
+
+    // The operation takes the key material, so keep a copy for the caller to MAC with.
+    keymaster_digest_t digest;
+    KeymasterKeyBlob key_material;
+    bool sha256 = key->authorizations().GetTagValue(TAG_DIGEST, &digest) &&
+                  digest == KM_DIGEST_SHA_2_256;
+    if (sha256) {
+        key_material = key->key_material();
+        if (!key_material.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    // Unlike the other batch commands, every record has its own key, so each gets its own
+    // operation.  Setting the key ID lets an HmacContextCache recognize keys seen before.
+    OperationPtr operation(factory->CreateOperation(move(*key), additional_params, &error));
+    if (operation.get() == nullptr) return error;
+
+    if (context_->enforcement_policy()) {
+        km_id_t key_id;
+        if (!context_->enforcement_policy()->CreateKeyId(record.key_blob, &key_id))
+            return KM_ERROR_UNKNOWN_ERROR;
+        operation->set_key_id(key_id);
+    }
+
+    bool begun = false;
+    AuthorizationSet output_params;
+    error = BeginBatchRecord(additional_params, operation.get(), &begun, &output_params);
+    if (error != KM_ERROR_OK) return error;
+
+    // HmacOperation keys its context on first use, so the operation, which has served to check
+    // the MAC length and authorize the record, is dropped without having hashed anything.
+    if (sha256) {
+        uint32_t mac_length_bits;
+        if (!additional_params.GetTagValue(TAG_MAC_LENGTH, &mac_length_bits))
+            return KM_ERROR_MISSING_MAC_LENGTH;
+        *sha256_key = move(key_material);
+        *sha256_mac_length = mac_length_bits / 8;
+        return KM_ERROR_OK;
+    }
+
+    Buffer signature;
+    output_params.Clear();
+    return operation->Finish(additional_params, record.input, signature, &output_params, mac);
+}
+
+void AndroidKeymaster::BatchAgreeKeys(const BatchAgreeKeysRequest& request,
+                                      BatchAgreeKeysResponse* response) {
+    if (!response)
+        return;
+
+    const KeyFactory* key_factory;
+    UniquePtr<Key> key;
+    response->error = LoadKey(request.key_blob, request.additional_params, &key_factory, &key);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    keymaster_algorithm_t key_algorithm;
+    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm) ||
+        key_algorithm != KM_ALGORITHM_EC)
+        return;
+
+    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
+    OperationFactory* factory = key_factory->GetOperationFactory(KM_PURPOSE_AGREE_KEY);
+    if (!factory) return;
+
+    // As for BatchVerifySignatures(), one operation, restarted for each peer, so that the private
+    // key is parsed and checked only once.
+    OperationPtr operation(
+        factory->CreateOperation(move(*key), request.additional_params, &response->error));
+    if (operation.get() == nullptr) return;
+
+    if (context_->enforcement_policy()) {
+        km_id_t key_id;
+        response->error = KM_ERROR_UNKNOWN_ERROR;
+        if (!context_->enforcement_policy()->CreateKeyId(request.key_blob, &key_id)) return;
+        operation->set_key_id(key_id);
+    }
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->AllocateResults(request.num_peer_public_values)) return;
+
+    bool begun = false;
+    AuthorizationSet output_params;
+    Buffer signature;
+    for (size_t i = 0; i < request.num_peer_public_values; ++i) {
+        AgreementResult* result = &response->results[i];
+        output_params.Clear();
+        result->error =
+            BeginBatchRecord(request.additional_params, operation.get(), &begun, &output_params);
+        if (result->error == KM_ERROR_OK)
+            result->error =
+                operation->Finish(request.additional_params, request.peer_public_values[i],
+                                  signature, &output_params, &result->secret);
+    }
+
+    response->error = KM_ERROR_OK;
+}
+
 void AndroidKeymaster::ExportKey(const ExportKeyRequest& request, ExportKeyResponse* response) {
     if (response == nullptr)
         return;
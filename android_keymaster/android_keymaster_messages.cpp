@@ -68,6 +68,47 @@ static bool deserialize_blob(keymaster_blob_t* blob, const uint8_t** buf_ptr, co
     return true;
 }
 
+/*
+ * Helper functions for working with input segment lists.
+ */
+
+static bool allocate_buffers(Buffer** buffers, size_t* count, size_t new_count) {
+    delete[] *buffers;
+    *count = 0;
+    *buffers = new (std::nothrow) Buffer[new_count];
+    if (!*buffers) return false;
+    *count = new_count;
+    return true;
+}
+
+static size_t buffers_size(const Buffer* buffers, size_t count) {
+    size_t size = sizeof(uint32_t) /* count */;
+    for (size_t i = 0; i < count; ++i)
+        size += buffers[i].SerializedSize();
+    return size;
+}
+
+static uint8_t* serialize_buffers(const Buffer* buffers, size_t count, uint8_t* buf,
+                                  const uint8_t* end) {
+    buf = append_uint32_to_buf(buf, end, count);
+    for (size_t i = 0; i < count; ++i)
+        buf = buffers[i].Serialize(buf, end);
+    return buf;
+}
+
+static bool deserialize_buffers(Buffer** buffers, size_t* count, const uint8_t** buf_ptr,
+                                const uint8_t* end) {
+    uint32_t new_count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &new_count)) return false;
+
+    // Every buffer serializes to at least its length; reject counts that can't fit.
+    if (new_count > static_cast<size_t>(end - *buf_ptr) / sizeof(uint32_t)) return false;
+    if (!allocate_buffers(buffers, count, new_count)) return false;
+    for (size_t i = 0; i < *count; ++i)
+        if (!(*buffers)[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
 size_t KeymasterResponse::SerializedSize() const {
     if (error != KM_ERROR_OK)
         return sizeof(int32_t);
@@ -187,11 +228,17 @@ bool BeginOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const
     return retval;
 }
 
+bool UpdateOperationRequest::AllocateInputSegments(size_t count) {
+    return allocate_buffers(&input_segments, &num_input_segments, count);
+}
+
 size_t UpdateOperationRequest::SerializedSize() const {
-    if (message_version == 0)
-        return sizeof(op_handle) + input.SerializedSize();
-    else
-        return sizeof(op_handle) + input.SerializedSize() + additional_params.SerializedSize();
+    size_t size = sizeof(op_handle) + input.SerializedSize();
+    if (message_version > 0)
+        size += additional_params.SerializedSize();
+    if (message_version > 3)
+        size += buffers_size(input_segments, num_input_segments);
+    return size;
 }
 
 uint8_t* UpdateOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
@@ -199,6 +246,8 @@ uint8_t* UpdateOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) con
     buf = input.Serialize(buf, end);
     if (message_version > 0)
         buf = additional_params.Serialize(buf, end);
+    if (message_version > 3)
+        buf = serialize_buffers(input_segments, num_input_segments, buf, end);
     return buf;
 }
 
@@ -206,12 +255,15 @@ bool UpdateOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t*
     bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle) && input.Deserialize(buf_ptr, end);
     if (retval && message_version > 0)
         retval = additional_params.Deserialize(buf_ptr, end);
+    if (retval && message_version > 3)
+        retval = deserialize_buffers(&input_segments, &num_input_segments, buf_ptr, end);
     return retval;
 }
 
 size_t UpdateOperationResponse::NonErrorSerializedSize() const {
     size_t size = 0;
     switch (message_version) {
+    case 4:
     case 3:
     case 2:
         size += output_params.SerializedSize();
@@ -248,9 +300,16 @@ bool UpdateOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const
     return retval;
 }
 
+bool FinishOperationRequest::AllocateInputSegments(size_t count) {
+    return allocate_buffers(&input_segments, &num_input_segments, count);
+}
+
 size_t FinishOperationRequest::SerializedSize() const {
     size_t size = 0;
     switch (message_version) {
+    case 4:
+        size += buffers_size(input_segments, num_input_segments);
+        FALLTHROUGH;
     case 3:
         size += input.SerializedSize();
         FALLTHROUGH;
@@ -276,6 +335,8 @@ uint8_t* FinishOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) con
         buf = additional_params.Serialize(buf, end);
     if (message_version > 2)
         buf = input.Serialize(buf, end);
+    if (message_version > 3)
+        buf = serialize_buffers(input_segments, num_input_segments, buf, end);
     return buf;
 }
 
@@ -286,6 +347,8 @@ bool FinishOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t*
         retval = additional_params.Deserialize(buf_ptr, end);
     if (retval && message_version > 2)
         retval = input.Deserialize(buf_ptr, end);
+    if (retval && message_version > 3)
+        retval = deserialize_buffers(&input_segments, &num_input_segments, buf_ptr, end);
     return retval;
 }
 
@@ -732,4 +795,475 @@ bool VerificationToken::Deserialize(const uint8_t** buf_ptr, const uint8_t* end)
            deserialize_blob(&mac, buf_ptr, end);
 }
 
+bool BatchVerifyAuthorizationRequest::SetChallenges(const uint64_t* challenge_array,
+                                                    size_t count) {
+    delete[] challenges;
+    num_challenges = 0;
+    challenges = dup_array(challenge_array, count);
+    if (!challenges) return false;
+    num_challenges = count;
+    return true;
+}
+
+size_t BatchVerifyAuthorizationRequest::SerializedSize() const {
+    return sizeof(uint32_t) /* num_challenges */ + num_challenges * sizeof(uint64_t) +
+           parameters_to_verify.SerializedSize() + auth_token.SerializedSize();
+}
+
+uint8_t* BatchVerifyAuthorizationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, num_challenges);
+    for (size_t i = 0; i < num_challenges; ++i)
+        buf = append_uint64_to_buf(buf, end, challenges[i]);
+    buf = parameters_to_verify.Serialize(buf, end);
+    return auth_token.Serialize(buf, end);
+}
+
+bool BatchVerifyAuthorizationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    delete[] challenges;
+    challenges = nullptr;
+    num_challenges = 0;
+
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count)) return false;
+    if (count > static_cast<size_t>(end - *buf_ptr) / sizeof(uint64_t)) return false;
+
+    challenges = new (std::nothrow) uint64_t[count];
+    if (!challenges) return false;
+    num_challenges = count;
+    for (size_t i = 0; i < num_challenges; ++i)
+        if (!copy_uint64_from_buf(buf_ptr, end, &challenges[i])) return false;
+
+    return parameters_to_verify.Deserialize(buf_ptr, end) && auth_token.Deserialize(buf_ptr, end);
+}
+
+bool BatchVerifyAuthorizationResponse::AllocateTokens(size_t count) {
+    delete[] tokens;
+    num_tokens = 0;
+    tokens = new (std::nothrow) VerificationToken[count];
+    if (!tokens) return false;
+    num_tokens = count;
+    return true;
+}
+
+size_t BatchVerifyAuthorizationResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t);  // num_tokens
+    for (size_t i = 0; i < num_tokens; ++i)
+        size += tokens[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchVerifyAuthorizationResponse::NonErrorSerialize(uint8_t* buf,
+                                                             const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, num_tokens);
+    for (size_t i = 0; i < num_tokens; ++i)
+        buf = tokens[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchVerifyAuthorizationResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                           const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count)) return false;
+    // Every token serializes to at least its two uint64_t fields, so reject counts that can't fit.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (2 * sizeof(uint64_t))) return false;
+    if (!AllocateTokens(count)) return false;
+    for (size_t i = 0; i < num_tokens; ++i)
+        if (!tokens[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+size_t AeadRecord::SerializedSize() const {
+    return nonce.SerializedSize() + aad.SerializedSize() + input.SerializedSize();
+}
+
+uint8_t* AeadRecord::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = nonce.Serialize(buf, end);
+    buf = aad.Serialize(buf, end);
+    return input.Serialize(buf, end);
+}
+
+bool AeadRecord::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return nonce.Deserialize(buf_ptr, end) && aad.Deserialize(buf_ptr, end) &&
+           input.Deserialize(buf_ptr, end);
+}
+
+size_t AeadRecordResult::SerializedSize() const {
+    return sizeof(uint32_t) /* error */ + nonce.SerializedSize() + output.SerializedSize();
+}
+
+uint8_t* AeadRecordResult::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, error);
+    buf = nonce.Serialize(buf, end);
+    return output.Serialize(buf, end);
+}
+
+bool AeadRecordResult::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return copy_uint32_from_buf(buf_ptr, end, &error) && nonce.Deserialize(buf_ptr, end) &&
+           output.Deserialize(buf_ptr, end);
+}
+
+void BatchAeadOperationRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+bool BatchAeadOperationRequest::AllocateRecords(size_t count) {
+    delete[] records;
+    num_records = 0;
+    records = new (std::nothrow) AeadRecord[count];
+    if (!records) return false;
+    num_records = count;
+    return true;
+}
+
+size_t BatchAeadOperationRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* purpose */ + key_blob_size(key_blob) +
+                  additional_params.SerializedSize() + sizeof(uint32_t) /* num_records */;
+    for (size_t i = 0; i < num_records; ++i)
+        size += records[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchAeadOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, purpose);
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, num_records);
+    for (size_t i = 0; i < num_records; ++i)
+        buf = records[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchAeadOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &purpose) ||
+        !deserialize_key_blob(&key_blob, buf_ptr, end) ||
+        !additional_params.Deserialize(buf_ptr, end) || !copy_uint32_from_buf(buf_ptr, end, &count))
+        return false;
+
+    // Every record serializes to at least its three buffer lengths; reject counts that can't fit.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (3 * sizeof(uint32_t))) return false;
+    if (!AllocateRecords(count)) return false;
+    for (size_t i = 0; i < num_records; ++i)
+        if (!records[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+bool BatchAeadOperationResponse::AllocateResults(size_t count) {
+    delete[] results;
+    num_results = 0;
+    results = new (std::nothrow) AeadRecordResult[count];
+    if (!results) return false;
+    num_results = count;
+    return true;
+}
+
+size_t BatchAeadOperationResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t);  // num_results
+    for (size_t i = 0; i < num_results; ++i)
+        size += results[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchAeadOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, num_results);
+    for (size_t i = 0; i < num_results; ++i)
+        buf = results[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchAeadOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                     const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count)) return false;
+    // Every result serializes to at least its error code and two buffer lengths.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (3 * sizeof(uint32_t))) return false;
+    if (!AllocateResults(count)) return false;
+    for (size_t i = 0; i < num_results; ++i)
+        if (!results[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+size_t SignatureRecord::SerializedSize() const {
+    return input.SerializedSize() + signature.SerializedSize();
+}
+
+uint8_t* SignatureRecord::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = input.Serialize(buf, end);
+    return signature.Serialize(buf, end);
+}
+
+bool SignatureRecord::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return input.Deserialize(buf_ptr, end) && signature.Deserialize(buf_ptr, end);
+}
+
+void BatchVerifySignaturesRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+bool BatchVerifySignaturesRequest::AllocateRecords(size_t count) {
+    delete[] records;
+    num_records = 0;
+    records = new (std::nothrow) SignatureRecord[count];
+    if (!records) return false;
+    num_records = count;
+    return true;
+}
+
+size_t BatchVerifySignaturesRequest::SerializedSize() const {
+    size_t size = key_blob_size(key_blob) + additional_params.SerializedSize() +
+                  sizeof(uint32_t) /* num_records */;
+    for (size_t i = 0; i < num_records; ++i)
+        size += records[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchVerifySignaturesRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, num_records);
+    for (size_t i = 0; i < num_records; ++i)
+        buf = records[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchVerifySignaturesRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||
+        !additional_params.Deserialize(buf_ptr, end) || !copy_uint32_from_buf(buf_ptr, end, &count))
+        return false;
+
+    // Every record serializes to at least its two buffer lengths; reject counts that can't fit.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (2 * sizeof(uint32_t))) return false;
+    if (!AllocateRecords(count)) return false;
+    for (size_t i = 0; i < num_records; ++i)
+        if (!records[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+bool BatchVerifySignaturesResponse::AllocateResults(size_t count) {
+    delete[] results;
+    num_results = 0;
+    results = new (std::nothrow) keymaster_error_t[count];
+    if (!results) return false;
+    num_results = count;
+    for (size_t i = 0; i < num_results; ++i)
+        results[i] = KM_ERROR_UNKNOWN_ERROR;
+    return true;
+}
+
+size_t BatchVerifySignaturesResponse::NonErrorSerializedSize() const {
+    return sizeof(uint32_t) /* num_results */ + num_results * sizeof(uint32_t);
+}
+
+uint8_t* BatchVerifySignaturesResponse::NonErrorSerialize(uint8_t* buf,
+                                                          const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, num_results);
+    for (size_t i = 0; i < num_results; ++i)
+        buf = append_uint32_to_buf(buf, end, results[i]);
+    return buf;
+}
+
+bool BatchVerifySignaturesResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                        const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count)) return false;
+    if (count > static_cast<size_t>(end - *buf_ptr) / sizeof(uint32_t)) return false;
+    if (!AllocateResults(count)) return false;
+    for (size_t i = 0; i < num_results; ++i)
+        if (!copy_uint32_from_buf(buf_ptr, end, &results[i])) return false;
+    return true;
+}
+
+void MacRecord::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t MacRecord::SerializedSize() const {
+    return key_blob_size(key_blob) + input.SerializedSize();
+}
+
+uint8_t* MacRecord::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    return input.Serialize(buf, end);
+}
+
+bool MacRecord::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_key_blob(&key_blob, buf_ptr, end) && input.Deserialize(buf_ptr, end);
+}
+
+bool BatchComputeMacsRequest::AllocateRecords(size_t count) {
+    delete[] records;
+    num_records = 0;
+    records = new (std::nothrow) MacRecord[count];
+    if (!records) return false;
+    num_records = count;
+    return true;
+}
+
+size_t BatchComputeMacsRequest::SerializedSize() const {
+    size_t size = additional_params.SerializedSize() + sizeof(uint32_t) /* num_records */;
+    for (size_t i = 0; i < num_records; ++i)
+        size += records[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchComputeMacsRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, num_records);
+    for (size_t i = 0; i < num_records; ++i)
+        buf = records[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchComputeMacsRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!additional_params.Deserialize(buf_ptr, end) || !copy_uint32_from_buf(buf_ptr, end, &count))
+        return false;
+
+    // Every record serializes to at least its key blob and input lengths.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (2 * sizeof(uint32_t))) return false;
+    if (!AllocateRecords(count)) return false;
+    for (size_t i = 0; i < num_records; ++i)
+        if (!records[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+size_t MacRecordResult::SerializedSize() const {
+    return sizeof(uint32_t) /* error */ + mac.SerializedSize();
+}
+
+uint8_t* MacRecordResult::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, error);
+    return mac.Serialize(buf, end);
+}
+
+bool MacRecordResult::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return copy_uint32_from_buf(buf_ptr, end, &error) && mac.Deserialize(buf_ptr, end);
+}
+
+bool BatchComputeMacsResponse::AllocateResults(size_t count) {
+    delete[] results;
+    num_results = 0;
+    results = new (std::nothrow) MacRecordResult[count];
+    if (!results) return false;
+    num_results = count;
+    return true;
+}
+
+size_t BatchComputeMacsResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t);  // num_results
+    for (size_t i = 0; i < num_results; ++i)
+        size += results[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchComputeMacsResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, num_results);
+    for (size_t i = 0; i < num_results; ++i)
+        buf = results[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchComputeMacsResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count)) return false;
+    // Every result serializes to at least its error code and MAC length.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (2 * sizeof(uint32_t))) return false;
+    if (!AllocateResults(count)) return false;
+    for (size_t i = 0; i < num_results; ++i)
+        if (!results[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+void BatchAgreeKeysRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+bool BatchAgreeKeysRequest::AllocatePeerPublicValues(size_t count) {
+    delete[] peer_public_values;
+    num_peer_public_values = 0;
+    peer_public_values = new (std::nothrow) Buffer[count];
+    if (!peer_public_values) return false;
+    num_peer_public_values = count;
+    return true;
+}
+
+size_t BatchAgreeKeysRequest::SerializedSize() const {
+    size_t size = key_blob_size(key_blob) + additional_params.SerializedSize() +
+                  sizeof(uint32_t) /* num_peer_public_values */;
+    for (size_t i = 0; i < num_peer_public_values; ++i)
+        size += peer_public_values[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchAgreeKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, num_peer_public_values);
+    for (size_t i = 0; i < num_peer_public_values; ++i)
+        buf = peer_public_values[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchAgreeKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||
+        !additional_params.Deserialize(buf_ptr, end) || !copy_uint32_from_buf(buf_ptr, end, &count))
+        return false;
+
+    // Every value serializes to at least its length.
+    if (count > static_cast<size_t>(end - *buf_ptr) / sizeof(uint32_t)) return false;
+    if (!AllocatePeerPublicValues(count)) return false;
+    for (size_t i = 0; i < num_peer_public_values; ++i)
+        if (!peer_public_values[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
+size_t AgreementResult::SerializedSize() const {
+    return sizeof(uint32_t) /* error */ + secret.SerializedSize();
+}
+
+uint8_t* AgreementResult::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, error);
+    return secret.Serialize(buf, end);
+}
+
+bool AgreementResult::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return copy_uint32_from_buf(buf_ptr, end, &error) && secret.Deserialize(buf_ptr, end);
+}
+
+bool BatchAgreeKeysResponse::AllocateResults(size_t count) {
+    delete[] results;
+    num_results = 0;
+    results = new (std::nothrow) AgreementResult[count];
+    if (!results) return false;
+    num_results = count;
+    return true;
+}
+
+size_t BatchAgreeKeysResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t);  // num_results
+    for (size_t i = 0; i < num_results; ++i)
+        size += results[i].SerializedSize();
+    return size;
+}
+
+uint8_t* BatchAgreeKeysResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, num_results);
+    for (size_t i = 0; i < num_results; ++i)
+        buf = results[i].Serialize(buf, end);
+    return buf;
+}
+
+bool BatchAgreeKeysResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count)) return false;
+    // Every result serializes to at least its error code and secret length.
+    if (count > static_cast<size_t>(end - *buf_ptr) / (2 * sizeof(uint32_t))) return false;
+    if (!AllocateResults(count)) return false;
+    for (size_t i = 0; i < num_results; ++i)
+        if (!results[i].Deserialize(buf_ptr, end)) return false;
+    return true;
+}
+
 }  // namespace keymaster
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/enforcement_decision_trace.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <keymaster/keymaster_tags.h>
+#include <keymaster/serializable.h>
+
+namespace keymaster {
+
+static_assert((EnforcementDecisionTrace::kCapacity & (EnforcementDecisionTrace::kCapacity - 1)) ==
+                  0,
+              "Trace capacity must be a power of two");
+
+const size_t EnforcementDecisionTrace::kCapacity;
+const uint32_t EnforcementDecisionTrace::kSerializationVersion;
+const size_t EnforcementDecisionTrace::kSerializedRecordSize;
+
+EnforcementDecisionTrace::EnforcementDecisionTrace() : head_(0) {
+    memset(slots_, 0, sizeof(slots_));
+}
+
+void EnforcementDecisionTrace::Encode(const EnforcementDecision& decision, uint64_t* words) {
+    words[0] = decision.key_id;
+    words[1] = decision.timestamp_ms;
+    words[2] = static_cast<uint32_t>(decision.result) |
+               (static_cast<uint64_t>(static_cast<uint32_t>(decision.deciding_tag)) << 32);
+    words[3] = static_cast<uint32_t>(decision.purpose) |
+               (static_cast<uint64_t>(decision.is_begin_operation ? 1 : 0) << 32);
+}
+
+void EnforcementDecisionTrace::Decode(const uint64_t* words, EnforcementDecision* decision) {
+    decision->key_id = words[0];
+    decision->timestamp_ms = words[1];
+    decision->result = static_cast<keymaster_error_t>(static_cast<int32_t>(words[2] & 0xFFFFFFFF));
+    decision->deciding_tag = static_cast<keymaster_tag_t>(words[2] >> 32);
+    decision->purpose = static_cast<keymaster_purpose_t>(words[3] & 0xFFFFFFFF);
+    decision->is_begin_operation = (words[3] >> 32) != 0;
+}
+
+void EnforcementDecisionTrace::Record(const EnforcementDecision& decision) {
+    // Only the producer writes head_, so a relaxed load is sufficient here.
+    uint64_t index = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+    Slot& slot = slots_[index & (kCapacity - 1)];
+
+    uint64_t words[4];
+    Encode(decision, words);
+
+    __atomic_store_n(&slot.sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t i = 0; i < 4; ++i)
+        __atomic_store_n(&slot.words[i], words[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.sequence, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&head_, index + 1, __ATOMIC_RELEASE);
+}
+
+size_t EnforcementDecisionTrace::Snapshot(EnforcementDecision* records, size_t max_records) const {
+    uint64_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+    uint64_t available = head < kCapacity ? head : kCapacity;
+    if (available > max_records)
+        available = max_records;
+
+    size_t copied = 0;
+    for (uint64_t index = head - available; index < head; ++index) {
+        const Slot& slot = slots_[index & (kCapacity - 1)];
+        uint64_t expected_sequence = 2 * index + 2;
+        if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != expected_sequence)
+            continue;  // Already overwritten by a newer record.
+
+        uint64_t words[4];
+        for (size_t i = 0; i < 4; ++i)
+            words[i] = __atomic_load_n(&slot.words[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot.sequence, __ATOMIC_RELAXED) != expected_sequence)
+            continue;  // Overwritten while we were copying it.
+
+        Decode(words, &records[copied++]);
+    }
+    return copied;
+}
+
+uint8_t* EnforcementDecisionTrace::Serialize(const EnforcementDecision* records,
+                                             size_t record_count, uint8_t* buf,
+                                             const uint8_t* end) {
+    buf = append_uint32_to_buf(buf, end, kSerializationVersion);
+    buf = append_uint32_to_buf(buf, end, record_count);
+    for (size_t i = 0; i < record_count; ++i) {
+        uint64_t words[4];
+        Encode(records[i], words);
+        for (size_t j = 0; j < 4; ++j)
+            buf = append_uint64_to_buf(buf, end, words[j]);
+    }
+    return buf;
+}
+
+bool EnforcementDecisionTrace::Deserialize(const uint8_t** buf_ptr, const uint8_t* end,
+                                           EnforcementDecision* records, size_t* record_count) {
+    uint32_t version;
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &version) || version != kSerializationVersion ||
+        !copy_uint32_from_buf(buf_ptr, end, &count) || count > *record_count)
+        return false;
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t words[4];
+        for (size_t j = 0; j < 4; ++j)
+            if (!copy_uint64_from_buf(buf_ptr, end, &words[j]))
+                return false;
+        Decode(words, &records[i]);
+    }
+    *record_count = count;
+    return true;
+}
+
+int EnforcementDecisionTrace::Format(const EnforcementDecision& decision, char* buf,
+                                     size_t buf_size) {
+#ifdef KEYMASTER_NAME_TAGS
+    const char* tag_name =
+        decision.deciding_tag == KM_TAG_INVALID ? "-" : StringifyTag(decision.deciding_tag);
+    return snprintf(buf, buf_size, "%llu ms key %016llx %s purpose %d: result %d (tag %s)",
+                    static_cast<unsigned long long>(decision.timestamp_ms),
+                    static_cast<unsigned long long>(decision.key_id),
+                    decision.is_begin_operation ? "begin" : "update/finish", decision.purpose,
+                    decision.result, tag_name);
+#else
+    return snprintf(buf, buf_size, "%llu ms key %016llx %s purpose %d: result %d (tag 0x%x)",
+                    static_cast<unsigned long long>(decision.timestamp_ms),
+                    static_cast<unsigned long long>(decision.key_id),
+                    decision.is_begin_operation ? "begin" : "update/finish", decision.purpose,
+                    decision.result, decision.deciding_tag);
+#endif
+}
+
+}  // namespace keymaster
@@ -33,19 +33,22 @@ class AccessTimeMap {
   public:
     explicit AccessTimeMap(uint32_t max_size) : max_size_(max_size) {}
 
-    /* If the key is found, returns true and fills \p last_access_time.  If not found returns
+    /* If the key is found, returns true and fills \p last_access_time_ms.  If not found returns
      * false. */
-    bool LastKeyAccessTime(km_id_t keyid, uint32_t* last_access_time) const;
+    bool LastKeyAccessTime(km_id_t keyid, uint64_t* last_access_time_ms) const;
 
-    /* Updates the last key access time with the currentTime parameter.  Adds the key if
-     * needed, returning false if key cannot be added because list is full. */
-    bool UpdateKeyAccessTime(km_id_t keyid, uint32_t current_time, uint32_t timeout);
+    /* Updates the last key access time with the current_time_ms parameter.  Adds the key if
+     * needed, returning false if key cannot be added because list is full.  Entries expire
+     * \p timeout_ms after their last access. */
+    bool UpdateKeyAccessTime(km_id_t keyid, uint64_t current_time_ms, uint64_t timeout_ms);
 
   private:
+    // Times are kept in milliseconds, so that the clock tolerance added to rate limits isn't
+    // swamped by rounding to whole seconds.
     struct AccessTime {
         km_id_t keyid;
-        uint32_t access_time;
-        uint32_t timeout;
+        uint64_t access_time_ms;
+        uint64_t timeout_ms;
     };
     List<AccessTime> last_access_list_;
     const uint32_t max_size_;
@@ -75,11 +78,15 @@ class AccessCountMap {
 bool is_public_key_algorithm(const AuthProxy& auth_set) {
     keymaster_algorithm_t algorithm;
     return auth_set.GetTagValue(TAG_ALGORITHM, &algorithm) &&
-           (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_EC);
+           (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_EC ||
+            algorithm == KM_ALGORITHM_ED25519);
 }
 
 static keymaster_error_t authorized_purpose(const keymaster_purpose_t purpose,
                                             const AuthProxy& auth_set) {
+    if (purpose == KM_PURPOSE_AGREE_KEY)
+        return auth_set.Contains(TAG_PURPOSE, purpose) ? KM_ERROR_OK
+                                                       : KM_ERROR_INCOMPATIBLE_PURPOSE;
     switch (purpose) {
     case KM_PURPOSE_VERIFY:
     case KM_PURPOSE_ENCRYPT:
@@ -119,12 +126,21 @@ keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpo
                                                            const AuthorizationSet& operation_params,
                                                            keymaster_operation_handle_t op_handle,
                                                            bool is_begin_operation) {
-    if (is_public_key_algorithm(auth_set)) {
+    keymaster_error_t error = KM_ERROR_OK;
+    keymaster_tag_t deciding_tag = KM_TAG_INVALID;
+    // Only Begin needs the time, so other decisions are traced with a zero timestamp rather than
+    // paying for a clock read.
+    uint64_t current_time_ms = 0;
+
+    bool public_key_operation = false;
+    // KM_PURPOSE_AGREE_KEY isn't an enumerator the switch can name; it uses the private key.
+    if (is_public_key_algorithm(auth_set) && purpose != KM_PURPOSE_AGREE_KEY) {
         switch (purpose) {
         case KM_PURPOSE_ENCRYPT:
         case KM_PURPOSE_VERIFY:
             /* Public key operations are always authorized. */
-            return KM_ERROR_OK;
+            public_key_operation = true;
+            break;
 
         case KM_PURPOSE_DECRYPT:
         case KM_PURPOSE_SIGN:
@@ -134,10 +150,57 @@ keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpo
         };
     };
 
-    if (is_begin_operation)
-        return AuthorizeBegin(purpose, keyid, auth_set, operation_params);
-    else
-        return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
+    if (!public_key_operation) {
+        if (is_begin_operation) {
+            current_time_ms = get_current_time_ms();
+            error = AuthorizeBegin(purpose, keyid, auth_set, operation_params, current_time_ms,
+                                   &deciding_tag);
+        } else {
+            error = AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle, &deciding_tag);
+        }
+    }
+
+    EnforcementDecision decision;
+    decision.key_id = keyid;
+    decision.timestamp_ms = current_time_ms;
+    decision.result = error;
+    decision.deciding_tag = error == KM_ERROR_OK ? KM_TAG_INVALID : deciding_tag;
+    decision.purpose = purpose;
+    decision.is_begin_operation = is_begin_operation;
+    decision_trace_.Record(decision);
+
+    return error;
+}
+
+BatchVerifyAuthorizationResponse
+KeymasterEnforcement::BatchVerifyAuthorization(const BatchVerifyAuthorizationRequest& request) {
+    BatchVerifyAuthorizationResponse response;
+    if (!response.AllocateTokens(request.num_challenges)) {
+        response.error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return response;
+    }
+
+    for (size_t i = 0; i < request.num_challenges; ++i) {
+        VerifyAuthorizationRequest single_request(request.message_version);
+        single_request.challenge = request.challenges[i];
+        single_request.parameters_to_verify = request.parameters_to_verify;
+        single_request.auth_token.challenge = request.auth_token.challenge;
+        single_request.auth_token.user_id = request.auth_token.user_id;
+        single_request.auth_token.authenticator_id = request.auth_token.authenticator_id;
+        single_request.auth_token.authenticator_type = request.auth_token.authenticator_type;
+        single_request.auth_token.timestamp = request.auth_token.timestamp;
+        single_request.auth_token.mac = request.auth_token.mac;
+
+        VerifyAuthorizationResponse single_response = VerifyAuthorization(single_request);
+        if (single_response.error != KM_ERROR_OK) {
+            response.error = single_response.error;
+            return response;
+        }
+        response.tokens[i] = move(single_response.token);
+    }
+
+    response.error = KM_ERROR_OK;
+    return response;
 }
 
 // For update and finish the only thing to check is user authentication, and then only if it's not
@@ -145,7 +208,9 @@ keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpo
 keymaster_error_t
 KeymasterEnforcement::AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
                                               const AuthorizationSet& operation_params,
-                                              keymaster_operation_handle_t op_handle) {
+                                              keymaster_operation_handle_t op_handle,
+                                              keymaster_tag_t* deciding_tag) {
+    *deciding_tag = KM_TAG_INVALID;
     int auth_type_index = -1;
     int trusted_confirmation_index = -1;
     for (size_t pos = 0; pos < auth_set.size(); ++pos) {
@@ -168,6 +233,7 @@ KeymasterEnforcement::AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
     // TODO verify trusted confirmation mac once we have a shared secret established
     // For now, since we do not have such a service, any token offered here must be invalid.
     if (trusted_confirmation_index != -1) {
+        *deciding_tag = KM_TAG_TRUSTED_CONFIRMATION_REQUIRED;
         return KM_ERROR_NO_USER_CONFIRMATION;
     }
 
@@ -184,13 +250,16 @@ KeymasterEnforcement::AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
         if (param.tag == KM_TAG_USER_SECURE_ID) {
             authentication_required = true;
             int auth_timeout_index = -1;
+            // Timeouts are only checked at Begin, so no time is needed.
             if (AuthTokenMatches(auth_set, operation_params, param.long_integer, auth_type_index,
-                                 auth_timeout_index, op_handle, false /* is_begin_operation */))
+                                 auth_timeout_index, op_handle, false /* is_begin_operation */,
+                                 0 /* current_time_ms */))
                 return KM_ERROR_OK;
         }
     }
 
     if (authentication_required) {
+        *deciding_tag = KM_TAG_USER_SECURE_ID;
         return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
     }
 
@@ -200,7 +269,11 @@ KeymasterEnforcement::AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
 keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t purpose,
                                                        const km_id_t keyid,
                                                        const AuthProxy& auth_set,
-                                                       const AuthorizationSet& operation_params) {
+                                                       const AuthorizationSet& operation_params,
+                                                       uint64_t current_time_ms,
+                                                       keymaster_tag_t* deciding_tag) {
+    *deciding_tag = KM_TAG_INVALID;
+
     // Find some entries that may be needed to handle KM_TAG_USER_SECURE_ID
     int auth_timeout_index = -1;
     int auth_type_index = -1;
@@ -222,8 +295,10 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
     }
 
     keymaster_error_t error = authorized_purpose(purpose, auth_set);
-    if (error != KM_ERROR_OK)
+    if (error != KM_ERROR_OK) {
+        *deciding_tag = KM_TAG_PURPOSE;
         return error;
+    }
 
     // If successful, and if key has a min time between ops, this will be set to the time limit
     uint32_t min_ops_timeout = UINT32_MAX;
@@ -240,26 +315,30 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
         if (param.tag == KM_TAG_PADDING_OLD || param.tag == KM_TAG_DIGEST_OLD)
             continue;
 
+        // Any rejection inside the switch is attributable to the tag being examined.
+        *deciding_tag = param.tag;
         switch (param.tag) {
 
         case KM_TAG_ACTIVE_DATETIME:
-            if (!activation_date_valid(param.date_time))
+            if (!activation_date_valid(param.date_time, current_time_ms))
                 return KM_ERROR_KEY_NOT_YET_VALID;
             break;
 
         case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
-            if (is_origination_purpose(purpose) && expiration_date_passed(param.date_time))
+            if (is_origination_purpose(purpose) &&
+                expiration_date_passed(param.date_time, current_time_ms))
                 return KM_ERROR_KEY_EXPIRED;
             break;
 
         case KM_TAG_USAGE_EXPIRE_DATETIME:
-            if (is_usage_purpose(purpose) && expiration_date_passed(param.date_time))
+            if (is_usage_purpose(purpose) &&
+                expiration_date_passed(param.date_time, current_time_ms))
                 return KM_ERROR_KEY_EXPIRED;
             break;
 
         case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
             min_ops_timeout = param.integer;
-            if (!MinTimeBetweenOpsPassed(min_ops_timeout, keyid))
+            if (!MinTimeBetweenOpsPassed(min_ops_timeout, keyid, current_time_ms))
                 return KM_ERROR_KEY_RATE_LIMIT_EXCEEDED;
             break;
 
@@ -279,7 +358,7 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
                 authentication_required = true;
                 if (AuthTokenMatches(auth_set, operation_params, param.long_integer,
                                      auth_type_index, auth_timeout_index, 0 /* op_handle */,
-                                     true /* is_begin_operation */))
+                                     true /* is_begin_operation */, current_time_ms))
                     auth_token_matched = true;
             }
             break;
@@ -367,28 +446,39 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
         }
     }
 
+    *deciding_tag = KM_TAG_INVALID;
+
     if (authentication_required && !auth_token_matched) {
+        *deciding_tag = KM_TAG_USER_SECURE_ID;
         LOG_E("Auth required but no matching auth token found", 0);
         return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
     }
 
     if (!caller_nonce_authorized_by_key && is_origination_purpose(purpose) &&
-        operation_params.find(KM_TAG_NONCE) != -1)
+        operation_params.find(KM_TAG_NONCE) != -1) {
+        *deciding_tag = KM_TAG_NONCE;
         return KM_ERROR_CALLER_NONCE_PROHIBITED;
+    }
 
     if (min_ops_timeout != UINT32_MAX) {
+        *deciding_tag = KM_TAG_MIN_SECONDS_BETWEEN_OPS;
         if (!access_time_map_) {
             LOG_S("Rate-limited keys table not allocated.  Rate-limited keys disabled", 0);
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
         }
 
-        if (!access_time_map_->UpdateKeyAccessTime(keyid, get_current_time(), min_ops_timeout)) {
+        // The entry must outlive the rate limit, tolerance included, or it could be dropped while
+        // the key is still limited.
+        uint64_t timeout_ms = static_cast<uint64_t>(min_ops_timeout) * 1000 +
+                              get_current_time_tolerance_ms();
+        if (!access_time_map_->UpdateKeyAccessTime(keyid, current_time_ms, timeout_ms)) {
             LOG_E("Rate-limited keys table full.  Entries will time out.", 0);
             return KM_ERROR_TOO_MANY_OPERATIONS;
         }
     }
 
     if (update_access_count) {
+        *deciding_tag = KM_TAG_MAX_USES_PER_BOOT;
         if (!access_count_map_) {
             LOG_S("Usage-count limited keys tabel not allocated.  Count-limited keys disabled", 0);
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
@@ -403,14 +493,19 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
     return KM_ERROR_OK;
 }
 
-bool KeymasterEnforcement::MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid) {
+bool KeymasterEnforcement::MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid,
+                                                   uint64_t current_time_ms) {
     if (!access_time_map_)
         return false;
 
-    uint32_t last_access_time;
-    if (!access_time_map_->LastKeyAccessTime(keyid, &last_access_time))
+    uint64_t last_access_time_ms;
+    if (!access_time_map_->LastKeyAccessTime(keyid, &last_access_time_ms))
         return true;
-    return min_time_between <= static_cast<int64_t>(get_current_time()) - last_access_time;
+    // Both times may lag by up to the clock tolerance, by different amounts, so the measured
+    // interval may exceed the real one by that much.
+    assert(current_time_ms >= last_access_time_ms);
+    return static_cast<uint64_t>(min_time_between) * 1000 + get_current_time_tolerance_ms() <=
+           current_time_ms - last_access_time_ms;
 }
 
 bool KeymasterEnforcement::MaxUsesPerBootNotExceeded(const km_id_t keyid, uint32_t max_uses) {
@@ -428,7 +523,8 @@ bool KeymasterEnforcement::AuthTokenMatches(const AuthProxy& auth_set,
                                             const uint64_t user_secure_id,
                                             const int auth_type_index, const int auth_timeout_index,
                                             const keymaster_operation_handle_t op_handle,
-                                            bool is_begin_operation) const {
+                                            bool is_begin_operation,
+                                            uint64_t current_time_ms) const {
     assert(auth_type_index < static_cast<int>(auth_set.size()));
     assert(auth_timeout_index < static_cast<int>(auth_set.size()));
 
@@ -490,7 +586,8 @@ bool KeymasterEnforcement::AuthTokenMatches(const AuthProxy& auth_set,
         if (auth_set[auth_timeout_index].tag != KM_TAG_AUTH_TIMEOUT)
             return false;
 
-        if (auth_token_timed_out(auth_token, auth_set[auth_timeout_index].integer)) {
+        if (auth_token_timed_out(auth_token, auth_set[auth_timeout_index].integer,
+                                 current_time_ms)) {
             LOG_E("Auth token has timed out", 0);
             return false;
         }
@@ -500,26 +597,27 @@ bool KeymasterEnforcement::AuthTokenMatches(const AuthProxy& auth_set,
     return true;
 }
 
-bool AccessTimeMap::LastKeyAccessTime(km_id_t keyid, uint32_t* last_access_time) const {
+bool AccessTimeMap::LastKeyAccessTime(km_id_t keyid, uint64_t* last_access_time_ms) const {
     for (auto& entry : last_access_list_)
         if (entry.keyid == keyid) {
-            *last_access_time = entry.access_time;
+            *last_access_time_ms = entry.access_time_ms;
             return true;
         }
     return false;
 }
 
-bool AccessTimeMap::UpdateKeyAccessTime(km_id_t keyid, uint32_t current_time, uint32_t timeout) {
+bool AccessTimeMap::UpdateKeyAccessTime(km_id_t keyid, uint64_t current_time_ms,
+                                        uint64_t timeout_ms) {
     List<AccessTime>::iterator iter;
     for (iter = last_access_list_.begin(); iter != last_access_list_.end();) {
         if (iter->keyid == keyid) {
-            iter->access_time = current_time;
+            iter->access_time_ms = current_time_ms;
             return true;
         }
 
         // Expire entry if possible.
-        assert(current_time >= iter->access_time);
-        if (current_time - iter->access_time >= iter->timeout)
+        assert(current_time_ms >= iter->access_time_ms);
+        if (current_time_ms - iter->access_time_ms >= iter->timeout_ms)
             iter = last_access_list_.erase(iter);
         else
             ++iter;
@@ -530,8 +628,8 @@ bool AccessTimeMap::UpdateKeyAccessTime(km_id_t keyid, uint32_t current_time, ui
 
     AccessTime new_entry;
     new_entry.keyid = keyid;
-    new_entry.access_time = current_time;
-    new_entry.timeout = timeout;
+    new_entry.access_time_ms = current_time_ms;
+    new_entry.timeout_ms = timeout_ms;
     last_access_list_.push_front(new_entry);
     return true;
 }
@@ -95,6 +95,14 @@ const char* StringifyTag(keymaster_tag_t tag) {
         return "KM_TAG_EC_CURVE";
     case KM_TAG_ECIES_SINGLE_HASH_MODE:
         return "KM_TAG_ECIES_SINGLE_HASH_MODE";
+    case KM_TAG_PREHASHED:
+        return "KM_TAG_PREHASHED";
+    case KM_TAG_KDF_SALT:
+        return "KM_TAG_KDF_SALT";
+    case KM_TAG_KDF_INFO:
+        return "KM_TAG_KDF_INFO";
+    case KM_TAG_KDF_OUTPUT_LENGTH:
+        return "KM_TAG_KDF_OUTPUT_LENGTH";
     case KM_TAG_OS_VERSION:
         return "KM_TAG_OS_VERSION";
     case KM_TAG_OS_PATCHLEVEL:
@@ -148,6 +156,10 @@ DEFINE_KEYMASTER_TAG(KM_BOOL, TAG_CALLER_NONCE);
 DEFINE_KEYMASTER_TAG(KM_UINT, TAG_MIN_MAC_LENGTH);
 DEFINE_KEYMASTER_TAG(KM_ULONG, TAG_RSA_PUBLIC_EXPONENT);
 DEFINE_KEYMASTER_TAG(KM_BOOL, TAG_ECIES_SINGLE_HASH_MODE);
+DEFINE_KEYMASTER_TAG(KM_BOOL, TAG_PREHASHED);
+DEFINE_KEYMASTER_TAG(KM_BYTES, TAG_KDF_SALT);
+DEFINE_KEYMASTER_TAG(KM_BYTES, TAG_KDF_INFO);
+DEFINE_KEYMASTER_TAG(KM_UINT, TAG_KDF_OUTPUT_LENGTH);
 DEFINE_KEYMASTER_TAG(KM_BOOL, TAG_INCLUDE_UNIQUE_ID);
 DEFINE_KEYMASTER_TAG(KM_DATE, TAG_ACTIVE_DATETIME);
 DEFINE_KEYMASTER_TAG(KM_DATE, TAG_ORIGINATION_EXPIRE_DATETIME);
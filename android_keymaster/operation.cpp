@@ -49,6 +49,8 @@ bool OperationFactory::supported(keymaster_digest_t digest) const {
 }
 
 inline bool is_public_key_algorithm(keymaster_algorithm_t algorithm) {
+    // Software-only, so not an enumerator the switch can name.
+    if (algorithm == KM_ALGORITHM_ED25519) return true;
     switch (algorithm) {
     case KM_ALGORITHM_HMAC:
     case KM_ALGORITHM_AES:
@@ -67,7 +69,7 @@ inline bool is_public_key_algorithm(keymaster_algorithm_t algorithm) {
 bool OperationFactory::is_public_key_operation() const {
     KeyType key_type = registry_key();
 
-    if (!is_public_key_algorithm(key_type.algorithm))
+    if (!is_public_key_algorithm(key_type.algorithm) || key_type.purpose == KM_PURPOSE_AGREE_KEY)
         return false;
 
     switch (key_type.purpose) {
@@ -158,4 +160,62 @@ keymaster_error_t Operation::UpdateForFinish(const AuthorizationSet& input_param
     return KM_ERROR_OK;
 }
 
+keymaster_error_t Operation::UpdateSegments(const AuthorizationSet& input_params,
+                                            const Buffer* segments, size_t segment_count,
+                                            AuthorizationSet* output_params, Buffer* output,
+                                            size_t* input_consumed) {
+    if (!output || !input_consumed) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!segments && segment_count) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    // The parameters (e.g. AAD) apply to the input as a whole, so only the first segment gets them.
+    AuthorizationSet no_params;
+    *input_consumed = 0;
+    for (size_t i = 0; i < segment_count; ++i) {
+        size_t segment_consumed = 0;
+        keymaster_error_t error = Update(i == 0 ? input_params : no_params, segments[i],
+                                         output_params, output, &segment_consumed);
+        if (error != KM_ERROR_OK) return error;
+        *input_consumed += segment_consumed;
+        if (segment_consumed < segments[i].available_read()) break;
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Operation::FinishSegments(const AuthorizationSet& input_params,
+                                            const Buffer* segments, size_t segment_count,
+                                            const Buffer& signature,
+                                            AuthorizationSet* output_params, Buffer* output) {
+    if (!output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!segments && segment_count) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (segment_count == 0) return Finish(input_params, Buffer(), signature, output_params, output);
+
+    // Update with all but the last segment, which goes to Finish() in the usual way.
+    size_t leading_count = segment_count - 1;
+    size_t leading_length = 0;
+    for (size_t i = 0; i < leading_count; ++i)
+        leading_length += segments[i].available_read();
+
+    size_t input_consumed;
+    keymaster_error_t error = UpdateSegments(input_params, segments, leading_count,
+                                             output_params, output, &input_consumed);
+    if (error != KM_ERROR_OK) return error;
+    if (input_consumed != leading_length) return KM_ERROR_INVALID_INPUT_LENGTH;
+
+    AuthorizationSet no_params;
+    const AuthorizationSet& finish_params = leading_count ? no_params : input_params;
+    if (output->available_read() == 0)
+        return Finish(finish_params, segments[leading_count], signature, output_params, output);
+
+    // Some operations replace the contents of Finish()'s output rather than appending to it, so
+    // collect it separately rather than risk losing what the updates produced.
+    Buffer finish_output;
+    error = Finish(finish_params, segments[leading_count], signature, output_params,
+                   &finish_output);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->reserve(finish_output.available_read()) ||
+        !output->write(finish_output.peek_read(), finish_output.available_read()))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
 }  // namespace keymaster
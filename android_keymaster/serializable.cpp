@@ -162,4 +162,10 @@ void Buffer::Clear() {
     buffer_size_ = 0;
 }
 
+void Buffer::Reset() {
+    memset_s(buffer_.get(), 0, buffer_size_);
+    read_position_ = 0;
+    write_position_ = 0;
+}
+
 }  // namespace keymaster
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/bulk_data_channel.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+// Seals that fix a descriptor's size, so that a mapping of it can never run past its end.
+static const int kRequiredSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+int BulkDataChannel::CreateMemfd(const char* name, size_t size) {
+    // Not every libc we build against wraps memfd_create, so make the system call directly.
+    int fd = static_cast<int>(syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (fd < 0) {
+        LOG_E("memfd_create failed: %d", errno);
+        return -1;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        LOG_E("Failed to size memfd to %zu bytes: %d", size, errno);
+        close(fd);
+        return -1;
+    }
+    if (fcntl(fd, F_ADD_SEALS, kRequiredSeals) != 0) {
+        LOG_E("Failed to seal memfd: %d", errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+keymaster_error_t BulkDataChannel::Map(int fd, size_t size) {
+    Unmap();
+    if (fd < 0 || size == 0) return KM_ERROR_INVALID_ARGUMENT;
+
+    // Touching a page of a shared mapping that lies past the end of the file raises SIGBUS, so the
+    // file must be at least size bytes long and sealed so that it stays that way.  The seals are
+    // checked first; once they are in place the size can't change under the fstat.
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & kRequiredSeals) != kRequiredSeals) {
+        LOG_E("Bulk data descriptor is not sealed against resizing", 0);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOG_E("Failed to stat bulk data descriptor: %d", errno);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if (st.st_size < 0 || static_cast<uint64_t>(st.st_size) < size) {
+        LOG_E("Bulk data descriptor holds %lld bytes, fewer than the %zu requested",
+              static_cast<long long>(st.st_size), size);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 /* offset */);
+    if (data == MAP_FAILED) {
+        LOG_E("Failed to map %zu bytes of bulk data descriptor: %d", size, errno);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    data_ = static_cast<uint8_t*>(data);
+    size_ = size;
+    return KM_ERROR_OK;
+}
+
+void BulkDataChannel::Unmap() {
+    if (data_) munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+keymaster_error_t BulkDataChannel::Update(keymaster_operation_handle_t op_handle,
+                                          const AuthorizationSet& additional_params,
+                                          size_t offset, size_t length,
+                                          AuthorizationSet* output_params) {
+    if (!InRegion(offset, length)) return KM_ERROR_INVALID_ARGUMENT;
+    return keymaster_->UpdateOperationInPlace(op_handle, additional_params, data_ + offset, length,
+                                              output_params);
+}
+
+keymaster_error_t BulkDataChannel::Finish(keymaster_operation_handle_t op_handle,
+                                          const AuthorizationSet& additional_params,
+                                          size_t offset, size_t length, size_t capacity,
+                                          AuthorizationSet* output_params,
+                                          size_t* output_length) {
+    if (capacity < length || !InRegion(offset, capacity)) return KM_ERROR_INVALID_ARGUMENT;
+    return keymaster_->FinishOperationInPlace(op_handle, additional_params, data_ + offset,
+                                              length, capacity, output_params, output_length);
+}
+
+}  // namespace keymaster
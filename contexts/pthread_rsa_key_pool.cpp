@@ -0,0 +1,168 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <keymaster/contexts/pthread_rsa_key_pool.h>
+
+#include <keymaster/km_openssl/rsa_key_factory.h>
+#include <keymaster/logger.h>
+#include <keymaster/new>
+
+namespace keymaster {
+
+PthreadRsaKeyPool::PthreadRsaKeyPool(const KeySpec* specs, size_t spec_count,
+                                     size_t thread_count)
+    : queue_count_(0), thread_count_(0), shutting_down_(false), stats_{0, 0, 0} {
+    pthread_mutex_init(&mutex_, nullptr);
+    pthread_cond_init(&refill_needed_, nullptr);
+    pthread_cond_init(&key_added_, nullptr);
+
+    queues_.reset(new (std::nothrow) Queue[spec_count]);
+    if (!queues_.get()) return;
+    for (size_t i = 0; i < spec_count; ++i) {
+        Queue& queue = queues_[queue_count_];
+        queue.keys.reset(new (std::nothrow) KeymasterKeyBlob[specs[i].capacity]);
+        if (!queue.keys.get()) continue;
+        queue.key_size = specs[i].key_size;
+        queue.public_exponent = specs[i].public_exponent;
+        queue.capacity = specs[i].capacity;
+        queue.count = 0;
+        queue.in_flight = 0;
+        ++queue_count_;
+    }
+
+    if (thread_count == 0) return;
+    threads_.reset(new (std::nothrow) pthread_t[thread_count]);
+    if (!threads_.get()) return;
+    for (size_t i = 0; i < thread_count; ++i) {
+        if (pthread_create(&threads_[i], nullptr, ThreadMain, this) != 0) break;
+        ++thread_count_;
+    }
+}
+
+PthreadRsaKeyPool::~PthreadRsaKeyPool() {
+    pthread_mutex_lock(&mutex_);
+    shutting_down_ = true;
+    pthread_cond_broadcast(&refill_needed_);
+    pthread_cond_broadcast(&key_added_);
+    pthread_mutex_unlock(&mutex_);
+
+    for (size_t i = 0; i < thread_count_; ++i)
+        pthread_join(threads_[i], nullptr);
+
+    // The queued KeymasterKeyBlobs wipe themselves as queues_ is destroyed.
+    pthread_cond_destroy(&key_added_);
+    pthread_cond_destroy(&refill_needed_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+PthreadRsaKeyPool::Queue* PthreadRsaKeyPool::FindQueueLocked(uint32_t key_size,
+                                                             uint64_t public_exponent) const {
+    for (size_t i = 0; i < queue_count_; ++i)
+        if (queues_[i].key_size == key_size && queues_[i].public_exponent == public_exponent)
+            return &queues_[i];
+    return nullptr;
+}
+
+PthreadRsaKeyPool::Queue* PthreadRsaKeyPool::NextQueueToFillLocked() {
+    Queue* next = nullptr;
+    for (size_t i = 0; i < queue_count_; ++i) {
+        Queue& queue = queues_[i];
+        size_t pending = queue.count + queue.in_flight;
+        if (pending < queue.capacity &&
+            (!next || pending * next->capacity < (next->count + next->in_flight) * queue.capacity))
+            next = &queue;
+    }
+    return next;
+}
+
+bool PthreadRsaKeyPool::FullLocked() const {
+    for (size_t i = 0; i < queue_count_; ++i)
+        if (queues_[i].count < queues_[i].capacity) return false;
+    return true;
+}
+
+void* PthreadRsaKeyPool::ThreadMain(void* arg) {
+    PthreadRsaKeyPool* pool = reinterpret_cast<PthreadRsaKeyPool*>(arg);
+    pthread_mutex_lock(&pool->mutex_);
+    while (!pool->shutting_down_) {
+        Queue* queue = pool->NextQueueToFillLocked();
+        if (!queue) {
+            pthread_cond_wait(&pool->refill_needed_, &pool->mutex_);
+            continue;
+        }
+
+        ++queue->in_flight;
+        pthread_mutex_unlock(&pool->mutex_);
+        KeymasterKeyBlob key_material;
+        keymaster_error_t error = RsaKeyFactory::GenerateKeyMaterial(
+            queue->key_size, queue->public_exponent, &key_material);
+        pthread_mutex_lock(&pool->mutex_);
+        --queue->in_flight;
+
+        if (error != KM_ERROR_OK) {
+            // Retrying would most likely fail the same way, so stop filling this queue; Take()
+            // will miss and RsaKeyFactory will report the error when it generates the key itself.
+            LOG_E("Failed to pre-generate %u-bit RSA key: %d", queue->key_size, error);
+            queue->capacity = queue->count;
+            pthread_cond_broadcast(&pool->key_added_);
+            continue;
+        }
+        queue->keys[queue->count++] = move(key_material);
+        ++pool->stats_.generated;
+        pthread_cond_broadcast(&pool->key_added_);
+    }
+    pthread_mutex_unlock(&pool->mutex_);
+    return nullptr;
+}
+
+bool PthreadRsaKeyPool::Take(uint32_t key_size, uint64_t public_exponent,
+                             KeymasterKeyBlob* key_material) {
+    pthread_mutex_lock(&mutex_);
+    Queue* queue = FindQueueLocked(key_size, public_exponent);
+    bool hit = queue && queue->count > 0;
+    if (hit) {
+        *key_material = move(queue->keys[--queue->count]);
+        ++stats_.hits;
+        pthread_cond_signal(&refill_needed_);
+    } else {
+        ++stats_.misses;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return hit;
+}
+
+size_t PthreadRsaKeyPool::available(uint32_t key_size, uint64_t public_exponent) const {
+    pthread_mutex_lock(&mutex_);
+    Queue* queue = FindQueueLocked(key_size, public_exponent);
+    size_t count = queue ? queue->count : 0;
+    pthread_mutex_unlock(&mutex_);
+    return count;
+}
+
+PthreadRsaKeyPool::Stats PthreadRsaKeyPool::stats() const {
+    pthread_mutex_lock(&mutex_);
+    Stats stats = stats_;
+    pthread_mutex_unlock(&mutex_);
+    return stats;
+}
+
+void PthreadRsaKeyPool::WaitUntilFull() {
+    pthread_mutex_lock(&mutex_);
+    while (thread_count_ > 0 && !shutting_down_ && !FullLocked())
+        pthread_cond_wait(&key_added_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+}  // namespace keymaster
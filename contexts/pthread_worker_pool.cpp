@@ -0,0 +1,102 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/pthread_worker_pool.h>
+
+#include <keymaster/new>
+
+namespace keymaster {
+
+PthreadWorkerPool::PthreadWorkerPool(size_t concurrency)
+    : thread_count_(0), shutting_down_(false), task_(nullptr), context_(nullptr), task_count_(0),
+      next_task_(0), tasks_outstanding_(0) {
+    pthread_mutex_init(&mutex_, nullptr);
+    pthread_cond_init(&work_available_, nullptr);
+    pthread_cond_init(&work_done_, nullptr);
+
+    if (concurrency < 2) return;
+    threads_.reset(new (std::nothrow) pthread_t[concurrency - 1]);
+    if (!threads_.get()) return;
+    for (size_t i = 0; i < concurrency - 1; ++i) {
+        if (pthread_create(&threads_[i], nullptr, ThreadMain, this) != 0) break;
+        ++thread_count_;
+    }
+}
+
+PthreadWorkerPool::~PthreadWorkerPool() {
+    pthread_mutex_lock(&mutex_);
+    shutting_down_ = true;
+    pthread_cond_broadcast(&work_available_);
+    pthread_mutex_unlock(&mutex_);
+
+    for (size_t i = 0; i < thread_count_; ++i)
+        pthread_join(threads_[i], nullptr);
+
+    pthread_cond_destroy(&work_done_);
+    pthread_cond_destroy(&work_available_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void PthreadWorkerPool::RunTasksLocked() {
+    while (next_task_ < task_count_) {
+        size_t index = next_task_++;
+        Task task = task_;
+        void* context = context_;
+
+        pthread_mutex_unlock(&mutex_);
+        task(context, index);
+        pthread_mutex_lock(&mutex_);
+
+        if (--tasks_outstanding_ == 0) pthread_cond_broadcast(&work_done_);
+    }
+}
+
+void* PthreadWorkerPool::ThreadMain(void* arg) {
+    PthreadWorkerPool* pool = reinterpret_cast<PthreadWorkerPool*>(arg);
+    pthread_mutex_lock(&pool->mutex_);
+    while (!pool->shutting_down_) {
+        if (pool->next_task_ < pool->task_count_)
+            pool->RunTasksLocked();
+        else
+            pthread_cond_wait(&pool->work_available_, &pool->mutex_);
+    }
+    pthread_mutex_unlock(&pool->mutex_);
+    return nullptr;
+}
+
+void PthreadWorkerPool::Run(Task task, void* context, size_t task_count) {
+    if (task_count == 0) return;
+
+    pthread_mutex_lock(&mutex_);
+    task_ = task;
+    context_ = context;
+    task_count_ = task_count;
+    next_task_ = 0;
+    tasks_outstanding_ = task_count;
+    if (thread_count_ > 0) pthread_cond_broadcast(&work_available_);
+
+    RunTasksLocked();
+    while (tasks_outstanding_ > 0)
+        pthread_cond_wait(&work_done_, &mutex_);
+
+    task_ = nullptr;
+    context_ = nullptr;
+    task_count_ = 0;
+    next_task_ = 0;
+    pthread_mutex_unlock(&mutex_);
+}
+
+}  // namespace keymaster
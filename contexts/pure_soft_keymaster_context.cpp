@@ -34,6 +34,7 @@
 #include <keymaster/km_openssl/asymmetric_key.h>
 #include <keymaster/km_openssl/attestation_utils.h>
 #include <keymaster/km_openssl/ec_key_factory.h>
+#include <keymaster/km_openssl/ed25519_key_factory.h>
 #include <keymaster/km_openssl/hmac_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
@@ -52,7 +53,7 @@ namespace keymaster {
 
 PureSoftKeymasterContext::PureSoftKeymasterContext()
     : rsa_factory_(new RsaKeyFactory(this)), ec_factory_(new EcKeyFactory(this)),
-      aes_factory_(new AesKeyFactory(this, this)),
+      ed25519_factory_(new Ed25519KeyFactory(this)), aes_factory_(new AesKeyFactory(this, this)),
       tdes_factory_(new TripleDesKeyFactory(this, this)),
       hmac_factory_(new HmacKeyFactory(this, this)), os_version_(0), os_patchlevel_(0),
       soft_keymaster_enforcement_(64, 64) {}
@@ -72,6 +73,7 @@ void PureSoftKeymasterContext::GetSystemVersion(uint32_t* os_version, uint32_t*
 }
 
 KeyFactory* PureSoftKeymasterContext::GetKeyFactory(keymaster_algorithm_t algorithm) const {
+    if (algorithm == KM_ALGORITHM_ED25519) return ed25519_factory_.get();
     switch (algorithm) {
     case KM_ALGORITHM_RSA:
         return rsa_factory_.get();
@@ -88,6 +90,8 @@ KeyFactory* PureSoftKeymasterContext::GetKeyFactory(keymaster_algorithm_t algori
     }
 }
 
+// KM_ALGORITHM_ED25519 is left out: this list goes to HAL clients, whose Algorithm enum has no
+// such value.  Callers that know about it can still generate and import Ed25519 keys.
 static keymaster_algorithm_t supported_algorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC,
                                                        KM_ALGORITHM_AES, KM_ALGORITHM_HMAC};
 
@@ -230,17 +234,22 @@ keymaster_error_t PureSoftKeymasterContext::GenerateAttestation(const Key& key,
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
-    if ((key_algorithm != KM_ALGORITHM_RSA && key_algorithm != KM_ALGORITHM_EC))
+    if ((key_algorithm != KM_ALGORITHM_RSA && key_algorithm != KM_ALGORITHM_EC &&
+         key_algorithm != KM_ALGORITHM_ED25519))
         return KM_ERROR_INCOMPATIBLE_ALGORITHM;
 
     // We have established that the given key has the correct algorithm, and because this is the
     // SoftKeymasterContext we can assume that the Key is an AsymmetricKey. So we can downcast.
     const AsymmetricKey& asymmetric_key = static_cast<const AsymmetricKey&>(key);
 
-    auto attestation_chain = getAttestationChain(key_algorithm, &error);
+    // There's no Ed25519 attestation key; Ed25519 keys are attested by the EC one.
+    keymaster_algorithm_t signing_algorithm =
+        key_algorithm == KM_ALGORITHM_ED25519 ? KM_ALGORITHM_EC : key_algorithm;
+
+    auto attestation_chain = getAttestationChain(signing_algorithm, &error);
     if (error != KM_ERROR_OK) return error;
 
-    auto attestation_key = getAttestationKey(key_algorithm, &error);
+    auto attestation_key = getAttestationKey(signing_algorithm, &error);
     if (error != KM_ERROR_OK) return error;
 
     return generate_attestation(asymmetric_key, attest_params,
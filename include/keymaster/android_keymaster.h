@@ -25,6 +25,7 @@ namespace keymaster {
 class Key;
 class KeyFactory;
 class KeymasterContext;
+class Operation;
 class OperationTable;
 
 /**
@@ -68,6 +69,8 @@ class AndroidKeymaster {
     GetHmacSharingParametersResponse GetHmacSharingParameters();
     ComputeSharedHmacResponse ComputeSharedHmac(const ComputeSharedHmacRequest& request);
     VerifyAuthorizationResponse VerifyAuthorization(const VerifyAuthorizationRequest& request);
+    BatchVerifyAuthorizationResponse
+    BatchVerifyAuthorization(const BatchVerifyAuthorizationRequest& request);
 
     void AddRngEntropy(const AddEntropyRequest& request, AddEntropyResponse* response);
     void Configure(const ConfigureRequest& request, ConfigureResponse* response);
@@ -86,13 +89,55 @@ class AndroidKeymaster {
     void UpdateOperation(const UpdateOperationRequest& request, UpdateOperationResponse* response);
     void FinishOperation(const FinishOperationRequest& request, FinishOperationResponse* response);
     void AbortOperation(const AbortOperationRequest& request, AbortOperationResponse* response);
+    void BatchAeadOperation(const BatchAeadOperationRequest& request,
+                            BatchAeadOperationResponse* response);
+    void BatchVerifySignatures(const BatchVerifySignaturesRequest& request,
+                               BatchVerifySignaturesResponse* response);
+    void BatchComputeMacs(const BatchComputeMacsRequest& request,
+                          BatchComputeMacsResponse* response);
+    void BatchAgreeKeys(const BatchAgreeKeysRequest& request, BatchAgreeKeysResponse* response);
+
+    /**
+     * Bulk variants of UpdateOperation() and FinishOperation(), for callers that hold the payload
+     * in memory they share with the implementation (see BulkDataChannel).  Rather than being
+     * copied into a request and out of a response, the \p data_length bytes at \p data are
+     * transformed in place, with the semantics of Operation::UpdateInPlace() and
+     * Operation::FinishInPlace().  Authorization and error handling are as for the message
+     * versions.  Operations that can't work in place return KM_ERROR_UNIMPLEMENTED, which leaves
+     * the operation usable through the message versions.
+     */
+    keymaster_error_t UpdateOperationInPlace(keymaster_operation_handle_t op_handle,
+                                             const AuthorizationSet& additional_params,
+                                             uint8_t* data, size_t data_length,
+                                             AuthorizationSet* output_params);
+    keymaster_error_t FinishOperationInPlace(keymaster_operation_handle_t op_handle,
+                                             const AuthorizationSet& additional_params,
+                                             uint8_t* data, size_t data_length,
+                                             size_t data_capacity,
+                                             AuthorizationSet* output_params,
+                                             size_t* output_length);
 
     bool has_operation(keymaster_operation_handle_t op_handle) const;
 
   private:
+    keymaster_error_t AuthorizeContinuedOperation(keymaster_operation_handle_t op_handle,
+                                                  const AuthorizationSet& additional_params,
+                                                  Operation** operation);
     keymaster_error_t LoadKey(const keymaster_key_blob_t& key_blob,
                               const AuthorizationSet& additional_params,
                               const KeyFactory** factory, UniquePtr<Key>* key);
+    keymaster_error_t BeginBatchRecord(const AuthorizationSet& record_params,
+                                       Operation* operation, bool* begun,
+                                       AuthorizationSet* output_params);
+    keymaster_error_t ProcessAeadRecord(const AuthorizationSet& record_params,
+                                        const AeadRecord& record, Operation* operation,
+                                        bool* begun, AeadRecordResult* result);
+    // MACs \p record into \p mac, except that for an HMAC-SHA256 key it only authorizes the
+    // record, returning the key material and MAC length for the caller to compute the MAC with.
+    // \p sha256_mac_length is zero unless it did so.
+    keymaster_error_t ComputeMacRecord(const AuthorizationSet& additional_params,
+                                       const MacRecord& record, Buffer* mac,
+                                       KeymasterKeyBlob* sha256_key, size_t* sha256_mac_length);
 
     UniquePtr<KeymasterContext> context_;
     UniquePtr<OperationTable> operation_table_;
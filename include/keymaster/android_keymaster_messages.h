@@ -55,6 +55,11 @@ enum AndroidKeymasterCommand : uint32_t {
     DELETE_ALL_KEYS = 23,
     DESTROY_ATTESTATION_IDS = 24,
     IMPORT_WRAPPED_KEY = 25,
+    BATCH_VERIFY_AUTHORIZATION = 26,
+    BATCH_AEAD_OPERATION = 27,
+    BATCH_VERIFY_SIGNATURES = 28,
+    BATCH_COMPUTE_MACS = 29,
+    BATCH_AGREE_KEYS = 30,
 };
 
 /**
@@ -75,7 +80,7 @@ enum AndroidKeymasterCommand : uint32_t {
  * Note that this approach implies that GetVersionRequest and GetVersionResponse cannot be
  * versioned.
  */
-const int32_t MAX_MESSAGE_VERSION = 3;
+const int32_t MAX_MESSAGE_VERSION = 4;
 inline int32_t MessageVersion(uint8_t major_ver, uint8_t minor_ver, uint8_t /* subminor_ver */) {
     int32_t message_version = -1;
     switch (major_ver) {
@@ -95,7 +100,14 @@ inline int32_t MessageVersion(uint8_t major_ver, uint8_t minor_ver, uint8_t /* s
         }
         break;
     case 2:
-        message_version = 3;
+        switch (minor_ver) {
+        case 0:
+            message_version = 3;
+            break;
+        case 1:
+            message_version = 4;
+            break;
+        }
         break;
     }
     return message_version;
@@ -358,8 +370,15 @@ struct BeginOperationResponse : public KeymasterResponse {
     AuthorizationSet output_params;
 };
 
+/**
+ * From message version 4, input may instead be given as a list of segments, which are processed in
+ * order as if they had been concatenated.  A request that has segments must leave input empty.
+ */
 struct UpdateOperationRequest : public KeymasterMessage {
     explicit UpdateOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+    ~UpdateOperationRequest() override { delete[] input_segments; }
+
+    bool AllocateInputSegments(size_t count);
 
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
@@ -368,6 +387,8 @@ struct UpdateOperationRequest : public KeymasterMessage {
     keymaster_operation_handle_t op_handle;
     Buffer input;
     AuthorizationSet additional_params;
+    Buffer* input_segments = nullptr;
+    size_t num_input_segments = 0;
 };
 
 struct UpdateOperationResponse : public KeymasterResponse {
@@ -383,8 +404,15 @@ struct UpdateOperationResponse : public KeymasterResponse {
     AuthorizationSet output_params;
 };
 
+/**
+ * As with UpdateOperationRequest, from message version 4 input may be given as a list of segments
+ * instead.
+ */
 struct FinishOperationRequest : public KeymasterMessage {
     explicit FinishOperationRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+    ~FinishOperationRequest() override { delete[] input_segments; }
+
+    bool AllocateInputSegments(size_t count);
 
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
@@ -394,6 +422,8 @@ struct FinishOperationRequest : public KeymasterMessage {
     Buffer input;
     Buffer signature;
     AuthorizationSet additional_params;
+    Buffer* input_segments = nullptr;
+    size_t num_input_segments = 0;
 };
 
 struct FinishOperationResponse : public KeymasterResponse {
@@ -844,6 +874,14 @@ struct VerificationToken : public Serializable {
         security_level = other.security_level;
         mac = move(other.mac);
     }
+    VerificationToken& operator=(VerificationToken&& other) {
+        challenge = other.challenge;
+        timestamp = other.timestamp;
+        parameters_verified = move(other.parameters_verified);
+        security_level = other.security_level;
+        mac = move(other.mac);
+        return *this;
+    }
 
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
@@ -903,6 +941,329 @@ struct VerifyAuthorizationResponse : public KeymasterResponse {
     VerificationToken token;
 };
 
+/**
+ * Requests one verification token per challenge.  All tokens cover the same parameters and auth
+ * token, and carry the same timestamp.
+ */
+struct BatchVerifyAuthorizationRequest : public KeymasterMessage {
+    explicit BatchVerifyAuthorizationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver) {}
+    ~BatchVerifyAuthorizationRequest() override { delete[] challenges; }
+
+    bool SetChallenges(const uint64_t* challenge_array, size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    uint64_t* challenges = nullptr;
+    size_t num_challenges = 0;
+    AuthorizationSet parameters_to_verify;
+    HardwareAuthToken auth_token;
+};
+
+struct BatchVerifyAuthorizationResponse : public KeymasterResponse {
+    explicit BatchVerifyAuthorizationResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver) {}
+    BatchVerifyAuthorizationResponse(BatchVerifyAuthorizationResponse&& other)
+        : KeymasterResponse(other.message_version) {
+        error = other.error;
+        tokens = other.tokens;
+        num_tokens = other.num_tokens;
+        other.tokens = nullptr;
+        other.num_tokens = 0;
+    }
+    ~BatchVerifyAuthorizationResponse() override { delete[] tokens; }
+
+    bool AllocateTokens(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    VerificationToken* tokens = nullptr;
+    size_t num_tokens = 0;
+};
+
+/**
+ * One message in a BatchAeadOperationRequest.  When encrypting, an empty nonce asks for one to be
+ * generated.  When decrypting, input is the ciphertext followed by the tag.
+ */
+struct AeadRecord : public Serializable {
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    Buffer nonce;
+    Buffer aad;
+    Buffer input;
+};
+
+/**
+ * The result of one AeadRecord.  nonce is the nonce used, which for encryption may have been
+ * generated, and output is the ciphertext and tag, or the plaintext.
+ */
+struct AeadRecordResult : public Serializable {
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_error_t error{KM_ERROR_UNKNOWN_ERROR};
+    Buffer nonce;
+    Buffer output;
+};
+
+/**
+ * Encrypts or decrypts many complete messages under one AES key, in GCM or ChaCha20-Poly1305 mode.
+ * Each record is authorized and processed as if by its own Begin/Finish pair with additional_params
+ * plus the record's nonce, so that, for example, each record counts against
+ * KM_TAG_MAX_USES_PER_BOOT.
+ */
+struct BatchAeadOperationRequest : public KeymasterMessage {
+    explicit BatchAeadOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~BatchAeadOperationRequest() override {
+        delete[] key_blob.key_material;
+        delete[] records;
+    }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+    bool AllocateRecords(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_purpose_t purpose;
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    AeadRecord* records = nullptr;
+    size_t num_records = 0;
+};
+
+/**
+ * The response carries one result per record, in order.  error is KM_ERROR_OK unless the batch as a
+ * whole failed (for example because the key couldn't be loaded); failures of individual records
+ * are reported in their results.
+ */
+struct BatchAeadOperationResponse : public KeymasterResponse {
+    explicit BatchAeadOperationResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver) {}
+    ~BatchAeadOperationResponse() override { delete[] results; }
+
+    bool AllocateResults(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AeadRecordResult* results = nullptr;
+    size_t num_results = 0;
+};
+
+/**
+ * One message and signature in a BatchVerifySignaturesRequest.  input is the message, or with
+ * KM_DIGEST_NONE its digest, exactly as it would be passed to a verification operation.
+ */
+struct SignatureRecord : public Serializable {
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    Buffer input;
+    Buffer signature;
+};
+
+/**
+ * Verifies many signatures made under one RSA, EC or Ed25519 key.  Each record is authorized and
+ * verified as if by its own Begin/Finish pair with additional_params, so that, for example, each
+ * record counts against KM_TAG_MAX_USES_PER_BOOT.
+ */
+struct BatchVerifySignaturesRequest : public KeymasterMessage {
+    explicit BatchVerifySignaturesRequest(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~BatchVerifySignaturesRequest() override {
+        delete[] key_blob.key_material;
+        delete[] records;
+    }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+    bool AllocateRecords(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    SignatureRecord* records = nullptr;
+    size_t num_records = 0;
+};
+
+/**
+ * The response carries one result per record, in order: KM_ERROR_OK if the signature is valid,
+ * KM_ERROR_VERIFICATION_FAILED if it isn't, or the error that prevented checking it.  error is
+ * KM_ERROR_OK unless the batch as a whole failed.
+ */
+struct BatchVerifySignaturesResponse : public KeymasterResponse {
+    explicit BatchVerifySignaturesResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver) {}
+    ~BatchVerifySignaturesResponse() override { delete[] results; }
+
+    bool AllocateResults(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_error_t* results = nullptr;
+    size_t num_results = 0;
+};
+
+/**
+ * One message in a BatchComputeMacsRequest, with the HMAC key blob to MAC it under.
+ */
+struct MacRecord : public Serializable {
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    KeymasterKeyBlob key_blob;
+    Buffer input;
+};
+
+/**
+ * Computes the HMACs of many independent messages, each under its own key.  Each record is
+ * authorized and processed as if by its own Begin/Finish pair with KM_PURPOSE_SIGN and
+ * additional_params, which must therefore include KM_TAG_MAC_LENGTH.  The MACs of HMAC-SHA256
+ * records are then computed side by side in SIMD lanes (see ComputeHmacSha256s()); for other
+ * digests, keys that appear in several records are cheapest when an HmacContextCache is installed.
+ */
+struct BatchComputeMacsRequest : public KeymasterMessage {
+    explicit BatchComputeMacsRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {}
+    ~BatchComputeMacsRequest() override { delete[] records; }
+
+    bool AllocateRecords(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AuthorizationSet additional_params;
+    MacRecord* records = nullptr;
+    size_t num_records = 0;
+};
+
+/**
+ * The result of one MacRecord: the MAC, or the error that prevented computing it.
+ */
+struct MacRecordResult : public Serializable {
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_error_t error{KM_ERROR_UNKNOWN_ERROR};
+    Buffer mac;
+};
+
+/**
+ * The response carries one result per record, in order.  error is KM_ERROR_OK unless the batch as
+ * a whole failed.
+ */
+struct BatchComputeMacsResponse : public KeymasterResponse {
+    explicit BatchComputeMacsResponse(int32_t ver = MAX_MESSAGE_VERSION)
+        : KeymasterResponse(ver) {}
+    ~BatchComputeMacsResponse() override { delete[] results; }
+
+    bool AllocateResults(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    MacRecordResult* results = nullptr;
+    size_t num_results = 0;
+};
+
+/**
+ * Runs one KM_PURPOSE_AGREE_KEY operation with an EC key against each of many peer public values,
+ * which are uncompressed points on the key's curve.  Each value is authorized and processed as if
+ * by its own Begin/Finish pair with additional_params, which may name a KDF for the secrets.
+ */
+struct BatchAgreeKeysRequest : public KeymasterMessage {
+    explicit BatchAgreeKeysRequest(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~BatchAgreeKeysRequest() override {
+        delete[] key_blob.key_material;
+        delete[] peer_public_values;
+    }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+    bool AllocatePeerPublicValues(size_t count);
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    Buffer* peer_public_values = nullptr;
+    size_t num_peer_public_values = 0;
+};
+
+/**
+ * The result of agreeing on one peer public value: the secret (or the KDF's output), or the error
+ * that prevented computing it.
+ */
+struct AgreementResult : public Serializable {
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_error_t error{KM_ERROR_UNKNOWN_ERROR};
+    Buffer secret;
+};
+
+/**
+ * The response carries one result per peer public value, in order.  error is KM_ERROR_OK unless
+ * the batch as a whole failed.
+ */
+struct BatchAgreeKeysResponse : public KeymasterResponse {
+    explicit BatchAgreeKeysResponse(int32_t ver = MAX_MESSAGE_VERSION) : KeymasterResponse(ver) {}
+    ~BatchAgreeKeysResponse() override { delete[] results; }
+
+    bool AllocateResults(size_t count);
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AgreementResult* results = nullptr;
+    size_t num_results = 0;
+};
+
 }  // namespace keymaster
 
 #endif  // SYSTEM_KEYMASTER_ANDROID_KEYMASTER_MESSAGES_H_
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_BULK_DATA_CHANNEL_H_
+#define SYSTEM_KEYMASTER_BULK_DATA_CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+class AndroidKeymaster;
+class AuthorizationSet;
+
+/**
+ * Linux-only channel for passing large Update/Finish payloads to an in-process AndroidKeymaster
+ * through a shared mapping of a file descriptor (typically a memfd), rather than copying them into
+ * requests and out of responses.  The client writes its input into the region and names it by
+ * offset and length; the operation transforms it in place, leaving the output at the same offset.
+ *
+ * Only operations that support in-place processing (block cipher modes without padding) can use
+ * the channel.  Others return KM_ERROR_UNIMPLEMENTED and remain usable through the usual messages.
+ */
+class BulkDataChannel {
+  public:
+    explicit BulkDataChannel(AndroidKeymaster* keymaster) : keymaster_(keymaster) {}
+    ~BulkDataChannel() { Unmap(); }
+
+    BulkDataChannel(const BulkDataChannel&) = delete;
+    void operator=(const BulkDataChannel&) = delete;
+
+    /**
+     * Creates a memfd of \p size bytes, sealed against shrinking and growing, suitable for passing
+     * to Map().  Returns the descriptor, which the caller owns, or -1 on failure.
+     */
+    static int CreateMemfd(const char* name, size_t size);
+
+    /**
+     * Maps the first \p size bytes of \p fd, replacing any previous mapping.  The descriptor must
+     * carry F_SEAL_SHRINK and F_SEAL_GROW and be at least \p size bytes long, so that the client
+     * can't truncate it under the mapping; otherwise KM_ERROR_INVALID_ARGUMENT is returned.  The
+     * descriptor remains owned by the caller and may be closed once this returns.
+     */
+    keymaster_error_t Map(int fd, size_t size);
+    void Unmap();
+
+    uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    /**
+     * Transforms the \p length bytes at \p offset in the region, as
+     * AndroidKeymaster::UpdateOperationInPlace().
+     */
+    keymaster_error_t Update(keymaster_operation_handle_t op_handle,
+                             const AuthorizationSet& additional_params, size_t offset,
+                             size_t length, AuthorizationSet* output_params);
+
+    /**
+     * Transforms the \p length bytes at \p offset in the region, as
+     * AndroidKeymaster::FinishOperationInPlace(), with room for output up to \p capacity bytes
+     * from \p offset (for example for an appended tag).  \p output_length is set to the number of
+     * bytes of output at \p offset.
+     */
+    keymaster_error_t Finish(keymaster_operation_handle_t op_handle,
+                             const AuthorizationSet& additional_params, size_t offset,
+                             size_t length, size_t capacity, AuthorizationSet* output_params,
+                             size_t* output_length);
+
+  private:
+    bool InRegion(size_t offset, size_t length) const {
+        return data_ && offset <= size_ && length <= size_ - offset;
+    }
+
+    AndroidKeymaster* keymaster_;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_BULK_DATA_CHANNEL_H_
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SYSTEM_KEYMASTER_PTHREAD_RSA_KEY_POOL_H_
+#define SYSTEM_KEYMASTER_PTHREAD_RSA_KEY_POOL_H_
+
+#include <pthread.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/km_openssl/rsa_key_pool.h>
+
+namespace keymaster {
+
+/**
+ * RsaKeyPool that generates keys on background POSIX threads.  It keeps a bounded queue of keys
+ * for each configured (key size, public exponent) pair, and refills a queue as soon as a key is
+ * taken from it.
+ *
+ * Queued keys exist only as key material in this process's memory, and are wiped when they are
+ * taken or the pool is destroyed.
+ */
+class PthreadRsaKeyPool : public RsaKeyPool {
+  public:
+    struct KeySpec {
+        uint32_t key_size;
+        uint64_t public_exponent;
+        size_t capacity;  // The number of keys to keep ready.
+    };
+
+    struct Stats {
+        uint64_t hits;       // Take() calls served from the pool.
+        uint64_t misses;     // Take() calls that found no key ready.
+        uint64_t generated;  // Keys generated by the pool's threads.
+    };
+
+    /**
+     * Creates a pool that keeps keys ready for each of the \p spec_count \p specs, generated by up
+     * to \p thread_count threads.  If threads can't be started, the pool runs with as many as
+     * could be, down to none, in which case every Take() misses.
+     */
+    PthreadRsaKeyPool(const KeySpec* specs, size_t spec_count, size_t thread_count);
+
+    /**
+     * Stops the threads, waiting for any key generation in progress to complete, and wipes the
+     * queued keys.
+     */
+    ~PthreadRsaKeyPool();
+
+    PthreadRsaKeyPool(const PthreadRsaKeyPool&) = delete;
+    void operator=(const PthreadRsaKeyPool&) = delete;
+
+    bool Take(uint32_t key_size, uint64_t public_exponent,
+              KeymasterKeyBlob* key_material) override;
+
+    /**
+     * Returns the number of keys ready for the given size and exponent.
+     */
+    size_t available(uint32_t key_size, uint64_t public_exponent) const;
+
+    Stats stats() const;
+
+    /**
+     * Blocks until every queue is full, for example to prime the pool before a burst of key
+     * generation.  Returns immediately if the pool has no threads.
+     */
+    void WaitUntilFull();
+
+  private:
+    struct Queue {
+        uint32_t key_size;
+        uint64_t public_exponent;
+        size_t capacity;
+        UniquePtr<KeymasterKeyBlob[]> keys;
+        size_t count;
+        size_t in_flight;
+    };
+
+    static void* ThreadMain(void* pool);
+
+    // Returns the queue most in need of a key, or nullptr if every queue is full or being filled.
+    // Called with mutex_ held.
+    Queue* NextQueueToFillLocked();
+    Queue* FindQueueLocked(uint32_t key_size, uint64_t public_exponent) const;
+    bool FullLocked() const;
+
+    mutable pthread_mutex_t mutex_;
+    pthread_cond_t refill_needed_;
+    pthread_cond_t key_added_;
+    UniquePtr<Queue[]> queues_;
+    size_t queue_count_;
+    UniquePtr<pthread_t[]> threads_;
+    size_t thread_count_;
+    bool shutting_down_;
+    Stats stats_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_PTHREAD_RSA_KEY_POOL_H_
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_PTHREAD_WORKER_POOL_H_
+#define SYSTEM_KEYMASTER_PTHREAD_WORKER_POOL_H_
+
+#include <pthread.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/worker_pool.h>
+
+namespace keymaster {
+
+/**
+ * WorkerPool backed by a fixed set of POSIX threads, which are started once and reused for every
+ * Run().  The thread calling Run() also executes tasks, so a pool of concurrency N starts N - 1
+ * threads.
+ */
+class PthreadWorkerPool : public WorkerPool {
+  public:
+    /**
+     * Creates a pool that runs up to \p concurrency tasks at once.  If threads can't be started,
+     * the pool runs with as many as could be, down to running every task on the calling thread.
+     */
+    explicit PthreadWorkerPool(size_t concurrency);
+    ~PthreadWorkerPool();
+
+    PthreadWorkerPool(const PthreadWorkerPool&) = delete;
+    void operator=(const PthreadWorkerPool&) = delete;
+
+    size_t concurrency() const override { return thread_count_ + 1; }
+    void Run(Task task, void* context, size_t task_count) override;
+
+  private:
+    static void* ThreadMain(void* pool);
+
+    // Claims and runs tasks from the current job until none are left.  Called with mutex_ held;
+    // returns with it held.
+    void RunTasksLocked();
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t work_available_;
+    pthread_cond_t work_done_;
+    UniquePtr<pthread_t[]> threads_;
+    size_t thread_count_;
+    bool shutting_down_;
+
+    // The current job, guarded by mutex_.
+    Task task_;
+    void* context_;
+    size_t task_count_;
+    size_t next_task_;
+    size_t tasks_outstanding_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_PTHREAD_WORKER_POOL_H_
@@ -93,6 +93,7 @@ class PureSoftKeymasterContext: public KeymasterContext,
   protected:
     std::unique_ptr<KeyFactory> rsa_factory_;
     std::unique_ptr<KeyFactory> ec_factory_;
+    std::unique_ptr<KeyFactory> ed25519_factory_;
     std::unique_ptr<KeyFactory> aes_factory_;
     std::unique_ptr<KeyFactory> tdes_factory_;
     std::unique_ptr<KeyFactory> hmac_factory_;
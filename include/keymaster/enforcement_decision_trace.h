@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ENFORCEMENT_DECISION_TRACE_H_
+#define SYSTEM_KEYMASTER_ENFORCEMENT_DECISION_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * A single authorization decision made by KeymasterEnforcement.  deciding_tag is the key or
+ * operation tag that caused a rejection, or KM_TAG_INVALID if the operation was authorized (or the
+ * rejection wasn't attributable to a single tag).  timestamp_ms is the get_current_time_ms()
+ * reading a Begin was checked against, or zero for decisions that didn't need the time (Update,
+ * Finish and public-key operations).
+ */
+struct EnforcementDecision {
+    uint64_t key_id;
+    uint64_t timestamp_ms;
+    keymaster_error_t result;
+    keymaster_tag_t deciding_tag;
+    keymaster_purpose_t purpose;
+    bool is_begin_operation;
+};
+
+/**
+ * Fixed-size trace of the most recent enforcement decisions.
+ *
+ * Record() must only be called from a single thread (the one that runs enforcement), and never
+ * blocks or allocates.  Snapshot() may be called concurrently from any thread; it is lock-free and
+ * simply omits entries that are overwritten while it is copying them.  Once full, the oldest
+ * entries are overwritten.
+ *
+ * Snapshots can be serialized into a compact binary form, which can be pulled off the device and
+ * decoded on the host with Deserialize() and Format().
+ */
+class EnforcementDecisionTrace {
+  public:
+    static const size_t kCapacity = 64;  // Must be a power of two.
+    static const uint32_t kSerializationVersion = 1;
+    static const size_t kSerializedRecordSize = 4 * sizeof(uint64_t);
+
+    EnforcementDecisionTrace();
+
+    void Record(const EnforcementDecision& decision);
+
+    /**
+     * Copies up to \p max_records of the most recent decisions into \p records, oldest first.
+     * Returns the number of records copied.
+     */
+    size_t Snapshot(EnforcementDecision* records, size_t max_records) const;
+
+    /**
+     * Total number of decisions recorded since construction, including those that have since been
+     * overwritten.
+     */
+    uint64_t total_recorded() const { return __atomic_load_n(&head_, __ATOMIC_ACQUIRE); }
+
+    static size_t SerializedSize(size_t record_count) {
+        return 2 * sizeof(uint32_t) + record_count * kSerializedRecordSize;
+    }
+    static uint8_t* Serialize(const EnforcementDecision* records, size_t record_count,
+                              uint8_t* buf, const uint8_t* end);
+
+    /**
+     * Decodes a serialized snapshot.  On entry \p record_count holds the capacity of \p records; on
+     * successful return it holds the number of records decoded.
+     */
+    static bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end,
+                            EnforcementDecision* records, size_t* record_count);
+
+    /**
+     * Writes a one-line human-readable description of \p decision into \p buf, with snprintf
+     * semantics.
+     */
+    static int Format(const EnforcementDecision& decision, char* buf, size_t buf_size);
+
+  private:
+    // Each record is stored as four 64-bit words, each written and read atomically, guarded by a
+    // per-slot sequence number (odd while the producer is writing the slot).
+    struct Slot {
+        uint64_t sequence;
+        uint64_t words[4];
+    };
+
+    static void Encode(const EnforcementDecision& decision, uint64_t* words);
+    static void Decode(const uint64_t* words, EnforcementDecision* decision);
+
+    Slot slots_[kCapacity];
+    uint64_t head_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ENFORCEMENT_DECISION_TRACE_H_
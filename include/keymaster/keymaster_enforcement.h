@@ -21,11 +21,27 @@
 
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/enforcement_decision_trace.h>
 
 namespace keymaster {
 
 typedef uint64_t km_id_t;
 
+/**
+ * Source of the relative time used by enforcement.  The requirements are those of
+ * KeymasterEnforcement::get_current_time_ms(), except that a reading may lag real time by up to
+ * tolerance_ms() (e.g. because the clock is only updated once per scheduler tick).  The lag varies
+ * between readings, so an interval measured with such a clock may be up to tolerance_ms() longer
+ * than the real one; callers add tolerance_ms() to any minimum interval they enforce.
+ */
+class EnforcementClock {
+  public:
+    virtual ~EnforcementClock() {}
+
+    virtual uint64_t now_ms() const = 0;
+    virtual uint64_t tolerance_ms() const = 0;
+};
+
 class KeymasterEnforcementContext {
   public:
     virtual ~KeymasterEnforcementContext() {}
@@ -65,7 +81,11 @@ class KeymasterEnforcement {
      */
     keymaster_error_t AuthorizeBegin(const keymaster_purpose_t purpose, const km_id_t keyid,
                                      const AuthProxy& auth_set,
-                                     const AuthorizationSet& operation_params);
+                                     const AuthorizationSet& operation_params) {
+        keymaster_tag_t deciding_tag;
+        return AuthorizeBegin(purpose, keyid, auth_set, operation_params, get_current_time_ms(),
+                              &deciding_tag);
+    }
 
     /**
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
@@ -75,7 +95,8 @@ class KeymasterEnforcement {
     keymaster_error_t AuthorizeUpdate(const AuthProxy& auth_set,
                                       const AuthorizationSet& operation_params,
                                       keymaster_operation_handle_t op_handle) {
-        return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
+        keymaster_tag_t deciding_tag;
+        return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle, &deciding_tag);
     }
 
     /**
@@ -86,7 +107,8 @@ class KeymasterEnforcement {
     keymaster_error_t AuthorizeFinish(const AuthProxy& auth_set,
                                       const AuthorizationSet& operation_params,
                                       keymaster_operation_handle_t op_handle) {
-        return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
+        keymaster_tag_t deciding_tag;
+        return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle, &deciding_tag);
     }
 
     //
@@ -102,36 +124,59 @@ class KeymasterEnforcement {
     //
     // - They must have some time source for relative times, but may not be able to provide more
     //   than reliability and monotonicity.
+    //
+    // The date and token checks are passed current_time_ms, the request's get_current_time_ms()
+    // snapshot, so that every check made for a request sees the same instant.  Implementations
+    // should work from it rather than read a clock again, e.g. by keeping real-world time as an
+    // offset from the relative clock.
 
     /*
      * Returns true if the specified activation date has passed, or if activation cannot be
      * enforced.
      */
-    virtual bool activation_date_valid(uint64_t activation_date) const = 0;
+    virtual bool activation_date_valid(uint64_t activation_date,
+                                       uint64_t current_time_ms) const = 0;
 
     /*
      * Returns true if the specified expiration date has passed.  Returns false if it has not, or if
      * expiration cannot be enforced.
      */
-    virtual bool expiration_date_passed(uint64_t expiration_date) const = 0;
+    virtual bool expiration_date_passed(uint64_t expiration_date,
+                                        uint64_t current_time_ms) const = 0;
 
     /*
-     * Returns true if the specified auth_token is older than the specified timeout.
+     * Returns true if the specified auth_token is older than the specified timeout.  Token
+     * timestamps come from other components, which use CLOCK_BOOTTIME.  An implementation whose
+     * clock may lag must treat tokens as expired get_current_time_tolerance_ms() early.
      */
-    virtual bool auth_token_timed_out(const hw_auth_token_t& token, uint32_t timeout) const = 0;
+    virtual bool auth_token_timed_out(const hw_auth_token_t& token, uint32_t timeout,
+                                      uint64_t current_time_ms) const = 0;
 
     /*
      * Get current time in milliseconds from some starting point.  This value is used to compute
-     * relative times between events.  It must be monotonically increasing, and must not skip or
-     * lag.  It need not have any relation to any external time standard (other than the duration of
-     * "second").
+     * relative times between events.  It must be monotonically increasing and must not skip.  It
+     * may lag by up to get_current_time_tolerance_ms().  It need not have any relation to any
+     * external time standard (other than the duration of "second").
      *
      * On Linux systems, it's recommended to use clock_gettime(CLOCK_BOOTTIME, ...) to implement
      * this method.  On non-Linux POSIX systems, CLOCK_MONOTONIC is good, assuming the device does
      * not suspend.
+     *
+     * AuthorizeOperation calls this once per Begin that it checks, and uses that snapshot for all
+     * of the Begin's time checks (dates, auth token timeouts, rate limiting and the decision
+     * trace), so every check within a request sees the same instant.  Update, Finish and
+     * public-key operations don't read it.
      */
     virtual uint64_t get_current_time_ms() const = 0;
 
+    /*
+     * Returns the most by which get_current_time_ms() may lag real time.  Minimum intervals between
+     * operations are lengthened by this amount, so that a lagging reading can only make them pass
+     * late, never early.  Rate-limit times are kept in milliseconds for this to hold.  Zero for
+     * exact clocks.
+     */
+    virtual uint64_t get_current_time_tolerance_ms() const { return 0; }
+
     /*
      * Get current time in seconds from some starting point.  This value is used to compute relative
      * times between events.  It must be monotonically increasing, and must not skip or lag.  It
@@ -170,6 +215,14 @@ class KeymasterEnforcement {
     virtual VerifyAuthorizationResponse
     VerifyAuthorization(const VerifyAuthorizationRequest& request) = 0;
 
+    /**
+     * Verify authorizations for another Keymaster instance, producing one token per challenge.
+     * The default implementation calls VerifyAuthorization once per challenge; subclasses may
+     * override it to share work across the batch.
+     */
+    virtual BatchVerifyAuthorizationResponse
+    BatchVerifyAuthorization(const BatchVerifyAuthorizationRequest& request);
+
     /**
      * Creates a key ID for use in subsequent calls to AuthorizeOperation.  AndroidKeymaster uses
      * this method for creating key IDs. The generated id must be stable in that the same key_blob
@@ -179,21 +232,35 @@ class KeymasterEnforcement {
      */
     virtual bool CreateKeyId(const keymaster_key_blob_t& key_blob, km_id_t* keyid) const = 0;
 
+    /**
+     * Trace of the most recent decisions made by AuthorizeOperation.  Recording is cheap enough to
+     * be left on, and the trace may be snapshotted from another thread.
+     */
+    const EnforcementDecisionTrace& decision_trace() const { return decision_trace_; }
+
   private:
+    keymaster_error_t AuthorizeBegin(const keymaster_purpose_t purpose, const km_id_t keyid,
+                                     const AuthProxy& auth_set,
+                                     const AuthorizationSet& operation_params,
+                                     uint64_t current_time_ms, keymaster_tag_t* deciding_tag);
     keymaster_error_t AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
                                               const AuthorizationSet& operation_params,
-                                              keymaster_operation_handle_t op_handle);
+                                              keymaster_operation_handle_t op_handle,
+                                              keymaster_tag_t* deciding_tag);
 
-    bool MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid);
+    bool MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid,
+                                 uint64_t current_time_ms);
     bool MaxUsesPerBootNotExceeded(const km_id_t keyid, uint32_t max_uses);
     bool AuthTokenMatches(const AuthProxy& auth_set, const AuthorizationSet& operation_params,
                           const uint64_t user_secure_id, const int auth_type_index,
                           const int auth_timeout_index,
                           const keymaster_operation_handle_t op_handle,
-                          bool is_begin_operation) const;
+                          bool is_begin_operation, uint64_t current_time_ms) const;
 
     AccessTimeMap* access_time_map_;
     AccessCountMap* access_count_map_;
+
+    EnforcementDecisionTrace decision_trace_;
 };
 
 }; /* namespace keymaster */
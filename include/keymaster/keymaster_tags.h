@@ -60,6 +60,37 @@ namespace keymaster {
 static const keymaster_tag_t KM_TAG_DIGEST_OLD = static_cast<keymaster_tag_t>(KM_ENUM | 5);
 static const keymaster_tag_t KM_TAG_PADDING_OLD = static_cast<keymaster_tag_t>(KM_ENUM | 7);
 
+// ChaCha20-Poly1305 AEAD mode, for 256-bit AES keys in software-only implementations.  It isn't
+// part of the HAL, so it isn't an enumerator and can't be a case label in a switch on the enum.
+// The value must still lie within the enum's range of values (0-63, given its largest enumerator,
+// KM_MODE_GCM), or the conversion is undefined, so it takes the top of that range.
+static const keymaster_block_mode_t KM_MODE_CHACHA20_POLY1305 =
+    static_cast<keymaster_block_mode_t>(63);
+
+// Ed25519 (RFC 8032) signing keys, in software-only implementations.  Like
+// KM_MODE_CHACHA20_POLY1305, it takes the top of the enum's range of values (0-255, given
+// KM_ALGORITHM_HMAC), and must be tested for outside switch statements.
+static const keymaster_algorithm_t KM_ALGORITHM_ED25519 =
+    static_cast<keymaster_algorithm_t>(255);
+
+// Begin parameter for RSA and ECDSA signing and verification: the input is the digest of the
+// message, already computed by the caller with the operation's digest, rather than the message
+// itself.  Also a software-only extension, numbered outside the HAL's range of tags.
+static const keymaster_tag_t KM_TAG_PREHASHED = static_cast<keymaster_tag_t>(KM_BOOL | 0x10001);
+
+// Elliptic-curve Diffie-Hellman key agreement with EC keys: the input is the peer's public point,
+// uncompressed, and the output is the shared secret.  Software-only, like KM_ALGORITHM_ED25519,
+// so it's kept out of switch statements.  Its value, 6, is inside the enum's range (0-7, given
+// KM_PURPOSE_WRAP) and is the one KeyMint's KeyPurpose later gave AGREE_KEY.
+static const keymaster_purpose_t KM_PURPOSE_AGREE_KEY = static_cast<keymaster_purpose_t>(6);
+
+// Begin parameters for KM_PURPOSE_AGREE_KEY with a KM_TAG_KDF other than KM_KDF_NONE: the KDF's
+// salt (RFC 5869 only) and info inputs, and the length of its output in bits.
+static const keymaster_tag_t KM_TAG_KDF_SALT = static_cast<keymaster_tag_t>(KM_BYTES | 0x10002);
+static const keymaster_tag_t KM_TAG_KDF_INFO = static_cast<keymaster_tag_t>(KM_BYTES | 0x10003);
+static const keymaster_tag_t KM_TAG_KDF_OUTPUT_LENGTH =
+    static_cast<keymaster_tag_t>(KM_UINT | 0x10004);
+
 // Until we have C++11, fake std::static_assert.
 template <bool b> struct StaticAssert {};
 template <> struct StaticAssert<true> {
@@ -141,6 +172,10 @@ DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_CALLER_NONCE);
 DECLARE_KEYMASTER_TAG(KM_UINT, TAG_MIN_MAC_LENGTH);
 DECLARE_KEYMASTER_TAG(KM_ULONG, TAG_RSA_PUBLIC_EXPONENT);
 DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_ECIES_SINGLE_HASH_MODE);
+DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_PREHASHED);
+DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_KDF_SALT);
+DECLARE_KEYMASTER_TAG(KM_BYTES, TAG_KDF_INFO);
+DECLARE_KEYMASTER_TAG(KM_UINT, TAG_KDF_OUTPUT_LENGTH);
 DECLARE_KEYMASTER_TAG(KM_BOOL, TAG_INCLUDE_UNIQUE_ID);
 DECLARE_KEYMASTER_TAG(KM_DATE, TAG_ACTIVE_DATETIME);
 DECLARE_KEYMASTER_TAG(KM_DATE, TAG_ORIGINATION_EXPIRE_DATETIME);
@@ -23,6 +23,9 @@
 
 namespace keymaster {
 
+class CipherContextCache;
+class WorkerPool;
+
 const size_t kMinGcmTagLength = 12 * 8;
 const size_t kMaxGcmTagLength = 16 * 8;
 
@@ -42,6 +45,22 @@ class AesKeyFactory : public SymmetricKeyFactory {
 
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
+    /**
+     * Enables reuse of initialized cipher contexts by AES operations, or disables it if \p cache is
+     * nullptr (the default).  The operation factories, and therefore the cache, are shared by all
+     * AesKeyFactory instances.  The cache is not owned and must outlive all operations begun while
+     * it is set.
+     */
+    static void set_cipher_context_cache(CipherContextCache* cache);
+
+    /**
+     * Enables parallel processing of AES CTR and ECB updates of at least \p min_parallel_bytes on
+     * \p pool, or disables it if \p pool is nullptr (the default).  Like the context cache, this is
+     * shared by all AesKeyFactory instances, and the pool must outlive all operations begun while
+     * it is set.
+     */
+    static void set_worker_pool(WorkerPool* pool, size_t min_parallel_bytes);
+
   private:
     bool key_size_supported(size_t key_size_bits) const override {
         return key_size_bits == 128 || key_size_bits == 192 || key_size_bits == 256;
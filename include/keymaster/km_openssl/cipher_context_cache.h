@@ -0,0 +1,91 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_CIPHER_CONTEXT_CACHE_H_
+#define SYSTEM_KEYMASTER_CIPHER_CONTEXT_CACHE_H_
+
+#include <openssl/evp.h>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+/**
+ * Bounded cache of keyed EVP_CIPHER_CTX templates, so that block cipher operations on a
+ * frequently-used key can copy a context with the key schedule already expanded instead of running
+ * EVP_CipherInit_ex from the raw key on every Begin.
+ *
+ * Entries are keyed by key ID, block mode, padding and direction, and also hold a copy of the key
+ * material, which is compared on lookup so that a key ID collision (or an unset key ID) can never
+ * yield a context for the wrong key.  When full, the least recently used entry is evicted.
+ * Evicted entries have their key material and expanded key schedule wiped.
+ *
+ * Not thread-safe; like AndroidKeymaster, it must be used from one thread at a time.
+ */
+class CipherContextCache {
+  public:
+    explicit CipherContextCache(size_t capacity);
+    ~CipherContextCache();
+
+    CipherContextCache(const CipherContextCache&) = delete;
+    void operator=(const CipherContextCache&) = delete;
+
+    /**
+     * If a template matching the arguments is cached, copies it into \p ctx and returns true.  \p
+     * ctx must have been initialized with EVP_CIPHER_CTX_init.
+     */
+    bool Lookup(km_id_t key_id, const KeymasterKeyBlob& key, keymaster_block_mode_t block_mode,
+                keymaster_padding_t padding, int encrypt, EVP_CIPHER_CTX* ctx);
+
+    /**
+     * Caches a copy of \p ctx, which must be initialized with \p key and padding but may have any
+     * IV.  Failures (e.g. allocation) are silently ignored; the cache is best-effort.
+     */
+    void Insert(km_id_t key_id, const KeymasterKeyBlob& key, keymaster_block_mode_t block_mode,
+                keymaster_padding_t padding, int encrypt, const EVP_CIPHER_CTX& ctx);
+
+    /**
+     * Evicts and wipes all entries.
+     */
+    void Clear();
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const;
+
+  private:
+    struct Entry {
+        bool in_use;
+        km_id_t key_id;
+        keymaster_block_mode_t block_mode;
+        keymaster_padding_t padding;
+        int encrypt;
+        uint64_t last_used;
+        KeymasterKeyBlob key;
+        EVP_CIPHER_CTX ctx;
+    };
+
+    static void Evict(Entry* entry);
+
+    UniquePtr<Entry[]> entries_;
+    size_t capacity_;
+    uint64_t clock_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_CIPHER_CONTEXT_CACHE_H_
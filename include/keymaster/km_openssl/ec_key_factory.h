@@ -56,8 +56,9 @@ class EcKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
   protected:
-    static EC_GROUP* ChooseGroup(size_t key_size_bits);
-    static EC_GROUP* ChooseGroup(keymaster_ec_curve_t ec_curve);
+    // These return shared groups (see ec_get_group()), which must not be modified or freed.
+    static const EC_GROUP* ChooseGroup(size_t key_size_bits);
+    static const EC_GROUP* ChooseGroup(keymaster_ec_curve_t ec_curve);
 
     static keymaster_error_t GetCurveAndSize(const AuthorizationSet& key_description,
                                              keymaster_ec_curve_t* curve, uint32_t* key_size_bits);
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ECDH_OPERATION_H_
+#define SYSTEM_KEYMASTER_ECDH_OPERATION_H_
+
+#include <keymaster/km_openssl/nist_curve_key_exchange.h>
+#include <keymaster/operation.h>
+
+namespace keymaster {
+
+/**
+ * ECDH key agreement.  Update() buffers the peer's uncompressed public point and Finish() returns
+ * the shared secret, i.e. the X coordinate of the product of the point and the private key.
+ *
+ * If the begin parameters name a KDF, the secret is run through it and the operation returns
+ * KM_TAG_KDF_OUTPUT_LENGTH bits of derived key material instead, so the raw secret never leaves
+ * the operation.
+ */
+class EcdhOperation : public Operation {
+  public:
+    EcdhOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                  NistCurveKeyExchange* key_exchange, size_t public_value_len)
+        : Operation(KM_PURPOSE_AGREE_KEY, move(hw_enforced), move(sw_enforced)),
+          key_exchange_(key_exchange), public_value_len_(public_value_len), kdf_(KM_KDF_NONE),
+          output_length_(0) {}
+
+    keymaster_error_t SetKdf(keymaster_kdf_t kdf, const keymaster_blob_t& salt,
+                             const keymaster_blob_t& info, size_t output_length);
+
+    keymaster_error_t Begin(const AuthorizationSet& input_params,
+                            AuthorizationSet* output_params) override;
+    keymaster_error_t Restart(const AuthorizationSet& input_params,
+                              AuthorizationSet* output_params) override;
+    keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
+                             AuthorizationSet* output_params, Buffer* output,
+                             size_t* input_consumed) override;
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
+                             const Buffer& signature, AuthorizationSet* output_params,
+                             Buffer* output) override;
+    keymaster_error_t Abort() override { return KM_ERROR_OK; }
+
+  private:
+    keymaster_error_t DeriveKey(const Buffer& secret, Buffer* output) const;
+
+    UniquePtr<NistCurveKeyExchange> key_exchange_;
+    size_t public_value_len_;
+    keymaster_kdf_t kdf_;
+    Buffer salt_;
+    Buffer info_;
+    size_t output_length_;
+    Buffer data_;
+};
+
+class EcdhOperationFactory : public OperationFactory {
+  private:
+    KeyType registry_key() const override {
+        return KeyType(KM_ALGORITHM_EC, KM_PURPOSE_AGREE_KEY);
+    }
+    OperationPtr CreateOperation(Key&& key, const AuthorizationSet& begin_params,
+                                 keymaster_error_t* error) const override;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ECDH_OPERATION_H_
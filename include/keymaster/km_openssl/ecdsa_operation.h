@@ -39,8 +39,17 @@ class EcdsaOperation : public Operation {
 
     keymaster_error_t Abort() override { return KM_ERROR_OK; }
 
+    /**
+     * Makes the operation treat its input as the digest of the message, computed by the caller,
+     * rather than as the message itself (see KM_TAG_PREHASHED).
+     */
+    void set_prehashed() { prehashed_ = true; }
+
   protected:
+    keymaster_error_t AllocateDataBuffer();
     keymaster_error_t StoreData(const Buffer& input, size_t* input_consumed);
+    keymaster_error_t StorePrehashed(const Buffer& input, size_t* input_consumed);
+    keymaster_error_t CheckPrehashedLength() const;
     keymaster_error_t InitDigest();
 
     keymaster_digest_t digest_;
@@ -48,6 +57,7 @@ class EcdsaOperation : public Operation {
     EVP_PKEY* ecdsa_key_;
     EVP_MD_CTX digest_ctx_;
     Buffer data_;
+    bool prehashed_ = false;
 };
 
 class EcdsaSignOperation : public EcdsaOperation {
@@ -69,15 +79,25 @@ class EcdsaVerifyOperation : public EcdsaOperation {
   public:
     EcdsaVerifyOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
                          keymaster_digest_t digest, EVP_PKEY* key)
-        : EcdsaOperation(move(hw_enforced), move(sw_enforced), KM_PURPOSE_VERIFY, digest, key) {}
+        : EcdsaOperation(move(hw_enforced), move(sw_enforced), KM_PURPOSE_VERIFY, digest, key) {
+        EVP_MD_CTX_init(&template_ctx_);
+    }
+    ~EcdsaVerifyOperation();
+
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
+    keymaster_error_t Restart(const AuthorizationSet& input_params,
+                              AuthorizationSet* output_params) override;
     keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
                              AuthorizationSet* output_params, Buffer* output,
                              size_t* input_consumed) override;
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+
+  private:
+    // The digest context as initialized by Begin(), which Restart() copies.
+    EVP_MD_CTX template_ctx_;
 };
 
 class EcdsaOperationFactory : public OperationFactory {
@@ -88,16 +108,18 @@ class EcdsaOperationFactory : public OperationFactory {
     const keymaster_digest_t* SupportedDigests(size_t* digest_count) const override;
 
     virtual keymaster_purpose_t purpose() const = 0;
-    virtual Operation* InstantiateOperation(AuthorizationSet&& hw_enforced,
-                                            AuthorizationSet&& sw_enforced,
-                                            keymaster_digest_t digest, EVP_PKEY* key) const = 0;
+    virtual EcdsaOperation* InstantiateOperation(AuthorizationSet&& hw_enforced,
+                                                 AuthorizationSet&& sw_enforced,
+                                                 keymaster_digest_t digest,
+                                                 EVP_PKEY* key) const = 0;
 };
 
 class EcdsaSignOperationFactory : public EcdsaOperationFactory {
   private:
     keymaster_purpose_t purpose() const override { return KM_PURPOSE_SIGN; }
-    Operation* InstantiateOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
-                                    keymaster_digest_t digest, EVP_PKEY* key) const override {
+    EcdsaOperation* InstantiateOperation(AuthorizationSet&& hw_enforced,
+                                         AuthorizationSet&& sw_enforced, keymaster_digest_t digest,
+                                         EVP_PKEY* key) const override {
         return new (std::nothrow)
             EcdsaSignOperation(move(hw_enforced), move(sw_enforced), digest, key);
     }
@@ -106,8 +128,9 @@ class EcdsaSignOperationFactory : public EcdsaOperationFactory {
 class EcdsaVerifyOperationFactory : public EcdsaOperationFactory {
   public:
     keymaster_purpose_t purpose() const override { return KM_PURPOSE_VERIFY; }
-    Operation* InstantiateOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
-                                    keymaster_digest_t digest, EVP_PKEY* key) const override {
+    EcdsaOperation* InstantiateOperation(AuthorizationSet&& hw_enforced,
+                                         AuthorizationSet&& sw_enforced, keymaster_digest_t digest,
+                                         EVP_PKEY* key) const override {
         return new (std::nothrow)
             EcdsaVerifyOperation(move(hw_enforced), move(sw_enforced), digest, key);
     }
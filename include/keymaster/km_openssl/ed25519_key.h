@@ -0,0 +1,82 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ED25519_KEY_H_
+#define SYSTEM_KEYMASTER_ED25519_KEY_H_
+
+#include <openssl/curve25519.h>
+
+#include <keymaster/km_openssl/asymmetric_key.h>
+
+namespace keymaster {
+
+/**
+ * An Ed25519 (RFC 8032) signing key.
+ *
+ * Key material is stored as the RFC 8410 PKCS#8 encoding of the 32-byte seed, and public keys are
+ * exported as RFC 8410 SubjectPublicKeyInfo.  Both encodings are fixed apart from the key bytes,
+ * so they're built and parsed here rather than through EVP_PKEY, which the BoringSSL we build
+ * against can't use for Ed25519.  For the same reason InternalToEvp() and EvpToInternal() always
+ * fail.
+ */
+class Ed25519Key : public AsymmetricKey {
+  public:
+    static const size_t kSeedSize = 32;
+    static const size_t kPublicKeySize = ED25519_PUBLIC_KEY_LEN;
+    static const size_t kPrivateKeySize = ED25519_PRIVATE_KEY_LEN;
+    static const size_t kSignatureSize = ED25519_SIGNATURE_LEN;
+    static const uint32_t kKeySizeBits = 256;
+
+    Ed25519Key(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+               const KeyFactory* key_factory)
+        : AsymmetricKey(move(hw_enforced), move(sw_enforced), key_factory) {}
+    ~Ed25519Key();
+
+    bool InternalToEvp(EVP_PKEY* /* pkey */) const override { return false; }
+    bool EvpToInternal(const EVP_PKEY* /* pkey */) override { return false; }
+
+    keymaster_error_t formatted_key_material(keymaster_key_format_t format,
+                                             UniquePtr<uint8_t[]>* material,
+                                             size_t* size) const override;
+
+    /**
+     * Derives the key pair from key_material(), which must be a PKCS#8 encoding.
+     */
+    keymaster_error_t LoadKeyMaterial();
+
+    // The 64-byte private key is the seed followed by the public key, as ED25519_sign() expects.
+    const uint8_t* private_key() const { return private_key_; }
+    const uint8_t* public_key() const { return public_key_; }
+
+    /**
+     * Encodes \p seed as RFC 8410 PKCS#8 into \p key_material.
+     */
+    static keymaster_error_t SeedToKeyMaterial(const uint8_t* seed, KeymasterKeyBlob* key_material);
+
+    /**
+     * Extracts the seed from the RFC 8410 PKCS#8 encoding in \p key_material.  \p seed must have
+     * room for kSeedSize bytes.
+     */
+    static keymaster_error_t KeyMaterialToSeed(const KeymasterKeyBlob& key_material, uint8_t* seed);
+
+  private:
+    uint8_t private_key_[kPrivateKeySize];
+    uint8_t public_key_[kPublicKeySize];
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ED25519_KEY_H_
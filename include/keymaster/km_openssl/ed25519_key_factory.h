@@ -0,0 +1,62 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ED25519_KEY_FACTORY_H_
+#define SYSTEM_KEYMASTER_ED25519_KEY_FACTORY_H_
+
+#include <openssl/evp.h>
+
+#include <keymaster/asymmetric_key_factory.h>
+#include <keymaster/soft_key_factory.h>
+
+namespace keymaster {
+
+/**
+ * Factory for KM_ALGORITHM_ED25519 keys.  Keys are always 256 bits, and are imported either as
+ * RFC 8410 PKCS#8 or as the raw 32-byte seed.
+ */
+class Ed25519KeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
+  public:
+    explicit Ed25519KeyFactory(const SoftwareKeyBlobMaker* blob_maker)
+        : SoftKeyFactoryMixin(blob_maker) {}
+
+    keymaster_algorithm_t keymaster_key_type() const override { return KM_ALGORITHM_ED25519; }
+    int evp_key_type() const override { return EVP_PKEY_NONE; }
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
+                                  KeymasterKeyBlob* key_blob, AuthorizationSet* hw_enforced,
+                                  AuthorizationSet* sw_enforced) const override;
+    keymaster_error_t ImportKey(const AuthorizationSet& key_description,
+                                keymaster_key_format_t input_key_material_format,
+                                const KeymasterKeyBlob& input_key_material,
+                                KeymasterKeyBlob* output_key_blob, AuthorizationSet* hw_enforced,
+                                AuthorizationSet* sw_enforced) const override;
+    keymaster_error_t LoadKey(KeymasterKeyBlob&& key_material,
+                              const AuthorizationSet& additional_params,
+                              AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                              UniquePtr<Key>* key) const override;
+    keymaster_error_t CreateEmptyKey(AuthorizationSet&& hw_enforced,
+                                     AuthorizationSet&& sw_enforced,
+                                     UniquePtr<AsymmetricKey>* key) const override;
+
+    const keymaster_key_format_t* SupportedImportFormats(size_t* format_count) const override;
+
+    OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ED25519_KEY_FACTORY_H_
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_ED25519_OPERATION_H_
+#define SYSTEM_KEYMASTER_ED25519_OPERATION_H_
+
+#include <keymaster/km_openssl/ed25519_key.h>
+#include <keymaster/operation.h>
+
+namespace keymaster {
+
+/**
+ * Ed25519 signs the message itself rather than a digest of it, in a single pass that needs the
+ * whole message, so Update() buffers the input and Finish() signs or verifies all of it.  There
+ * is no digest to choose; KM_DIGEST_NONE is the only one accepted.  Messages are limited to
+ * kMaxMessageSize bytes, so that a client can't make the operation buffer without bound.
+ */
+class Ed25519Operation : public Operation {
+  public:
+    static const size_t kMaxMessageSize = 16 * 1024;
+
+    Ed25519Operation(keymaster_purpose_t purpose, AuthorizationSet&& hw_enforced,
+                     AuthorizationSet&& sw_enforced)
+        : Operation(purpose, move(hw_enforced), move(sw_enforced)) {}
+
+    keymaster_error_t Begin(const AuthorizationSet& input_params,
+                            AuthorizationSet* output_params) override;
+    keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
+                             AuthorizationSet* output_params, Buffer* output,
+                             size_t* input_consumed) override;
+    keymaster_error_t Abort() override { return KM_ERROR_OK; }
+
+  protected:
+    Buffer data_;
+};
+
+class Ed25519SignOperation : public Ed25519Operation {
+  public:
+    Ed25519SignOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                         const Ed25519Key& key);
+    ~Ed25519SignOperation();
+
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
+                             const Buffer& signature, AuthorizationSet* output_params,
+                             Buffer* output) override;
+
+  private:
+    uint8_t private_key_[Ed25519Key::kPrivateKeySize];
+};
+
+class Ed25519VerifyOperation : public Ed25519Operation {
+  public:
+    Ed25519VerifyOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                           const Ed25519Key& key);
+
+    keymaster_error_t Restart(const AuthorizationSet& input_params,
+                              AuthorizationSet* output_params) override;
+    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
+                             const Buffer& signature, AuthorizationSet* output_params,
+                             Buffer* output) override;
+
+  private:
+    uint8_t public_key_[Ed25519Key::kPublicKeySize];
+};
+
+class Ed25519OperationFactory : public OperationFactory {
+  private:
+    KeyType registry_key() const override { return KeyType(KM_ALGORITHM_ED25519, purpose()); }
+    OperationPtr CreateOperation(Key&& key, const AuthorizationSet& begin_params,
+                                 keymaster_error_t* error) const override;
+    const keymaster_digest_t* SupportedDigests(size_t* digest_count) const override;
+
+    virtual keymaster_purpose_t purpose() const = 0;
+    virtual Operation* InstantiateOperation(AuthorizationSet&& hw_enforced,
+                                            AuthorizationSet&& sw_enforced,
+                                            const Ed25519Key& key) const = 0;
+};
+
+class Ed25519SignOperationFactory : public Ed25519OperationFactory {
+  private:
+    keymaster_purpose_t purpose() const override { return KM_PURPOSE_SIGN; }
+    Operation* InstantiateOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                    const Ed25519Key& key) const override {
+        return new (std::nothrow)
+            Ed25519SignOperation(move(hw_enforced), move(sw_enforced), key);
+    }
+};
+
+class Ed25519VerifyOperationFactory : public Ed25519OperationFactory {
+  private:
+    keymaster_purpose_t purpose() const override { return KM_PURPOSE_VERIFY; }
+    Operation* InstantiateOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                    const Ed25519Key& key) const override {
+        return new (std::nothrow)
+            Ed25519VerifyOperation(move(hw_enforced), move(sw_enforced), key);
+    }
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_ED25519_OPERATION_H_
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_HMAC_CONTEXT_CACHE_H_
+#define SYSTEM_KEYMASTER_HMAC_CONTEXT_CACHE_H_
+
+#include <openssl/hmac.h>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/keymaster_enforcement.h>
+
+namespace keymaster {
+
+/**
+ * Bounded cache of keyed HMAC_CTX templates, so that HMAC operations on a frequently-used key can
+ * copy a context whose inner and outer digests have already absorbed the padded key, instead of
+ * running HMAC_Init_ex from the raw key on every Begin.  For short messages that saves about half
+ * the work of the MAC.
+ *
+ * As with CipherContextCache, entries are keyed by key ID and digest and also hold a copy of the
+ * key material, which is compared on lookup.  When full, the least recently used entry is evicted.
+ * Evicted entries have their key material and digest states wiped.
+ *
+ * Not thread-safe; like AndroidKeymaster, it must be used from one thread at a time.
+ */
+class HmacContextCache {
+  public:
+    explicit HmacContextCache(size_t capacity);
+    ~HmacContextCache();
+
+    HmacContextCache(const HmacContextCache&) = delete;
+    void operator=(const HmacContextCache&) = delete;
+
+    /**
+     * If a template matching the arguments is cached, copies it into \p ctx and returns true.  \p
+     * ctx must have been initialized with HMAC_CTX_init.
+     */
+    bool Lookup(km_id_t key_id, const KeymasterKeyBlob& key, keymaster_digest_t digest,
+                HMAC_CTX* ctx);
+
+    /**
+     * Caches a copy of \p ctx, which must be freshly initialized with \p key and \p digest, with
+     * no data processed.  Failures (e.g. allocation) are silently ignored; the cache is
+     * best-effort.
+     */
+    void Insert(km_id_t key_id, const KeymasterKeyBlob& key, keymaster_digest_t digest,
+                const HMAC_CTX& ctx);
+
+    /**
+     * Evicts and wipes all entries.
+     */
+    void Clear();
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const;
+
+  private:
+    struct Entry {
+        bool in_use;
+        km_id_t key_id;
+        keymaster_digest_t digest;
+        uint64_t last_used;
+        KeymasterKeyBlob key;
+        HMAC_CTX ctx;
+    };
+
+    static void Evict(Entry* entry);
+
+    UniquePtr<Entry[]> entries_;
+    size_t capacity_;
+    uint64_t clock_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_HMAC_CONTEXT_CACHE_H_
@@ -21,6 +21,8 @@
 
 namespace keymaster {
 
+class HmacContextCache;
+
 const size_t kMinHmacLengthBits = 64;
 const size_t kMinHmacKeyLengthBits = 64;
 const size_t kMaxHmacKeyLengthBits = 2048;  // Some RFC test cases require >1024-bit keys
@@ -39,6 +41,14 @@ class HmacKeyFactory : public SymmetricKeyFactory {
 
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
+    /**
+     * Enables reuse of keyed HMAC contexts by HMAC operations, or disables it if \p cache is
+     * nullptr (the default).  As for AesKeyFactory::set_cipher_context_cache(), the cache is
+     * shared by all HmacKeyFactory instances, is not owned, and must outlive all operations begun
+     * while it is set.
+     */
+    static void set_context_cache(HmacContextCache* cache);
+
   private:
     bool key_size_supported(size_t key_size_bits) const override {
         return key_size_bits > 0 && key_size_bits % 8 == 00 &&
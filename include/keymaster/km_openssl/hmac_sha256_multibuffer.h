@@ -0,0 +1,56 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_HMAC_SHA256_MULTIBUFFER_H_
+#define SYSTEM_KEYMASTER_HMAC_SHA256_MULTIBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+static const size_t kHmacSha256Size = 32;
+
+/**
+ * One independent HMAC-SHA256 computation: a MAC of \p message under \p key, written to \p mac.
+ * Keys longer than the SHA-256 block size are hashed first, as RFC 2104 requires.
+ */
+struct HmacSha256Job {
+    const uint8_t* key;
+    size_t key_length;
+    const uint8_t* message;
+    size_t message_length;
+    uint8_t mac[kHmacSha256Size];
+};
+
+/**
+ * Returns the number of HMAC-SHA256 computations ComputeHmacSha256s() runs side by side: eight
+ * when built for AVX2, four otherwise (SSE2, NEON, or the compiler's scalar lowering).
+ */
+size_t HmacSha256Lanes();
+
+/**
+ * Computes the MAC of every job in \p jobs.  Each SIMD lane holds one job's SHA-256 state and
+ * compresses its next block, so up to HmacSha256Lanes() jobs progress per pass.  A lane moves on to
+ * the next waiting job as soon as its current one is done, so messages of mixed lengths keep the
+ * lanes busy.  Messages over 512 bytes, where hardware SHA-256 keeps up with a lane, and a lone
+ * shorter message are computed with plain HMAC instead.
+ */
+void ComputeHmacSha256s(HmacSha256Job* jobs, size_t job_count);
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_HMAC_SHA256_MULTIBUFFER_H_
@@ -21,6 +21,7 @@
 #include <openssl/ec.h>
 #include <openssl/engine.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
 
@@ -61,6 +62,7 @@ DEFINE_OPENSSL_OBJECT_POINTER(EC_KEY)
 DEFINE_OPENSSL_OBJECT_POINTER(EC_POINT)
 DEFINE_OPENSSL_OBJECT_POINTER(ENGINE)
 DEFINE_OPENSSL_OBJECT_POINTER(EVP_PKEY)
+DEFINE_OPENSSL_OBJECT_POINTER(HMAC_CTX)
 DEFINE_OPENSSL_OBJECT_POINTER(PKCS8_PRIV_KEY_INFO)
 DEFINE_OPENSSL_OBJECT_POINTER(RSA)
 DEFINE_OPENSSL_OBJECT_POINTER(X509)
@@ -71,7 +73,13 @@ typedef OpenSslObjectDeleter<BIGNUM, BN_free> BIGNUM_Delete;
 typedef UniquePtr<BIGNUM, BIGNUM_Delete> BIGNUM_Ptr;
 
 keymaster_error_t ec_get_group_size(const EC_GROUP* group, size_t* key_size_bits);
-EC_GROUP* ec_get_group(keymaster_ec_curve_t curve);
+
+/**
+ * Returns the group for \p curve, or nullptr if it isn't supported.  Groups are created once per
+ * process, with any precomputation the library supports, and shared by every caller; they must not
+ * be modified or freed.
+ */
+const EC_GROUP* ec_get_group(keymaster_ec_curve_t curve);
 
 /**
  * Many OpenSSL APIs take ownership of an argument on success but don't free the argument on
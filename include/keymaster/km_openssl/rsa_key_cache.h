@@ -0,0 +1,85 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_RSA_KEY_CACHE_H_
+#define SYSTEM_KEYMASTER_RSA_KEY_CACHE_H_
+
+#include <openssl/rsa.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+/**
+ * Bounded cache of decoded RSA private keys, so that loading a frequently-used key reuses one RSA
+ * object instead of parsing the key material again.  Besides the parse, this saves the
+ * per-object setup BoringSSL does on the first private key operation (the Montgomery contexts for
+ * n, p and q, and the blinding state), which it keeps in the RSA object for later operations.
+ *
+ * Entries are keyed by the key material itself, which is compared on lookup, so a cached object
+ * is only ever returned for identical key material.  RSA objects are reference counted: lookups
+ * return a new reference, and operations still holding one are unaffected when its entry is
+ * evicted.  When full, the least recently used entry is evicted, and its copy of the key material
+ * wiped.
+ *
+ * The cache itself is not thread-safe; like AndroidKeymaster, it must be used from one thread at a
+ * time.  The RSA objects it hands out may be used concurrently.
+ */
+class RsaKeyCache {
+  public:
+    explicit RsaKeyCache(size_t capacity);
+    ~RsaKeyCache();
+
+    RsaKeyCache(const RsaKeyCache&) = delete;
+    void operator=(const RsaKeyCache&) = delete;
+
+    /**
+     * Returns a new reference to the RSA object cached for \p key_material, which the caller must
+     * release with RSA_free, or nullptr if there is none.
+     */
+    RSA* Lookup(const KeymasterKeyBlob& key_material);
+
+    /**
+     * Caches \p rsa, which must be the key decoded from \p key_material, taking a new reference to
+     * it.  Failures (e.g. allocation) are silently ignored; the cache is best-effort.
+     */
+    void Insert(const KeymasterKeyBlob& key_material, RSA* rsa);
+
+    /**
+     * Evicts all entries.
+     */
+    void Clear();
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const;
+
+  private:
+    struct Entry {
+        RSA* rsa;
+        uint64_t last_used;
+        KeymasterKeyBlob key_material;
+    };
+
+    static void Evict(Entry* entry);
+
+    UniquePtr<Entry[]> entries_;
+    size_t capacity_;
+    uint64_t clock_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_RSA_KEY_CACHE_H_
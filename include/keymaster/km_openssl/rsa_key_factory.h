@@ -26,6 +26,9 @@
 
 namespace keymaster {
 
+class RsaKeyCache;
+class RsaKeyPool;
+
 class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
   public:
     explicit RsaKeyFactory(const SoftwareKeyBlobMaker* blob_maker) :
@@ -40,6 +43,11 @@ class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
                                 KeymasterKeyBlob* output_key_blob, AuthorizationSet* hw_enforced,
                                 AuthorizationSet* sw_enforced) const override;
 
+    keymaster_error_t LoadKey(KeymasterKeyBlob&& key_material,
+                              const AuthorizationSet& additional_params,
+                              AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                              UniquePtr<Key>* key) const override;
+
     keymaster_error_t CreateEmptyKey(AuthorizationSet&& hw_enforced,
                                      AuthorizationSet&& sw_enforced,
                                      UniquePtr<AsymmetricKey>* key) const override;
@@ -49,6 +57,27 @@ class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
     keymaster_algorithm_t keymaster_key_type() const override { return KM_ALGORITHM_RSA; }
     int evp_key_type() const override { return EVP_PKEY_RSA; }
 
+    /**
+     * Enables reuse of decoded RSA keys by LoadKey(), or disables it if \p cache is nullptr (the
+     * default).  Like the AES cipher context cache, this is shared by all RsaKeyFactory instances.
+     * The cache is not owned, and must outlive any LoadKey() calls made while it is set.
+     */
+    static void set_key_cache(RsaKeyCache* cache);
+
+    /**
+     * Makes GenerateKey() take pre-generated keys from \p pool when it has a suitable one, falling
+     * back to generating them synchronously.  nullptr (the default) disables the pool.  Shared by
+     * all RsaKeyFactory instances; the pool is not owned.
+     */
+    static void set_key_pool(RsaKeyPool* pool);
+
+    /**
+     * Generates a \p key_size-bit RSA key with public exponent \p public_exponent, and encodes it
+     * as key material.  Safe to call from any thread.
+     */
+    static keymaster_error_t GenerateKeyMaterial(uint32_t key_size, uint64_t public_exponent,
+                                                 KeymasterKeyBlob* key_material);
+
   protected:
     keymaster_error_t UpdateImportKeyDescription(const AuthorizationSet& key_description,
                                                  keymaster_key_format_t import_key_format,
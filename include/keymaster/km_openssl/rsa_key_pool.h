@@ -0,0 +1,47 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SYSTEM_KEYMASTER_RSA_KEY_POOL_H_
+#define SYSTEM_KEYMASTER_RSA_KEY_POOL_H_
+
+#include <stdint.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+/**
+ * Source of RSA keys generated ahead of time.
+ *
+ * RSA key generation can take seconds for large keys.  Environments with spare threads can supply
+ * an implementation of this interface to RsaKeyFactory, which takes keys from it when it can and
+ * otherwise generates them itself.  See PthreadRsaKeyPool.
+ */
+class RsaKeyPool {
+  public:
+    virtual ~RsaKeyPool() {}
+
+    /**
+     * If a key of \p key_size bits with public exponent \p public_exponent is ready, moves its key
+     * material, as produced by RsaKeyFactory::GenerateKeyMaterial(), into \p key_material and
+     * returns true.  Otherwise returns false immediately.  A key is never returned twice.
+     */
+    virtual bool Take(uint32_t key_size, uint64_t public_exponent,
+                      KeymasterKeyBlob* key_material) = 0;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_RSA_KEY_POOL_H_
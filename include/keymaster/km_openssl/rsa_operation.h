@@ -53,6 +53,8 @@ class RsaOperation : public Operation {
   protected:
     virtual int GetOpensslPadding(keymaster_error_t* error) = 0;
     virtual bool require_digest() const = 0;
+    // Whether the operation accumulates its input in data_, rather than digesting it.
+    virtual bool buffers_input() const { return true; }
 
     keymaster_error_t StoreData(const Buffer& input, size_t* input_consumed);
     keymaster_error_t SetRsaPaddingInEvpContext(EVP_PKEY_CTX* pkey_ctx, bool signing);
@@ -78,10 +80,20 @@ class RsaDigestingOperation : public RsaOperation {
                           keymaster_padding_t padding, EVP_PKEY* key);
     ~RsaDigestingOperation();
 
+    /**
+     * Makes the operation treat its input as the digest of the message, computed by the caller,
+     * rather than as the message itself (see KM_TAG_PREHASHED).
+     */
+    void set_prehashed() { prehashed_ = true; }
+
   protected:
     int GetOpensslPadding(keymaster_error_t* error) override;
     bool require_digest() const override { return padding_ == KM_PAD_RSA_PSS; }
+    bool buffers_input() const override { return digest_ == KM_DIGEST_NONE || prehashed_; }
+    keymaster_error_t InitPrehashedContext(EVP_PKEY_CTX* pkey_ctx, bool signing);
+
     EVP_MD_CTX digest_ctx_;
+    bool prehashed_ = false;
 };
 
 /**
@@ -106,6 +118,7 @@ class RsaSignOperation : public RsaDigestingOperation {
   private:
     keymaster_error_t SignUndigested(Buffer* output);
     keymaster_error_t SignDigested(Buffer* output);
+    keymaster_error_t SignPrehashed(Buffer* output);
 };
 
 /**
@@ -116,10 +129,15 @@ class RsaVerifyOperation : public RsaDigestingOperation {
     RsaVerifyOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
                        keymaster_digest_t digest, keymaster_padding_t padding, EVP_PKEY* key)
         : RsaDigestingOperation(move(hw_enforced), move(sw_enforced), KM_PURPOSE_VERIFY, digest,
-                                padding, key) {}
+                                padding, key) {
+        EVP_MD_CTX_init(&template_ctx_);
+    }
+    ~RsaVerifyOperation();
 
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
+    keymaster_error_t Restart(const AuthorizationSet& input_params,
+                              AuthorizationSet* output_params) override;
     keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
                              AuthorizationSet* output_params, Buffer* output,
                              size_t* input_consumed) override;
@@ -130,6 +148,11 @@ class RsaVerifyOperation : public RsaDigestingOperation {
   private:
     keymaster_error_t VerifyUndigested(const Buffer& signature);
     keymaster_error_t VerifyDigested(const Buffer& signature);
+    keymaster_error_t VerifyPrehashed(const Buffer& signature);
+
+    // The digest context as initialized by Begin(), with padding configured, which Restart()
+    // copies rather than setting up the key context again.
+    EVP_MD_CTX template_ctx_;
 };
 
 /**
@@ -211,6 +234,8 @@ class RsaOperationFactory : public OperationFactory {
  */
 class RsaDigestingOperationFactory : public RsaOperationFactory {
   public:
+    RsaOperation* CreateRsaOperation(Key&& key, const AuthorizationSet& begin_params,
+                                     keymaster_error_t* error) const override;
     const keymaster_padding_t* SupportedPaddingModes(size_t* padding_mode_count) const override;
 };
 
@@ -20,21 +20,55 @@
 
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/keymaster_enforcement.h>
+#include <keymaster/km_openssl/openssl_utils.h>
 
 namespace keymaster {
 
+/**
+ * Reads CLOCK_BOOTTIME with clock_gettime.  Exact, and includes time spent in suspend.
+ */
+class BoottimeClock : public EnforcementClock {
+  public:
+    uint64_t now_ms() const override;
+    uint64_t tolerance_ms() const override { return 0; }
+};
+
+/**
+ * Reads CLOCK_MONOTONIC_COARSE, which Linux serves from the vDSO without a syscall.  Linux has no
+ * coarse variant of CLOCK_BOOTTIME, so this clock does not advance while the device is suspended;
+ * use it only where enforcement timeouts need not include suspended time (e.g. hosts that don't
+ * suspend).  Readings lag real time by up to one scheduler tick, as reported by tolerance_ms().
+ */
+class CoarseMonotonicClock : public EnforcementClock {
+  public:
+    CoarseMonotonicClock();
+    uint64_t now_ms() const override;
+    uint64_t tolerance_ms() const override { return tolerance_ms_; }
+
+  private:
+    uint64_t tolerance_ms_;
+};
+
 class SoftKeymasterEnforcement : public KeymasterEnforcement {
   public:
     SoftKeymasterEnforcement(uint32_t max_access_time_map_size, uint32_t max_access_count_map_size)
-        : KeymasterEnforcement(max_access_time_map_size, max_access_count_map_size) {}
+        : KeymasterEnforcement(max_access_time_map_size, max_access_count_map_size),
+          clock_(&default_clock_) {}
     virtual ~SoftKeymasterEnforcement() {}
-    bool activation_date_valid(uint64_t /*activation_date*/) const override { return true; }
-    bool expiration_date_passed(uint64_t /*expiration_date*/) const override { return false; }
-    bool auth_token_timed_out(const hw_auth_token_t& /*token*/,
-                              uint32_t /*timeout*/) const override {
+    bool activation_date_valid(uint64_t /*activation_date*/,
+                               uint64_t /*current_time_ms*/) const override {
+        return true;
+    }
+    bool expiration_date_passed(uint64_t /*expiration_date*/,
+                                uint64_t /*current_time_ms*/) const override {
+        return false;
+    }
+    bool auth_token_timed_out(const hw_auth_token_t& /*token*/, uint32_t /*timeout*/,
+                              uint64_t /*current_time_ms*/) const override {
         return false;
     }
-    uint64_t get_current_time_ms() const override;
+    uint64_t get_current_time_ms() const override { return clock_->now_ms(); }
+    uint64_t get_current_time_tolerance_ms() const override { return clock_->tolerance_ms(); }
     keymaster_security_level_t SecurityLevel() const override { return KM_SECURITY_LEVEL_SOFTWARE; }
     bool ValidateTokenSignature(const hw_auth_token_t& /*token*/) const override { return true; }
     bool CreateKeyId(const keymaster_key_blob_t& key_blob, km_id_t* keyid) const override;
@@ -44,11 +78,28 @@ class SoftKeymasterEnforcement : public KeymasterEnforcement {
                                         KeymasterBlob* sharingCheck) override;
     VerifyAuthorizationResponse
     VerifyAuthorization(const VerifyAuthorizationRequest& request) override;
+    BatchVerifyAuthorizationResponse
+    BatchVerifyAuthorization(const BatchVerifyAuthorizationRequest& request) override;
+
+    /**
+     * Replaces the default BoottimeClock for rate limiting.  Verification token timestamps are
+     * always read from CLOCK_BOOTTIME, since other components compare them against auth token
+     * timestamps.  The clock is not owned and must outlive this object.
+     */
+    void set_clock(const EnforcementClock* clock) { clock_ = clock ? clock : &default_clock_; }
+    const EnforcementClock& clock() const { return *clock_; }
 
   private:
+    // Returns an HMAC-SHA256 context keyed with hmac_key_, to be copied rather than used directly.
+    // Keying once saves recomputing the inner and outer pad hashes on every token MAC.
+    const HMAC_CTX* hmac_key_ctx();
+
+    BoottimeClock default_clock_;  // Also the source of verification token timestamps.
+    const EnforcementClock* clock_;
     bool have_saved_params_ = false;
     HmacSharingParameters saved_params_;
     KeymasterKeyBlob hmac_key_;
+    HMAC_CTX_Ptr hmac_key_ctx_;
 };
 
 }  // namespace keymaster
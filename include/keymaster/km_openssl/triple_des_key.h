@@ -23,6 +23,9 @@
 
 namespace keymaster {
 
+class CipherContextCache;
+class WorkerPool;
+
 class TripleDesKeyFactory : public SymmetricKeyFactory {
   public:
     explicit TripleDesKeyFactory(const SoftwareKeyBlobMaker* blob_maker,
@@ -38,6 +41,22 @@ class TripleDesKeyFactory : public SymmetricKeyFactory {
 
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
+    /**
+     * Enables reuse of initialized cipher contexts by 3DES operations, or disables it if \p cache
+     * is nullptr (the default).  The operation factories, and therefore the cache, are shared by
+     * all TripleDesKeyFactory instances.  The cache is not owned and must outlive all operations
+     * begun while it is set.
+     */
+    static void set_cipher_context_cache(CipherContextCache* cache);
+
+    /**
+     * Enables parallel processing of 3DES ECB updates of at least \p min_parallel_bytes on
+     * \p pool, or disables it if \p pool is nullptr (the default).  Like the context cache, this
+     * is shared by all TripleDesKeyFactory instances, and the pool must outlive all operations
+     * begun while it is set.
+     */
+    static void set_worker_pool(WorkerPool* pool, size_t min_parallel_bytes);
+
   private:
     bool key_size_supported(size_t key_size_bits) const override {
         return key_size_bits == 112 || key_size_bits == 168;
@@ -114,6 +114,91 @@ class Operation {
                                      Buffer* output) = 0;
     virtual keymaster_error_t Abort() = 0;
 
+    /**
+     * Zero-copy variants of Update() and Finish(), which write output directly into the
+     * caller-supplied region \p output of \p output_size bytes rather than into a Buffer, and set
+     * \p output_written to the number of bytes produced.  \p output_size must be at least the value
+     * returned by GetMaxOutputSize() for the same input length, or
+     * KM_ERROR_INSUFFICIENT_BUFFER_SPACE is returned and no input is consumed.  Operations that
+     * don't support them return KM_ERROR_UNIMPLEMENTED.
+     */
+    virtual keymaster_error_t UpdateInto(const AuthorizationSet& /* input_params */,
+                                         const Buffer& /* input */,
+                                         AuthorizationSet* /* output_params */,
+                                         uint8_t* /* output */, size_t /* output_size */,
+                                         size_t* /* output_written */,
+                                         size_t* /* input_consumed */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+    virtual keymaster_error_t FinishInto(const AuthorizationSet& /* input_params */,
+                                         const Buffer& /* input */, const Buffer& /* signature */,
+                                         AuthorizationSet* /* output_params */,
+                                         uint8_t* /* output */, size_t /* output_size */,
+                                         size_t* /* output_written */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    /**
+     * In-place variants of UpdateInto() and FinishInto(), for operations whose output is the same
+     * length as their input (block cipher modes without padding).  UpdateInPlace() replaces the
+     * \p data_length bytes at \p data with their output.  FinishInPlace() does the same, except
+     * that when encrypting it appends the tag, if any, for which \p data_capacity must leave room.
+     * When decrypting, the tag must be the last bytes of the data passed to FinishInPlace(), and
+     * isn't part of the output.  \p output_length is set to the number of bytes of output at
+     * \p data.  Operations and modes that don't support in-place processing return
+     * KM_ERROR_UNIMPLEMENTED.
+     */
+    virtual keymaster_error_t UpdateInPlace(const AuthorizationSet& /* input_params */,
+                                            uint8_t* /* data */, size_t /* data_length */,
+                                            AuthorizationSet* /* output_params */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+    virtual keymaster_error_t FinishInPlace(const AuthorizationSet& /* input_params */,
+                                            uint8_t* /* data */, size_t /* data_length */,
+                                            size_t /* data_capacity */,
+                                            AuthorizationSet* /* output_params */,
+                                            size_t* /* output_length */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    /**
+     * Scatter-gather variants of Update() and Finish(), which process the \p segment_count buffers
+     * at \p segments in order, as if they had been concatenated.  \p input_params applies to the
+     * input as a whole, as it would for a single call.  UpdateSegments() sets \p input_consumed to
+     * the total consumed from all segments, stopping at the first segment not fully consumed.  The
+     * default implementations feed the segments to Update() one at a time, so operations that
+     * carry partial blocks or digest incrementally handle them without copying.
+     */
+    virtual keymaster_error_t UpdateSegments(const AuthorizationSet& input_params,
+                                             const Buffer* segments, size_t segment_count,
+                                             AuthorizationSet* output_params, Buffer* output,
+                                             size_t* input_consumed);
+    virtual keymaster_error_t FinishSegments(const AuthorizationSet& input_params,
+                                             const Buffer* segments, size_t segment_count,
+                                             const Buffer& signature,
+                                             AuthorizationSet* output_params, Buffer* output);
+
+    /**
+     * Returns in \p max_output the largest amount of output that an UpdateInto() (or, if \p finish
+     * is true, a FinishInto()) call with \p input_length bytes of input can produce, taking into
+     * account any data buffered by earlier calls.
+     */
+    virtual keymaster_error_t GetMaxOutputSize(size_t /* input_length */, bool /* finish */,
+                                               size_t* /* max_output */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    /**
+     * Discards any message in progress and prepares to process a new one, as if the operation had
+     * been created again from the same key and begun with \p input_params, but without repeating
+     * the key setup done by Begin().  Only valid after a successful Begin().  Operations that don't
+     * support restarting return KM_ERROR_UNIMPLEMENTED.
+     */
+    virtual keymaster_error_t Restart(const AuthorizationSet& /* input_params */,
+                                      AuthorizationSet* /* output_params */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
   protected:
     // Helper function for implementing Finish() methods that need to call Update() to process
     // input, but don't expect any output.
@@ -124,7 +209,7 @@ class Operation {
     const keymaster_purpose_t purpose_;
     AuthorizationSet hw_enforced_;
     AuthorizationSet sw_enforced_;
-    uint64_t key_id_;
+    uint64_t key_id_ = 0;
 };
 
 }  // namespace keymaster
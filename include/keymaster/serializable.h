@@ -224,6 +224,10 @@ class Buffer : public Serializable {
 
     void Clear();
 
+    // Wipe and discard the contents, but keep the allocation, so the buffer can be refilled up
+    // to buffer_size() bytes without reallocating.
+    void Reset();
+
     size_t available_write() const;
     size_t available_read() const;
     size_t buffer_size() const { return buffer_size_; }
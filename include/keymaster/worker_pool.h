@@ -0,0 +1,51 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_WORKER_POOL_H_
+#define SYSTEM_KEYMASTER_WORKER_POOL_H_
+
+#include <stddef.h>
+
+namespace keymaster {
+
+/**
+ * Runs independent tasks concurrently.
+ *
+ * libkeymaster_portable never creates threads itself, because it must run in environments that
+ * don't have them.  Environments that do can supply an implementation of this interface to let
+ * operations spread large inputs across several cores.
+ */
+class WorkerPool {
+  public:
+    typedef void (*Task)(void* context, size_t index);
+
+    virtual ~WorkerPool() {}
+
+    /**
+     * The number of tasks that can usefully run at once, including on the calling thread.
+     */
+    virtual size_t concurrency() const = 0;
+
+    /**
+     * Calls \p task(\p context, i) for each i in [0, \p task_count), possibly concurrently, and
+     * returns once all calls have completed.  Must not be called concurrently with itself.
+     */
+    virtual void Run(Task task, void* context, size_t task_count) = 0;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_WORKER_POOL_H_
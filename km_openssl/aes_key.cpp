@@ -24,6 +24,7 @@
 #include <openssl/rand.h>
 
 #include "aes_operation.h"
+#include "chacha20_poly1305.h"
 
 namespace keymaster {
 
@@ -41,6 +42,16 @@ OperationFactory* AesKeyFactory::GetOperationFactory(keymaster_purpose_t purpose
     }
 }
 
+void AesKeyFactory::set_cipher_context_cache(CipherContextCache* cache) {
+    encrypt_factory.set_context_cache(cache);
+    decrypt_factory.set_context_cache(cache);
+}
+
+void AesKeyFactory::set_worker_pool(WorkerPool* pool, size_t min_parallel_bytes) {
+    encrypt_factory.set_worker_pool(pool, min_parallel_bytes);
+    decrypt_factory.set_worker_pool(pool, min_parallel_bytes);
+}
+
 keymaster_error_t AesKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
                                          const AuthorizationSet& /* additional_params */,
                                          AuthorizationSet&& hw_enforced,
@@ -51,12 +62,14 @@ keymaster_error_t AesKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
 
     uint32_t min_mac_length = 0;
     if (hw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM) ||
-        sw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM)) {
+        sw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM) ||
+        hw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305) ||
+        sw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)) {
 
         if (!hw_enforced.GetTagValue(TAG_MIN_MAC_LENGTH, &min_mac_length) &&
             !sw_enforced.GetTagValue(TAG_MIN_MAC_LENGTH, &min_mac_length)) {
 
-            LOG_E("AES-GCM key must have KM_TAG_MIN_MAC_LENGTH", 0);
+            LOG_E("AES AEAD key must have KM_TAG_MIN_MAC_LENGTH", 0);
             return KM_ERROR_INVALID_KEY_BLOB;
         }
     }
@@ -71,7 +84,24 @@ keymaster_error_t AesKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
 
 keymaster_error_t AesKeyFactory::validate_algorithm_specific_new_key_params(
     const AuthorizationSet& key_description) const {
-    if (key_description.Contains(TAG_BLOCK_MODE, KM_MODE_GCM)) {
+    if (key_description.Contains(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)) {
+        // The key material is used directly as the ChaCha20 key, so it can't be shared with AES
+        // modes.
+        if (key_description.GetTagCount(TAG_BLOCK_MODE) != 1)
+            return KM_ERROR_INCOMPATIBLE_BLOCK_MODE;
+
+        uint32_t key_size;
+        if (key_description.GetTagValue(TAG_KEY_SIZE, &key_size) &&
+            key_size != ChaCha20Poly1305::kKeySize * 8)
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+
+        uint32_t min_tag_length;
+        if (!key_description.GetTagValue(TAG_MIN_MAC_LENGTH, &min_tag_length))
+            return KM_ERROR_MISSING_MIN_MAC_LENGTH;
+
+        if (min_tag_length != ChaCha20Poly1305::kTagSize * 8)
+            return KM_ERROR_UNSUPPORTED_MIN_MAC_LENGTH;
+    } else if (key_description.Contains(TAG_BLOCK_MODE, KM_MODE_GCM)) {
         uint32_t min_tag_length;
         if (!key_description.GetTagValue(TAG_MIN_MAC_LENGTH, &min_tag_length))
             return KM_ERROR_MISSING_MIN_MAC_LENGTH;
@@ -82,9 +112,9 @@ keymaster_error_t AesKeyFactory::validate_algorithm_specific_new_key_params(
         if (min_tag_length < kMinGcmTagLength || min_tag_length > kMaxGcmTagLength)
             return KM_ERROR_UNSUPPORTED_MIN_MAC_LENGTH;
     } else {
-        // Not GCM
+        // Not AEAD
         if (key_description.find(TAG_MIN_MAC_LENGTH) != -1) {
-            LOG_W("KM_TAG_MIN_MAC_LENGTH found for non AES-GCM key", 0);
+            LOG_W("KM_TAG_MIN_MAC_LENGTH found for non AEAD AES key", 0);
             return KM_ERROR_INVALID_TAG;
         }
     }
@@ -18,8 +18,11 @@
 
 namespace keymaster {
 
-static const keymaster_block_mode_t supported_block_modes[] = {KM_MODE_ECB, KM_MODE_CBC,
-                                                               KM_MODE_CTR, KM_MODE_GCM};
+// ChaCha20-Poly1305 isn't an AES mode, but is offered on (256-bit) AES keys so that software-only
+// implementations have an AEAD that's fast without AES hardware.  GetCipherInstance() doesn't
+// handle it; BlockCipherEvpOperation implements it directly.
+static const keymaster_block_mode_t supported_block_modes[] = {
+    KM_MODE_ECB, KM_MODE_CBC, KM_MODE_CTR, KM_MODE_GCM, KM_MODE_CHACHA20_POLY1305};
 
 const keymaster_block_mode_t*
 AesEvpCipherDescription::SupportedBlockModes(size_t* block_mode_count) const {
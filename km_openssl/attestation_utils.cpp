@@ -22,6 +22,7 @@
 #include <keymaster/authorization_set.h>
 #include <keymaster/attestation_record.h>
 #include <keymaster/km_openssl/asymmetric_key.h>
+#include <keymaster/km_openssl/ed25519_key.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/km_openssl/openssl_err.h>
 
@@ -274,6 +275,25 @@ bool add_public_key(EVP_PKEY* key, X509* certificate, keymaster_error_t* error)
     return true;
 }
 
+bool add_public_key(const Ed25519Key& key, X509* certificate, keymaster_error_t* error) {
+    // EVP_PKEY can't hold Ed25519 keys in the BoringSSL we build against, so fill in the
+    // certificate's SubjectPublicKeyInfo directly.  RFC 8410 requires the parameters be absent.
+    uint8_t* public_key = reinterpret_cast<uint8_t*>(OPENSSL_malloc(Ed25519Key::kPublicKeySize));
+    if (!public_key) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return false;
+    }
+    memcpy(public_key, key.public_key(), Ed25519Key::kPublicKeySize);
+    if (!X509_PUBKEY_set0_param(X509_get_X509_PUBKEY(certificate), OBJ_nid2obj(NID_ED25519),
+                                V_ASN1_UNDEF, nullptr /* pval */, public_key /* Takes ownership */,
+                                Ed25519Key::kPublicKeySize)) {
+        OPENSSL_free(public_key);
+        *error = TranslateLastOpenSslError();
+        return false;
+    }
+    return true;
+}
+
 bool add_attestation_extension(const AuthorizationSet& attest_params,
                                       const AuthorizationSet& tee_enforced,
                                       const AuthorizationSet& sw_enforced,
@@ -310,10 +330,6 @@ keymaster_error_t generate_attestation(const AsymmetricKey& key,
          !key.hw_enforced().GetTagValue(TAG_ALGORITHM, &sign_algorithm)))
         return KM_ERROR_UNKNOWN_ERROR;
 
-    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
-    if (!key.InternalToEvp(pkey.get()))
-        return TranslateLastOpenSslError();
-
     X509_Ptr certificate(X509_new());
     if (!certificate.get())
         return TranslateLastOpenSslError();
@@ -357,7 +373,8 @@ keymaster_error_t generate_attestation(const AsymmetricKey& key,
         return error;
     }
 
-    // We have established above that it is one of the two. So if it is not RSA its EC.
+    // We have established above that it is one of the three. RSA keys are signed by the RSA
+    // attestation key, and both EC and Ed25519 keys by the EC one.
     int evp_key_type = (sign_algorithm == KM_ALGORITHM_RSA) ? EVP_PKEY_RSA : EVP_PKEY_EC;
 
     const uint8_t* key_material = attestation_signing_key.key_material;
@@ -367,8 +384,18 @@ keymaster_error_t generate_attestation(const AsymmetricKey& key,
                     attestation_signing_key.key_material_size));
     if (!sign_key.get()) return TranslateLastOpenSslError();
 
-    if (!add_public_key(pkey.get(), certificate.get(), &error) ||
-        !add_attestation_extension(attest_params, key.hw_enforced(), key.sw_enforced(),
+    if (sign_algorithm == KM_ALGORITHM_ED25519) {
+        if (!add_public_key(static_cast<const Ed25519Key&>(key), certificate.get(), &error))
+            return error;
+    } else {
+        EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+        if (!pkey.get() || !key.InternalToEvp(pkey.get()))
+            return TranslateLastOpenSslError();
+        if (!add_public_key(pkey.get(), certificate.get(), &error))
+            return error;
+    }
+
+    if (!add_attestation_extension(attest_params, key.hw_enforced(), key.sw_enforced(),
                                    context, certificate.get(), &error))
         return error;
 
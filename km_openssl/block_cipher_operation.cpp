@@ -16,6 +16,7 @@
 
 #include "block_cipher_operation.h"
 
+#include <limits.h>
 #include <stdio.h>
 
 #include <keymaster/new>
@@ -24,6 +25,7 @@
 
 #include <openssl/aes.h>
 #include <openssl/err.h>
+#include <openssl/mem.h>
 #include <openssl/rand.h>
 
 #include <keymaster/logger.h>
@@ -37,6 +39,8 @@ namespace keymaster {
 static const size_t GCM_NONCE_SIZE = 12;
 
 inline bool allows_padding(keymaster_block_mode_t block_mode) {
+    // Not an enumerator of keymaster_block_mode_t, so it can't be a case label under -Wswitch.
+    if (block_mode == KM_MODE_CHACHA20_POLY1305) return false;
     switch (block_mode) {
     case KM_MODE_CTR:
     case KM_MODE_GCM:
@@ -96,11 +100,15 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
     }
 
     size_t tag_length = 0;
-    if (block_mode == KM_MODE_GCM) {
+    if (block_mode == KM_MODE_GCM || block_mode == KM_MODE_CHACHA20_POLY1305) {
         *error = GetAndValidateGcmTagLength(begin_params, key.authorizations(), &tag_length);
         if (*error != KM_ERROR_OK) {
             return nullptr;
         }
+        if (block_mode == KM_MODE_CHACHA20_POLY1305 && tag_length != ChaCha20Poly1305::kTagSize) {
+            *error = KM_ERROR_UNSUPPORTED_MAC_LENGTH;
+            return nullptr;
+        }
     }
 
     keymaster_padding_t padding;
@@ -119,11 +127,12 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
     switch (purpose_) {
     case KM_PURPOSE_ENCRYPT:
         op.reset(new (std::nothrow) BlockCipherEvpEncryptOperation(  //
-            block_mode, padding, caller_nonce, tag_length, move(key), GetCipherDescription()));
+            block_mode, padding, caller_nonce, tag_length, move(key), GetCipherDescription(),
+            options_));
         break;
     case KM_PURPOSE_DECRYPT:
         op.reset(new (std::nothrow) BlockCipherEvpDecryptOperation(
-            block_mode, padding, tag_length, move(key), GetCipherDescription()));
+            block_mode, padding, tag_length, move(key), GetCipherDescription(), options_));
         break;
     default:
         *error = KM_ERROR_UNSUPPORTED_PURPOSE;
@@ -145,10 +154,12 @@ BlockCipherEvpOperation::BlockCipherEvpOperation(keymaster_purpose_t purpose,
                                                  keymaster_block_mode_t block_mode,
                                                  keymaster_padding_t padding, bool caller_iv,
                                                  size_t tag_length, Key&& key,
-                                                 const EvpCipherDescription& cipher_description)
+                                                 const EvpCipherDescription& cipher_description,
+                                                 const BlockCipherOperationOptions& options)
     : Operation(purpose, key.hw_enforced_move(), key.sw_enforced_move()), block_mode_(block_mode),
-      caller_iv_(caller_iv), tag_length_(tag_length), data_started_(false), padding_(padding),
-      key_(key.key_material_move()), cipher_description_(cipher_description) {
+      caller_iv_(caller_iv), tag_length_(tag_length), aad_block_buf_len_(0), data_started_(false),
+      padding_(padding), key_(key.key_material_move()), cipher_description_(cipher_description),
+      options_(options) {
     EVP_CIPHER_CTX_init(&ctx_);
 }
 
@@ -156,58 +167,292 @@ BlockCipherEvpOperation::~BlockCipherEvpOperation() {
     EVP_CIPHER_CTX_cleanup(&ctx_);
 }
 
-keymaster_error_t BlockCipherEvpOperation::Begin(const AuthorizationSet& /* input_params */,
-                                                 AuthorizationSet* /* output_params */) {
+keymaster_error_t BlockCipherEvpOperation::Begin(const AuthorizationSet& input_params,
+                                                 AuthorizationSet* output_params) {
     auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
                              (size_t)sizeof(operation_handle_));
     if (rc != KM_ERROR_OK) return rc;
 
+    rc = BeginMessage(input_params, output_params);
+    if (rc != KM_ERROR_OK) return rc;
+
     return InitializeCipher(move(key_));
 }
 
+keymaster_error_t BlockCipherEvpOperation::Restart(const AuthorizationSet& input_params,
+                                                   AuthorizationSet* output_params) {
+    // Begin() handed the key to ctx_ (or chacha_), so it must have been keyed for a restart to be
+    // possible.
+    if (is_chacha20_poly1305() ? !chacha_ : !EVP_CIPHER_CTX_cipher(&ctx_))
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    aad_block_buf_len_ = 0;
+    data_started_ = false;
+    keymaster_error_t error = BeginMessage(input_params, output_params);
+    if (error != KM_ERROR_OK) return error;
+
+    if (chacha_) {
+        chacha_->Start(iv_.data);
+        return KM_ERROR_OK;
+    }
+
+    // Re-initializing without a key resets the context's per-message state (and sets the new IV,
+    // if any) but keeps the key schedule.
+    if (!EVP_CipherInit_ex(&ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                           iv_.data, -1 /* keep direction */)) {
+        return TranslateLastOpenSslError();
+    }
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t BlockCipherEvpOperation::Update(const AuthorizationSet& additional_params,
                                                   const Buffer& input,
-                                                  AuthorizationSet* /* output_params */,
-                                                  Buffer* output, size_t* input_consumed) {
-    keymaster_error_t error;
-    if (block_mode_ == KM_MODE_GCM && !HandleAad(additional_params, input, &error)) return error;
-    if (!InternalUpdate(input.peek_read(), input.available_read(), output, &error)) return error;
+                                                  AuthorizationSet* output_params, Buffer* output,
+                                                  size_t* input_consumed) {
+    if (!output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    // Reserve the worst case once, then let the cipher write directly into the buffer.
+    size_t max_output;
+    keymaster_error_t error =
+        GetMaxOutputSize(input.available_read(), false /* finish */, &max_output);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->reserve(max_output)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    size_t output_written;
+    error = UpdateInto(additional_params, input, output_params, output->peek_write(),
+                       output->available_write(), &output_written, input_consumed);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->advance_write(output_written)) return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t BlockCipherEvpOperation::UpdateInto(const AuthorizationSet& additional_params,
+                                                      const Buffer& input,
+                                                      AuthorizationSet* /* output_params */,
+                                                      uint8_t* output, size_t output_size,
+                                                      size_t* output_written,
+                                                      size_t* input_consumed) {
+    if (!output || !output_written || !input_consumed) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error =
+        CheckOutputSize(input.available_read(), false /* finish */, output_size);
+    if (error != KM_ERROR_OK) return error;
+
+    OutputSpan span(output, output_size);
+    if (is_aead() && !HandleAad(additional_params, input.available_read(), &error)) return error;
+    if (!InternalUpdate(input.peek_read(), input.available_read(), &span, &error)) return error;
     *input_consumed = input.available_read();
+    *output_written = span.written;
 
     return KM_ERROR_OK;
 }
 
+keymaster_error_t BlockCipherEvpOperation::UpdateInPlace(const AuthorizationSet& additional_params,
+                                                         uint8_t* data, size_t data_length,
+                                                         AuthorizationSet* /* output_params */) {
+    if (!supports_in_place()) return KM_ERROR_UNIMPLEMENTED;
+    if (!data && data_length) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    keymaster_error_t error = KM_ERROR_OK;
+    if (is_aead() && !HandleAad(additional_params, data_length, &error)) return error;
+    if (!TransformInPlace(data, data_length, &error)) return error;
+    return KM_ERROR_OK;
+}
+
+bool BlockCipherEvpOperation::TransformInPlace(uint8_t* data, size_t data_length,
+                                               keymaster_error_t* error) {
+    // ECB and CBC only pass whole blocks straight through.  Anything else would leave EVP holding
+    // a partial block, to be released later at a different offset.
+    if ((block_mode_ == KM_MODE_ECB || block_mode_ == KM_MODE_CBC) &&
+        (data_length % block_size_bytes() != 0 || ctx_.buf_len != 0)) {
+        *error = KM_ERROR_INVALID_INPUT_LENGTH;
+        return false;
+    }
+
+    OutputSpan span(data, data_length);
+    if (!InternalUpdate(data, data_length, &span, error)) return false;
+    if (span.written != data_length) {
+        *error = KM_ERROR_UNKNOWN_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool BlockCipherEvpOperation::FinishCipherInPlace(keymaster_error_t* error) {
+    // Without padding, and with no partial block held, finishing produces no output, but EVP
+    // still needs somewhere to put it.
+    uint8_t final_block[EVP_MAX_BLOCK_LENGTH];
+    OutputSpan span(final_block, sizeof(final_block));
+    if (!FinishCipher(&span, error)) return false;
+    if (span.written != 0) {
+        *error = KM_ERROR_UNKNOWN_ERROR;
+        return false;
+    }
+    return true;
+}
+
 inline bool is_bad_decrypt(unsigned long error) {
     return (ERR_GET_LIB(error) == ERR_LIB_CIPHER &&  //
             ERR_GET_REASON(error) == CIPHER_R_BAD_DECRYPT);
 }
 
 keymaster_error_t BlockCipherEvpOperation::Finish(const AuthorizationSet& additional_params,
-                                                  const Buffer& input,
-                                                  const Buffer& /* signature */,
+                                                  const Buffer& input, const Buffer& signature,
                                                   AuthorizationSet* output_params, Buffer* output) {
-    keymaster_error_t error;
-    if (!UpdateForFinish(additional_params, input, output_params, output, &error)) return error;
-    if (!output->reserve(block_size_bytes())) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    if (block_mode_ == KM_MODE_GCM && aad_block_buf_len_ > 0 && !ProcessBufferedAadBlock(&error)) {
-        return error;
+    size_t max_output;
+    keymaster_error_t error =
+        GetMaxOutputSize(input.available_read(), true /* finish */, &max_output);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->reserve(max_output)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    size_t output_written;
+    error = FinishInto(additional_params, input, signature, output_params, output->peek_write(),
+                       output->available_write(), &output_written);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->advance_write(output_written)) return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+static size_t total_length(const Buffer* segments, size_t segment_count) {
+    size_t length = 0;
+    for (size_t i = 0; i < segment_count; ++i)
+        length += segments[i].available_read();
+    return length;
+}
+
+keymaster_error_t BlockCipherEvpOperation::UpdateSegments(const AuthorizationSet& additional_params,
+                                                          const Buffer* segments,
+                                                          size_t segment_count,
+                                                          AuthorizationSet* output_params,
+                                                          Buffer* output, size_t* input_consumed) {
+    if (!output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!segments && segment_count) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    // Reserve for all of the segments at once; EVP carries any partial block from one segment into
+    // the next, so each Update() just appends.
+    size_t max_output;
+    keymaster_error_t error = GetMaxOutputSize(total_length(segments, segment_count),
+                                               false /* finish */, &max_output);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->reserve(max_output)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    return Operation::UpdateSegments(additional_params, segments, segment_count, output_params,
+                                     output, input_consumed);
+}
+
+keymaster_error_t BlockCipherEvpOperation::FinishSegments(const AuthorizationSet& additional_params,
+                                                          const Buffer* segments,
+                                                          size_t segment_count,
+                                                          const Buffer& signature,
+                                                          AuthorizationSet* output_params,
+                                                          Buffer* output) {
+    if (!output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!segments && segment_count) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (segment_count == 0)
+        return Finish(additional_params, Buffer(), signature, output_params, output);
+
+    size_t max_output;
+    keymaster_error_t error = GetMaxOutputSize(total_length(segments, segment_count),
+                                               true /* finish */, &max_output);
+    if (error != KM_ERROR_OK) return error;
+    if (!output->reserve(max_output)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    // Finish() appends to output, so unlike the generic version there's no need to collect the
+    // final output separately.
+    size_t leading_count = segment_count - 1;
+    size_t input_consumed;
+    error = Operation::UpdateSegments(additional_params, segments, leading_count, output_params,
+                                      output, &input_consumed);
+    if (error != KM_ERROR_OK) return error;
+    if (input_consumed != total_length(segments, leading_count))
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+
+    AuthorizationSet no_params;
+    return Finish(leading_count ? no_params : additional_params, segments[leading_count],
+                  signature, output_params, output);
+}
+
+keymaster_error_t BlockCipherEvpOperation::FinishInto(const AuthorizationSet& additional_params,
+                                                      const Buffer& input,
+                                                      const Buffer& /* signature */,
+                                                      AuthorizationSet* output_params,
+                                                      uint8_t* output, size_t output_size,
+                                                      size_t* output_written) {
+    if (!output || !output_written) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error =
+        CheckOutputSize(input.available_read(), true /* finish */, output_size);
+    if (error != KM_ERROR_OK) return error;
+
+    OutputSpan span(output, output_size);
+    if (!UpdateForFinish(additional_params, input, output_params, &span, &error)) return error;
+    if (!FinishCipher(&span, &error)) return error;
+    *output_written = span.written;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t BlockCipherEvpOperation::GetMaxOutputSize(size_t input_length, bool finish,
+                                                            size_t* max_output) const {
+    if (!max_output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    // EVP may release up to a block of input buffered by earlier calls, and GCM decryption also
+    // releases up to tag_length_ bytes it withheld as a possible tag.  Finishing adds the final
+    // (padding) block and, when encrypting, the tag.
+    size_t overhead = block_size_bytes();
+    if (purpose() == KM_PURPOSE_DECRYPT) overhead += tag_length_;
+    if (finish) {
+        overhead += block_size_bytes();
+        if (purpose() == KM_PURPOSE_ENCRYPT) overhead += tag_length_;
+    }
+
+    if (input_length > SIZE_MAX - overhead) return KM_ERROR_INVALID_INPUT_LENGTH;
+    *max_output = input_length + overhead;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t BlockCipherEvpOperation::CheckOutputSize(size_t input_length, bool finish,
+                                                           size_t output_size) const {
+    size_t max_output;
+    keymaster_error_t error = GetMaxOutputSize(input_length, finish, &max_output);
+    if (error != KM_ERROR_OK) return error;
+    if (output_size < max_output) return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+    return KM_ERROR_OK;
+}
+
+bool BlockCipherEvpOperation::FinishCipher(OutputSpan* output, keymaster_error_t* error) {
+    if (is_aead() && aad_block_buf_len_ > 0 && !ProcessBufferedAadBlock(error)) {
+        return false;
+    }
+
+    // ChaCha20-Poly1305 never buffers data, and its tag is produced by the caller.
+    if (chacha_) return true;
+
+    if (output->available_write() < block_size_bytes()) {
+        *error = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+        return false;
     }
 
     int output_written = -1;
     if (!EVP_CipherFinal_ex(&ctx_, output->peek_write(), &output_written)) {
-        if (tag_length_ > 0) return KM_ERROR_VERIFICATION_FAILED;
+        if (tag_length_ > 0) {
+            *error = KM_ERROR_VERIFICATION_FAILED;
+            return false;
+        }
         LOG_E("Error encrypting final block: %s", ERR_error_string(ERR_peek_last_error(), nullptr));
-        return TranslateLastOpenSslError();
+        *error = TranslateLastOpenSslError();
+        return false;
     }
 
     assert(output_written >= 0);
     assert(static_cast<size_t>(output_written) <= block_size_bytes());
-    if (!output->advance_write(output_written)) return KM_ERROR_UNKNOWN_ERROR;
-    return KM_ERROR_OK;
+    output->written += output_written;
+    return true;
 }
 
 bool BlockCipherEvpOperation::need_iv() const {
+    if (is_chacha20_poly1305()) return true;
     switch (block_mode_) {
     case KM_MODE_CBC:
     case KM_MODE_CTR:
@@ -223,31 +468,47 @@ bool BlockCipherEvpOperation::need_iv() const {
 }
 
 keymaster_error_t BlockCipherEvpOperation::InitializeCipher(KeymasterKeyBlob key) {
-    keymaster_error_t error;
-    const EVP_CIPHER* cipher =
-        cipher_description_.GetCipherInstance(key.key_material_size, block_mode_, &error);
-    if (error) return error;
-
-    if (!EVP_CipherInit_ex(&ctx_, cipher, nullptr /* engine */, key.key_material, iv_.data,
-                           evp_encrypt_mode())) {
-        return TranslateLastOpenSslError();
+    if (is_chacha20_poly1305()) {
+        if (key.key_material_size != ChaCha20Poly1305::kKeySize)
+            return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+        chacha_.reset(new (std::nothrow) ChaCha20Poly1305(key.key_material));
+        if (!chacha_.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        chacha_->Start(iv_.data);
+        return KM_ERROR_OK;
     }
 
-    switch (padding_) {
-    case KM_PAD_NONE:
-        EVP_CIPHER_CTX_set_padding(&ctx_, 0 /* disable padding */);
-        break;
-    case KM_PAD_PKCS7:
-        // This is the default for OpenSSL EVP cipher operations.
-        break;
-    default:
-        return KM_ERROR_UNSUPPORTED_PADDING_MODE;
+    // The key schedule and padding setting don't depend on the IV, so a cached context keyed with
+    // the same key can be reused, with only the IV set below.
+    CipherContextCache* cache = options_.context_cache;
+    if (!cache ||
+        !cache->Lookup(key_id(), key, block_mode_, padding_, evp_encrypt_mode(), &ctx_)) {
+        keymaster_error_t error;
+        const EVP_CIPHER* cipher =
+            cipher_description_.GetCipherInstance(key.key_material_size, block_mode_, &error);
+        if (error) return error;
+
+        if (!EVP_CipherInit_ex(&ctx_, cipher, nullptr /* engine */, key.key_material,
+                               nullptr /* iv */, evp_encrypt_mode())) {
+            return TranslateLastOpenSslError();
+        }
+
+        switch (padding_) {
+        case KM_PAD_NONE:
+            EVP_CIPHER_CTX_set_padding(&ctx_, 0 /* disable padding */);
+            break;
+        case KM_PAD_PKCS7:
+            // This is the default for OpenSSL EVP cipher operations.
+            break;
+        default:
+            return KM_ERROR_UNSUPPORTED_PADDING_MODE;
+        }
+
+        if (cache) cache->Insert(key_id(), key, block_mode_, padding_, evp_encrypt_mode(), ctx_);
     }
 
-    if (block_mode_ == KM_MODE_GCM) {
-        aad_block_buf_.reset(new (std::nothrow) uint8_t[block_size_bytes()]);
-        if (!aad_block_buf_) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        aad_block_buf_len_ = 0;
+    if (iv_.data && !EVP_CipherInit_ex(&ctx_, nullptr /* cipher */, nullptr /* engine */,
+                                       nullptr /* key */, iv_.data, evp_encrypt_mode())) {
+        return TranslateLastOpenSslError();
     }
 
     return KM_ERROR_OK;
@@ -260,14 +521,14 @@ keymaster_error_t BlockCipherEvpOperation::GetIv(const AuthorizationSet& input_p
         return KM_ERROR_INVALID_ARGUMENT;
     }
 
-    if (block_mode_ != KM_MODE_GCM && iv_blob.data_length != block_size_bytes()) {
+    if (!is_aead() && iv_blob.data_length != block_size_bytes()) {
         LOG_E("Expected %d-byte IV for operation, but got %d bytes", block_size_bytes(),
               iv_blob.data_length);
         return KM_ERROR_INVALID_NONCE;
     }
 
-    if (block_mode_ == KM_MODE_GCM && iv_blob.data_length != GCM_NONCE_SIZE) {
-        LOG_E("Expected %d-byte nonce for GCM operation, but got %d bytes", GCM_NONCE_SIZE,
+    if (is_aead() && iv_blob.data_length != GCM_NONCE_SIZE) {
+        LOG_E("Expected %d-byte nonce for AEAD operation, but got %d bytes", GCM_NONCE_SIZE,
               iv_blob.data_length);
         return KM_ERROR_INVALID_NONCE;
     }
@@ -284,7 +545,7 @@ keymaster_error_t BlockCipherEvpOperation::GetIv(const AuthorizationSet& input_p
  * the wrong thing when given partial AAD blocks, so we have to take care to process AAD in block
  * size increments, buffering (in aad_block_buf_) when given smaller amounts of data.
  */
-bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, const Buffer& input,
+bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, size_t input_length,
                                         keymaster_error_t* error) {
     assert(tag_length_ > 0);
     assert(error);
@@ -313,7 +574,7 @@ bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, co
         assert(aad.data_length == 0);
     }
 
-    if (input.available_read()) {
+    if (input_length) {
         data_started_ = true;
         // Data has begun, no more AAD is allowed.  Process any buffered AAD.
         if (aad_block_buf_len_ > 0 && !ProcessBufferedAadBlock(error)) return false;
@@ -323,8 +584,14 @@ bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, co
 }
 
 bool BlockCipherEvpOperation::ProcessBufferedAadBlock(keymaster_error_t* error) {
+    if (chacha_) {
+        chacha_->UpdateAad(aad_block_buf_, aad_block_buf_len_);
+        aad_block_buf_len_ = 0;
+        return true;
+    }
+
     int output_written;
-    if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, aad_block_buf_.get(),
+    if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, aad_block_buf_,
                          aad_block_buf_len_)) {
         aad_block_buf_len_ = 0;
         return true;
@@ -335,6 +602,11 @@ bool BlockCipherEvpOperation::ProcessBufferedAadBlock(keymaster_error_t* error)
 
 bool BlockCipherEvpOperation::ProcessAadBlocks(const uint8_t* data, size_t blocks,
                                                keymaster_error_t* error) {
+    if (chacha_) {
+        chacha_->UpdateAad(data, blocks * block_size_bytes());
+        return true;
+    }
+
     int output_written;
     if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, data,
                          blocks * block_size_bytes())) {
@@ -350,39 +622,205 @@ inline size_t min(size_t a, size_t b) {
 
 void BlockCipherEvpOperation::FillBufferedAadBlock(keymaster_blob_t* aad) {
     size_t to_buffer = min(block_size_bytes() - aad_block_buf_len_, aad->data_length);
-    memcpy(aad_block_buf_.get() + aad_block_buf_len_, aad->data, to_buffer);
+    memcpy(aad_block_buf_ + aad_block_buf_len_, aad->data, to_buffer);
     aad->data += to_buffer;
     aad->data_length -= to_buffer;
     aad_block_buf_len_ += to_buffer;
 }
 
 bool BlockCipherEvpOperation::InternalUpdate(const uint8_t* input, size_t input_length,
-                                             Buffer* output, keymaster_error_t* error) {
+                                             OutputSpan* output, keymaster_error_t* error) {
     assert(output);
     assert(error);
 
+    if (CanUpdateInParallel(input_length))
+        return ParallelUpdate(input, input_length, output, error);
+    return SerialUpdate(input, input_length, output, error);
+}
+
+// The most output EVP_CipherUpdate() can produce from |input_length| bytes: the input plus any
+// partial block the context holds, and the final block it withholds when decrypting with padding.
+size_t BlockCipherEvpOperation::MaxEvpUpdateOutput(size_t input_length) const {
+    if (chacha_) return input_length;
+    return input_length + ctx_.buf_len + (ctx_.final_used ? block_size_bytes() : 0);
+}
+
+bool BlockCipherEvpOperation::SerialUpdate(const uint8_t* input, size_t input_length,
+                                           OutputSpan* output, keymaster_error_t* error) {
     if (!input_length) return true;
 
-    if (!output->reserve(input_length + block_size_bytes())) {
-        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (output->available_write() < MaxEvpUpdateOutput(input_length)) {
+        *error = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
         return false;
     }
 
+    if (chacha_) {
+        if (!chacha_->Update(purpose() == KM_PURPOSE_ENCRYPT, input, input_length,
+                             output->peek_write())) {
+            *error = KM_ERROR_INVALID_INPUT_LENGTH;
+            return false;
+        }
+        output->written += input_length;
+        return true;
+    }
+
     int output_written = -1;
     if (!EVP_CipherUpdate(&ctx_, output->peek_write(), &output_written, input, input_length)) {
         *error = TranslateLastOpenSslError();
         return false;
     }
-    return output->advance_write(output_written);
+    output->written += output_written;
+    return true;
+}
+
+namespace {
+
+// Adds |blocks| to the big-endian counter |counter|, carrying across all |length| bytes the way
+// OpenSSL's CTR mode does.
+void AddToCounter(uint8_t* counter, size_t length, uint64_t blocks) {
+    uint64_t carry = blocks;
+    for (size_t i = length; i > 0 && carry; --i) {
+        uint64_t sum = counter[i - 1] + (carry & 0xFF);
+        counter[i - 1] = static_cast<uint8_t>(sum);
+        carry = (carry >> 8) + (sum >> 8);
+    }
+}
+
+// One parallel update, split into tasks of chunk_blocks blocks each (the last may be shorter).
+struct ParallelUpdateJob {
+    const EVP_CIPHER_CTX* template_ctx;
+    const uint8_t* counter;  // Counter for the first block in CTR mode; nullptr in ECB mode.
+    size_t block_size;
+    size_t chunk_blocks;
+    size_t total_blocks;
+    const uint8_t* input;
+    uint8_t* output;
+    bool failed;
+};
+
+void RunParallelUpdateTask(void* context, size_t index) {
+    ParallelUpdateJob* job = reinterpret_cast<ParallelUpdateJob*>(context);
+    size_t first_block = index * job->chunk_blocks;
+    size_t blocks = min(job->chunk_blocks, job->total_blocks - first_block);
+    size_t offset = first_block * job->block_size;
+    size_t length = blocks * job->block_size;
+
+    // Each task works on its own copy of the operation's context, positioned (in CTR mode) at the
+    // counter for its first block.
+    EVP_CIPHER_CTX ctx;
+    EVP_CIPHER_CTX_init(&ctx);
+    bool ok = EVP_CIPHER_CTX_copy(&ctx, job->template_ctx);
+    if (ok && job->counter) {
+        uint8_t counter[EVP_MAX_IV_LENGTH];
+        memcpy(counter, job->counter, job->block_size);
+        AddToCounter(counter, job->block_size, first_block);
+        ok = EVP_CipherInit_ex(&ctx, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                               counter, -1 /* keep direction */);
+    }
+    int output_written = -1;
+    ok = ok && EVP_CipherUpdate(&ctx, job->output + offset, &output_written, job->input + offset,
+                                length);
+    ok = ok && static_cast<size_t>(output_written) == length;
+    EVP_CIPHER_CTX_cleanup(&ctx);
+
+    if (!ok) __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+}
+
+}  // anonymous namespace
+
+bool BlockCipherEvpOperation::CanUpdateInParallel(size_t input_length) const {
+    if (!options_.worker_pool || options_.worker_pool->concurrency() < 2 ||
+        input_length < options_.min_parallel_bytes || input_length < 2 * block_size_bytes())
+        return false;
+
+    switch (block_mode_) {
+    case KM_MODE_CTR:
+        return true;
+    case KM_MODE_ECB:
+        // ECB blocks are independent as long as EVP isn't holding a partial block, or (when
+        // decrypting with padding) holding back the last block for padding removal.
+        return ctx_.buf_len == 0 && (padding_ == KM_PAD_NONE || evp_encrypt_mode());
+    default:
+        return false;
+    }
+}
+
+/*
+ * Processes the whole blocks of the input across the worker pool, then the remainder serially.
+ *
+ * In CTR mode the parallel part must start on a counter boundary, so any keystream left over from
+ * an earlier partial block is used up serially first, and afterwards the operation's own counter
+ * is advanced past the blocks the workers processed.  The result is identical to a serial update.
+ */
+bool BlockCipherEvpOperation::ParallelUpdate(const uint8_t* input, size_t input_length,
+                                             OutputSpan* output, keymaster_error_t* error) {
+    const size_t block_size = block_size_bytes();
+    if (output->available_write() < MaxEvpUpdateOutput(input_length)) {
+        *error = KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+        return false;
+    }
+
+    if (block_mode_ == KM_MODE_CTR && ctx_.num != 0) {
+        size_t lead = min(block_size - ctx_.num, input_length);
+        if (!SerialUpdate(input, lead, output, error)) return false;
+        input += lead;
+        input_length -= lead;
+    }
+
+    size_t total_blocks = input_length / block_size;
+    if (total_blocks > 0) {
+        size_t concurrency = options_.worker_pool->concurrency();
+        // EVP_CipherUpdate takes an int length, so bound the chunk size accordingly.
+        size_t max_chunk_blocks = INT_MAX / block_size;
+        size_t chunk_blocks = min((total_blocks + concurrency - 1) / concurrency, max_chunk_blocks);
+
+        ParallelUpdateJob job;
+        job.template_ctx = &ctx_;
+        job.counter = block_mode_ == KM_MODE_CTR ? ctx_.iv : nullptr;
+        job.block_size = block_size;
+        job.chunk_blocks = chunk_blocks;
+        job.total_blocks = total_blocks;
+        job.input = input;
+        job.output = output->peek_write();
+        job.failed = false;
+        options_.worker_pool->Run(RunParallelUpdateTask, &job,
+                                  (total_blocks + chunk_blocks - 1) / chunk_blocks);
+        if (job.failed) {
+            LOG_E("Parallel block cipher update failed", 0);
+            *error = KM_ERROR_UNKNOWN_ERROR;
+            return false;
+        }
+
+        size_t parallel_bytes = total_blocks * block_size;
+        output->written += parallel_bytes;
+        input += parallel_bytes;
+        input_length -= parallel_bytes;
+
+        if (block_mode_ == KM_MODE_CTR) {
+            uint8_t counter[EVP_MAX_IV_LENGTH];
+            memcpy(counter, ctx_.iv, block_size);
+            AddToCounter(counter, block_size, total_blocks);
+            if (!EVP_CipherInit_ex(&ctx_, nullptr /* cipher */, nullptr /* engine */,
+                                   nullptr /* key */, counter, -1 /* keep direction */)) {
+                *error = TranslateLastOpenSslError();
+                return false;
+            }
+        }
+    }
+
+    return SerialUpdate(input, input_length, output, error);
 }
 
 bool BlockCipherEvpOperation::UpdateForFinish(const AuthorizationSet& additional_params,
                                               const Buffer& input, AuthorizationSet* output_params,
-                                              Buffer* output, keymaster_error_t* error) {
+                                              OutputSpan* output, keymaster_error_t* error) {
     if (input.available_read() || !additional_params.empty()) {
         size_t input_consumed;
-        *error = Update(additional_params, input, output_params, output, &input_consumed);
+        size_t output_written;
+        *error = UpdateInto(additional_params, input, output_params, output->peek_write(),
+                            output->available_write(), &output_written, &input_consumed);
         if (*error != KM_ERROR_OK) return false;
+        output->written += output_written;
         if (input_consumed != input.available_read()) {
             *error = KM_ERROR_INVALID_INPUT_LENGTH;
             return false;
@@ -392,8 +830,9 @@ bool BlockCipherEvpOperation::UpdateForFinish(const AuthorizationSet& additional
     return true;
 }
 
-keymaster_error_t BlockCipherEvpEncryptOperation::Begin(const AuthorizationSet& input_params,
-                                                        AuthorizationSet* output_params) {
+keymaster_error_t
+BlockCipherEvpEncryptOperation::BeginMessage(const AuthorizationSet& input_params,
+                                             AuthorizationSet* output_params) {
     if (!output_params) return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
     if (need_iv()) {
@@ -410,139 +849,247 @@ keymaster_error_t BlockCipherEvpEncryptOperation::Begin(const AuthorizationSet&
         output_params->push_back(TAG_NONCE, iv_.data, iv_.data_length);
     }
 
-    return BlockCipherEvpOperation::Begin(input_params, output_params);
+    return KM_ERROR_OK;
 }
 
-keymaster_error_t BlockCipherEvpEncryptOperation::Finish(const AuthorizationSet& additional_params,
-                                                         const Buffer& input,
-                                                         const Buffer& signature,
-                                                         AuthorizationSet* output_params,
-                                                         Buffer* output) {
-    if (!output->reserve(input.available_read() + block_size_bytes() + tag_length_)) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+keymaster_error_t BlockCipherEvpEncryptOperation::FinishInto(
+    const AuthorizationSet& additional_params, const Buffer& input, const Buffer& signature,
+    AuthorizationSet* output_params, uint8_t* output, size_t output_size, size_t* output_written) {
+    // GetMaxOutputSize() includes the tag, so the base class has already checked there's room.
+    keymaster_error_t error = BlockCipherEvpOperation::FinishInto(
+        additional_params, input, signature, output_params, output, output_size, output_written);
+    if (error != KM_ERROR_OK) return error;
+
+    if (tag_length_ > 0) {
+        if (output_size - *output_written < tag_length_) return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+
+        error = WriteTag(output + *output_written);
+        if (error != KM_ERROR_OK) return error;
+        *output_written += tag_length_;
     }
 
-    keymaster_error_t error =
-        BlockCipherEvpOperation::Finish(additional_params, input, signature, output_params, output);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t BlockCipherEvpEncryptOperation::FinishInPlace(
+    const AuthorizationSet& additional_params, uint8_t* data, size_t data_length,
+    size_t data_capacity, AuthorizationSet* output_params, size_t* output_length) {
+    if (!output_length) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!supports_in_place()) return KM_ERROR_UNIMPLEMENTED;
+    if (data_capacity < data_length || data_capacity - data_length < tag_length_)
+        return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+
+    keymaster_error_t error = UpdateInPlace(additional_params, data, data_length, output_params);
     if (error != KM_ERROR_OK) return error;
+    if (!FinishCipherInPlace(&error)) return error;
 
     if (tag_length_ > 0) {
-        if (!output->reserve(tag_length_)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        error = WriteTag(data + data_length);
+        if (error != KM_ERROR_OK) return error;
+    }
+    *output_length = data_length + tag_length_;
+    return KM_ERROR_OK;
+}
 
-        if (!EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_GET_TAG, tag_length_, output->peek_write()))
-            return TranslateLastOpenSslError();
-        if (!output->advance_write(tag_length_)) return KM_ERROR_UNKNOWN_ERROR;
+// Writes the tag_length_ byte tag for the finished message to |tag|.
+keymaster_error_t BlockCipherEvpEncryptOperation::WriteTag(uint8_t* tag) {
+    if (chacha_) {
+        uint8_t full_tag[ChaCha20Poly1305::kTagSize];
+        chacha_->Finish(full_tag);
+        memcpy(tag, full_tag, tag_length_);
+        return KM_ERROR_OK;
     }
 
+    if (!EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_GET_TAG, tag_length_, tag))
+        return TranslateLastOpenSslError();
     return KM_ERROR_OK;
 }
 
 keymaster_error_t BlockCipherEvpEncryptOperation::GenerateIv() {
-    iv_.Reset((block_mode_ == KM_MODE_GCM) ? GCM_NONCE_SIZE : block_size_bytes());
+    iv_.Reset(is_aead() ? GCM_NONCE_SIZE : block_size_bytes());
     if (!iv_.data) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     if (RAND_bytes(iv_.writable_data(), iv_.data_length) != 1) return TranslateLastOpenSslError();
     return KM_ERROR_OK;
 }
 
-keymaster_error_t BlockCipherEvpDecryptOperation::Begin(const AuthorizationSet& input_params,
-                                                        AuthorizationSet* output_params) {
+keymaster_error_t
+BlockCipherEvpDecryptOperation::BeginMessage(const AuthorizationSet& input_params,
+                                             AuthorizationSet* /* output_params */) {
     if (need_iv()) {
         keymaster_error_t error = GetIv(input_params);
         if (error != KM_ERROR_OK) return error;
     }
 
-    if (tag_length_ > 0) {
-        tag_buf_.reset(new (std::nothrow) uint8_t[tag_length_]);
-        if (!tag_buf_) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        tag_buf_len_ = 0;
-    }
-
-    return BlockCipherEvpOperation::Begin(input_params, output_params);
+    tag_buf_start_ = 0;
+    tag_buf_len_ = 0;
+    return KM_ERROR_OK;
 }
 
-keymaster_error_t BlockCipherEvpDecryptOperation::Update(const AuthorizationSet& additional_params,
-                                                         const Buffer& input,
-                                                         AuthorizationSet* /* output_params */,
-                                                         Buffer* output, size_t* input_consumed) {
-    if (!output || !input_consumed) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+keymaster_error_t BlockCipherEvpDecryptOperation::UpdateInto(
+    const AuthorizationSet& additional_params, const Buffer& input,
+    AuthorizationSet* /* output_params */, uint8_t* output, size_t output_size,
+    size_t* output_written, size_t* input_consumed) {
+    if (!output || !output_written || !input_consumed) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error =
+        CheckOutputSize(input.available_read(), false /* finish */, output_size);
+    if (error != KM_ERROR_OK) return error;
 
     // Barring error, we'll consume it all.
     *input_consumed = input.available_read();
 
-    keymaster_error_t error;
-    if (block_mode_ == KM_MODE_GCM) {
-        if (!HandleAad(additional_params, input, &error)) return error;
-        return ProcessAllButTagLengthBytes(input, output);
+    OutputSpan span(output, output_size);
+    if (is_aead()) {
+        if (!HandleAad(additional_params, input.available_read(), &error)) return error;
+        error = ProcessAllButTagLengthBytes(input, &span);
+        if (error != KM_ERROR_OK) return error;
+    } else if (!InternalUpdate(input.peek_read(), input.available_read(), &span, &error)) {
+        return error;
     }
 
-    if (!InternalUpdate(input.peek_read(), input.available_read(), output, &error)) return error;
+    *output_written = span.written;
     return KM_ERROR_OK;
 }
 
 keymaster_error_t BlockCipherEvpDecryptOperation::ProcessAllButTagLengthBytes(const Buffer& input,
-                                                                              Buffer* output) {
-    if (input.available_read() <= tag_buf_unused()) {
-        BufferCandidateTagData(input.peek_read(), input.available_read());
+                                                                              OutputSpan* output) {
+    const uint8_t* data = input.peek_read();
+    const size_t length = input.available_read();
+
+    if (length <= tag_buf_unused()) {
+        BufferCandidateTagData(data, length);
         return KM_ERROR_OK;
     }
 
-    const size_t data_available = tag_buf_len_ + input.available_read();
-
-    const size_t to_process = data_available - tag_length_;
-    const size_t to_process_from_tag_buf = min(to_process, tag_buf_len_);
-    const size_t to_process_from_input = to_process - to_process_from_tag_buf;
-
-    if (!output->reserve(to_process + block_size_bytes())) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
     keymaster_error_t error;
-    if (!ProcessTagBufContentsAsData(to_process_from_tag_buf, output, &error)) return error;
-
-    if (!InternalUpdate(input.peek_read(), to_process_from_input, output, &error)) return error;
+    if (length >= tag_length_) {
+        // Everything held back is data, and the new candidate tag lies entirely within the input,
+        // so the input before it can go straight to the cipher.
+        if (!ProcessTagBufContentsAsData(tag_buf_len_, output, &error)) return error;
+        const size_t to_process = length - tag_length_;
+        if (!InternalUpdate(data, to_process, output, &error)) return error;
+        tag_buf_start_ = 0;
+        BufferCandidateTagData(data + to_process, tag_length_);
+    } else {
+        // Release just enough of the oldest held-back bytes to make room for the input.
+        if (!ProcessTagBufContentsAsData(tag_buf_len_ + length - tag_length_, output, &error))
+            return error;
+        BufferCandidateTagData(data, length);
+    }
 
-    BufferCandidateTagData(input.peek_read() + to_process_from_input,
-                           input.available_read() - to_process_from_input);
     assert(tag_buf_unused() == 0);
-
     return KM_ERROR_OK;
 }
 
-bool BlockCipherEvpDecryptOperation::ProcessTagBufContentsAsData(size_t to_process, Buffer* output,
+bool BlockCipherEvpDecryptOperation::ProcessTagBufContentsAsData(size_t to_process,
+                                                                 OutputSpan* output,
                                                                  keymaster_error_t* error) {
     assert(to_process <= tag_buf_len_);
-    if (!InternalUpdate(tag_buf_.get(), to_process, output, error)) return false;
-    if (to_process < tag_buf_len_) {
-        memmove(tag_buf_.get(), tag_buf_.get() + to_process, tag_buf_len_ - to_process);
+    // The oldest bytes may wrap around the end of the ring.
+    const size_t first = min(to_process, tag_length_ - tag_buf_start_);
+    if (!InternalUpdate(tag_buf_ + tag_buf_start_, first, output, error) ||
+        !InternalUpdate(tag_buf_, to_process - first, output, error)) {
+        return false;
     }
     tag_buf_len_ -= to_process;
+    tag_buf_start_ = tag_buf_len_ ? (tag_buf_start_ + to_process) % tag_length_ : 0;
     return true;
 }
 
 void BlockCipherEvpDecryptOperation::BufferCandidateTagData(const uint8_t* data,
                                                             size_t data_length) {
-    assert(data_length <= tag_length_ - tag_buf_len_);
-    memcpy(tag_buf_.get() + tag_buf_len_, data, data_length);
+    assert(data_length <= tag_buf_unused());
+    const size_t end = (tag_buf_start_ + tag_buf_len_) % tag_length_;
+    const size_t first = min(data_length, tag_length_ - end);
+    memcpy(tag_buf_ + end, data, first);
+    memcpy(tag_buf_, data + first, data_length - first);
     tag_buf_len_ += data_length;
 }
 
-keymaster_error_t BlockCipherEvpDecryptOperation::Finish(const AuthorizationSet& additional_params,
-                                                         const Buffer& input,
-                                                         const Buffer& signature,
-                                                         AuthorizationSet* output_params,
-                                                         Buffer* output) {
-    keymaster_error_t error;
-    if (!UpdateForFinish(additional_params, input, output_params, output, &error)) return error;
+// Returns the held-back bytes as a contiguous tag, unwrapping them into |scratch| if necessary.
+const uint8_t* BlockCipherEvpDecryptOperation::GetCandidateTag(uint8_t* scratch) const {
+    const size_t first = tag_length_ - tag_buf_start_;
+    if (first >= tag_buf_len_) return tag_buf_ + tag_buf_start_;
+    memcpy(scratch, tag_buf_ + tag_buf_start_, first);
+    memcpy(scratch + first, tag_buf_, tag_buf_len_ - first);
+    return scratch;
+}
 
-    if (tag_buf_len_ < tag_length_) {
-        return KM_ERROR_INVALID_INPUT_LENGTH;
-    } else if (tag_length_ > 0 &&
-               !EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_SET_TAG, tag_length_, tag_buf_.get())) {
+keymaster_error_t BlockCipherEvpDecryptOperation::FinishInto(
+    const AuthorizationSet& additional_params, const Buffer& input, const Buffer& /* signature */,
+    AuthorizationSet* output_params, uint8_t* output, size_t output_size, size_t* output_written) {
+    if (!output || !output_written) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error =
+        CheckOutputSize(input.available_read(), true /* finish */, output_size);
+    if (error != KM_ERROR_OK) return error;
+
+    OutputSpan span(output, output_size);
+    if (!UpdateForFinish(additional_params, input, output_params, &span, &error)) return error;
+
+    if (tag_buf_len_ < tag_length_) return KM_ERROR_INVALID_INPUT_LENGTH;
+    uint8_t scratch[kMaxGcmTagLength / 8];
+    const uint8_t* tag = tag_length_ > 0 ? GetCandidateTag(scratch) : nullptr;
+    error = SetExpectedTag(tag);
+    if (error != KM_ERROR_OK) return error;
+
+    if (!FinishCipher(&span, &error)) return error;
+    error = CheckTag(tag);
+    if (error != KM_ERROR_OK) return error;
+    *output_written = span.written;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t BlockCipherEvpDecryptOperation::UpdateInPlace(
+    const AuthorizationSet& additional_params, uint8_t* data, size_t data_length,
+    AuthorizationSet* output_params) {
+    // Bytes held back as a possible tag by UpdateInto() would have to be output ahead of |data|,
+    // which there's no room for.
+    if (tag_buf_len_ > 0) return KM_ERROR_INVALID_ARGUMENT;
+    return BlockCipherEvpOperation::UpdateInPlace(additional_params, data, data_length,
+                                                  output_params);
+}
+
+keymaster_error_t BlockCipherEvpDecryptOperation::FinishInPlace(
+    const AuthorizationSet& additional_params, uint8_t* data, size_t data_length,
+    size_t /* data_capacity */, AuthorizationSet* output_params, size_t* output_length) {
+    if (!output_length) return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!supports_in_place()) return KM_ERROR_UNIMPLEMENTED;
+    if (data_length < tag_length_) return KM_ERROR_INVALID_INPUT_LENGTH;
+
+    // Nothing is held back in place, so the tag is simply the end of the data.
+    const size_t ciphertext_length = data_length - tag_length_;
+    keymaster_error_t error =
+        UpdateInPlace(additional_params, data, ciphertext_length, output_params);
+    if (error != KM_ERROR_OK) return error;
+
+    const uint8_t* tag = tag_length_ > 0 ? data + ciphertext_length : nullptr;
+    error = SetExpectedTag(tag);
+    if (error != KM_ERROR_OK) return error;
+    if (!FinishCipherInPlace(&error)) return error;
+    error = CheckTag(tag);
+    if (error != KM_ERROR_OK) return error;
+
+    *output_length = ciphertext_length;
+    return KM_ERROR_OK;
+}
+
+// Gives GCM the tag to verify when the cipher is finished.
+keymaster_error_t BlockCipherEvpDecryptOperation::SetExpectedTag(const uint8_t* tag) {
+    if (!tag || chacha_) return KM_ERROR_OK;
+    // EVP_CIPHER_CTX_ctrl takes a non-const pointer, but only reads the tag.
+    if (!EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_SET_TAG, tag_length_, const_cast<uint8_t*>(tag)))
         return TranslateLastOpenSslError();
-    }
+    return KM_ERROR_OK;
+}
 
-    AuthorizationSet empty_params;
-    Buffer empty_input;
-    return BlockCipherEvpOperation::Finish(empty_params, empty_input, signature, output_params,
-                                           output);
+// Verifies a ChaCha20-Poly1305 tag, after the cipher is finished.  GCM tags are verified by EVP.
+keymaster_error_t BlockCipherEvpDecryptOperation::CheckTag(const uint8_t* tag) {
+    if (!tag || !chacha_) return KM_ERROR_OK;
+    uint8_t expected_tag[ChaCha20Poly1305::kTagSize];
+    chacha_->Finish(expected_tag);
+    if (CRYPTO_memcmp(expected_tag, tag, tag_length_) != 0) return KM_ERROR_VERIFICATION_FAILED;
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t BlockCipherEvpOperation::Abort() {
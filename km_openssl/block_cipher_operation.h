@@ -19,10 +19,32 @@
 
 #include <openssl/evp.h>
 
+#include <keymaster/km_openssl/aes_key.h>
+#include <keymaster/km_openssl/cipher_context_cache.h>
 #include <keymaster/operation.h>
+#include <keymaster/worker_pool.h>
+
+#include "chacha20_poly1305.h"
 
 namespace keymaster {
 
+/**
+ * Optional performance features for block cipher operations, configured on the factory and passed
+ * to each operation it creates.  None of the pointers are owned.
+ */
+struct BlockCipherOperationOptions {
+    BlockCipherOperationOptions()
+        : context_cache(nullptr), worker_pool(nullptr), min_parallel_bytes(0) {}
+
+    // Cache of keyed cipher contexts reused across operations, or nullptr.
+    CipherContextCache* context_cache;
+
+    // Pool used to process CTR and ECB inputs of at least min_parallel_bytes in parallel, or
+    // nullptr to always process serially.
+    WorkerPool* worker_pool;
+    size_t min_parallel_bytes;
+};
+
 /**
  * EvpCipherDescription is an abstract interface that provides information about a block cipher.
  */
@@ -62,15 +84,32 @@ class BlockCipherOperationFactory : public OperationFactory {
 
     virtual const EvpCipherDescription& GetCipherDescription() const = 0;
 
+    /**
+     * Sets the cache of initialized cipher contexts used by operations this factory creates, or
+     * disables caching if \p cache is nullptr (the default).  The cache is not owned.
+     */
+    void set_context_cache(CipherContextCache* cache) { options_.context_cache = cache; }
+
+    /**
+     * Enables parallel processing of CTR and ECB updates of at least \p min_parallel_bytes, using
+     * \p pool, or disables it if \p pool is nullptr (the default).  The pool is not owned.
+     */
+    void set_worker_pool(WorkerPool* pool, size_t min_parallel_bytes) {
+        options_.worker_pool = pool;
+        options_.min_parallel_bytes = min_parallel_bytes;
+    }
+
   private:
     const keymaster_purpose_t purpose_;
+    BlockCipherOperationOptions options_;
 };
 
 class BlockCipherEvpOperation : public Operation {
   public:
     BlockCipherEvpOperation(keymaster_purpose_t purpose, keymaster_block_mode_t block_mode,
                             keymaster_padding_t padding, bool caller_iv, size_t tag_length,
-                            Key&& key, const EvpCipherDescription& cipher_description);
+                            Key&& key, const EvpCipherDescription& cipher_description,
+                            const BlockCipherOperationOptions& options);
     ~BlockCipherEvpOperation();
 
     keymaster_error_t Begin(const AuthorizationSet& input_params,
@@ -83,86 +122,176 @@ class BlockCipherEvpOperation : public Operation {
                              Buffer* output) override;
     keymaster_error_t Abort() override;
 
+    keymaster_error_t UpdateInto(const AuthorizationSet& additional_params, const Buffer& input,
+                                 AuthorizationSet* output_params, uint8_t* output,
+                                 size_t output_size, size_t* output_written,
+                                 size_t* input_consumed) override;
+    keymaster_error_t FinishInto(const AuthorizationSet& additional_params, const Buffer& input,
+                                 const Buffer& signature, AuthorizationSet* output_params,
+                                 uint8_t* output, size_t output_size,
+                                 size_t* output_written) override;
+    keymaster_error_t GetMaxOutputSize(size_t input_length, bool finish,
+                                       size_t* max_output) const override;
+    keymaster_error_t Restart(const AuthorizationSet& input_params,
+                              AuthorizationSet* output_params) override;
+    keymaster_error_t UpdateInPlace(const AuthorizationSet& additional_params, uint8_t* data,
+                                    size_t data_length, AuthorizationSet* output_params) override;
+    keymaster_error_t UpdateSegments(const AuthorizationSet& additional_params,
+                                     const Buffer* segments, size_t segment_count,
+                                     AuthorizationSet* output_params, Buffer* output,
+                                     size_t* input_consumed) override;
+    keymaster_error_t FinishSegments(const AuthorizationSet& additional_params,
+                                     const Buffer* segments, size_t segment_count,
+                                     const Buffer& signature, AuthorizationSet* output_params,
+                                     Buffer* output) override;
+
   protected:
-    virtual int evp_encrypt_mode() = 0;
+    /**
+     * Caller-supplied region that UpdateInto() and FinishInto() write into.
+     */
+    struct OutputSpan {
+        OutputSpan(uint8_t* buf, size_t buf_size) : data(buf), size(buf_size), written(0) {}
+
+        uint8_t* peek_write() { return data + written; }
+        size_t available_write() const { return size - written; }
+
+        uint8_t* data;
+        size_t size;
+        size_t written;
+    };
+
+    virtual int evp_encrypt_mode() const = 0;
+
+    // Sets up the state for one message (the IV, and anything subclasses buffer) from the begin
+    // parameters.  Called by both Begin() and Restart().
+    virtual keymaster_error_t BeginMessage(const AuthorizationSet& input_params,
+                                           AuthorizationSet* output_params) = 0;
 
     bool need_iv() const;
+    bool is_aead() const {
+        return block_mode_ == KM_MODE_GCM || block_mode_ == KM_MODE_CHACHA20_POLY1305;
+    }
+    bool is_chacha20_poly1305() const { return block_mode_ == KM_MODE_CHACHA20_POLY1305; }
     keymaster_error_t InitializeCipher(KeymasterKeyBlob key);
     keymaster_error_t GetIv(const AuthorizationSet& input_params);
-    bool HandleAad(const AuthorizationSet& input_params, const Buffer& input,
+    bool HandleAad(const AuthorizationSet& input_params, size_t input_length,
                    keymaster_error_t* error);
     bool ProcessAadBlocks(const uint8_t* data, size_t blocks, keymaster_error_t* error);
     void FillBufferedAadBlock(keymaster_blob_t* aad);
     bool ProcessBufferedAadBlock(keymaster_error_t* error);
-    bool InternalUpdate(const uint8_t* input, size_t input_length, Buffer* output,
+    bool InternalUpdate(const uint8_t* input, size_t input_length, OutputSpan* output,
+                        keymaster_error_t* error);
+    bool SerialUpdate(const uint8_t* input, size_t input_length, OutputSpan* output,
+                      keymaster_error_t* error);
+    bool CanUpdateInParallel(size_t input_length) const;
+    bool ParallelUpdate(const uint8_t* input, size_t input_length, OutputSpan* output,
                         keymaster_error_t* error);
     bool UpdateForFinish(const AuthorizationSet& additional_params, const Buffer& input,
-                         AuthorizationSet* output_params, Buffer* output, keymaster_error_t* error);
+                         AuthorizationSet* output_params, OutputSpan* output,
+                         keymaster_error_t* error);
+    bool FinishCipher(OutputSpan* output, keymaster_error_t* error);
+    bool supports_in_place() const { return padding_ == KM_PAD_NONE; }
+    bool TransformInPlace(uint8_t* data, size_t data_length, keymaster_error_t* error);
+    bool FinishCipherInPlace(keymaster_error_t* error);
+    size_t MaxEvpUpdateOutput(size_t input_length) const;
+    keymaster_error_t CheckOutputSize(size_t input_length, bool finish, size_t output_size) const;
     size_t block_size_bytes() const { return cipher_description_.block_size_bytes(); }
 
     const keymaster_block_mode_t block_mode_;
     EVP_CIPHER_CTX ctx_;
+    // Used in place of ctx_ in ChaCha20-Poly1305 mode, which EVP_CIPHER doesn't provide.
+    UniquePtr<ChaCha20Poly1305> chacha_;
     KeymasterBlob iv_;
     const bool caller_iv_;
     const size_t tag_length_;
 
   private:
-    UniquePtr<uint8_t[]> aad_block_buf_;
+    uint8_t aad_block_buf_[EVP_MAX_BLOCK_LENGTH];
     size_t aad_block_buf_len_;
     bool data_started_;
     const keymaster_padding_t padding_;
     KeymasterKeyBlob key_;
     const EvpCipherDescription& cipher_description_;
+    const BlockCipherOperationOptions options_;
 };
 
 class BlockCipherEvpEncryptOperation : public BlockCipherEvpOperation {
   public:
     BlockCipherEvpEncryptOperation(keymaster_block_mode_t block_mode, keymaster_padding_t padding,
                                    bool caller_iv, size_t tag_length, Key&& key,
-                                   const EvpCipherDescription& cipher_description)
+                                   const EvpCipherDescription& cipher_description,
+                                   const BlockCipherOperationOptions& options)
         : BlockCipherEvpOperation(KM_PURPOSE_ENCRYPT, block_mode, padding, caller_iv, tag_length,
-                                  move(key), cipher_description) {}
+                                  move(key), cipher_description, options) {}
 
-    keymaster_error_t Begin(const AuthorizationSet& input_params,
-                            AuthorizationSet* output_params) override;
-    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
-                             const Buffer& signature, AuthorizationSet* output_params,
-                             Buffer* output) override;
+    keymaster_error_t FinishInto(const AuthorizationSet& additional_params, const Buffer& input,
+                                 const Buffer& signature, AuthorizationSet* output_params,
+                                 uint8_t* output, size_t output_size,
+                                 size_t* output_written) override;
+    keymaster_error_t FinishInPlace(const AuthorizationSet& additional_params, uint8_t* data,
+                                    size_t data_length, size_t data_capacity,
+                                    AuthorizationSet* output_params,
+                                    size_t* output_length) override;
 
-    int evp_encrypt_mode() override { return 1; }
+    int evp_encrypt_mode() const override { return 1; }
+
+  protected:
+    keymaster_error_t BeginMessage(const AuthorizationSet& input_params,
+                                   AuthorizationSet* output_params) override;
 
   private:
     keymaster_error_t GenerateIv();
+    keymaster_error_t WriteTag(uint8_t* tag);
 };
 
 class BlockCipherEvpDecryptOperation : public BlockCipherEvpOperation {
   public:
     BlockCipherEvpDecryptOperation(keymaster_block_mode_t block_mode, keymaster_padding_t padding,
                                    size_t tag_length, Key&& key,
-                                   const EvpCipherDescription& cipher_description)
+                                   const EvpCipherDescription& cipher_description,
+                                   const BlockCipherOperationOptions& options)
         : BlockCipherEvpOperation(KM_PURPOSE_DECRYPT, block_mode, padding,
                                   false /* caller_iv -- don't care */, tag_length, move(key),
-                                  cipher_description) {}
+                                  cipher_description, options),
+          tag_buf_start_(0), tag_buf_len_(0) {}
+
+    keymaster_error_t UpdateInto(const AuthorizationSet& additional_params, const Buffer& input,
+                                 AuthorizationSet* output_params, uint8_t* output,
+                                 size_t output_size, size_t* output_written,
+                                 size_t* input_consumed) override;
+    keymaster_error_t FinishInto(const AuthorizationSet& additional_params, const Buffer& input,
+                                 const Buffer& signature, AuthorizationSet* output_params,
+                                 uint8_t* output, size_t output_size,
+                                 size_t* output_written) override;
+    keymaster_error_t UpdateInPlace(const AuthorizationSet& additional_params, uint8_t* data,
+                                    size_t data_length, AuthorizationSet* output_params) override;
+    keymaster_error_t FinishInPlace(const AuthorizationSet& additional_params, uint8_t* data,
+                                    size_t data_length, size_t data_capacity,
+                                    AuthorizationSet* output_params,
+                                    size_t* output_length) override;
+
+    int evp_encrypt_mode() const override { return 0; }
 
-    keymaster_error_t Begin(const AuthorizationSet& input_params,
-                            AuthorizationSet* output_params) override;
-    keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
-                             AuthorizationSet* output_params, Buffer* output,
-                             size_t* input_consumed) override;
-    keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
-                             const Buffer& signature, AuthorizationSet* output_params,
-                             Buffer* output) override;
-
-    int evp_encrypt_mode() override { return 0; }
+  protected:
+    keymaster_error_t BeginMessage(const AuthorizationSet& input_params,
+                                   AuthorizationSet* output_params) override;
 
   private:
     size_t tag_buf_unused() { return tag_length_ - tag_buf_len_; }
 
-    keymaster_error_t ProcessAllButTagLengthBytes(const Buffer& input, Buffer* output);
-    bool ProcessTagBufContentsAsData(size_t to_process, Buffer* output, keymaster_error_t* error);
+    keymaster_error_t ProcessAllButTagLengthBytes(const Buffer& input, OutputSpan* output);
+    bool ProcessTagBufContentsAsData(size_t to_process, OutputSpan* output,
+                                     keymaster_error_t* error);
     void BufferCandidateTagData(const uint8_t* data, size_t data_length);
-
-    UniquePtr<uint8_t[]> tag_buf_;
+    const uint8_t* GetCandidateTag(uint8_t* scratch) const;
+    keymaster_error_t SetExpectedTag(const uint8_t* tag);
+    keymaster_error_t CheckTag(const uint8_t* tag);
+
+    // The last tag_length_ bytes of input seen, which might be the tag, are held back in tag_buf_.
+    // It's used as a ring of tag_length_ bytes, holding tag_buf_len_ bytes from tag_buf_start_, so
+    // that releasing the oldest bytes never requires moving the rest.
+    uint8_t tag_buf_[kMaxGcmTagLength / 8];
+    size_t tag_buf_start_;
     size_t tag_buf_len_;
 };
 
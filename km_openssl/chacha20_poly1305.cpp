@@ -0,0 +1,134 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chacha20_poly1305.h"
+
+#include <string.h>
+
+#include <openssl/chacha.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+const size_t ChaCha20Poly1305::kKeySize;
+const size_t ChaCha20Poly1305::kNonceSize;
+const size_t ChaCha20Poly1305::kTagSize;
+const size_t ChaCha20Poly1305::kBlockSize;
+
+// Block zero of the key stream is used for the Poly1305 key, so data starts at block one and the
+// 32-bit block counter limits a message to 2^32 - 1 blocks.
+static const uint64_t kMaxDataLength = (static_cast<uint64_t>(1) << 32) * 64 - 64;
+
+static const uint8_t kZeroPad[16] = {};
+
+static void AppendLe64(uint64_t value, uint8_t* buf) {
+    for (size_t i = 0; i < 8; ++i) {
+        buf[i] = static_cast<uint8_t>(value);
+        value >>= 8;
+    }
+}
+
+ChaCha20Poly1305::ChaCha20Poly1305(const uint8_t key[kKeySize])
+    : counter_(0), keystream_used_(kBlockSize), aad_length_(0), data_length_(0),
+      data_started_(false) {
+    memcpy(key_, key, kKeySize);
+    memset(nonce_, 0, kNonceSize);
+}
+
+ChaCha20Poly1305::~ChaCha20Poly1305() {
+    memset_s(key_, 0, sizeof(key_));
+    memset_s(keystream_, 0, sizeof(keystream_));
+    memset_s(&poly1305_, 0, sizeof(poly1305_));
+}
+
+void ChaCha20Poly1305::Start(const uint8_t nonce[kNonceSize]) {
+    memcpy(nonce_, nonce, kNonceSize);
+
+    uint8_t poly1305_key[kBlockSize] = {};
+    CRYPTO_chacha_20(poly1305_key, poly1305_key, sizeof(poly1305_key), key_, nonce_,
+                     0 /* counter */);
+    CRYPTO_poly1305_init(&poly1305_, poly1305_key);
+    memset_s(poly1305_key, 0, sizeof(poly1305_key));
+
+    counter_ = 1;
+    keystream_used_ = kBlockSize;
+    aad_length_ = 0;
+    data_length_ = 0;
+    data_started_ = false;
+}
+
+void ChaCha20Poly1305::UpdateAad(const uint8_t* aad, size_t aad_length) {
+    CRYPTO_poly1305_update(&poly1305_, aad, aad_length);
+    aad_length_ += aad_length;
+}
+
+void ChaCha20Poly1305::StartData() {
+    if (data_started_) return;
+    CRYPTO_poly1305_update(&poly1305_, kZeroPad, (16 - aad_length_ % 16) % 16);
+    data_started_ = true;
+}
+
+bool ChaCha20Poly1305::Update(bool encrypt, const uint8_t* input, size_t length,
+                              uint8_t* output) {
+    if (length > kMaxDataLength - data_length_) return false;
+    StartData();
+
+    // The MAC always covers the ciphertext, which is the input when decrypting.
+    if (!encrypt) CRYPTO_poly1305_update(&poly1305_, input, length);
+    Crypt(input, length, output);
+    if (encrypt) CRYPTO_poly1305_update(&poly1305_, output, length);
+    data_length_ += length;
+    return true;
+}
+
+void ChaCha20Poly1305::Crypt(const uint8_t* input, size_t length, uint8_t* output) {
+    // Use up any key stream left over from a previous partial block.
+    while (length > 0 && keystream_used_ < kBlockSize) {
+        *output++ = *input++ ^ keystream_[keystream_used_++];
+        --length;
+    }
+
+    size_t whole_blocks = length / kBlockSize;
+    if (whole_blocks > 0) {
+        CRYPTO_chacha_20(output, input, whole_blocks * kBlockSize, key_, nonce_, counter_);
+        counter_ += whole_blocks;
+        input += whole_blocks * kBlockSize;
+        output += whole_blocks * kBlockSize;
+        length -= whole_blocks * kBlockSize;
+    }
+
+    if (length > 0) {
+        memset(keystream_, 0, sizeof(keystream_));
+        CRYPTO_chacha_20(keystream_, keystream_, sizeof(keystream_), key_, nonce_, counter_++);
+        keystream_used_ = 0;
+        while (length-- > 0)
+            *output++ = *input++ ^ keystream_[keystream_used_++];
+    }
+}
+
+void ChaCha20Poly1305::Finish(uint8_t tag[kTagSize]) {
+    StartData();
+    CRYPTO_poly1305_update(&poly1305_, kZeroPad, (16 - data_length_ % 16) % 16);
+
+    uint8_t lengths[16];
+    AppendLe64(aad_length_, lengths);
+    AppendLe64(data_length_, lengths + 8);
+    CRYPTO_poly1305_update(&poly1305_, lengths, sizeof(lengths));
+    CRYPTO_poly1305_finish(&poly1305_, tag);
+}
+
+}  // namespace keymaster
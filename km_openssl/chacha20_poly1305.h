@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSTEM_KEYMASTER_CHACHA20_POLY1305_H_
+#define SYSTEM_KEYMASTER_CHACHA20_POLY1305_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/poly1305.h>
+
+namespace keymaster {
+
+/**
+ * Incremental ChaCha20-Poly1305 (RFC 8439).  BoringSSL only offers the construction as a one-shot
+ * EVP_AEAD, so this builds it from the ChaCha20 and Poly1305 primitives, allowing AAD and data to
+ * be supplied in pieces of any size, the way block cipher operations receive them.
+ */
+class ChaCha20Poly1305 {
+  public:
+    static const size_t kKeySize = 32;
+    static const size_t kNonceSize = 12;
+    static const size_t kTagSize = 16;
+
+    explicit ChaCha20Poly1305(const uint8_t key[kKeySize]);
+    ~ChaCha20Poly1305();
+
+    ChaCha20Poly1305(const ChaCha20Poly1305&) = delete;
+    void operator=(const ChaCha20Poly1305&) = delete;
+
+    /**
+     * Starts a new message under \p nonce, discarding any message in progress.
+     */
+    void Start(const uint8_t nonce[kNonceSize]);
+
+    /**
+     * Authenticates \p aad.  All AAD must be supplied before any data.
+     */
+    void UpdateAad(const uint8_t* aad, size_t aad_length);
+
+    /**
+     * Encrypts or decrypts \p length bytes from \p input to \p output, which may be the same.
+     * Returns false if the message would exceed the 256 GiB ChaCha20 limit.
+     */
+    bool Update(bool encrypt, const uint8_t* input, size_t length, uint8_t* output);
+
+    /**
+     * Completes the message and writes its tag.
+     */
+    void Finish(uint8_t tag[kTagSize]);
+
+  private:
+    static const size_t kBlockSize = 64;
+
+    void StartData();
+    void Crypt(const uint8_t* input, size_t length, uint8_t* output);
+
+    uint8_t key_[kKeySize];
+    uint8_t nonce_[kNonceSize];
+    uint32_t counter_;
+    uint8_t keystream_[kBlockSize];
+    size_t keystream_used_;
+    poly1305_state poly1305_;
+    uint64_t aad_length_;
+    uint64_t data_length_;
+    bool data_started_;
+};
+
+}  // namespace keymaster
+
+#endif  // SYSTEM_KEYMASTER_CHACHA20_POLY1305_H_
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/cipher_context_cache.h>
+
+#include <keymaster/new>
+
+namespace keymaster {
+
+CipherContextCache::CipherContextCache(size_t capacity)
+    : entries_(new (std::nothrow) Entry[capacity]), capacity_(entries_.get() ? capacity : 0),
+      clock_(0) {
+    for (size_t i = 0; i < capacity_; ++i) {
+        entries_[i].in_use = false;
+        EVP_CIPHER_CTX_init(&entries_[i].ctx);
+    }
+}
+
+CipherContextCache::~CipherContextCache() {
+    Clear();
+}
+
+void CipherContextCache::Evict(Entry* entry) {
+    // BoringSSL's EVP_CIPHER_CTX_cleanup wipes the expanded key schedule before freeing it (and
+    // the cipher's own cleanup hook may need it intact, so it can't be wiped here first).
+    EVP_CIPHER_CTX_cleanup(&entry->ctx);
+    EVP_CIPHER_CTX_init(&entry->ctx);
+    entry->key.Clear();
+    entry->in_use = false;
+}
+
+void CipherContextCache::Clear() {
+    for (size_t i = 0; i < capacity_; ++i)
+        if (entries_[i].in_use) Evict(&entries_[i]);
+}
+
+size_t CipherContextCache::size() const {
+    size_t count = 0;
+    for (size_t i = 0; i < capacity_; ++i)
+        if (entries_[i].in_use) ++count;
+    return count;
+}
+
+bool CipherContextCache::Lookup(km_id_t key_id, const KeymasterKeyBlob& key,
+                                keymaster_block_mode_t block_mode, keymaster_padding_t padding,
+                                int encrypt, EVP_CIPHER_CTX* ctx) {
+    for (size_t i = 0; i < capacity_; ++i) {
+        Entry& entry = entries_[i];
+        if (!entry.in_use || entry.key_id != key_id || entry.block_mode != block_mode ||
+            entry.padding != padding || entry.encrypt != encrypt ||
+            entry.key.key_material_size != key.key_material_size ||
+            memcmp_s(entry.key.key_material, key.key_material, key.key_material_size) != 0)
+            continue;
+
+        if (!EVP_CIPHER_CTX_copy(ctx, &entry.ctx)) return false;
+        entry.last_used = ++clock_;
+        return true;
+    }
+    return false;
+}
+
+void CipherContextCache::Insert(km_id_t key_id, const KeymasterKeyBlob& key,
+                                keymaster_block_mode_t block_mode, keymaster_padding_t padding,
+                                int encrypt, const EVP_CIPHER_CTX& ctx) {
+    if (capacity_ == 0) return;
+
+    Entry* victim = &entries_[0];
+    for (size_t i = 0; i < capacity_; ++i) {
+        Entry& entry = entries_[i];
+        if (!entry.in_use) {
+            victim = &entry;
+            break;
+        }
+        if (entry.last_used < victim->last_used) victim = &entry;
+    }
+    if (victim->in_use) Evict(victim);
+
+    victim->key = KeymasterKeyBlob(key.key_material, key.key_material_size);
+    if (!victim->key.key_material || !EVP_CIPHER_CTX_copy(&victim->ctx, &ctx)) {
+        Evict(victim);
+        return;
+    }
+    victim->key_id = key_id;
+    victim->block_mode = block_mode;
+    victim->padding = padding;
+    victim->encrypt = encrypt;
+    victim->last_used = ++clock_;
+    victim->in_use = true;
+}
+
+}  // namespace keymaster
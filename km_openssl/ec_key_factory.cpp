@@ -19,6 +19,7 @@
 #include <openssl/evp.h>
 
 #include <keymaster/km_openssl/ec_key.h>
+#include <keymaster/km_openssl/ecdh_operation.h>
 #include <keymaster/km_openssl/ecdsa_operation.h>
 #include <keymaster/km_openssl/openssl_err.h>
 
@@ -28,8 +29,10 @@ namespace keymaster {
 
 static EcdsaSignOperationFactory sign_factory;
 static EcdsaVerifyOperationFactory verify_factory;
+static EcdhOperationFactory agree_factory;
 
 OperationFactory* EcKeyFactory::GetOperationFactory(keymaster_purpose_t purpose) const {
+    if (purpose == KM_PURPOSE_AGREE_KEY) return &agree_factory;
     switch (purpose) {
     case KM_PURPOSE_SIGN:
         return &sign_factory;
@@ -96,18 +99,13 @@ keymaster_error_t EcKeyFactory::GenerateKey(const AuthorizationSet& key_descript
     if (ec_key.get() == nullptr || pkey.get() == nullptr)
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    UniquePtr<EC_GROUP, EC_GROUP_Delete> group(ChooseGroup(ec_curve));
-    if (group.get() == nullptr) {
+    const EC_GROUP* group = ChooseGroup(ec_curve);
+    if (group == nullptr) {
         LOG_E("Unable to get EC group for curve %d", ec_curve);
         return KM_ERROR_UNSUPPORTED_KEY_SIZE;
     }
 
-#if !defined(OPENSSL_IS_BORINGSSL)
-    EC_GROUP_set_point_conversion_form(group.get(), POINT_CONVERSION_UNCOMPRESSED);
-    EC_GROUP_set_asn1_flag(group.get(), OPENSSL_EC_NAMED_CURVE);
-#endif
-
-    if (EC_KEY_set_group(ec_key.get(), group.get()) != 1 ||
+    if (EC_KEY_set_group(ec_key.get(), group) != 1 ||
         EC_KEY_generate_key(ec_key.get()) != 1 || EC_KEY_check_key(ec_key.get()) < 0) {
         return TranslateLastOpenSslError();
     }
@@ -198,45 +196,16 @@ keymaster_error_t EcKeyFactory::UpdateImportKeyDescription(const AuthorizationSe
 }
 
 /* static */
-EC_GROUP* EcKeyFactory::ChooseGroup(size_t key_size_bits) {
-    switch (key_size_bits) {
-    case 224:
-        return EC_GROUP_new_by_curve_name(NID_secp224r1);
-        break;
-    case 256:
-        return EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-        break;
-    case 384:
-        return EC_GROUP_new_by_curve_name(NID_secp384r1);
-        break;
-    case 521:
-        return EC_GROUP_new_by_curve_name(NID_secp521r1);
-        break;
-    default:
+const EC_GROUP* EcKeyFactory::ChooseGroup(size_t key_size_bits) {
+    keymaster_ec_curve_t ec_curve;
+    if (EcKeySizeToCurve(key_size_bits, &ec_curve) != KM_ERROR_OK)
         return nullptr;
-        break;
-    }
+    return ec_get_group(ec_curve);
 }
 
 /* static */
-EC_GROUP* EcKeyFactory::ChooseGroup(keymaster_ec_curve_t ec_curve) {
-    switch (ec_curve) {
-    case KM_EC_CURVE_P_224:
-        return EC_GROUP_new_by_curve_name(NID_secp224r1);
-        break;
-    case KM_EC_CURVE_P_256:
-        return EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-        break;
-    case KM_EC_CURVE_P_384:
-        return EC_GROUP_new_by_curve_name(NID_secp384r1);
-        break;
-    case KM_EC_CURVE_P_521:
-        return EC_GROUP_new_by_curve_name(NID_secp521r1);
-        break;
-    default:
-        return nullptr;
-        break;
-    }
+const EC_GROUP* EcKeyFactory::ChooseGroup(keymaster_ec_curve_t ec_curve) {
+    return ec_get_group(ec_curve);
 }
 
 keymaster_error_t EcKeyFactory::CreateEmptyKey(AuthorizationSet&& hw_enforced,
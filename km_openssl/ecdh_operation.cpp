@@ -0,0 +1,241 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/ecdh_operation.h>
+
+#include <keymaster/new>
+
+#include <openssl/sha.h>
+
+#include <keymaster/km_openssl/ec_key.h>
+#include <keymaster/km_openssl/hkdf.h>
+#include <keymaster/km_openssl/kdf1.h>
+#include <keymaster/km_openssl/kdf2.h>
+#include <keymaster/km_openssl/openssl_err.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+// RFC 5869 expands to at most 255 blocks of its digest, SHA-256.  The ISO 18033-2 KDFs have a
+// much larger counter, but are held to the same number of blocks of theirs.
+static const size_t kMaxKdfOutputBlocks = 255;
+static const size_t kMaxHkdfOutputBytes = kMaxKdfOutputBlocks * SHA256_DIGEST_LENGTH;
+
+OperationPtr EcdhOperationFactory::CreateOperation(Key&& key, const AuthorizationSet& begin_params,
+                                                   keymaster_error_t* error) const {
+    const EcKey& ec_key = static_cast<EcKey&>(key);
+
+    // A key that lists KDFs may only be used with one of them; KM_KDF_NONE must be listed for the
+    // raw secret to be released.
+    keymaster_kdf_t kdf = KM_KDF_NONE;
+    begin_params.GetTagValue(TAG_KDF, &kdf);
+    if (key.authorizations().Contains(KM_TAG_KDF) && !key.authorizations().Contains(TAG_KDF, kdf)) {
+        LOG_E("KDF %d was specified, but not authorized by key", kdf);
+        *error = KM_ERROR_UNSUPPORTED_KDF;
+        return nullptr;
+    }
+
+    keymaster_blob_t salt = {};
+    keymaster_blob_t info = {};
+    uint32_t output_length = 0;
+    begin_params.GetTagValue(TAG_KDF_SALT, &salt);
+    begin_params.GetTagValue(TAG_KDF_INFO, &info);
+    begin_params.GetTagValue(TAG_KDF_OUTPUT_LENGTH, &output_length);
+    if (output_length % 8 != 0) {
+        LOG_E("KDF output length %u is not a whole number of bytes", output_length);
+        *error = KM_ERROR_INVALID_ARGUMENT;
+        return nullptr;
+    }
+
+    size_t field_len_bits;
+    *error = ec_get_group_size(EC_KEY_get0_group(ec_key.key()), &field_len_bits);
+    if (*error != KM_ERROR_OK) return nullptr;
+
+    // NistCurveKeyExchange takes ownership of the EC_KEY, which the Key still holds.
+    if (!EC_KEY_up_ref(ec_key.key())) {
+        *error = TranslateLastOpenSslError();
+        return nullptr;
+    }
+    UniquePtr<NistCurveKeyExchange> key_exchange(new (std::nothrow)
+                                                     NistCurveKeyExchange(ec_key.key(), error));
+    if (!key_exchange.get()) {
+        EC_KEY_free(ec_key.key());
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    if (*error != KM_ERROR_OK) return nullptr;
+
+    UniquePtr<EcdhOperation> op(new (std::nothrow) EcdhOperation(
+        key.hw_enforced_move(), key.sw_enforced_move(), key_exchange.release(),
+        1 + 2 * ((field_len_bits + 7) / 8)));
+    if (!op.get()) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    *error = op->SetKdf(kdf, salt, info, output_length / 8);
+    if (*error != KM_ERROR_OK) return nullptr;
+    return OperationPtr(op.release());
+}
+
+keymaster_error_t EcdhOperation::SetKdf(keymaster_kdf_t kdf, const keymaster_blob_t& salt,
+                                        const keymaster_blob_t& info, size_t output_length) {
+    switch (kdf) {
+    case KM_KDF_NONE:
+        if (salt.data_length || info.data_length || output_length) {
+            LOG_E("KDF parameters given, but no KDF", 0);
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        return KM_ERROR_OK;
+    case KM_KDF_RFC5869_SHA256:
+        if (output_length > kMaxHkdfOutputBytes) {
+            LOG_E("HKDF output length %d bytes exceeds %d", output_length, kMaxHkdfOutputBytes);
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        break;
+    case KM_KDF_ISO18033_2_KDF1_SHA1:
+    case KM_KDF_ISO18033_2_KDF1_SHA256:
+    case KM_KDF_ISO18033_2_KDF2_SHA1:
+    case KM_KDF_ISO18033_2_KDF2_SHA256: {
+        if (salt.data_length) {
+            LOG_E("ISO 18033-2 KDFs take no salt", 0);
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        size_t digest_size = (kdf == KM_KDF_ISO18033_2_KDF1_SHA1 ||
+                              kdf == KM_KDF_ISO18033_2_KDF2_SHA1)
+                                 ? SHA_DIGEST_LENGTH
+                                 : SHA256_DIGEST_LENGTH;
+        if (output_length > kMaxKdfOutputBlocks * digest_size) {
+            LOG_E("KDF output length %d bytes exceeds %d", output_length,
+                  kMaxKdfOutputBlocks * digest_size);
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        break;
+    }
+    default:
+        LOG_E("KDF %d not supported", kdf);
+        return KM_ERROR_UNSUPPORTED_KDF;
+    }
+
+    if (output_length == 0) {
+        LOG_E("KDF %d requires a nonzero output length", kdf);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((salt.data_length && !salt_.Reinitialize(salt.data, salt.data_length)) ||
+        (info.data_length && !info_.Reinitialize(info.data, info.data_length)))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    kdf_ = kdf;
+    output_length_ = output_length;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcdhOperation::Begin(const AuthorizationSet& /* input_params */,
+                                       AuthorizationSet* /* output_params */) {
+    // Peer points have a fixed size, so the buffer is allocated once, here, and never grows.
+    if (!data_.Reinitialize(public_value_len_))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
+                          (size_t)sizeof(operation_handle_));
+}
+
+keymaster_error_t EcdhOperation::Restart(const AuthorizationSet& /* input_params */,
+                                         AuthorizationSet* /* output_params */) {
+    data_.Reset();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcdhOperation::Update(const AuthorizationSet& /* additional_params */,
+                                        const Buffer& input, AuthorizationSet* /* output_params */,
+                                        Buffer* /* output */, size_t* input_consumed) {
+    if (!data_.write(input.peek_read(), input.available_read())) {
+        LOG_E("Input longer than the %d-byte public value", public_value_len_);
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+    *input_consumed = input.available_read();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcdhOperation::Finish(const AuthorizationSet& additional_params,
+                                        const Buffer& input, const Buffer& /* signature */,
+                                        AuthorizationSet* /* output_params */, Buffer* output) {
+    if (!output)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error = UpdateForFinish(additional_params, input);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    // CalculateSharedKey rejects values that aren't uncompressed points on the key's curve.
+    Buffer secret;
+    if (!key_exchange_->CalculateSharedKey(data_, &secret)) {
+        LOG_E("Peer public value is not a point on the key's curve", 0);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (kdf_ == KM_KDF_NONE) {
+        if (!output->Reinitialize(secret))
+            error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    } else {
+        error = DeriveKey(secret, output);
+    }
+    secret.Clear();
+    return error;
+}
+
+keymaster_error_t EcdhOperation::DeriveKey(const Buffer& secret, Buffer* output) const {
+    Rfc5869Sha256Kdf hkdf;
+    Kdf1 kdf1;
+    Kdf2 kdf2;
+    Kdf* kdf;
+    bool initialized;
+    switch (kdf_) {
+    case KM_KDF_RFC5869_SHA256:
+        initialized = hkdf.Init(secret.peek_read(), secret.available_read(), salt_.peek_read(),
+                                salt_.available_read());
+        kdf = &hkdf;
+        break;
+    case KM_KDF_ISO18033_2_KDF1_SHA1:
+        initialized = kdf1.Init(KM_DIGEST_SHA1, secret.peek_read(), secret.available_read());
+        kdf = &kdf1;
+        break;
+    case KM_KDF_ISO18033_2_KDF1_SHA256:
+        initialized = kdf1.Init(KM_DIGEST_SHA_2_256, secret.peek_read(), secret.available_read());
+        kdf = &kdf1;
+        break;
+    case KM_KDF_ISO18033_2_KDF2_SHA1:
+        initialized = kdf2.Init(KM_DIGEST_SHA1, secret.peek_read(), secret.available_read());
+        kdf = &kdf2;
+        break;
+    case KM_KDF_ISO18033_2_KDF2_SHA256:
+        initialized = kdf2.Init(KM_DIGEST_SHA_2_256, secret.peek_read(), secret.available_read());
+        kdf = &kdf2;
+        break;
+    default:
+        return KM_ERROR_UNSUPPORTED_KDF;
+    }
+    if (!initialized)
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    if (!output->Reinitialize(output_length_))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!kdf->GenerateKey(info_.peek_read(), info_.available_read(), output->peek_write(),
+                          output_length_) ||
+        !output->advance_write(output_length_))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -41,11 +41,23 @@ OperationPtr EcdsaOperationFactory::CreateOperation(Key&& key, const Authorizati
     keymaster_digest_t digest;
     if (!GetAndValidateDigest(begin_params, ecdsa_key, &digest, error)) return nullptr;
 
+    bool prehashed = begin_params.GetTagValue(TAG_PREHASHED);
+    if (prehashed && digest == KM_DIGEST_NONE) {
+        LOG_E("Prehashed input requires a digest other than NONE", 0);
+        *error = KM_ERROR_INCOMPATIBLE_DIGEST;
+        return nullptr;
+    }
+
+    UniquePtr<EcdsaOperation> op(InstantiateOperation(key.hw_enforced_move(),
+                                                      key.sw_enforced_move(), digest,
+                                                      pkey.release()));
+    if (!op.get()) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    if (prehashed) op->set_prehashed();
     *error = KM_ERROR_OK;
-    auto op = OperationPtr(InstantiateOperation(key.hw_enforced_move(), key.sw_enforced_move(),
-                                                digest, pkey.release()));
-    if (!op) *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    return op;
+    return OperationPtr(op.release());
 }
 
 const keymaster_digest_t* EcdsaOperationFactory::SupportedDigests(size_t* digest_count) const {
@@ -89,10 +101,17 @@ inline size_t min(size_t a, size_t b) {
     return (a < b) ? a : b;
 }
 
-keymaster_error_t EcdsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
-    if (!data_.reserve((EVP_PKEY_bits(ecdsa_key_) + 7) / 8))
+keymaster_error_t EcdsaOperation::AllocateDataBuffer() {
+    // Only as much of an undigested message as the group order can be signed, and a prehashed
+    // digest has a fixed size, so the buffer is allocated once, here, and never grows.
+    size_t size = prehashed_ ? EVP_MD_size(digest_algorithm_) : (EVP_PKEY_bits(ecdsa_key_) + 7) / 8;
+    if (!data_.Reinitialize(size))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
 
+keymaster_error_t EcdsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
+    // Input beyond the group order size is silently dropped, as ECDSA_sign would truncate it.
     if (!data_.write(input.peek_read(), min(data_.available_write(), input.available_read())))
         return KM_ERROR_UNKNOWN_ERROR;
 
@@ -100,6 +119,26 @@ keymaster_error_t EcdsaOperation::StoreData(const Buffer& input, size_t* input_c
     return KM_ERROR_OK;
 }
 
+keymaster_error_t EcdsaOperation::StorePrehashed(const Buffer& input, size_t* input_consumed) {
+    // Unlike message data for KM_DIGEST_NONE, a digest isn't truncated to the key size here;
+    // ECDSA_sign does that, just as EVP_DigestSign would.  data_ holds exactly one digest, so
+    // the write fails if there's too much input.
+    if (!data_.write(input.peek_read(), input.available_read()))
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+
+    *input_consumed = input.available_read();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcdsaOperation::CheckPrehashedLength() const {
+    if (data_.available_read() != static_cast<size_t>(EVP_MD_size(digest_algorithm_))) {
+        LOG_E("Prehashed input is %u bytes; digest is %d bytes", data_.available_read(),
+              EVP_MD_size(digest_algorithm_));
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t EcdsaSignOperation::Begin(const AuthorizationSet& /* input_params */,
                                             AuthorizationSet* /* output_params */) {
     auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
@@ -110,8 +149,8 @@ keymaster_error_t EcdsaSignOperation::Begin(const AuthorizationSet& /* input_par
     if (error != KM_ERROR_OK)
         return error;
 
-    if (digest_ == KM_DIGEST_NONE)
-        return KM_ERROR_OK;
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
+        return AllocateDataBuffer();
 
     EVP_PKEY_CTX* pkey_ctx;
     if (EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
@@ -126,6 +165,8 @@ keymaster_error_t EcdsaSignOperation::Update(const AuthorizationSet& /* addition
                                              Buffer* /* output */, size_t* input_consumed) {
     if (digest_ == KM_DIGEST_NONE)
         return StoreData(input, input_consumed);
+    if (prehashed_)
+        return StorePrehashed(input, input_consumed);
 
     if (EVP_DigestSignUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
@@ -144,8 +185,15 @@ keymaster_error_t EcdsaSignOperation::Finish(const AuthorizationSet& additional_
     if (error != KM_ERROR_OK)
         return error;
 
+    if (prehashed_) {
+        error = CheckPrehashedLength();
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+
+    // A caller-supplied digest is signed directly, exactly like the input for KM_DIGEST_NONE.
     size_t siglen;
-    if (digest_ == KM_DIGEST_NONE) {
+    if (digest_ == KM_DIGEST_NONE || prehashed_) {
         UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
         if (!ecdsa.get())
             return TranslateLastOpenSslError();
@@ -169,6 +217,10 @@ keymaster_error_t EcdsaSignOperation::Finish(const AuthorizationSet& additional_
     return KM_ERROR_OK;
 }
 
+EcdsaVerifyOperation::~EcdsaVerifyOperation() {
+    EVP_MD_CTX_cleanup(&template_ctx_);
+}
+
 keymaster_error_t EcdsaVerifyOperation::Begin(const AuthorizationSet& /* input_params */,
                                               AuthorizationSet* /* output_params */) {
     auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
@@ -179,12 +231,26 @@ keymaster_error_t EcdsaVerifyOperation::Begin(const AuthorizationSet& /* input_p
     if (error != KM_ERROR_OK)
         return error;
 
-    if (digest_ == KM_DIGEST_NONE)
-        return KM_ERROR_OK;
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
+        return AllocateDataBuffer();
 
     EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                             ecdsa_key_) != 1)
+    if (EVP_DigestVerifyInit(&template_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
+                             ecdsa_key_) != 1 ||
+        !EVP_MD_CTX_copy_ex(&digest_ctx_, &template_ctx_))
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t EcdsaVerifyOperation::Restart(const AuthorizationSet& /* input_params */,
+                                                AuthorizationSet* /* output_params */) {
+    data_.Reset();
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
+        return KM_ERROR_OK;
+
+    if (!EVP_MD_CTX_md(&template_ctx_))
+        return KM_ERROR_UNKNOWN_ERROR;
+    if (!EVP_MD_CTX_copy_ex(&digest_ctx_, &template_ctx_))
         return TranslateLastOpenSslError();
     return KM_ERROR_OK;
 }
@@ -195,6 +261,8 @@ keymaster_error_t EcdsaVerifyOperation::Update(const AuthorizationSet& /* additi
                                                Buffer* /* output */, size_t* input_consumed) {
     if (digest_ == KM_DIGEST_NONE)
         return StoreData(input, input_consumed);
+    if (prehashed_)
+        return StorePrehashed(input, input_consumed);
 
     if (EVP_DigestVerifyUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
@@ -210,7 +278,13 @@ keymaster_error_t EcdsaVerifyOperation::Finish(const AuthorizationSet& additiona
     if (error != KM_ERROR_OK)
         return error;
 
-    if (digest_ == KM_DIGEST_NONE) {
+    if (prehashed_) {
+        error = CheckPrehashedLength();
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+
+    if (digest_ == KM_DIGEST_NONE || prehashed_) {
         UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
         if (!ecdsa.get())
             return TranslateLastOpenSslError();
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/ed25519_key.h>
+
+#include <keymaster/new>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+const size_t Ed25519Key::kSeedSize;
+const size_t Ed25519Key::kPublicKeySize;
+const size_t Ed25519Key::kPrivateKeySize;
+const size_t Ed25519Key::kSignatureSize;
+const uint32_t Ed25519Key::kKeySizeBits;
+
+// RFC 8410 section 7: OneAsymmetricKey { version 0, AlgorithmIdentifier { id-Ed25519 },
+// OCTET STRING { OCTET STRING seed } }.
+static const uint8_t kPkcs8Prefix[] = {0x30, 0x2e, 0x02, 0x01, 0x00, 0x30, 0x05, 0x06,
+                                       0x03, 0x2b, 0x65, 0x70, 0x04, 0x22, 0x04, 0x20};
+
+// RFC 8410 section 4: SubjectPublicKeyInfo { AlgorithmIdentifier { id-Ed25519 },
+// BIT STRING public key }.
+static const uint8_t kSpkiPrefix[] = {0x30, 0x2a, 0x30, 0x05, 0x06, 0x03,
+                                      0x2b, 0x65, 0x70, 0x03, 0x21, 0x00};
+
+Ed25519Key::~Ed25519Key() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
+keymaster_error_t Ed25519Key::formatted_key_material(keymaster_key_format_t format,
+                                                     UniquePtr<uint8_t[]>* material,
+                                                     size_t* size) const {
+    if (format != KM_KEY_FORMAT_X509)
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+
+    if (material == nullptr || size == nullptr)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    material->reset(new (std::nothrow) uint8_t[sizeof(kSpkiPrefix) + kPublicKeySize]);
+    if (material->get() == nullptr)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    memcpy(material->get(), kSpkiPrefix, sizeof(kSpkiPrefix));
+    memcpy(material->get() + sizeof(kSpkiPrefix), public_key_, kPublicKeySize);
+    *size = sizeof(kSpkiPrefix) + kPublicKeySize;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519Key::LoadKeyMaterial() {
+    uint8_t seed[kSeedSize];
+    Eraser seed_eraser(seed, sizeof(seed));
+    keymaster_error_t error = KeyMaterialToSeed(key_material(), seed);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    ED25519_keypair_from_seed(public_key_, private_key_, seed);
+    return KM_ERROR_OK;
+}
+
+/* static */
+keymaster_error_t Ed25519Key::SeedToKeyMaterial(const uint8_t* seed,
+                                                KeymasterKeyBlob* key_material) {
+    if (!key_material->Reset(sizeof(kPkcs8Prefix) + kSeedSize))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    memcpy(key_material->writable_data(), kPkcs8Prefix, sizeof(kPkcs8Prefix));
+    memcpy(key_material->writable_data() + sizeof(kPkcs8Prefix), seed, kSeedSize);
+    return KM_ERROR_OK;
+}
+
+/* static */
+keymaster_error_t Ed25519Key::KeyMaterialToSeed(const KeymasterKeyBlob& key_material,
+                                                uint8_t* seed) {
+    if (key_material.key_material_size != sizeof(kPkcs8Prefix) + kSeedSize ||
+        memcmp(key_material.key_material, kPkcs8Prefix, sizeof(kPkcs8Prefix)) != 0)
+        return KM_ERROR_INVALID_KEY_BLOB;
+
+    memcpy(seed, key_material.key_material + sizeof(kPkcs8Prefix), kSeedSize);
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
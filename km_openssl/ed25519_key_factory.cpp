@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/ed25519_key_factory.h>
+
+#include <keymaster/new>
+
+#include <keymaster/km_openssl/ed25519_key.h>
+#include <keymaster/km_openssl/ed25519_operation.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+static Ed25519SignOperationFactory sign_factory;
+static Ed25519VerifyOperationFactory verify_factory;
+
+OperationFactory* Ed25519KeyFactory::GetOperationFactory(keymaster_purpose_t purpose) const {
+    switch (purpose) {
+    case KM_PURPOSE_SIGN:
+        return &sign_factory;
+    case KM_PURPOSE_VERIFY:
+        return &verify_factory;
+    default:
+        return nullptr;
+    }
+}
+
+static const keymaster_key_format_t supported_import_formats[] = {KM_KEY_FORMAT_PKCS8,
+                                                                  KM_KEY_FORMAT_RAW};
+const keymaster_key_format_t*
+Ed25519KeyFactory::SupportedImportFormats(size_t* format_count) const {
+    *format_count = array_length(supported_import_formats);
+    return supported_import_formats;
+}
+
+keymaster_error_t Ed25519KeyFactory::GenerateKey(const AuthorizationSet& key_description,
+                                                 KeymasterKeyBlob* key_blob,
+                                                 AuthorizationSet* hw_enforced,
+                                                 AuthorizationSet* sw_enforced) const {
+    if (!key_blob || !hw_enforced || !sw_enforced)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    AuthorizationSet authorizations(key_description);
+
+    uint32_t key_size;
+    if (!authorizations.GetTagValue(TAG_KEY_SIZE, &key_size)) {
+        authorizations.push_back(TAG_KEY_SIZE, Ed25519Key::kKeySizeBits);
+    } else if (key_size != Ed25519Key::kKeySizeBits) {
+        LOG_E("Ed25519 keys are %u bits, not %u", Ed25519Key::kKeySizeBits, key_size);
+        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+    }
+
+    uint8_t public_key[Ed25519Key::kPublicKeySize];
+    uint8_t private_key[Ed25519Key::kPrivateKeySize];
+    Eraser private_key_eraser(private_key);
+    ED25519_keypair(public_key, private_key);
+
+    // The private key starts with the seed it was derived from, which is all that's stored.
+    KeymasterKeyBlob key_material;
+    keymaster_error_t error = Ed25519Key::SeedToKeyMaterial(private_key, &key_material);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    return blob_maker_.CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED, key_material, key_blob,
+                                     hw_enforced, sw_enforced);
+}
+
+keymaster_error_t Ed25519KeyFactory::ImportKey(const AuthorizationSet& key_description,
+                                               keymaster_key_format_t input_key_material_format,
+                                               const KeymasterKeyBlob& input_key_material,
+                                               KeymasterKeyBlob* output_key_blob,
+                                               AuthorizationSet* hw_enforced,
+                                               AuthorizationSet* sw_enforced) const {
+    if (!output_key_blob || !hw_enforced || !sw_enforced)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    KeymasterKeyBlob key_material;
+    keymaster_error_t error;
+    switch (input_key_material_format) {
+    case KM_KEY_FORMAT_PKCS8: {
+        uint8_t seed[Ed25519Key::kSeedSize];
+        Eraser seed_eraser(seed);
+        error = Ed25519Key::KeyMaterialToSeed(input_key_material, seed);
+        if (error != KM_ERROR_OK)
+            return KM_ERROR_INVALID_KEY_BLOB;
+        key_material = input_key_material;
+        break;
+    }
+    case KM_KEY_FORMAT_RAW:
+        if (input_key_material.key_material_size != Ed25519Key::kSeedSize)
+            return KM_ERROR_INVALID_KEY_BLOB;
+        error = Ed25519Key::SeedToKeyMaterial(input_key_material.key_material, &key_material);
+        if (error != KM_ERROR_OK)
+            return error;
+        break;
+    default:
+        return KM_ERROR_UNSUPPORTED_KEY_FORMAT;
+    }
+    if (!key_material.key_material)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    AuthorizationSet authorizations(key_description);
+
+    uint32_t key_size;
+    if (!authorizations.GetTagValue(TAG_KEY_SIZE, &key_size))
+        authorizations.push_back(TAG_KEY_SIZE, Ed25519Key::kKeySizeBits);
+    else if (key_size != Ed25519Key::kKeySizeBits)
+        return KM_ERROR_IMPORT_PARAMETER_MISMATCH;
+
+    keymaster_algorithm_t algorithm;
+    if (!authorizations.GetTagValue(TAG_ALGORITHM, &algorithm))
+        authorizations.push_back(TAG_ALGORITHM, KM_ALGORITHM_ED25519);
+    else if (algorithm != KM_ALGORITHM_ED25519)
+        return KM_ERROR_IMPORT_PARAMETER_MISMATCH;
+
+    return blob_maker_.CreateKeyBlob(authorizations, KM_ORIGIN_IMPORTED, key_material,
+                                     output_key_blob, hw_enforced, sw_enforced);
+}
+
+keymaster_error_t Ed25519KeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
+                                             const AuthorizationSet& /* additional_params */,
+                                             AuthorizationSet&& hw_enforced,
+                                             AuthorizationSet&& sw_enforced,
+                                             UniquePtr<Key>* key) const {
+    UniquePtr<Ed25519Key> ed25519_key(
+        new (std::nothrow) Ed25519Key(move(hw_enforced), move(sw_enforced), this));
+    if (!ed25519_key.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    ed25519_key->key_material() = move(key_material);
+    keymaster_error_t error = ed25519_key->LoadKeyMaterial();
+    if (error != KM_ERROR_OK)
+        return error;
+
+    key->reset(ed25519_key.release());
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519KeyFactory::CreateEmptyKey(AuthorizationSet&& hw_enforced,
+                                                    AuthorizationSet&& sw_enforced,
+                                                    UniquePtr<AsymmetricKey>* key) const {
+    key->reset(new (std::nothrow) Ed25519Key(move(hw_enforced), move(sw_enforced), this));
+    if (!(*key)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
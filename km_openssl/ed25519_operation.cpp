@@ -0,0 +1,140 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/ed25519_operation.h>
+
+#include <keymaster/km_openssl/openssl_err.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+static const keymaster_digest_t supported_digests[] = {KM_DIGEST_NONE};
+
+const size_t Ed25519Operation::kMaxMessageSize;
+
+OperationPtr Ed25519OperationFactory::CreateOperation(Key&& key,
+                                                      const AuthorizationSet& begin_params,
+                                                      keymaster_error_t* error) const {
+    keymaster_digest_t digest;
+    if (begin_params.GetTagValue(TAG_DIGEST, &digest) && digest != KM_DIGEST_NONE) {
+        LOG_E("Digest %d specified for Ed25519, which signs messages directly", digest);
+        *error = KM_ERROR_UNSUPPORTED_DIGEST;
+        return nullptr;
+    }
+
+    const Ed25519Key& ed25519_key = static_cast<Ed25519Key&>(key);
+    *error = KM_ERROR_OK;
+    auto op = OperationPtr(
+        InstantiateOperation(key.hw_enforced_move(), key.sw_enforced_move(), ed25519_key));
+    if (!op) *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return op;
+}
+
+const keymaster_digest_t* Ed25519OperationFactory::SupportedDigests(size_t* digest_count) const {
+    *digest_count = array_length(supported_digests);
+    return supported_digests;
+}
+
+keymaster_error_t Ed25519Operation::Begin(const AuthorizationSet& /* input_params */,
+                                          AuthorizationSet* /* output_params */) {
+    return GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
+                          (size_t)sizeof(operation_handle_));
+}
+
+keymaster_error_t Ed25519Operation::Update(const AuthorizationSet& /* additional_params */,
+                                           const Buffer& input,
+                                           AuthorizationSet* /* output_params */,
+                                           Buffer* /* output */, size_t* input_consumed) {
+    size_t length = input.available_read();
+    if (length > kMaxMessageSize - data_.available_read()) {
+        LOG_E("Ed25519 message exceeds %d bytes", kMaxMessageSize);
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+
+    // Grow geometrically, so that many small updates don't copy the message each time.
+    if (data_.available_write() < length &&
+        !data_.reserve(length > data_.available_read() ? length : data_.available_read()))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (!data_.write(input.peek_read(), length))
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    *input_consumed = length;
+    return KM_ERROR_OK;
+}
+
+Ed25519SignOperation::Ed25519SignOperation(AuthorizationSet&& hw_enforced,
+                                           AuthorizationSet&& sw_enforced, const Ed25519Key& key)
+    : Ed25519Operation(KM_PURPOSE_SIGN, move(hw_enforced), move(sw_enforced)) {
+    memcpy(private_key_, key.private_key(), sizeof(private_key_));
+}
+
+Ed25519SignOperation::~Ed25519SignOperation() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
+keymaster_error_t Ed25519SignOperation::Finish(const AuthorizationSet& additional_params,
+                                               const Buffer& input,
+                                               const Buffer& /* signature */,
+                                               AuthorizationSet* /* output_params */,
+                                               Buffer* output) {
+    if (!output)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    keymaster_error_t error = UpdateForFinish(additional_params, input);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (!output->Reinitialize(Ed25519Key::kSignatureSize))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!ED25519_sign(output->peek_write(), data_.peek_read(), data_.available_read(),
+                      private_key_))
+        return TranslateLastOpenSslError();
+    if (!output->advance_write(Ed25519Key::kSignatureSize))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+Ed25519VerifyOperation::Ed25519VerifyOperation(AuthorizationSet&& hw_enforced,
+                                               AuthorizationSet&& sw_enforced,
+                                               const Ed25519Key& key)
+    : Ed25519Operation(KM_PURPOSE_VERIFY, move(hw_enforced), move(sw_enforced)) {
+    memcpy(public_key_, key.public_key(), sizeof(public_key_));
+}
+
+keymaster_error_t Ed25519VerifyOperation::Restart(const AuthorizationSet& /* input_params */,
+                                                  AuthorizationSet* /* output_params */) {
+    data_.Clear();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519VerifyOperation::Finish(const AuthorizationSet& additional_params,
+                                                 const Buffer& input, const Buffer& signature,
+                                                 AuthorizationSet* /* output_params */,
+                                                 Buffer* /* output */) {
+    keymaster_error_t error = UpdateForFinish(additional_params, input);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (signature.available_read() != Ed25519Key::kSignatureSize ||
+        !ED25519_verify(data_.peek_read(), data_.available_read(), signature.peek_read(),
+                        public_key_))
+        return KM_ERROR_VERIFICATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/hmac_context_cache.h>
+
+#include <keymaster/new>
+
+namespace keymaster {
+
+HmacContextCache::HmacContextCache(size_t capacity)
+    : entries_(new (std::nothrow) Entry[capacity]), capacity_(entries_.get() ? capacity : 0),
+      clock_(0) {
+    for (size_t i = 0; i < capacity_; ++i) {
+        entries_[i].in_use = false;
+        HMAC_CTX_init(&entries_[i].ctx);
+    }
+}
+
+HmacContextCache::~HmacContextCache() {
+    Clear();
+}
+
+void HmacContextCache::Evict(Entry* entry) {
+    // HMAC_CTX_cleanup frees the digest states, which hold the key-dependent pad blocks, and
+    // wipes the context itself.
+    HMAC_CTX_cleanup(&entry->ctx);
+    HMAC_CTX_init(&entry->ctx);
+    entry->key.Clear();
+    entry->in_use = false;
+}
+
+void HmacContextCache::Clear() {
+    for (size_t i = 0; i < capacity_; ++i)
+        if (entries_[i].in_use) Evict(&entries_[i]);
+}
+
+size_t HmacContextCache::size() const {
+    size_t count = 0;
+    for (size_t i = 0; i < capacity_; ++i)
+        if (entries_[i].in_use) ++count;
+    return count;
+}
+
+bool HmacContextCache::Lookup(km_id_t key_id, const KeymasterKeyBlob& key,
+                              keymaster_digest_t digest, HMAC_CTX* ctx) {
+    for (size_t i = 0; i < capacity_; ++i) {
+        Entry& entry = entries_[i];
+        if (!entry.in_use || entry.key_id != key_id || entry.digest != digest ||
+            entry.key.key_material_size != key.key_material_size ||
+            memcmp_s(entry.key.key_material, key.key_material, key.key_material_size) != 0)
+            continue;
+
+        if (!HMAC_CTX_copy_ex(ctx, &entry.ctx)) return false;
+        entry.last_used = ++clock_;
+        return true;
+    }
+    return false;
+}
+
+void HmacContextCache::Insert(km_id_t key_id, const KeymasterKeyBlob& key,
+                              keymaster_digest_t digest, const HMAC_CTX& ctx) {
+    if (capacity_ == 0) return;
+
+    Entry* victim = &entries_[0];
+    for (size_t i = 0; i < capacity_; ++i) {
+        Entry& entry = entries_[i];
+        if (!entry.in_use) {
+            victim = &entry;
+            break;
+        }
+        if (entry.last_used < victim->last_used) victim = &entry;
+    }
+    if (victim->in_use) Evict(victim);
+
+    victim->key = KeymasterKeyBlob(key.key_material, key.key_material_size);
+    if (!victim->key.key_material || !HMAC_CTX_copy_ex(&victim->ctx, &ctx)) {
+        Evict(victim);
+        return;
+    }
+    victim->key_id = key_id;
+    victim->digest = digest;
+    victim->last_used = ++clock_;
+    victim->in_use = true;
+}
+
+}  // namespace keymaster
@@ -39,6 +39,11 @@ OperationFactory* HmacKeyFactory::GetOperationFactory(keymaster_purpose_t purpos
     }
 }
 
+void HmacKeyFactory::set_context_cache(HmacContextCache* cache) {
+    sign_factory.set_context_cache(cache);
+    verify_factory.set_context_cache(cache);
+}
+
 keymaster_error_t HmacKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
                                           const AuthorizationSet& /* additional_params */,
                                           AuthorizationSet&& hw_enforced,
@@ -21,6 +21,7 @@
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 
+#include <keymaster/km_openssl/hmac_context_cache.h>
 #include <keymaster/km_openssl/hmac_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
@@ -66,7 +67,8 @@ OperationPtr HmacOperationFactory::CreateOperation(Key&& key, const Authorizatio
     }
 
     UniquePtr<HmacOperation> op(new (std::nothrow) HmacOperation(
-        move(key), purpose(), digest, mac_length_bits / 8, min_mac_length_bits / 8));
+        move(key), purpose(), digest, mac_length_bits / 8, min_mac_length_bits / 8,
+        context_cache_));
     if (!op.get())
         *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
     else
@@ -86,8 +88,10 @@ const keymaster_digest_t* HmacOperationFactory::SupportedDigests(size_t* digest_
 }
 
 HmacOperation::HmacOperation(Key&& key, keymaster_purpose_t purpose, keymaster_digest_t digest,
-                             size_t mac_length, size_t min_mac_length)
-    : Operation(purpose, key.hw_enforced_move(), key.sw_enforced_move()), error_(KM_ERROR_OK),
+                             size_t mac_length, size_t min_mac_length,
+                             HmacContextCache* context_cache)
+    : Operation(purpose, key.hw_enforced_move(), key.sw_enforced_move()), context_keyed_(false),
+      error_(KM_ERROR_OK), digest_(digest), md_(nullptr), context_cache_(context_cache),
       mac_length_(mac_length), min_mac_length_(min_mac_length) {
     // Initialize CTX first, so dtor won't crash even if we error out later.
     HMAC_CTX_init(&ctx_);
@@ -131,8 +135,8 @@ HmacOperation::HmacOperation(Key&& key, keymaster_purpose_t purpose, keymaster_d
         }
     }
 
-    KeymasterKeyBlob blob = key.key_material_move();
-    HMAC_Init_ex(&ctx_, blob.key_material, blob.key_material_size, md, nullptr /* engine */);
+    md_ = md;
+    key_ = key.key_material_move();
 }
 
 HmacOperation::~HmacOperation() {
@@ -144,13 +148,32 @@ keymaster_error_t HmacOperation::Begin(const AuthorizationSet& /* input_params *
     auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
                              (size_t)sizeof(operation_handle_));
     if (rc != KM_ERROR_OK) return rc;
-
     return error_;
 }
 
+// Keying is deferred from Begin to first use, so that AndroidKeymaster::BatchComputeMacs() can
+// authorize an HMAC-SHA256 operation and then compute its MAC in a SIMD lane without keying ctx_.
+keymaster_error_t HmacOperation::KeyContext() {
+    if (context_keyed_) return KM_ERROR_OK;
+
+    // The key is absorbed into the inner and outer digests up front, so a context initialized with
+    // the same key and digest can be copied instead.
+    if (!context_cache_ || !context_cache_->Lookup(key_id(), key_, digest_, &ctx_)) {
+        if (!HMAC_Init_ex(&ctx_, key_.key_material, key_.key_material_size, md_,
+                          nullptr /* engine */))
+            return TranslateLastOpenSslError();
+        if (context_cache_) context_cache_->Insert(key_id(), key_, digest_, ctx_);
+    }
+    key_.Clear();
+    context_keyed_ = true;
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t HmacOperation::Update(const AuthorizationSet& /* additional_params */,
                                         const Buffer& input, AuthorizationSet* /* output_params */,
                                         Buffer* /* output */, size_t* input_consumed) {
+    keymaster_error_t error = KeyContext();
+    if (error != KM_ERROR_OK) return error;
     if (!HMAC_Update(&ctx_, input.peek_read(), input.available_read()))
         return TranslateLastOpenSslError();
     *input_consumed = input.available_read();
@@ -164,7 +187,9 @@ keymaster_error_t HmacOperation::Abort() {
 keymaster_error_t HmacOperation::Finish(const AuthorizationSet& additional_params,
                                         const Buffer& input, const Buffer& signature,
                                         AuthorizationSet* /* output_params */, Buffer* output) {
-    keymaster_error_t error = UpdateForFinish(additional_params, input);
+    keymaster_error_t error = KeyContext();
+    if (error != KM_ERROR_OK) return error;
+    error = UpdateForFinish(additional_params, input);
     if (error != KM_ERROR_OK) return error;
 
     uint8_t digest[EVP_MAX_MD_SIZE];
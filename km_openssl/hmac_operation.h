@@ -22,10 +22,13 @@
 
 namespace keymaster {
 
+class HmacContextCache;
+
 class HmacOperation : public Operation {
   public:
     HmacOperation(Key&& key, keymaster_purpose_t purpose, keymaster_digest_t digest,
-                  size_t mac_length, size_t min_mac_length);
+                  size_t mac_length, size_t min_mac_length,
+                  HmacContextCache* context_cache = nullptr);
     ~HmacOperation();
 
     virtual keymaster_error_t Begin(const AuthorizationSet& input_params,
@@ -41,8 +44,16 @@ class HmacOperation : public Operation {
     keymaster_error_t error() { return error_; }
 
   private:
+    keymaster_error_t KeyContext();
+
     HMAC_CTX ctx_;
+    bool context_keyed_;
     keymaster_error_t error_;
+    const keymaster_digest_t digest_;
+    const EVP_MD* md_;
+    // Held from construction until the first Update or Finish keys ctx_.
+    KeymasterKeyBlob key_;
+    HmacContextCache* context_cache_;
     const size_t mac_length_;
     const size_t min_mac_length_;
 };
@@ -61,6 +72,11 @@ class HmacOperationFactory : public OperationFactory {
     virtual const keymaster_digest_t* SupportedDigests(size_t* digest_count) const;
 
     virtual keymaster_purpose_t purpose() const = 0;
+
+    void set_context_cache(HmacContextCache* cache) { context_cache_ = cache; }
+
+  private:
+    HmacContextCache* context_cache_ = nullptr;
 };
 
 class HmacSignOperationFactory : public HmacOperationFactory {
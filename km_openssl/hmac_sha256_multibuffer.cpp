@@ -0,0 +1,266 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/hmac_sha256_multibuffer.h>
+
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+namespace {
+
+// One 32-bit word from each lane.  GCC and clang lower arithmetic on these to whatever vector
+// instructions the target has, so the same code runs eight lanes on AVX2 and four on SSE2 or NEON.
+#if defined(__AVX2__)
+typedef uint32_t Lanes __attribute__((vector_size(32)));
+#else
+typedef uint32_t Lanes __attribute__((vector_size(16)));
+#endif
+
+const size_t kLaneCount = sizeof(Lanes) / sizeof(uint32_t);
+const size_t kBlockSize = 64;
+const size_t kLengthSize = 8;
+
+// Past this, the fixed cost of HMAC no longer dominates, and a hardware SHA-256 (SHA-NI, ARMv8
+// SHA2), which BoringSSL uses where present, hashes a message about as fast as a lane does.
+const size_t kMaxLaneMessageSize = 512;
+
+const uint32_t kInitialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Macros rather than functions, so that no vector is ever passed by value (which, for 32-byte
+// vectors, has a different ABI depending on whether AVX is enabled).
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define BIG_SIGMA0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BIG_SIGMA1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SMALL_SIGMA0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SMALL_SIGMA1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+// The SHA-256 compression function, applied to every lane of |state| with the block in |w|.
+void Compress(Lanes* state, Lanes* w) {
+    Lanes a = state[0], b = state[1], c = state[2], d = state[3];
+    Lanes e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t t = 0; t < 64; ++t) {
+        if (t >= 16)
+            w[t & 15] += SMALL_SIGMA1(w[(t - 2) & 15]) + w[(t - 7) & 15] +
+                         SMALL_SIGMA0(w[(t - 15) & 15]);
+        Lanes t1 = h + BIG_SIGMA1(e) + CH(e, f, g) + kRoundConstants[t] + w[t & 15];
+        Lanes t2 = BIG_SIGMA0(a) + MAJ(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+#undef ROTR
+#undef BIG_SIGMA0
+#undef BIG_SIGMA1
+#undef SMALL_SIGMA0
+#undef SMALL_SIGMA1
+#undef CH
+#undef MAJ
+
+// Number of blocks SHA-256 padding turns |length| bytes into.
+size_t PaddedBlocks(size_t length) {
+    return (length + 1 + kLengthSize + kBlockSize - 1) / kBlockSize;
+}
+
+// Copies the block at |offset| of the padded form of |data|, whose hash also covers |prefix_length|
+// bytes before it.
+void PaddedBlock(const uint8_t* data, size_t length, size_t prefix_length, size_t offset,
+                 uint8_t* block) {
+    if (offset + kBlockSize <= length) {
+        memcpy(block, data + offset, kBlockSize);
+        return;
+    }
+
+    memset(block, 0, kBlockSize);
+    if (offset <= length) {
+        memcpy(block, data + offset, length - offset);
+        block[length - offset] = 0x80;
+    }
+    if (offset + kBlockSize >= length + 1 + kLengthSize) {
+        uint64_t bits = (static_cast<uint64_t>(prefix_length) + length) * 8;
+        for (size_t i = 0; i < kLengthSize; ++i)
+            block[kBlockSize - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+}
+
+// Progress of the job in one lane.  Each job hashes twice: the inner hash of (K ^ ipad) || message,
+// then the outer hash of (K ^ opad) || inner digest.  Block 0 of each is the padded key.
+struct LaneJob {
+    HmacSha256Job* job;
+    bool outer;
+    size_t block;
+    uint8_t key_block[kBlockSize];
+    uint8_t inner_digest[kHmacSha256Size];
+
+    const uint8_t* data() const { return outer ? inner_digest : job->message; }
+    size_t length() const { return outer ? sizeof(inner_digest) : job->message_length; }
+    size_t blocks() const { return 1 + PaddedBlocks(length()); }
+
+    void Start(HmacSha256Job* next) {
+        job = next;
+        outer = false;
+        block = 0;
+        memset(key_block, 0, sizeof(key_block));
+        if (job->key_length > kBlockSize)
+            SHA256(job->key, job->key_length, key_block);
+        else
+            memcpy(key_block, job->key, job->key_length);
+    }
+
+    void NextBlock(uint8_t* out) const {
+        if (block == 0) {
+            uint8_t pad = outer ? 0x5c : 0x36;
+            for (size_t i = 0; i < kBlockSize; ++i)
+                out[i] = key_block[i] ^ pad;
+        } else {
+            PaddedBlock(data(), length(), kBlockSize, (block - 1) * kBlockSize, out);
+        }
+    }
+};
+
+bool UsesLane(const HmacSha256Job& job) {
+    return job.message_length <= kMaxLaneMessageSize;
+}
+
+// Returns the first job at or after |*next| that goes in a lane, advancing |*next| past it.
+HmacSha256Job* NextLaneJob(HmacSha256Job* jobs, size_t job_count, size_t* next) {
+    while (*next < job_count) {
+        HmacSha256Job* job = &jobs[(*next)++];
+        if (UsesLane(*job)) return job;
+    }
+    return nullptr;
+}
+
+}  // anonymous namespace
+
+size_t HmacSha256Lanes() {
+    return kLaneCount;
+}
+
+void ComputeHmacSha256s(HmacSha256Job* jobs, size_t job_count) {
+    // Long messages, and a lone short one that would leave all but one lane idle, are faster with
+    // plain HMAC.
+    size_t lane_job_count = 0;
+    for (size_t i = 0; i < job_count; ++i)
+        if (UsesLane(jobs[i])) ++lane_job_count;
+    for (size_t i = 0; i < job_count; ++i) {
+        if (UsesLane(jobs[i]) && lane_job_count > 1) continue;
+        unsigned int mac_length;
+        HMAC(EVP_sha256(), jobs[i].key, jobs[i].key_length, jobs[i].message,
+             jobs[i].message_length, jobs[i].mac, &mac_length);
+    }
+    if (lane_job_count < 2) return;
+
+    LaneJob lanes[kLaneCount];
+    Lanes state[8] = {};
+    Lanes w[16] = {};
+    uint8_t block[kBlockSize];
+
+    size_t next_job = 0;
+    size_t active = 0;
+    for (size_t lane = 0; lane < kLaneCount; ++lane) {
+        lanes[lane].job = NextLaneJob(jobs, job_count, &next_job);
+        if (lanes[lane].job) {
+            lanes[lane].Start(lanes[lane].job);
+            ++active;
+        }
+    }
+
+    while (active > 0) {
+        // Gather the next block of every lane, transposed so that w[i] holds word i of each.  Idle
+        // lanes compress whatever is left in them; their results are never read.
+        for (size_t lane = 0; lane < kLaneCount; ++lane) {
+            LaneJob& lane_job = lanes[lane];
+            if (!lane_job.job) continue;
+            if (lane_job.block == 0)
+                for (size_t i = 0; i < 8; ++i)
+                    state[i][lane] = kInitialState[i];
+            lane_job.NextBlock(block);
+            for (size_t i = 0; i < 16; ++i)
+                w[i][lane] = static_cast<uint32_t>(block[4 * i]) << 24 |
+                             static_cast<uint32_t>(block[4 * i + 1]) << 16 |
+                             static_cast<uint32_t>(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        }
+
+        Compress(state, w);
+
+        for (size_t lane = 0; lane < kLaneCount; ++lane) {
+            LaneJob& lane_job = lanes[lane];
+            if (!lane_job.job || ++lane_job.block < lane_job.blocks()) continue;
+
+            uint8_t* digest = lane_job.outer ? lane_job.job->mac : lane_job.inner_digest;
+            for (size_t i = 0; i < 8; ++i) {
+                uint32_t word = state[i][lane];
+                digest[4 * i] = static_cast<uint8_t>(word >> 24);
+                digest[4 * i + 1] = static_cast<uint8_t>(word >> 16);
+                digest[4 * i + 2] = static_cast<uint8_t>(word >> 8);
+                digest[4 * i + 3] = static_cast<uint8_t>(word);
+            }
+            if (!lane_job.outer) {
+                lane_job.outer = true;
+                lane_job.block = 0;
+            } else if (HmacSha256Job* next = NextLaneJob(jobs, job_count, &next_job)) {
+                lane_job.Start(next);
+            } else {
+                lane_job.job = nullptr;
+                --active;
+            }
+        }
+    }
+
+    // Scrub key-derived material.
+    memset_s(lanes, 0, sizeof(lanes));
+    memset_s(state, 0, sizeof(state));
+    memset_s(w, 0, sizeof(w));
+    memset_s(block, 0, sizeof(block));
+}
+
+}  // namespace keymaster
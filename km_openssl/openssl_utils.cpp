@@ -43,23 +43,40 @@ keymaster_error_t ec_get_group_size(const EC_GROUP* group, size_t* key_size_bits
     return KM_ERROR_OK;
 }
 
-EC_GROUP* ec_get_group(keymaster_ec_curve_t curve) {
+static EC_GROUP* NewSharedGroup(int nid) {
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(nid);
+#if !defined(OPENSSL_IS_BORINGSSL)
+    // BoringSSL's built-in groups come with their generator tables, but OpenSSL's must be built.
+    if (group) {
+        EC_GROUP_set_point_conversion_form(group, POINT_CONVERSION_UNCOMPRESSED);
+        EC_GROUP_set_asn1_flag(group, OPENSSL_EC_NAMED_CURVE);
+        EC_GROUP_precompute_mult(group, nullptr /* ctx */);
+    }
+#endif
+    return group;
+}
+
+const EC_GROUP* ec_get_group(keymaster_ec_curve_t curve) {
+    // Each group is created on first use and deliberately never freed.
     switch (curve) {
-    case KM_EC_CURVE_P_224:
-        return EC_GROUP_new_by_curve_name(NID_secp224r1);
-        break;
-    case KM_EC_CURVE_P_256:
-        return EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-        break;
-    case KM_EC_CURVE_P_384:
-        return EC_GROUP_new_by_curve_name(NID_secp384r1);
-        break;
-    case KM_EC_CURVE_P_521:
-        return EC_GROUP_new_by_curve_name(NID_secp521r1);
-        break;
+    case KM_EC_CURVE_P_224: {
+        static const EC_GROUP* p224 = NewSharedGroup(NID_secp224r1);
+        return p224;
+    }
+    case KM_EC_CURVE_P_256: {
+        static const EC_GROUP* p256 = NewSharedGroup(NID_X9_62_prime256v1);
+        return p256;
+    }
+    case KM_EC_CURVE_P_384: {
+        static const EC_GROUP* p384 = NewSharedGroup(NID_secp384r1);
+        return p384;
+    }
+    case KM_EC_CURVE_P_521: {
+        static const EC_GROUP* p521 = NewSharedGroup(NID_secp521r1);
+        return p521;
+    }
     default:
         return nullptr;
-        break;
     }
 }
 
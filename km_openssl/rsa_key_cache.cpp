@@ -0,0 +1,94 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/rsa_key_cache.h>
+
+#include <keymaster/new>
+
+namespace keymaster {
+
+RsaKeyCache::RsaKeyCache(size_t capacity)
+    : entries_(new (std::nothrow) Entry[capacity]), capacity_(entries_.get() ? capacity : 0),
+      clock_(0) {
+    for (size_t i = 0; i < capacity_; ++i) {
+        entries_[i].rsa = nullptr;
+        entries_[i].last_used = 0;
+    }
+}
+
+RsaKeyCache::~RsaKeyCache() {
+    Clear();
+}
+
+void RsaKeyCache::Evict(Entry* entry) {
+    // Operations may still hold references; RSA_free only drops the cache's.
+    RSA_free(entry->rsa);
+    entry->rsa = nullptr;
+    entry->key_material.Clear();
+}
+
+void RsaKeyCache::Clear() {
+    for (size_t i = 0; i < capacity_; ++i)
+        if (entries_[i].rsa) Evict(&entries_[i]);
+}
+
+size_t RsaKeyCache::size() const {
+    size_t count = 0;
+    for (size_t i = 0; i < capacity_; ++i)
+        if (entries_[i].rsa) ++count;
+    return count;
+}
+
+RSA* RsaKeyCache::Lookup(const KeymasterKeyBlob& key_material) {
+    for (size_t i = 0; i < capacity_; ++i) {
+        Entry& entry = entries_[i];
+        if (!entry.rsa || entry.key_material.key_material_size != key_material.key_material_size ||
+            memcmp_s(entry.key_material.key_material, key_material.key_material,
+                     key_material.key_material_size) != 0)
+            continue;
+
+        if (!RSA_up_ref(entry.rsa)) return nullptr;
+        entry.last_used = ++clock_;
+        return entry.rsa;
+    }
+    return nullptr;
+}
+
+void RsaKeyCache::Insert(const KeymasterKeyBlob& key_material, RSA* rsa) {
+    if (capacity_ == 0 || !rsa) return;
+
+    Entry* victim = &entries_[0];
+    for (size_t i = 0; i < capacity_; ++i) {
+        Entry& entry = entries_[i];
+        if (!entry.rsa) {
+            victim = &entry;
+            break;
+        }
+        if (entry.last_used < victim->last_used) victim = &entry;
+    }
+    if (victim->rsa) Evict(victim);
+
+    victim->key_material =
+        KeymasterKeyBlob(key_material.key_material, key_material.key_material_size);
+    if (!victim->key_material.key_material || !RSA_up_ref(rsa)) {
+        victim->key_material.Clear();
+        return;
+    }
+    victim->rsa = rsa;
+    victim->last_used = ++clock_;
+}
+
+}  // namespace keymaster
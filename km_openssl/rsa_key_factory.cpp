@@ -20,6 +20,8 @@
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/km_openssl/rsa_key.h>
+#include <keymaster/km_openssl/rsa_key_cache.h>
+#include <keymaster/km_openssl/rsa_key_pool.h>
 #include <keymaster/km_openssl/rsa_operation.h>
 #include <keymaster/new>
 
@@ -29,6 +31,9 @@ const int kMaximumRsaKeySize = 4096;  // OpenSSL fails above 4096.
 const int kMinimumRsaKeySize = 16;    // OpenSSL goes into an infinite loop if key size < 10
 const int kMinimumRsaExponent = 3;
 
+static RsaKeyCache* key_cache = nullptr;
+static RsaKeyPool* key_pool = nullptr;
+
 static RsaSigningOperationFactory sign_factory;
 static RsaVerificationOperationFactory verify_factory;
 static RsaEncryptionOperationFactory encrypt_factory;
@@ -49,6 +54,54 @@ OperationFactory* RsaKeyFactory::GetOperationFactory(keymaster_purpose_t purpose
     }
 }
 
+void RsaKeyFactory::set_key_cache(RsaKeyCache* cache) {
+    key_cache = cache;
+}
+
+void RsaKeyFactory::set_key_pool(RsaKeyPool* pool) {
+    key_pool = pool;
+}
+
+keymaster_error_t RsaKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
+                                         const AuthorizationSet& additional_params,
+                                         AuthorizationSet&& hw_enforced,
+                                         AuthorizationSet&& sw_enforced,
+                                         UniquePtr<Key>* key) const {
+    if (!key)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+    if (!key_cache)
+        return AsymmetricKeyFactory::LoadKey(move(key_material), additional_params,
+                                             move(hw_enforced), move(sw_enforced), key);
+
+    UniquePtr<RSA, RsaKey::RSA_Delete> cached_rsa(key_cache->Lookup(key_material));
+    if (!cached_rsa.get()) {
+        keymaster_error_t error = AsymmetricKeyFactory::LoadKey(
+            move(key_material), additional_params, move(hw_enforced), move(sw_enforced), key);
+        if (error == KM_ERROR_OK) {
+            const RsaKey& rsa_key = static_cast<const RsaKey&>(**key);
+            key_cache->Insert(rsa_key.key_material(), rsa_key.key());
+        }
+        return error;
+    }
+
+    // Share the cached RSA object, and with it any Montgomery and blinding state from earlier
+    // operations, rather than decoding the key material again.
+    UniquePtr<AsymmetricKey> asym_key;
+    keymaster_error_t error = CreateEmptyKey(move(hw_enforced), move(sw_enforced), &asym_key);
+    if (error != KM_ERROR_OK)
+        return error;
+    asym_key->key_material() = move(key_material);
+
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
+    if (!pkey.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!EVP_PKEY_set1_RSA(pkey.get(), cached_rsa.get()) || !asym_key->EvpToInternal(pkey.get()))
+        return TranslateLastOpenSslError();
+
+    key->reset(asym_key.release());
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t RsaKeyFactory::GenerateKey(const AuthorizationSet& key_description,
                                              KeymasterKeyBlob* key_blob,
                                              AuthorizationSet* hw_enforced,
@@ -78,6 +131,19 @@ keymaster_error_t RsaKeyFactory::GenerateKey(const AuthorizationSet& key_descrip
         return KM_ERROR_UNSUPPORTED_KEY_SIZE;
     }
 
+    KeymasterKeyBlob key_material;
+    if (!key_pool || !key_pool->Take(key_size, public_exponent, &key_material)) {
+        keymaster_error_t error = GenerateKeyMaterial(key_size, public_exponent, &key_material);
+        if (error != KM_ERROR_OK)
+            return error;
+    }
+
+    return blob_maker_.CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED, key_material, key_blob,
+                                     hw_enforced, sw_enforced);
+}
+
+keymaster_error_t RsaKeyFactory::GenerateKeyMaterial(uint32_t key_size, uint64_t public_exponent,
+                                                     KeymasterKeyBlob* key_material) {
     UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
     UniquePtr<RSA, RsaKey::RSA_Delete> rsa_key(RSA_new());
     UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
@@ -91,13 +157,7 @@ keymaster_error_t RsaKeyFactory::GenerateKey(const AuthorizationSet& key_descrip
     if (EVP_PKEY_set1_RSA(pkey.get(), rsa_key.get()) != 1)
         return TranslateLastOpenSslError();
 
-    KeymasterKeyBlob key_material;
-    keymaster_error_t error = EvpKeyToKeyMaterial(pkey.get(), &key_material);
-    if (error != KM_ERROR_OK)
-        return error;
-
-    return blob_maker_.CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED, key_material, key_blob,
-                                     hw_enforced, sw_enforced);
+    return EvpKeyToKeyMaterial(pkey.get(), key_material);
 }
 
 keymaster_error_t RsaKeyFactory::ImportKey(const AuthorizationSet& key_description,
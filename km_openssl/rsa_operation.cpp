@@ -34,6 +34,10 @@ const size_t kPssOverhead = 2;
 // additional overhead, for the digest algorithmIdentifier required by PKCS#1.
 const size_t kPkcs1UndigestedSignaturePaddingOverhead = 11;
 
+struct EVP_PKEY_CTX_Delete {
+    void operator()(EVP_PKEY_CTX* p) { EVP_PKEY_CTX_free(p); }
+};
+
 /* static */
 EVP_PKEY* RsaOperationFactory::GetRsaKey(Key&& key, keymaster_error_t* error) {
     const RsaKey& rsa_key = static_cast<RsaKey&>(key);
@@ -88,6 +92,23 @@ RsaDigestingOperationFactory::SupportedPaddingModes(size_t* padding_mode_count)
     return supported_sig_padding;
 }
 
+RsaOperation* RsaDigestingOperationFactory::CreateRsaOperation(
+    Key&& key, const AuthorizationSet& begin_params, keymaster_error_t* error) const {
+    UniquePtr<RsaOperation> op(
+        RsaOperationFactory::CreateRsaOperation(move(key), begin_params, error));
+    if (op.get() && begin_params.GetTagValue(TAG_PREHASHED)) {
+        // The caller's digest has to be made with a digest the operation knows, so that it can be
+        // checked for length and identified in the signature.
+        if (op->digest() == KM_DIGEST_NONE) {
+            LOG_E("Prehashed input requires a digest other than NONE", 0);
+            *error = KM_ERROR_INCOMPATIBLE_DIGEST;
+            return nullptr;
+        }
+        static_cast<RsaDigestingOperation*>(op.get())->set_prehashed();
+    }
+    return op.release();
+}
+
 RsaOperation* RsaCryptingOperationFactory::CreateRsaOperation(Key&& key,
                                                               const AuthorizationSet& begin_params,
                                                               keymaster_error_t* error) const {
@@ -137,7 +158,15 @@ keymaster_error_t RsaOperation::Begin(const AuthorizationSet& /* input_params */
                              (size_t)sizeof(operation_handle_));
     if (rc != KM_ERROR_OK) return rc;
 
-    return InitDigest();
+    keymaster_error_t error = InitDigest();
+    if (error != KM_ERROR_OK)
+        return error;
+
+    // Input can never usefully exceed the key size, so allocate for that once, up front, and
+    // let Update() and Finish() work within it.
+    if (buffers_input() && !data_.Reinitialize(EVP_PKEY_size(rsa_key_)))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t RsaOperation::Update(const AuthorizationSet& /* additional_params */,
@@ -158,9 +187,8 @@ keymaster_error_t RsaOperation::Update(const AuthorizationSet& /* additional_par
 keymaster_error_t RsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
     assert(input_consumed);
 
-    if (!data_.reserve(EVP_PKEY_size(rsa_key_)))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    // If the write fails, it's because input length exceeds key size.
+    // data_ was sized to the key in Begin(), so if the write fails, it's because input length
+    // exceeds key size.
     if (!data_.write(input.peek_read(), input.available_read())) {
         LOG_E("Input too long: cannot operate on %u bytes of data with %u-byte RSA key",
               input.available_read() + data_.available_read(), EVP_PKEY_size(rsa_key_));
@@ -260,13 +288,34 @@ int RsaDigestingOperation::GetOpensslPadding(keymaster_error_t* error) {
     }
 }
 
+keymaster_error_t RsaDigestingOperation::InitPrehashedContext(EVP_PKEY_CTX* pkey_ctx,
+                                                              bool signing) {
+    if (data_.available_read() != static_cast<size_t>(EVP_MD_size(digest_algorithm_))) {
+        LOG_E("Prehashed input is %u bytes; digest is %d bytes", data_.available_read(),
+              EVP_MD_size(digest_algorithm_));
+        return KM_ERROR_INVALID_INPUT_LENGTH;
+    }
+
+    if ((signing ? EVP_PKEY_sign_init(pkey_ctx) : EVP_PKEY_verify_init(pkey_ctx)) <= 0)
+        return TranslateLastOpenSslError();
+    keymaster_error_t error = SetRsaPaddingInEvpContext(pkey_ctx, signing);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    // With the digest set, the context produces the same encoding that EVP_DigestSign would,
+    // including the DigestInfo for PKCS#1 v1.5 padding.
+    if (EVP_PKEY_CTX_set_signature_md(pkey_ctx, digest_algorithm_) <= 0)
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t RsaSignOperation::Begin(const AuthorizationSet& input_params,
                                           AuthorizationSet* output_params) {
     keymaster_error_t error = RsaDigestingOperation::Begin(input_params, output_params);
     if (error != KM_ERROR_OK)
         return error;
 
-    if (digest_ == KM_DIGEST_NONE)
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
         return KM_ERROR_OK;
 
     EVP_PKEY_CTX* pkey_ctx;
@@ -279,7 +328,7 @@ keymaster_error_t RsaSignOperation::Begin(const AuthorizationSet& input_params,
 keymaster_error_t RsaSignOperation::Update(const AuthorizationSet& additional_params,
                                            const Buffer& input, AuthorizationSet* output_params,
                                            Buffer* output, size_t* input_consumed) {
-    if (digest_ == KM_DIGEST_NONE)
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
         // Just buffer the data.
         return RsaOperation::Update(additional_params, input, output_params, output,
                                     input_consumed);
@@ -301,22 +350,27 @@ keymaster_error_t RsaSignOperation::Finish(const AuthorizationSet& additional_pa
 
     if (digest_ == KM_DIGEST_NONE)
         return SignUndigested(output);
+    else if (prehashed_)
+        return SignPrehashed(output);
     else
         return SignDigested(output);
 }
 
-static keymaster_error_t zero_pad_left(UniquePtr<uint8_t[]>* dest, size_t padded_len, Buffer& src) {
-    assert(padded_len > src.available_read());
+// Zero-pads the contents of |buffer| on the left to |padded_len| bytes, in place, using the space
+// that RsaOperation::Begin() allocated after the data.
+static keymaster_error_t zero_pad_left(Buffer* buffer, size_t padded_len) {
+    size_t data_len = buffer->available_read();
+    assert(padded_len > data_len);
 
-    dest->reset(new(std::nothrow) uint8_t[padded_len]);
-    if (!dest->get())
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    size_t padding_len = padded_len - src.available_read();
-    memset(dest->get(), 0, padding_len);
-    if (!src.read(dest->get() + padding_len, src.available_read()))
+    size_t padding_len = padded_len - data_len;
+    if (buffer->available_write() < padding_len)
         return KM_ERROR_UNKNOWN_ERROR;
 
+    uint8_t* data = buffer->peek_write() - data_len;
+    memmove(data + padding_len, data, data_len);
+    memset(data, 0, padding_len);
+    if (!buffer->advance_write(padding_len))
+        return KM_ERROR_UNKNOWN_ERROR;
     return KM_ERROR_OK;
 }
 
@@ -331,21 +385,17 @@ keymaster_error_t RsaSignOperation::SignUndigested(Buffer* output) {
     size_t key_len = EVP_PKEY_size(rsa_key_);
     int bytes_encrypted;
     switch (padding_) {
-    case KM_PAD_NONE: {
-        const uint8_t* to_encrypt = data_.peek_read();
-        UniquePtr<uint8_t[]> zero_padded;
+    case KM_PAD_NONE:
         if (data_.available_read() > key_len) {
             return KM_ERROR_INVALID_INPUT_LENGTH;
         } else if (data_.available_read() < key_len) {
-            keymaster_error_t error = zero_pad_left(&zero_padded, key_len, data_);
+            keymaster_error_t error = zero_pad_left(&data_, key_len);
             if (error != KM_ERROR_OK)
                 return error;
-            to_encrypt = zero_padded.get();
         }
-        bytes_encrypted = RSA_private_encrypt(key_len, to_encrypt, output->peek_write(), rsa.get(),
-                                              RSA_NO_PADDING);
+        bytes_encrypted = RSA_private_encrypt(key_len, data_.peek_read(), output->peek_write(),
+                                              rsa.get(), RSA_NO_PADDING);
         break;
-    }
     case KM_PAD_RSA_PKCS1_1_5_SIGN:
         // Does PKCS1 padding without digesting even make sense?  Dunno.  We'll support it.
         if (data_.available_read() + kPkcs1UndigestedSignaturePaddingOverhead > key_len) {
@@ -384,25 +434,68 @@ keymaster_error_t RsaSignOperation::SignDigested(Buffer* output) {
     return KM_ERROR_OK;
 }
 
+keymaster_error_t RsaSignOperation::SignPrehashed(Buffer* output) {
+    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(
+        EVP_PKEY_CTX_new(rsa_key_, nullptr /* engine */));
+    if (!ctx.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    keymaster_error_t error = InitPrehashedContext(ctx.get(), true /* signing */);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    size_t siglen = EVP_PKEY_size(rsa_key_);
+    if (!output->Reinitialize(siglen))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (EVP_PKEY_sign(ctx.get(), output->peek_write(), &siglen, data_.peek_read(),
+                      data_.available_read()) <= 0)
+        return TranslateLastOpenSslError();
+    if (!output->advance_write(siglen))
+        return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+RsaVerifyOperation::~RsaVerifyOperation() {
+    EVP_MD_CTX_cleanup(&template_ctx_);
+}
+
 keymaster_error_t RsaVerifyOperation::Begin(const AuthorizationSet& input_params,
                                             AuthorizationSet* output_params) {
     keymaster_error_t error = RsaDigestingOperation::Begin(input_params, output_params);
     if (error != KM_ERROR_OK)
         return error;
 
-    if (digest_ == KM_DIGEST_NONE)
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
         return KM_ERROR_OK;
 
     EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr, rsa_key_) != 1)
+    if (EVP_DigestVerifyInit(&template_ctx_, &pkey_ctx, digest_algorithm_, nullptr, rsa_key_) != 1)
+        return TranslateLastOpenSslError();
+    error = SetRsaPaddingInEvpContext(pkey_ctx, false /* signing */);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (!EVP_MD_CTX_copy_ex(&digest_ctx_, &template_ctx_))
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RsaVerifyOperation::Restart(const AuthorizationSet& /* input_params */,
+                                              AuthorizationSet* /* output_params */) {
+    data_.Reset();
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
+        return KM_ERROR_OK;
+
+    if (!EVP_MD_CTX_md(&template_ctx_))
+        return KM_ERROR_UNKNOWN_ERROR;
+    if (!EVP_MD_CTX_copy_ex(&digest_ctx_, &template_ctx_))
         return TranslateLastOpenSslError();
-    return SetRsaPaddingInEvpContext(pkey_ctx, false /* signing */);
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t RsaVerifyOperation::Update(const AuthorizationSet& additional_params,
                                              const Buffer& input, AuthorizationSet* output_params,
                                              Buffer* output, size_t* input_consumed) {
-    if (digest_ == KM_DIGEST_NONE)
+    if (digest_ == KM_DIGEST_NONE || prehashed_)
         // Just buffer the data.
         return RsaOperation::Update(additional_params, input, output_params, output,
                                     input_consumed);
@@ -423,6 +516,8 @@ keymaster_error_t RsaVerifyOperation::Finish(const AuthorizationSet& additional_
 
     if (digest_ == KM_DIGEST_NONE)
         return VerifyUndigested(signature);
+    else if (prehashed_)
+        return VerifyPrehashed(signature);
     else
         return VerifyDigested(signature);
 }
@@ -485,6 +580,21 @@ keymaster_error_t RsaVerifyOperation::VerifyDigested(const Buffer& signature) {
     return KM_ERROR_OK;
 }
 
+keymaster_error_t RsaVerifyOperation::VerifyPrehashed(const Buffer& signature) {
+    UniquePtr<EVP_PKEY_CTX, EVP_PKEY_CTX_Delete> ctx(
+        EVP_PKEY_CTX_new(rsa_key_, nullptr /* engine */));
+    if (!ctx.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    keymaster_error_t error = InitPrehashedContext(ctx.get(), false /* signing */);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    if (EVP_PKEY_verify(ctx.get(), signature.peek_read(), signature.available_read(),
+                        data_.peek_read(), data_.available_read()) <= 0)
+        return KM_ERROR_VERIFICATION_FAILED;
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t RsaCryptOperation::SetOaepDigestIfRequired(EVP_PKEY_CTX* pkey_ctx) {
     if (padding() != KM_PAD_RSA_OAEP)
         return KM_ERROR_OK;
@@ -514,10 +624,6 @@ int RsaCryptOperation::GetOpensslPadding(keymaster_error_t* error) {
     }
 }
 
-struct EVP_PKEY_CTX_Delete {
-    void operator()(EVP_PKEY_CTX* p) { EVP_PKEY_CTX_free(p); }
-};
-
 keymaster_error_t RsaEncryptOperation::Finish(const AuthorizationSet& additional_params,
                                               const Buffer& input, const Buffer& /* signature */,
                                               AuthorizationSet* /* output_params */,
@@ -552,18 +658,14 @@ keymaster_error_t RsaEncryptOperation::Finish(const AuthorizationSet& additional
     if (!output->Reinitialize(outlen))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    const uint8_t* to_encrypt = data_.peek_read();
-    size_t to_encrypt_len = data_.available_read();
-    UniquePtr<uint8_t[]> zero_padded;
-    if (padding_ == KM_PAD_NONE && to_encrypt_len < outlen) {
-        keymaster_error_t error = zero_pad_left(&zero_padded, outlen, data_);
+    if (padding_ == KM_PAD_NONE && data_.available_read() < outlen) {
+        keymaster_error_t error = zero_pad_left(&data_, outlen);
         if (error != KM_ERROR_OK)
             return error;
-        to_encrypt = zero_padded.get();
-        to_encrypt_len = outlen;
     }
 
-    if (EVP_PKEY_encrypt(ctx.get(), output->peek_write(), &outlen, to_encrypt, to_encrypt_len) <= 0)
+    if (EVP_PKEY_encrypt(ctx.get(), output->peek_write(), &outlen, data_.peek_read(),
+                         data_.available_read()) <= 0)
         return TranslateLastOpenSslError();
     if (!output->advance_write(outlen))
         return KM_ERROR_UNKNOWN_ERROR;
@@ -605,18 +707,14 @@ keymaster_error_t RsaDecryptOperation::Finish(const AuthorizationSet& additional
     if (!output->Reinitialize(outlen))
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    const uint8_t* to_decrypt = data_.peek_read();
-    size_t to_decrypt_len = data_.available_read();
-    UniquePtr<uint8_t[]> zero_padded;
-    if (padding_ == KM_PAD_NONE && to_decrypt_len < outlen) {
-        keymaster_error_t error = zero_pad_left(&zero_padded, outlen, data_);
+    if (padding_ == KM_PAD_NONE && data_.available_read() < outlen) {
+        keymaster_error_t error = zero_pad_left(&data_, outlen);
         if (error != KM_ERROR_OK)
             return error;
-        to_decrypt = zero_padded.get();
-        to_decrypt_len = outlen;
     }
 
-    if (EVP_PKEY_decrypt(ctx.get(), output->peek_write(), &outlen, to_decrypt, to_decrypt_len) <= 0)
+    if (EVP_PKEY_decrypt(ctx.get(), output->peek_write(), &outlen, data_.peek_read(),
+                         data_.available_read()) <= 0)
         return TranslateLastOpenSslError();
     if (!output->advance_write(outlen))
         return KM_ERROR_UNKNOWN_ERROR;
@@ -49,16 +49,45 @@ class EvpMdCtx {
     EVP_MD_CTX ctx_;
 };
 
+class HmacCtx {
+  public:
+    HmacCtx() { HMAC_CTX_init(&ctx_); }
+    ~HmacCtx() { HMAC_CTX_cleanup(&ctx_); }
+
+    HMAC_CTX* get() { return &ctx_; }
+
+  private:
+    HMAC_CTX ctx_;
+};
+
 }  // anonymous namespace
 
-uint64_t SoftKeymasterEnforcement::get_current_time_ms() const {
+static uint64_t read_clock_ms(clockid_t clock_id) {
     struct timespec tp;
-    int err = clock_gettime(CLOCK_BOOTTIME, &tp);
+    int err = clock_gettime(clock_id, &tp);
     if (err || tp.tv_sec < 0) return 0;
 
     return static_cast<uint64_t>(tp.tv_sec) * 1000 + static_cast<uint64_t>(tp.tv_nsec) / 1000000;
 }
 
+uint64_t BoottimeClock::now_ms() const {
+    return read_clock_ms(CLOCK_BOOTTIME);
+}
+
+CoarseMonotonicClock::CoarseMonotonicClock() {
+    struct timespec res;
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &res) || res.tv_sec < 0) {
+        tolerance_ms_ = 1000;  // Unknown resolution; assume the worst plausible tick.
+        return;
+    }
+    tolerance_ms_ = static_cast<uint64_t>(res.tv_sec) * 1000 +
+                    (static_cast<uint64_t>(res.tv_nsec) + 999999) / 1000000;
+}
+
+uint64_t CoarseMonotonicClock::now_ms() const {
+    return read_clock_ms(CLOCK_MONOTONIC_COARSE);
+}
+
 bool SoftKeymasterEnforcement::CreateKeyId(const keymaster_key_blob_t& key_blob,
                                            km_id_t* keyid) const {
     EvpMdCtx ctx;
@@ -90,29 +119,30 @@ SoftKeymasterEnforcement::GetHmacSharingParameters(HmacSharingParameters* params
 
 namespace {
 
-DEFINE_OPENSSL_OBJECT_POINTER(HMAC_CTX);
-
-keymaster_error_t hmacSha256(const keymaster_key_blob_t& key, const keymaster_blob_t data_chunks[],
-                             size_t data_chunk_count, KeymasterBlob* output) {
+// Computes HMAC-SHA256 over the concatenation of data_chunks, starting from a copy of keyed_ctx,
+// which must have been initialized with the key and SHA-256.  work_ctx is used for the
+// computation, and may be reused across calls to avoid reallocating its digest state.
+keymaster_error_t hmacSha256(const HMAC_CTX* keyed_ctx, HMAC_CTX* work_ctx,
+                             const keymaster_blob_t data_chunks[], size_t data_chunk_count,
+                             KeymasterBlob* output) {
     if (!output) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (!keyed_ctx) return KM_ERROR_UNKNOWN_ERROR;
 
     unsigned digest_len = SHA256_DIGEST_LENGTH;
     if (!output->Reset(digest_len)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    HMAC_CTX_Ptr ctx(HMAC_CTX_new());
-    if (!HMAC_Init_ex(ctx.get(), key.key_material, key.key_material_size, EVP_sha256(),
-                      nullptr /* engine*/)) {
+    if (!HMAC_CTX_copy_ex(work_ctx, keyed_ctx)) {
         return TranslateLastOpenSslError();
     }
 
     for (size_t i = 0; i < data_chunk_count; i++) {
         auto& chunk = data_chunks[i];
-        if (!HMAC_Update(ctx.get(), chunk.data, chunk.data_length)) {
+        if (!HMAC_Update(work_ctx, chunk.data, chunk.data_length)) {
             return TranslateLastOpenSslError();
         }
     }
 
-    if (!HMAC_Final(ctx.get(), output->writable_data(), &digest_len)) {
+    if (!HMAC_Final(work_ctx, output->writable_data(), &digest_len)) {
         return TranslateLastOpenSslError();
     }
 
@@ -121,6 +151,12 @@ keymaster_error_t hmacSha256(const keymaster_key_blob_t& key, const keymaster_bl
     return KM_ERROR_OK;
 }
 
+keymaster_error_t hmacSha256(const HMAC_CTX* keyed_ctx, const keymaster_blob_t data_chunks[],
+                             size_t data_chunk_count, KeymasterBlob* output) {
+    HmacCtx ctx;
+    return hmacSha256(keyed_ctx, ctx.get(), data_chunks, data_chunk_count, output);
+}
+
 // Helpers for converting types to keymaster_blob_t, for easy feeding of hmacSha256.
 template <typename T> inline keymaster_blob_t toBlob(const T& t) {
     return {reinterpret_cast<const uint8_t*>(&t), sizeof(t)};
@@ -143,6 +179,19 @@ bool operator==(const HmacSharingParameters& a, const HmacSharingParameters& b)
 
 }  // namespace
 
+const HMAC_CTX* SoftKeymasterEnforcement::hmac_key_ctx() {
+    if (hmac_key_ctx_.get()) return hmac_key_ctx_.get();
+
+    HMAC_CTX_Ptr ctx(HMAC_CTX_new());
+    if (!ctx.get() || !HMAC_Init_ex(ctx.get(), hmac_key_.key_material,
+                                    hmac_key_.key_material_size, EVP_sha256(),
+                                    nullptr /* engine */)) {
+        return nullptr;
+    }
+    hmac_key_ctx_.reset(ctx.release());
+    return hmac_key_ctx_.get();
+}
+
 keymaster_error_t
 SoftKeymasterEnforcement::ComputeSharedHmac(const HmacSharingParametersArray& params_array,
                                             KeymasterBlob* sharingCheck) {
@@ -161,6 +210,8 @@ SoftKeymasterEnforcement::ComputeSharedHmac(const HmacSharingParametersArray& pa
 
     if (!found_mine) return KM_ERROR_INVALID_ARGUMENT;
 
+    // Drop the context keyed with the old key; it's rebuilt from the new one on next use.
+    hmac_key_ctx_.reset();
     if (!hmac_key_.Reset(SHA256_DIGEST_LENGTH)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     keymaster_error_t error = ckdf(
         KeymasterKeyBlob(kFakeKeyAgreementKey, sizeof(kFakeKeyAgreementKey)),
@@ -172,7 +223,7 @@ SoftKeymasterEnforcement::ComputeSharedHmac(const HmacSharingParametersArray& pa
     keymaster_blob_t data = {reinterpret_cast<const uint8_t*>(kMacVerificationString),
                              strlen(kMacVerificationString)};
     keymaster_blob_t data_chunks[] = {data};
-    return hmacSha256(hmac_key_, data_chunks, 1, sharingCheck);
+    return hmacSha256(hmac_key_ctx(), data_chunks, 1, sharingCheck);
 }
 
 VerifyAuthorizationResponse
@@ -183,7 +234,7 @@ SoftKeymasterEnforcement::VerifyAuthorization(const VerifyAuthorizationRequest&
     // implementation that requires more.
     VerifyAuthorizationResponse response;
     response.token.challenge = request.challenge;
-    response.token.timestamp = get_current_time_ms();
+    response.token.timestamp = default_clock_.now_ms();
     response.token.security_level = SecurityLevel();
     keymaster_blob_t data_chunks[] = {
         toBlob(kAuthVerificationLabel),
@@ -192,7 +243,40 @@ SoftKeymasterEnforcement::VerifyAuthorization(const VerifyAuthorizationRequest&
         toBlob(response.token.security_level),
         {},  // parametersVerified
     };
-    response.error = hmacSha256(hmac_key_, data_chunks, 5, &response.token.mac);
+    response.error = hmacSha256(hmac_key_ctx(), data_chunks, 5, &response.token.mac);
+
+    return response;
+}
+
+BatchVerifyAuthorizationResponse
+SoftKeymasterEnforcement::BatchVerifyAuthorization(const BatchVerifyAuthorizationRequest& request) {
+    // As for VerifyAuthorization, but with a single timestamp and HMAC context for the batch.
+    BatchVerifyAuthorizationResponse response;
+    if (!response.AllocateTokens(request.num_challenges)) {
+        response.error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return response;
+    }
+
+    const HMAC_CTX* keyed_ctx = hmac_key_ctx();
+    HmacCtx work_ctx;
+    uint64_t timestamp = default_clock_.now_ms();
+    keymaster_security_level_t security_level = SecurityLevel();
+    response.error = KM_ERROR_OK;
+    for (size_t i = 0; i < request.num_challenges; ++i) {
+        VerificationToken& token = response.tokens[i];
+        token.challenge = request.challenges[i];
+        token.timestamp = timestamp;
+        token.security_level = security_level;
+        keymaster_blob_t data_chunks[] = {
+            toBlob(kAuthVerificationLabel),
+            toBlob(token.challenge),
+            toBlob(token.timestamp),
+            toBlob(token.security_level),
+            {},  // parametersVerified
+        };
+        response.error = hmacSha256(keyed_ctx, work_ctx.get(), data_chunks, 5, &token.mac);
+        if (response.error != KM_ERROR_OK) return response;
+    }
 
     return response;
 }
@@ -41,6 +41,16 @@ OperationFactory* TripleDesKeyFactory::GetOperationFactory(keymaster_purpose_t p
     }
 }
 
+void TripleDesKeyFactory::set_cipher_context_cache(CipherContextCache* cache) {
+    encrypt_factory.set_context_cache(cache);
+    decrypt_factory.set_context_cache(cache);
+}
+
+void TripleDesKeyFactory::set_worker_pool(WorkerPool* pool, size_t min_parallel_bytes) {
+    encrypt_factory.set_worker_pool(pool, min_parallel_bytes);
+    decrypt_factory.set_worker_pool(pool, min_parallel_bytes);
+}
+
 keymaster_error_t TripleDesKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
                                                const AuthorizationSet& /* additional_params */,
                                                AuthorizationSet&& hw_enforced,
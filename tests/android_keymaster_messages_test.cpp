@@ -223,6 +223,7 @@ TEST(RoundTrip, BeginOperationResponse) {
         case 1:
         case 2:
         case 3:
+        case 4:
             deserialized.reset(round_trip(ver, msg, 39));
             break;
         default:
@@ -239,6 +240,7 @@ TEST(RoundTrip, BeginOperationResponse) {
         case 1:
         case 2:
         case 3:
+        case 4:
             EXPECT_EQ(msg.output_params, deserialized->output_params);
             break;
         default:
@@ -274,6 +276,9 @@ TEST(RoundTrip, UpdateOperationRequest) {
         case 3:
             deserialized.reset(round_trip(ver, msg, 27));
             break;
+        case 4:
+            deserialized.reset(round_trip(ver, msg, 31));
+            break;
         default:
             FAIL();
         }
@@ -300,6 +305,7 @@ TEST(RoundTrip, UpdateOperationResponse) {
             break;
         case 2:
         case 3:
+        case 4:
             deserialized.reset(round_trip(ver, msg, 42));
             break;
         default:
@@ -318,6 +324,7 @@ TEST(RoundTrip, UpdateOperationResponse) {
             break;
         case 2:
         case 3:
+        case 4:
             EXPECT_EQ(99U, deserialized->input_consumed);
             EXPECT_EQ(1U, deserialized->output_params.size());
             break;
@@ -346,6 +353,9 @@ TEST(RoundTrip, FinishOperationRequest) {
         case 3:
             deserialized.reset(round_trip(ver, msg, 34));
             break;
+        case 4:
+            deserialized.reset(round_trip(ver, msg, 38));
+            break;
         default:
             FAIL();
         }
@@ -355,6 +365,60 @@ TEST(RoundTrip, FinishOperationRequest) {
     }
 }
 
+TEST(RoundTrip, UpdateOperationRequestSegments) {
+    UpdateOperationRequest msg(4);
+    msg.op_handle = 0xDEADBEEF;
+    ASSERT_TRUE(msg.AllocateInputSegments(3));
+    msg.input_segments[0].Reinitialize("foo", 3);
+    msg.input_segments[2].Reinitialize("barbaz", 6);
+
+    UniquePtr<UpdateOperationRequest> deserialized(round_trip(4, msg, 49));
+    EXPECT_EQ(0U, deserialized->input.available_read());
+    ASSERT_EQ(3U, deserialized->num_input_segments);
+    EXPECT_EQ(3U, deserialized->input_segments[0].available_read());
+    EXPECT_EQ(0, memcmp(deserialized->input_segments[0].peek_read(), "foo", 3));
+    EXPECT_EQ(0U, deserialized->input_segments[1].available_read());
+    EXPECT_EQ(6U, deserialized->input_segments[2].available_read());
+    EXPECT_EQ(0, memcmp(deserialized->input_segments[2].peek_read(), "barbaz", 6));
+
+    // Older versions don't carry segments.
+    UpdateOperationRequest old_msg(3);
+    ASSERT_TRUE(old_msg.AllocateInputSegments(1));
+    old_msg.input_segments[0].Reinitialize("foo", 3);
+    deserialized.reset(round_trip(3, old_msg, 24));
+    EXPECT_EQ(0U, deserialized->num_input_segments);
+}
+
+TEST(RoundTrip, FinishOperationRequestSegments) {
+    FinishOperationRequest msg(4);
+    msg.op_handle = 0xDEADBEEF;
+    msg.signature.Reinitialize("sig", 3);
+    ASSERT_TRUE(msg.AllocateInputSegments(2));
+    msg.input_segments[0].Reinitialize("foo", 3);
+    msg.input_segments[1].Reinitialize("bar", 3);
+
+    UniquePtr<FinishOperationRequest> deserialized(round_trip(4, msg, 49));
+    EXPECT_EQ(3U, deserialized->signature.available_read());
+    ASSERT_EQ(2U, deserialized->num_input_segments);
+    EXPECT_EQ(0, memcmp(deserialized->input_segments[0].peek_read(), "foo", 3));
+    EXPECT_EQ(0, memcmp(deserialized->input_segments[1].peek_read(), "bar", 3));
+}
+
+TEST(GarbageTest, InputSegmentCountTooLarge) {
+    UpdateOperationRequest msg(4);
+    msg.op_handle = 0xDEADBEEF;
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    // The segment count is the last field; claim more segments than the remaining bytes can hold.
+    uint8_t* count = buf.get() + size - sizeof(uint32_t);
+    memset(count, 0xFF, sizeof(uint32_t));
+    UpdateOperationRequest deserialized(4);
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, buf.get() + size));
+}
+
 TEST(Round_Trip, FinishOperationResponse) {
     for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
         FinishOperationResponse msg(ver);
@@ -369,6 +433,7 @@ TEST(Round_Trip, FinishOperationResponse) {
             break;
         case 2:
         case 3:
+        case 4:
             deserialized.reset(round_trip(ver, msg, 23));
             break;
         default:
@@ -625,6 +690,204 @@ TEST(RoundTrip, UpgradeKeyResponse) {
     }
 }
 
+TEST(RoundTrip, BatchVerifyAuthorizationRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchVerifyAuthorizationRequest msg(ver);
+        const uint64_t challenges[] = {1, 2, 0xFFFFFFFFFFFFFFFF};
+        ASSERT_TRUE(msg.SetChallenges(challenges, array_length(challenges)));
+
+        UniquePtr<BatchVerifyAuthorizationRequest> deserialized(round_trip(ver, msg, 80));
+        ASSERT_EQ(3U, deserialized->num_challenges);
+        EXPECT_EQ(0, memcmp(challenges, deserialized->challenges, sizeof(challenges)));
+    }
+}
+
+TEST(RoundTrip, BatchVerifyAuthorizationResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchVerifyAuthorizationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.AllocateTokens(2));
+        for (size_t i = 0; i < msg.num_tokens; ++i) {
+            msg.tokens[i].challenge = i + 1;
+            msg.tokens[i].timestamp = 1000;
+            msg.tokens[i].security_level = KM_SECURITY_LEVEL_SOFTWARE;
+            msg.tokens[i].mac = KeymasterBlob(reinterpret_cast<const uint8_t*>("mac"), 3);
+        }
+
+        UniquePtr<BatchVerifyAuthorizationResponse> deserialized(round_trip(ver, msg, 86));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->num_tokens);
+        for (size_t i = 0; i < deserialized->num_tokens; ++i) {
+            EXPECT_EQ(i + 1, deserialized->tokens[i].challenge);
+            EXPECT_EQ(1000U, deserialized->tokens[i].timestamp);
+            EXPECT_EQ(KM_SECURITY_LEVEL_SOFTWARE, deserialized->tokens[i].security_level);
+            EXPECT_EQ(3U, deserialized->tokens[i].mac.data_length);
+            EXPECT_EQ(0, memcmp("mac", deserialized->tokens[i].mac.data, 3));
+        }
+    }
+}
+
+TEST(RoundTrip, BatchAeadOperationRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchAeadOperationRequest msg(ver);
+        msg.purpose = KM_PURPOSE_ENCRYPT;
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.AllocateRecords(2));
+        msg.records[0].input.Reinitialize("plaintext", 9);
+        msg.records[1].nonce.Reinitialize("123456789012", 12);
+        msg.records[1].aad.Reinitialize("aad", 3);
+
+        UniquePtr<BatchAeadOperationRequest> deserialized(round_trip(ver, msg, 141));
+        EXPECT_EQ(KM_PURPOSE_ENCRYPT, deserialized->purpose);
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->num_records);
+        EXPECT_EQ(0U, deserialized->records[0].nonce.available_read());
+        EXPECT_EQ(9U, deserialized->records[0].input.available_read());
+        EXPECT_EQ(12U, deserialized->records[1].nonce.available_read());
+        EXPECT_EQ(0, memcmp("aad", deserialized->records[1].aad.peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, BatchAeadOperationResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchAeadOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.AllocateResults(2));
+        msg.results[0].error = KM_ERROR_OK;
+        msg.results[0].nonce.Reinitialize("123456789012", 12);
+        msg.results[0].output.Reinitialize("ciphertext", 10);
+        msg.results[1].error = KM_ERROR_VERIFICATION_FAILED;
+
+        UniquePtr<BatchAeadOperationResponse> deserialized(round_trip(ver, msg, 54));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->num_results);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->results[0].error);
+        EXPECT_EQ(12U, deserialized->results[0].nonce.available_read());
+        EXPECT_EQ(0, memcmp("ciphertext", deserialized->results[0].output.peek_read(), 10));
+        EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, deserialized->results[1].error);
+        EXPECT_EQ(0U, deserialized->results[1].output.available_read());
+    }
+}
+
+TEST(RoundTrip, BatchVerifySignaturesRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchVerifySignaturesRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.AllocateRecords(2));
+        msg.records[0].input.Reinitialize("message", 7);
+        msg.records[0].signature.Reinitialize("sig", 3);
+        msg.records[1].input.Reinitialize("digest", 6);
+        msg.records[1].signature.Reinitialize("signature", 9);
+
+        UniquePtr<BatchVerifySignaturesRequest> deserialized(round_trip(ver, msg, 130));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->num_records);
+        EXPECT_EQ(0, memcmp("message", deserialized->records[0].input.peek_read(), 7));
+        EXPECT_EQ(3U, deserialized->records[0].signature.available_read());
+        EXPECT_EQ(6U, deserialized->records[1].input.available_read());
+        EXPECT_EQ(0, memcmp("signature", deserialized->records[1].signature.peek_read(), 9));
+    }
+}
+
+TEST(RoundTrip, BatchVerifySignaturesResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchVerifySignaturesResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.AllocateResults(3));
+        msg.results[0] = KM_ERROR_OK;
+        msg.results[1] = KM_ERROR_VERIFICATION_FAILED;
+        msg.results[2] = KM_ERROR_KEY_MAX_OPS_EXCEEDED;
+
+        UniquePtr<BatchVerifySignaturesResponse> deserialized(round_trip(ver, msg, 20));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(3U, deserialized->num_results);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->results[0]);
+        EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, deserialized->results[1]);
+        EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED, deserialized->results[2]);
+    }
+}
+
+TEST(RoundTrip, BatchComputeMacsRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchComputeMacsRequest msg(ver);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.AllocateRecords(2));
+        msg.records[0].SetKeyMaterial("foo", 3);
+        msg.records[0].input.Reinitialize("message", 7);
+        msg.records[1].SetKeyMaterial("keyblob", 7);
+        msg.records[1].input.Reinitialize("data", 4);
+
+        UniquePtr<BatchComputeMacsRequest> deserialized(round_trip(ver, msg, 119));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->num_records);
+        EXPECT_EQ(3U, deserialized->records[0].key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("message", deserialized->records[0].input.peek_read(), 7));
+        EXPECT_EQ(0, memcmp("keyblob", deserialized->records[1].key_blob.key_material, 7));
+        EXPECT_EQ(4U, deserialized->records[1].input.available_read());
+    }
+}
+
+TEST(RoundTrip, BatchComputeMacsResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchComputeMacsResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.AllocateResults(2));
+        msg.results[0].error = KM_ERROR_OK;
+        msg.results[0].mac.Reinitialize("0123456789abcdef", 16);
+        msg.results[1].error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+
+        UniquePtr<BatchComputeMacsResponse> deserialized(round_trip(ver, msg, 40));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->num_results);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->results[0].error);
+        EXPECT_EQ(0, memcmp("0123456789abcdef", deserialized->results[0].mac.peek_read(), 16));
+        EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, deserialized->results[1].error);
+        EXPECT_EQ(0U, deserialized->results[1].mac.available_read());
+    }
+}
+
+TEST(RoundTrip, BatchAgreeKeysRequest) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchAgreeKeysRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        ASSERT_TRUE(msg.AllocatePeerPublicValues(2));
+        msg.peer_public_values[0].Reinitialize("point", 5);
+        msg.peer_public_values[1].Reinitialize("another point", 13);
+
+        UniquePtr<BatchAgreeKeysRequest> deserialized(round_trip(ver, msg, 115));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->num_peer_public_values);
+        EXPECT_EQ(0, memcmp("point", deserialized->peer_public_values[0].peek_read(), 5));
+        EXPECT_EQ(13U, deserialized->peer_public_values[1].available_read());
+    }
+}
+
+TEST(RoundTrip, BatchAgreeKeysResponse) {
+    for (int ver = 0; ver <= MAX_MESSAGE_VERSION; ++ver) {
+        BatchAgreeKeysResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.AllocateResults(2));
+        msg.results[0].error = KM_ERROR_INVALID_ARGUMENT;
+        msg.results[1].error = KM_ERROR_OK;
+        msg.results[1].secret.Reinitialize("0123456789abcdef0123456789abcdef", 32);
+
+        UniquePtr<BatchAgreeKeysResponse> deserialized(round_trip(ver, msg, 56));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->num_results);
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, deserialized->results[0].error);
+        EXPECT_EQ(0U, deserialized->results[0].secret.available_read());
+        EXPECT_EQ(KM_ERROR_OK, deserialized->results[1].error);
+        EXPECT_EQ(0, memcmp("0123456789abcdef0123456789abcdef",
+                            deserialized->results[1].secret.peek_read(), 32));
+    }
+}
+
 uint8_t msgbuf[] = {
     220, 88,  183, 255, 71,  1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
     0,   173, 0,   0,   0,   228, 174, 98,  187, 191, 135, 253, 200, 51,  230, 114, 247, 151, 109,
@@ -721,6 +984,16 @@ GARBAGE_TEST(AttestKeyRequest);
 GARBAGE_TEST(AttestKeyResponse);
 GARBAGE_TEST(UpgradeKeyRequest);
 GARBAGE_TEST(UpgradeKeyResponse);
+GARBAGE_TEST(BatchVerifyAuthorizationRequest);
+GARBAGE_TEST(BatchVerifyAuthorizationResponse);
+GARBAGE_TEST(BatchAeadOperationRequest);
+GARBAGE_TEST(BatchAeadOperationResponse);
+GARBAGE_TEST(BatchVerifySignaturesRequest);
+GARBAGE_TEST(BatchVerifySignaturesResponse);
+GARBAGE_TEST(BatchComputeMacsRequest);
+GARBAGE_TEST(BatchComputeMacsResponse);
+GARBAGE_TEST(BatchAgreeKeysRequest);
+GARBAGE_TEST(BatchAgreeKeysResponse);
 
 // The macro doesn't work on this one.
 TEST(GarbageTest, SupportedResponse) {
@@ -14,24 +14,44 @@
  * limitations under the License.
  */
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <fstream>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include <openssl/ec.h>
 #include <openssl/evp.h>
+#include <openssl/sha.h>
 #include <openssl/x509.h>
 
 #include <hardware/keymaster0.h>
 
 #include <keymaster/android_keymaster.h>
 #include <keymaster/attestation_record.h>
+#include <keymaster/contexts/bulk_data_channel.h>
+#include <keymaster/contexts/pthread_rsa_key_pool.h>
+#include <keymaster/contexts/pthread_worker_pool.h>
 #include <keymaster/contexts/pure_soft_keymaster_context.h>
 #include <keymaster/contexts/soft_keymaster_context.h>
 #include <keymaster/key_factory.h>
+#include <keymaster/km_openssl/aes_key.h>
+#include <keymaster/km_openssl/cipher_context_cache.h>
+#include <keymaster/km_openssl/ed25519_operation.h>
+#include <keymaster/km_openssl/hkdf.h>
+#include <keymaster/km_openssl/hmac_context_cache.h>
 #include <keymaster/km_openssl/hmac_key.h>
+#include <keymaster/km_openssl/hmac_sha256_multibuffer.h>
+#include <keymaster/km_openssl/kdf2.h>
+#include <keymaster/km_openssl/nist_curve_key_exchange.h>
 #include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/km_openssl/rsa_key.h>
+#include <keymaster/km_openssl/rsa_key_cache.h>
+#include <keymaster/km_openssl/rsa_key_factory.h>
 #include <keymaster/km_openssl/soft_keymaster_enforcement.h>
+#include <keymaster/km_openssl/software_random_source.h>
 #include <keymaster/legacy_support/keymaster0_engine.h>
 #include <keymaster/soft_keymaster_device.h>
 
@@ -82,10 +102,16 @@ class TestKeymasterEnforcement : public SoftKeymasterEnforcement {
   public:
     TestKeymasterEnforcement() : SoftKeymasterEnforcement(3, 3) {}
 
-    virtual bool activation_date_valid(uint64_t /* activation_date */) const { return true; }
-    virtual bool expiration_date_passed(uint64_t /* expiration_date */) const { return false; }
-    virtual bool auth_token_timed_out(const hw_auth_token_t& /* token */,
-                                      uint32_t /* timeout */) const {
+    virtual bool activation_date_valid(uint64_t /* activation_date */,
+                                       uint64_t /* current_time_ms */) const {
+        return true;
+    }
+    virtual bool expiration_date_passed(uint64_t /* expiration_date */,
+                                        uint64_t /* current_time_ms */) const {
+        return false;
+    }
+    virtual bool auth_token_timed_out(const hw_auth_token_t& /* token */, uint32_t /* timeout */,
+                                      uint64_t /* current_time_ms */) const {
         return false;
     }
     virtual uint32_t get_current_time() const { return 0; }
@@ -684,6 +710,48 @@ TEST_P(SigningOperationsTest, RsaSignTooLargeMessage) {
         EXPECT_EQ(3, GetParam()->keymaster0_calls());
 }
 
+TEST_P(SigningOperationsTest, RsaNoPaddingIncrementalInput) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(256, 3)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Padding(KM_PAD_NONE)));
+    // Shorter than the key, so it gets zero-padded.
+    string message = "1234567890123456789012345678901";
+    string signature;
+    SignMessage(message, &signature, KM_DIGEST_NONE, KM_PAD_NONE);
+
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_DIGEST, KM_DIGEST_NONE);
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, begin_params));
+    string result;
+    size_t input_consumed;
+    for (char c : message) {
+        ASSERT_EQ(KM_ERROR_OK, UpdateOperation(string(1, c), &result, &input_consumed));
+        EXPECT_EQ(1U, input_consumed);
+    }
+    string output;
+    ASSERT_EQ(KM_ERROR_OK, FinishOperation(&output));
+    // Unpadded RSA is deterministic.
+    EXPECT_EQ(signature, output);
+}
+
+TEST_P(SigningOperationsTest, RsaNoPaddingIncrementalInputTooLong) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(256, 3)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Padding(KM_PAD_NONE)));
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_DIGEST, KM_DIGEST_NONE);
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, begin_params));
+    string result;
+    size_t input_consumed;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(string(20, 'a'), &result, &input_consumed));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH,
+              UpdateOperation(string(13, 'a'), &result, &input_consumed));
+}
+
 TEST_P(SigningOperationsTest, EcdsaSuccess) {
     ASSERT_EQ(KM_ERROR_OK,
               GenerateKey(AuthorizationSetBuilder().EcdsaSigningKey(224).Digest(KM_DIGEST_NONE)));
@@ -3376,122 +3444,415 @@ TEST_P(EncryptionOperationsTest, AesGcmCorruptTag) {
     EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
-TEST_P(EncryptionOperationsTest, TripleDesEcbRoundTripSuccess) {
-    auto auths = AuthorizationSetBuilder()
-                     .TripleDesEncryptionKey(112)
-                     .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
-                     .Padding(KM_PAD_NONE);
+TEST_P(EncryptionOperationsTest, ChaCha20Poly1305RoundTripSuccess) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    string aad = "foobar";
+    string message = "123456789012345678901234567890123456";
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
 
-    ASSERT_EQ(KM_ERROR_OK, GenerateKey(auths));
-    // Two-block message.
-    string message = "1234567890123456";
-    string ciphertext1 = EncryptMessage(message, KM_MODE_ECB, KM_PAD_NONE);
-    EXPECT_EQ(message.size(), ciphertext1.size());
+    AuthorizationSet update_params;
+    update_params.push_back(TAG_ASSOCIATED_DATA, aad.data(), aad.size());
 
-    string ciphertext2 = EncryptMessage(string(message), KM_MODE_ECB, KM_PAD_NONE);
-    EXPECT_EQ(message.size(), ciphertext2.size());
+    // Encrypt
+    AuthorizationSet begin_out_params;
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params, &begin_out_params));
+    string ciphertext;
+    size_t input_consumed;
+    AuthorizationSet update_out_params;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, message, &update_out_params, &ciphertext,
+                                           &input_consumed));
+    EXPECT_EQ(message.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&ciphertext));
+    EXPECT_EQ(message.size() + 16, ciphertext.size());
 
-    // ECB is deterministic.
-    EXPECT_EQ(ciphertext1, ciphertext2);
+    // Grab nonce
+    keymaster_blob_t nonce;
+    ASSERT_TRUE(begin_out_params.GetTagValue(TAG_NONCE, &nonce));
+    EXPECT_EQ(12U, nonce.data_length);
+    begin_params.push_back(begin_out_params);
+
+    // Decrypt.
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    string plaintext;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, ciphertext, &update_out_params,
+                                           &plaintext, &input_consumed));
+    EXPECT_EQ(ciphertext.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&plaintext));
 
-    string plaintext = DecryptMessage(ciphertext1, KM_MODE_ECB, KM_PAD_NONE);
     EXPECT_EQ(message, plaintext);
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
-TEST_P(EncryptionOperationsTest, TripleDesEcbNotAuthorized) {
+TEST_P(EncryptionOperationsTest, ChaCha20Poly1305KeyRestrictions) {
+    // 256-bit keys only.
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE,
+              GenerateKey(AuthorizationSetBuilder()
+                              .AesEncryptionKey(128)
+                              .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                              .Authorization(TAG_PADDING, KM_PAD_NONE)
+                              .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+
+    // The key material can't also be used with AES modes.
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_BLOCK_MODE,
+              GenerateKey(AuthorizationSetBuilder()
+                              .AesEncryptionKey(256)
+                              .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                              .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                              .Authorization(TAG_PADDING, KM_PAD_NONE)
+                              .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+
+    // Poly1305 tags aren't truncated.
+    EXPECT_EQ(KM_ERROR_MISSING_MIN_MAC_LENGTH,
+              GenerateKey(AuthorizationSetBuilder()
+                              .AesEncryptionKey(256)
+                              .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                              .Authorization(TAG_PADDING, KM_PAD_NONE)));
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_MIN_MAC_LENGTH,
+              GenerateKey(AuthorizationSetBuilder()
+                              .AesEncryptionKey(256)
+                              .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                              .Authorization(TAG_PADDING, KM_PAD_NONE)
+                              .Authorization(TAG_MIN_MAC_LENGTH, 96)));
+
     ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
-                                           .TripleDesEncryptionKey(112)
-                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CBC)
-                                           .Padding(KM_PAD_NONE)));
-    // Two-block message.
-    string message = "1234567890123456";
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
     AuthorizationSet begin_params(client_params());
-    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
-    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
-    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_BLOCK_MODE, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305);
+    begin_params.push_back(TAG_PADDING, KM_PAD_PKCS7);
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PADDING_MODE, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
-TEST_P(EncryptionOperationsTest, TripleDesEcbNoPaddingWrongInputSize) {
+TEST_P(EncryptionOperationsTest, ChaCha20Poly1305Incremental) {
     ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
-                                           .TripleDesEncryptionKey(112)
-                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
-                                           .Padding(KM_PAD_NONE)));
-    // Message is slightly shorter than two blocks.
-    string message = "123456789012345";
-
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
     AuthorizationSet begin_params(client_params());
-    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305);
     begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
-    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
+
+    AuthorizationSet update_params;
+    update_params.push_back(TAG_ASSOCIATED_DATA, "b", 1);
+
+    // Encrypt
+    AuthorizationSet begin_out_params;
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params, &begin_out_params));
     string ciphertext;
-    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, FinishOperation(message, "", &ciphertext));
-}
+    size_t input_consumed;
+    AuthorizationSet update_out_params;
 
-TEST_P(EncryptionOperationsTest, TripleDesEcbPkcs7Padding) {
-    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
-                                           .TripleDesEncryptionKey(112)
-                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
-                                           .Authorization(TAG_PADDING, KM_PAD_PKCS7)));
+    // Send AAD, incrementally
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, "", &update_out_params, &ciphertext,
+                                               &input_consumed));
+        EXPECT_EQ(0U, input_consumed);
+        EXPECT_EQ(0U, ciphertext.size());
+    }
 
-    // Try various message lengths; all should work.
-    for (size_t i = 0; i < 32; ++i) {
-        string message(i, 'a');
-        string ciphertext = EncryptMessage(message, KM_MODE_ECB, KM_PAD_PKCS7);
-        EXPECT_EQ(i + 8 - (i % 8), ciphertext.size());
-        string plaintext = DecryptMessage(ciphertext, KM_MODE_ECB, KM_PAD_PKCS7);
-        EXPECT_EQ(message, plaintext);
+    // Now send data, incrementally, no data.
+    AuthorizationSet empty_params;
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(KM_ERROR_OK, UpdateOperation(empty_params, "a", &update_out_params, &ciphertext,
+                                               &input_consumed));
+        EXPECT_EQ(1U, input_consumed);
     }
-}
+    EXPECT_EQ(1000U, ciphertext.size());
 
-TEST_P(EncryptionOperationsTest, TripleDesEcbNoPaddingKeyWithPkcs7Padding) {
-    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
-                                           .TripleDesEncryptionKey(112)
-                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
-                                           .Authorization(TAG_PADDING, KM_PAD_NONE)));
+    // And finish.
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&ciphertext));
+    EXPECT_EQ(1016U, ciphertext.size());
 
-    // Try various message lengths; all should fail.
-    for (size_t i = 0; i < 32; ++i) {
-        AuthorizationSet begin_params(client_params());
-        begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
-        begin_params.push_back(TAG_PADDING, KM_PAD_PKCS7);
-        EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PADDING_MODE,
-                  BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+    // Grab nonce
+    EXPECT_NE(-1, begin_out_params.find(TAG_NONCE));
+    begin_params.push_back(begin_out_params);
+
+    // Decrypt.
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    string plaintext;
+
+    // Send AAD, incrementally, no data
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, "", &update_out_params, &plaintext,
+                                               &input_consumed));
+        EXPECT_EQ(0U, input_consumed);
+        EXPECT_EQ(0U, plaintext.size());
+    }
+
+    // Now send data, incrementally.
+    for (size_t i = 0; i < ciphertext.length(); ++i) {
+        EXPECT_EQ(KM_ERROR_OK, UpdateOperation(empty_params, string(ciphertext.data() + i, 1),
+                                               &update_out_params, &plaintext, &input_consumed));
+        EXPECT_EQ(1U, input_consumed);
     }
+    EXPECT_EQ(1000U, plaintext.size());
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&plaintext));
+    EXPECT_EQ(string(1000, 'a'), plaintext);
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
-TEST_P(EncryptionOperationsTest, TripleDesEcbPkcs7PaddingCorrupted) {
+TEST_P(EncryptionOperationsTest, ChaCha20Poly1305BadAad) {
     ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
-                                           .TripleDesEncryptionKey(112)
-                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
-                                           .Authorization(TAG_PADDING, KM_PAD_PKCS7)));
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    string message = "12345678901234567890123456789012";
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
 
-    string message = "a";
-    string ciphertext = EncryptMessage(message, KM_MODE_ECB, KM_PAD_PKCS7);
-    EXPECT_EQ(8U, ciphertext.size());
-    EXPECT_NE(ciphertext, message);
-    ++ciphertext[ciphertext.size() / 2];
+    AuthorizationSet update_params;
+    update_params.push_back(TAG_ASSOCIATED_DATA, "foobar", 6);
 
-    AuthorizationSet begin_params(client_params());
-    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
-    begin_params.push_back(TAG_PADDING, KM_PAD_PKCS7);
-    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
-    string plaintext;
+    // Encrypt
+    AuthorizationSet begin_out_params;
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params, &begin_out_params));
+    AuthorizationSet update_out_params;
+    string ciphertext;
     size_t input_consumed;
-    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(ciphertext, &plaintext, &input_consumed));
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, message, &update_out_params, &ciphertext,
+                                           &input_consumed));
+    EXPECT_EQ(message.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&ciphertext));
+
+    // Grab nonce
+    EXPECT_NE(-1, begin_out_params.find(TAG_NONCE));
+    begin_params.push_back(begin_out_params);
+
+    update_params.Clear();
+    update_params.push_back(TAG_ASSOCIATED_DATA, "barfoo" /* Wrong AAD */, 6);
+
+    // Decrypt.
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params, &begin_out_params));
+    string plaintext;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, ciphertext, &update_out_params,
+                                           &plaintext, &input_consumed));
     EXPECT_EQ(ciphertext.size(), input_consumed);
-    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, FinishOperation(&plaintext));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(&plaintext));
+
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
 }
 
-struct TripleDesTestVector {
-    const char* name;
-    const keymaster_purpose_t purpose;
-    const keymaster_block_mode_t block_mode;
-    const keymaster_padding_t padding_mode;
-    const char* key;
-    const char* iv;
-    const char* input;
-    const char* output;
-};
+TEST_P(EncryptionOperationsTest, ChaCha20Poly1305WrongNonce) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    string message = "12345678901234567890123456789012";
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
+
+    AuthorizationSet update_params;
+    update_params.push_back(TAG_ASSOCIATED_DATA, "foobar", 6);
+
+    // Encrypt
+    AuthorizationSet begin_out_params;
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params, &begin_out_params));
+    AuthorizationSet update_out_params;
+    string ciphertext;
+    size_t input_consumed;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, message, &update_out_params, &ciphertext,
+                                           &input_consumed));
+    EXPECT_EQ(message.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&ciphertext));
+
+    begin_params.push_back(TAG_NONCE, "123456789012", 12);
+
+    // Decrypt
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params, &begin_out_params));
+    string plaintext;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, ciphertext, &update_out_params,
+                                           &plaintext, &input_consumed));
+    EXPECT_EQ(ciphertext.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(&plaintext));
+
+    // With wrong nonce, should have gotten garbage plaintext.
+    EXPECT_NE(message, plaintext);
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
+TEST_P(EncryptionOperationsTest, ChaCha20Poly1305CorruptTag) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(256)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    string aad = "foobar";
+    string message = "123456789012345678901234567890123456";
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_CHACHA20_POLY1305);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    begin_params.push_back(TAG_MAC_LENGTH, 128);
+    AuthorizationSet begin_out_params;
+
+    AuthorizationSet update_params;
+    update_params.push_back(TAG_ASSOCIATED_DATA, aad.data(), aad.size());
+
+    // Encrypt
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params, &begin_out_params));
+    AuthorizationSet update_out_params;
+    string ciphertext;
+    size_t input_consumed;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, message, &update_out_params, &ciphertext,
+                                           &input_consumed));
+    EXPECT_EQ(message.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation(&ciphertext));
+
+    // Corrupt tag
+    (*ciphertext.rbegin())++;
+
+    // Grab nonce.
+    EXPECT_NE(-1, begin_out_params.find(TAG_NONCE));
+    begin_params.push_back(begin_out_params);
+
+    // Decrypt.
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params, &begin_out_params));
+    string plaintext;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(update_params, ciphertext, &update_out_params,
+                                           &plaintext, &input_consumed));
+    EXPECT_EQ(ciphertext.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, FinishOperation(&plaintext));
+
+    EXPECT_EQ(message, plaintext);
+    EXPECT_EQ(0, GetParam()->keymaster0_calls());
+}
+
+TEST_P(EncryptionOperationsTest, TripleDesEcbRoundTripSuccess) {
+    auto auths = AuthorizationSetBuilder()
+                     .TripleDesEncryptionKey(112)
+                     .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                     .Padding(KM_PAD_NONE);
+
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(auths));
+    // Two-block message.
+    string message = "1234567890123456";
+    string ciphertext1 = EncryptMessage(message, KM_MODE_ECB, KM_PAD_NONE);
+    EXPECT_EQ(message.size(), ciphertext1.size());
+
+    string ciphertext2 = EncryptMessage(string(message), KM_MODE_ECB, KM_PAD_NONE);
+    EXPECT_EQ(message.size(), ciphertext2.size());
+
+    // ECB is deterministic.
+    EXPECT_EQ(ciphertext1, ciphertext2);
+
+    string plaintext = DecryptMessage(ciphertext1, KM_MODE_ECB, KM_PAD_NONE);
+    EXPECT_EQ(message, plaintext);
+}
+
+TEST_P(EncryptionOperationsTest, TripleDesEcbNotAuthorized) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .TripleDesEncryptionKey(112)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CBC)
+                                           .Padding(KM_PAD_NONE)));
+    // Two-block message.
+    string message = "1234567890123456";
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_BLOCK_MODE, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+}
+
+TEST_P(EncryptionOperationsTest, TripleDesEcbNoPaddingWrongInputSize) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .TripleDesEncryptionKey(112)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                           .Padding(KM_PAD_NONE)));
+    // Message is slightly shorter than two blocks.
+    string message = "123456789012345";
+
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
+    begin_params.push_back(TAG_PADDING, KM_PAD_NONE);
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+    string ciphertext;
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, FinishOperation(message, "", &ciphertext));
+}
+
+TEST_P(EncryptionOperationsTest, TripleDesEcbPkcs7Padding) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .TripleDesEncryptionKey(112)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                           .Authorization(TAG_PADDING, KM_PAD_PKCS7)));
+
+    // Try various message lengths; all should work.
+    for (size_t i = 0; i < 32; ++i) {
+        string message(i, 'a');
+        string ciphertext = EncryptMessage(message, KM_MODE_ECB, KM_PAD_PKCS7);
+        EXPECT_EQ(i + 8 - (i % 8), ciphertext.size());
+        string plaintext = DecryptMessage(ciphertext, KM_MODE_ECB, KM_PAD_PKCS7);
+        EXPECT_EQ(message, plaintext);
+    }
+}
+
+TEST_P(EncryptionOperationsTest, TripleDesEcbNoPaddingKeyWithPkcs7Padding) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .TripleDesEncryptionKey(112)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                           .Authorization(TAG_PADDING, KM_PAD_NONE)));
+
+    // Try various message lengths; all should fail.
+    for (size_t i = 0; i < 32; ++i) {
+        AuthorizationSet begin_params(client_params());
+        begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
+        begin_params.push_back(TAG_PADDING, KM_PAD_PKCS7);
+        EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PADDING_MODE,
+                  BeginOperation(KM_PURPOSE_ENCRYPT, begin_params));
+    }
+}
+
+TEST_P(EncryptionOperationsTest, TripleDesEcbPkcs7PaddingCorrupted) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .TripleDesEncryptionKey(112)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                           .Authorization(TAG_PADDING, KM_PAD_PKCS7)));
+
+    string message = "a";
+    string ciphertext = EncryptMessage(message, KM_MODE_ECB, KM_PAD_PKCS7);
+    EXPECT_EQ(8U, ciphertext.size());
+    EXPECT_NE(ciphertext, message);
+    ++ciphertext[ciphertext.size() / 2];
+
+    AuthorizationSet begin_params(client_params());
+    begin_params.push_back(TAG_BLOCK_MODE, KM_MODE_ECB);
+    begin_params.push_back(TAG_PADDING, KM_PAD_PKCS7);
+    EXPECT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, begin_params));
+    string plaintext;
+    size_t input_consumed;
+    EXPECT_EQ(KM_ERROR_OK, UpdateOperation(ciphertext, &plaintext, &input_consumed));
+    EXPECT_EQ(ciphertext.size(), input_consumed);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, FinishOperation(&plaintext));
+}
+
+struct TripleDesTestVector {
+    const char* name;
+    const keymaster_purpose_t purpose;
+    const keymaster_block_mode_t block_mode;
+    const keymaster_padding_t padding_mode;
+    const char* key;
+    const char* iv;
+    const char* input;
+    const char* output;
+};
 
 // These test vectors are from NIST CAVP, plus a few custom variants to test padding, since all of
 // the NIST vectors are multiples of the block size.
@@ -4480,5 +4841,2280 @@ TEST_F(HmacKeySharingTest, ComputeSharedHmacCorruptSeed) {
     }
 }
 
+/**
+ * Exercises AES operations directly, bypassing the keymaster device and enforcement, so that
+ * Operation APIs not exposed through keymaster messages can be tested.
+ */
+class AesOperationTest : public testing::Test {
+  protected:
+    AesOperationTest() : factory_(nullptr /* blob_maker */, &random_source_) {
+        memset(key_bytes_, 0x5a, sizeof(key_bytes_));
+    }
+
+    OperationPtr Begin(keymaster_purpose_t purpose, keymaster_block_mode_t block_mode,
+                       keymaster_padding_t padding, const AuthorizationSet& extra_begin_params,
+                       AuthorizationSet* output_params) {
+        // ChaCha20-Poly1305 needs a 256-bit key; everything else uses the first 128 bits.
+        size_t key_size = block_mode == KM_MODE_CHACHA20_POLY1305 ? 32 : 16;
+        AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                         .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                         .Authorization(TAG_KEY_SIZE, key_size * 8)
+                                         .Authorization(TAG_BLOCK_MODE, block_mode)
+                                         .Authorization(TAG_PADDING, padding)
+                                         .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                         .Authorization(TAG_CALLER_NONCE));
+        UniquePtr<Key> key;
+        EXPECT_EQ(KM_ERROR_OK,
+                  factory_.LoadKey(KeymasterKeyBlob(key_bytes_, key_size), AuthorizationSet(),
+                                   move(hw_enforced), AuthorizationSet(), &key));
+        if (!key) return nullptr;
+
+        AuthorizationSet begin_params(AuthorizationSetBuilder()
+                                          .Authorization(TAG_BLOCK_MODE, block_mode)
+                                          .Authorization(TAG_PADDING, padding));
+        if (block_mode == KM_MODE_GCM || block_mode == KM_MODE_CHACHA20_POLY1305)
+            begin_params.push_back(TAG_MAC_LENGTH, 128);
+        begin_params.push_back(extra_begin_params);
+
+        keymaster_error_t error;
+        OperationPtr op = factory_.GetOperationFactory(purpose)->CreateOperation(
+            move(*key), begin_params, &error);
+        EXPECT_EQ(KM_ERROR_OK, error);
+        if (!op) return nullptr;
+        EXPECT_EQ(KM_ERROR_OK, op->Begin(begin_params, output_params));
+        return op;
+    }
+
+    // Runs \p input through \p op in chunks of \p chunk_size using the span API, returning the
+    // concatenated output.
+    string ProcessInto(Operation* op, const string& input, size_t chunk_size,
+                       const AuthorizationSet& update_params) {
+        string result;
+        for (size_t pos = 0; pos < input.size(); pos += chunk_size) {
+            Buffer chunk(input.data() + pos, std::min(chunk_size, input.size() - pos));
+            size_t max_output;
+            EXPECT_EQ(KM_ERROR_OK,
+                      op->GetMaxOutputSize(chunk.available_read(), false, &max_output));
+            vector<uint8_t> out(max_output);
+            size_t written, consumed;
+            EXPECT_EQ(KM_ERROR_OK, op->UpdateInto(pos == 0 ? update_params : AuthorizationSet(),
+                                                  chunk, nullptr, out.data(), out.size(),
+                                                  &written, &consumed));
+            EXPECT_EQ(chunk.available_read(), consumed);
+            EXPECT_LE(written, max_output);
+            result.append(reinterpret_cast<const char*>(out.data()), written);
+        }
+
+        size_t max_output;
+        EXPECT_EQ(KM_ERROR_OK, op->GetMaxOutputSize(0, true, &max_output));
+        vector<uint8_t> out(max_output);
+        size_t written;
+        EXPECT_EQ(KM_ERROR_OK, op->FinishInto(AuthorizationSet(), Buffer(), Buffer(), nullptr,
+                                              out.data(), out.size(), &written));
+        result.append(reinterpret_cast<const char*>(out.data()), written);
+        return result;
+    }
+
+    string ProcessBuffered(Operation* op, const string& input,
+                           const AuthorizationSet& update_params) {
+        Buffer output;
+        size_t consumed;
+        EXPECT_EQ(KM_ERROR_OK, op->Update(update_params, Buffer(input.data(), input.size()),
+                                          nullptr, &output, &consumed));
+        EXPECT_EQ(input.size(), consumed);
+        EXPECT_EQ(KM_ERROR_OK,
+                  op->Finish(AuthorizationSet(), Buffer(), Buffer(), nullptr, &output));
+        return string(reinterpret_cast<const char*>(output.peek_read()), output.available_read());
+    }
+
+    SoftwareRandomSource random_source_;
+    AesKeyFactory factory_;
+    uint8_t key_bytes_[32];
+};
+
+TEST_F(AesOperationTest, UpdateIntoMatchesBufferPath) {
+    const uint8_t nonce[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    string message(1000, 'a');
+    AuthorizationSet aad(AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, "aad", 3));
+
+    struct {
+        keymaster_block_mode_t block_mode;
+        keymaster_padding_t padding;
+        size_t nonce_length;
+    } modes[] = {
+        {KM_MODE_ECB, KM_PAD_PKCS7, 0},
+        {KM_MODE_CBC, KM_PAD_PKCS7, 16},
+        {KM_MODE_CTR, KM_PAD_NONE, 16},
+        {KM_MODE_GCM, KM_PAD_NONE, 12},
+        {KM_MODE_CHACHA20_POLY1305, KM_PAD_NONE, 12},
+    };
+    for (auto& mode : modes) {
+        AuthorizationSet nonce_params;
+        if (mode.nonce_length) nonce_params.push_back(TAG_NONCE, nonce, mode.nonce_length);
+        AuthorizationSet no_params;
+        const AuthorizationSet& aad_params = mode.nonce_length == 12 ? aad : no_params;
+
+        AuthorizationSet out_params;
+        OperationPtr op = Begin(KM_PURPOSE_ENCRYPT, mode.block_mode, mode.padding, nonce_params,
+                                &out_params);
+        ASSERT_TRUE(op);
+        string expected = ProcessBuffered(op.get(), message, aad_params);
+
+        for (size_t chunk_size : {1, 15, 16, 17, 1000}) {
+            op = Begin(KM_PURPOSE_ENCRYPT, mode.block_mode, mode.padding, nonce_params,
+                       &out_params);
+            ASSERT_TRUE(op);
+            string ciphertext = ProcessInto(op.get(), message, chunk_size, aad_params);
+            EXPECT_EQ(expected, ciphertext)
+                << "mode " << mode.block_mode << " chunk " << chunk_size;
+
+            op = Begin(KM_PURPOSE_DECRYPT, mode.block_mode, mode.padding, nonce_params,
+                       &out_params);
+            ASSERT_TRUE(op);
+            EXPECT_EQ(message, ProcessInto(op.get(), ciphertext, chunk_size, aad_params))
+                << "mode " << mode.block_mode << " chunk " << chunk_size;
+        }
+    }
+}
+
+TEST_F(AesOperationTest, UpdateIntoInsufficientSpace) {
+    AuthorizationSet out_params;
+    OperationPtr op =
+        Begin(KM_PURPOSE_ENCRYPT, KM_MODE_CBC, KM_PAD_PKCS7, AuthorizationSet(), &out_params);
+    ASSERT_TRUE(op);
+
+    size_t max_output;
+    ASSERT_EQ(KM_ERROR_OK, op->GetMaxOutputSize(32, false, &max_output));
+    EXPECT_EQ(48U, max_output);
+    ASSERT_EQ(KM_ERROR_OK, op->GetMaxOutputSize(32, true, &max_output));
+    EXPECT_EQ(64U, max_output);
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, op->GetMaxOutputSize(SIZE_MAX, false, &max_output));
+
+    string message(32, 'a');
+    uint8_t out[64];
+    size_t written, consumed;
+    EXPECT_EQ(KM_ERROR_INSUFFICIENT_BUFFER_SPACE,
+              op->UpdateInto(AuthorizationSet(), Buffer(message.data(), message.size()), nullptr,
+                             out, 47, &written, &consumed));
+
+    // The failed call mustn't have consumed anything.
+    EXPECT_EQ(KM_ERROR_OK,
+              op->FinishInto(AuthorizationSet(), Buffer(message.data(), message.size()), Buffer(),
+                             nullptr, out, sizeof(out), &written));
+    EXPECT_EQ(48U, written);
+}
+
+TEST_F(AesOperationTest, GcmMaxOutputSizeIncludesTag) {
+    const uint8_t nonce[12] = {};
+    AuthorizationSet nonce_params(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce, 12));
+    AuthorizationSet out_params;
+    OperationPtr encrypt =
+        Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+    ASSERT_TRUE(encrypt);
+    size_t max_output;
+    ASSERT_EQ(KM_ERROR_OK, encrypt->GetMaxOutputSize(10, true, &max_output));
+    EXPECT_EQ(10U + 16 + 16 + 16, max_output);
+
+    OperationPtr decrypt =
+        Begin(KM_PURPOSE_DECRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+    ASSERT_TRUE(decrypt);
+    ASSERT_EQ(KM_ERROR_OK, decrypt->GetMaxOutputSize(10, false, &max_output));
+    EXPECT_EQ(10U + 16 + 16, max_output);
+}
+
+TEST_F(AesOperationTest, CipherContextCache) {
+    CipherContextCache cache(2);
+    AesKeyFactory::set_cipher_context_cache(&cache);
+    auto disable_cache = finally([&]() { AesKeyFactory::set_cipher_context_cache(nullptr); });
+
+    const uint8_t nonce1[12] = {1};
+    const uint8_t nonce2[12] = {2};
+    AuthorizationSet nonce1_params(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce1, 12));
+    AuthorizationSet nonce2_params(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce2, 12));
+    AuthorizationSet aad(AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, "aad", 3));
+    string message(100, 'a');
+    AuthorizationSet out_params;
+
+    // Compute the expected ciphertexts without the cache.
+    AesKeyFactory::set_cipher_context_cache(nullptr);
+    OperationPtr op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce1_params,
+                            &out_params);
+    ASSERT_TRUE(op);
+    string expected1 = ProcessBuffered(op.get(), message, aad);
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce2_params, &out_params);
+    ASSERT_TRUE(op);
+    string expected2 = ProcessBuffered(op.get(), message, aad);
+    EXPECT_NE(expected1, expected2);
+    EXPECT_EQ(0U, cache.size());
+
+    // The first operation populates the cache, the second reuses it with a different nonce.
+    AesKeyFactory::set_cipher_context_cache(&cache);
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce1_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(expected1, ProcessBuffered(op.get(), message, aad));
+    EXPECT_EQ(1U, cache.size());
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce2_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(expected2, ProcessBuffered(op.get(), message, aad));
+    EXPECT_EQ(1U, cache.size());
+
+    // Decryption is cached separately.
+    op = Begin(KM_PURPOSE_DECRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce2_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(message, ProcessBuffered(op.get(), expected2, aad));
+    EXPECT_EQ(2U, cache.size());
+
+    // A different key with the same (unset) key ID must not hit, and evicts an entry.
+    key_bytes_[0] ^= 1;
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce1_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_NE(expected1, ProcessBuffered(op.get(), message, aad));
+    EXPECT_EQ(2U, cache.size());
+
+    cache.Clear();
+    EXPECT_EQ(0U, cache.size());
+}
+
+// Computes an HMAC of \p message directly on an HmacKeyFactory operation, with key ID \p key_id.
+static string HmacWithFactory(const HmacKeyFactory& factory, const string& key_bytes,
+                              keymaster_digest_t digest, km_id_t key_id, const string& message) {
+    AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                     .Authorization(TAG_ALGORITHM, KM_ALGORITHM_HMAC)
+                                     .Authorization(TAG_KEY_SIZE, key_bytes.size() * 8)
+                                     .Authorization(TAG_DIGEST, digest)
+                                     .Authorization(TAG_MIN_MAC_LENGTH, 128));
+    UniquePtr<Key> key;
+    EXPECT_EQ(KM_ERROR_OK,
+              factory.LoadKey(KeymasterKeyBlob(reinterpret_cast<const uint8_t*>(key_bytes.data()),
+                                               key_bytes.size()),
+                              AuthorizationSet(), move(hw_enforced), AuthorizationSet(), &key));
+    if (!key) return "";
+
+    AuthorizationSet begin_params(AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 128));
+    keymaster_error_t error;
+    OperationPtr op = factory.GetOperationFactory(KM_PURPOSE_SIGN)
+                          ->CreateOperation(move(*key), begin_params, &error);
+    EXPECT_EQ(KM_ERROR_OK, error);
+    if (!op) return "";
+    op->set_key_id(key_id);
+
+    AuthorizationSet output_params;
+    EXPECT_EQ(KM_ERROR_OK, op->Begin(begin_params, &output_params));
+    Buffer output;
+    EXPECT_EQ(KM_ERROR_OK, op->Finish(AuthorizationSet(), Buffer(message.data(), message.size()),
+                                      Buffer(), &output_params, &output));
+    return string(reinterpret_cast<const char*>(output.peek_read()), output.available_read());
+}
+
+TEST(HmacContextCacheTest, MatchesUncachedMacs) {
+    SoftwareRandomSource random_source;
+    HmacKeyFactory factory(nullptr /* blob_maker */, &random_source);
+    HmacContextCache cache(2);
+    auto disable_cache = finally([&]() { HmacKeyFactory::set_context_cache(nullptr); });
+
+    string key1(32, 'k');
+    string key2(32, 'K');
+    string message1(32, 'a');
+    string message2(32, 'b');
+
+    // Compute the expected MACs without the cache.
+    string expected11 = HmacWithFactory(factory, key1, KM_DIGEST_SHA_2_256, 1, message1);
+    string expected12 = HmacWithFactory(factory, key1, KM_DIGEST_SHA_2_256, 1, message2);
+    string expected_sha1 = HmacWithFactory(factory, key1, KM_DIGEST_SHA1, 1, message1);
+    string expected21 = HmacWithFactory(factory, key2, KM_DIGEST_SHA_2_256, 1, message1);
+    EXPECT_EQ(16U, expected11.size());
+    EXPECT_NE(expected11, expected12);
+    EXPECT_NE(expected11, expected_sha1);
+    EXPECT_NE(expected11, expected21);
+    EXPECT_EQ(0U, cache.size());
+
+    // The first operation populates the cache, the second reuses it for a different message.
+    HmacKeyFactory::set_context_cache(&cache);
+    EXPECT_EQ(expected11, HmacWithFactory(factory, key1, KM_DIGEST_SHA_2_256, 1, message1));
+    EXPECT_EQ(1U, cache.size());
+    EXPECT_EQ(expected12, HmacWithFactory(factory, key1, KM_DIGEST_SHA_2_256, 1, message2));
+    EXPECT_EQ(1U, cache.size());
+
+    // Each digest is cached separately.
+    EXPECT_EQ(expected_sha1, HmacWithFactory(factory, key1, KM_DIGEST_SHA1, 1, message1));
+    EXPECT_EQ(2U, cache.size());
+
+    // A different key with the same key ID must not hit, and evicts the least recently used entry.
+    EXPECT_EQ(expected21, HmacWithFactory(factory, key2, KM_DIGEST_SHA_2_256, 1, message1));
+    EXPECT_EQ(2U, cache.size());
+    EXPECT_EQ(expected_sha1, HmacWithFactory(factory, key1, KM_DIGEST_SHA1, 1, message1));
+    EXPECT_EQ(2U, cache.size());
+
+    cache.Clear();
+    EXPECT_EQ(0U, cache.size());
+    EXPECT_EQ(expected11, HmacWithFactory(factory, key1, KM_DIGEST_SHA_2_256, 1, message1));
+}
+
+static void CountTask(void* context, size_t index) {
+    __atomic_fetch_add(&reinterpret_cast<uint32_t*>(context)[index], 1, __ATOMIC_RELAXED);
+}
+
+TEST(PthreadWorkerPoolTest, RunsEveryTaskOnce) {
+    for (size_t concurrency : {1, 2, 8}) {
+        PthreadWorkerPool pool(concurrency);
+        EXPECT_EQ(concurrency, pool.concurrency());
+        for (size_t task_count : {0, 1, 7, 100}) {
+            vector<uint32_t> counts(task_count + 1, 0);
+            pool.Run(CountTask, counts.data(), task_count);
+            for (size_t i = 0; i < task_count; ++i)
+                EXPECT_EQ(1U, counts[i]) << "task " << i << " of " << task_count;
+            EXPECT_EQ(0U, counts[task_count]);
+        }
+    }
+}
+
+TEST_F(AesOperationTest, ParallelUpdateMatchesSerial) {
+    PthreadWorkerPool pool(4);
+    auto disable_pool = finally([&]() { AesKeyFactory::set_worker_pool(nullptr, 0); });
+
+    const uint8_t nonce[16] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                               0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0};
+    AuthorizationSet nonce_params(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce, 16));
+    AuthorizationSet no_params;
+    string message;
+    for (size_t i = 0; i < 100003; ++i)
+        message.push_back(static_cast<char>(i * 7));
+
+    struct {
+        keymaster_block_mode_t block_mode;
+        keymaster_padding_t padding;
+        const AuthorizationSet& begin_params;
+        size_t message_length;
+    } cases[] = {
+        // The nonce makes the 128-bit counter wrap part-way through.
+        {KM_MODE_CTR, KM_PAD_NONE, nonce_params, message.size()},
+        {KM_MODE_ECB, KM_PAD_NONE, no_params, message.size() - message.size() % 16},
+        {KM_MODE_ECB, KM_PAD_PKCS7, no_params, message.size()},
+    };
+    for (auto& test : cases) {
+        string input = message.substr(0, test.message_length);
+        AuthorizationSet out_params;
+
+        AesKeyFactory::set_worker_pool(nullptr, 0);
+        OperationPtr op = Begin(KM_PURPOSE_ENCRYPT, test.block_mode, test.padding,
+                                test.begin_params, &out_params);
+        ASSERT_TRUE(op);
+        string expected = ProcessInto(op.get(), input, 30001, no_params);
+
+        AesKeyFactory::set_worker_pool(&pool, 64);
+        // Odd chunk sizes leave CTR mode part-way through a keystream block between updates.
+        for (size_t chunk_size : {input.size(), size_t(30001), size_t(4099)}) {
+            op = Begin(KM_PURPOSE_ENCRYPT, test.block_mode, test.padding, test.begin_params,
+                       &out_params);
+            ASSERT_TRUE(op);
+            EXPECT_EQ(expected, ProcessInto(op.get(), input, chunk_size, no_params))
+                << "mode " << test.block_mode << " chunk " << chunk_size;
+
+            op = Begin(KM_PURPOSE_DECRYPT, test.block_mode, test.padding, test.begin_params,
+                       &out_params);
+            ASSERT_TRUE(op);
+            EXPECT_EQ(input, ProcessInto(op.get(), expected, chunk_size, no_params))
+                << "mode " << test.block_mode << " chunk " << chunk_size;
+        }
+    }
+}
+
+TEST_F(AesOperationTest, RestartMatchesNewOperation) {
+    const uint8_t nonce1[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    const uint8_t nonce2[12] = {12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+    AuthorizationSet params1(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce1, 12));
+    AuthorizationSet params2(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce2, 12));
+    AuthorizationSet aad_params(
+        AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, "aad", 3));
+    string message = "a message that is not a whole number of blocks";
+    AuthorizationSet out_params;
+
+    OperationPtr op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, params2, &out_params);
+    ASSERT_TRUE(op);
+    string expected = ProcessBuffered(op.get(), message, aad_params);
+
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, params1, &out_params);
+    ASSERT_TRUE(op);
+    string first = ProcessBuffered(op.get(), message, aad_params);
+    EXPECT_NE(expected, first);
+
+    // Restart part-way through a message, too.
+    Buffer partial;
+    size_t consumed;
+    EXPECT_EQ(KM_ERROR_OK, op->Update(aad_params, Buffer("abc", 3), nullptr, &partial, &consumed));
+    out_params.Clear();
+    ASSERT_EQ(KM_ERROR_OK, op->Restart(params2, &out_params));
+    EXPECT_NE(-1, out_params.find(TAG_NONCE));
+    EXPECT_EQ(expected, ProcessBuffered(op.get(), message, aad_params));
+
+    // A decryption that fails tag verification doesn't affect the next message.
+    string corrupt = expected;
+    corrupt[corrupt.size() - 1] ^= 1;
+    op = Begin(KM_PURPOSE_DECRYPT, KM_MODE_GCM, KM_PAD_NONE, params2, &out_params);
+    ASSERT_TRUE(op);
+    Buffer output;
+    EXPECT_EQ(KM_ERROR_OK, op->Update(aad_params, Buffer(corrupt.data(), corrupt.size()), nullptr,
+                                      &output, &consumed));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+              op->Finish(AuthorizationSet(), Buffer(), Buffer(), nullptr, &output));
+    ASSERT_EQ(KM_ERROR_OK, op->Restart(params2, &out_params));
+    EXPECT_EQ(message, ProcessBuffered(op.get(), expected, aad_params));
+}
+
+TEST_F(AesOperationTest, GcmDecryptAnyChunkSize) {
+    const uint8_t nonce[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    AuthorizationSet nonce_params(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce, 12));
+    AuthorizationSet no_params;
+    string message;
+    for (size_t i = 0; i < 1000; ++i)
+        message.push_back(static_cast<char>(i * 3));
+
+    AuthorizationSet out_params;
+    OperationPtr op =
+        Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+    ASSERT_TRUE(op);
+    string ciphertext = ProcessBuffered(op.get(), message, no_params);
+
+    // Chunks smaller than the tag make the held-back tag bytes wrap around their buffer.
+    for (size_t chunk_size : {1, 5, 7, 15, 16, 17, 33, 1016}) {
+        op = Begin(KM_PURPOSE_DECRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+        ASSERT_TRUE(op);
+        EXPECT_EQ(message, ProcessInto(op.get(), ciphertext, chunk_size, no_params))
+            << "chunk " << chunk_size;
+    }
+}
+
+TEST_F(AesOperationTest, InPlaceMatchesBufferPath) {
+    const uint8_t nonce[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    string message;
+    for (size_t i = 0; i < 1024; ++i)
+        message.push_back(static_cast<char>(i * 5));
+    AuthorizationSet aad(AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, "aad", 3));
+    AuthorizationSet no_params;
+
+    struct {
+        keymaster_block_mode_t block_mode;
+        size_t nonce_length;
+        size_t tag_length;
+    } modes[] = {
+        {KM_MODE_ECB, 0, 0},
+        {KM_MODE_CBC, 16, 0},
+        {KM_MODE_CTR, 16, 0},
+        {KM_MODE_GCM, 12, 16},
+        {KM_MODE_CHACHA20_POLY1305, 12, 16},
+    };
+    for (auto& mode : modes) {
+        AuthorizationSet nonce_params;
+        if (mode.nonce_length) nonce_params.push_back(TAG_NONCE, nonce, mode.nonce_length);
+        const AuthorizationSet& aad_params = mode.tag_length ? aad : no_params;
+
+        AuthorizationSet out_params;
+        OperationPtr op =
+            Begin(KM_PURPOSE_ENCRYPT, mode.block_mode, KM_PAD_NONE, nonce_params, &out_params);
+        ASSERT_TRUE(op);
+        string expected = ProcessBuffered(op.get(), message, aad_params);
+        ASSERT_EQ(message.size() + mode.tag_length, expected.size());
+
+        // Encrypt in two pieces, the second with room for the tag.
+        vector<uint8_t> data(message.begin(), message.end());
+        data.resize(message.size() + mode.tag_length);
+        op = Begin(KM_PURPOSE_ENCRYPT, mode.block_mode, KM_PAD_NONE, nonce_params, &out_params);
+        ASSERT_TRUE(op);
+        EXPECT_EQ(KM_ERROR_OK, op->UpdateInPlace(aad_params, data.data(), 512, nullptr));
+        size_t output_length;
+        EXPECT_EQ(KM_ERROR_OK, op->FinishInPlace(no_params, data.data() + 512, message.size() - 512,
+                                                 data.size() - 512, nullptr, &output_length));
+        EXPECT_EQ(message.size() - 512 + mode.tag_length, output_length);
+        EXPECT_EQ(expected, string(data.begin(), data.end())) << "mode " << mode.block_mode;
+
+        // Decrypt in place, with the tag at the end of the last piece.
+        op = Begin(KM_PURPOSE_DECRYPT, mode.block_mode, KM_PAD_NONE, nonce_params, &out_params);
+        ASSERT_TRUE(op);
+        EXPECT_EQ(KM_ERROR_OK, op->UpdateInPlace(aad_params, data.data(), 512, nullptr));
+        EXPECT_EQ(KM_ERROR_OK, op->FinishInPlace(no_params, data.data() + 512, data.size() - 512,
+                                                 data.size() - 512, nullptr, &output_length));
+        EXPECT_EQ(message.size() - 512, output_length);
+        EXPECT_EQ(message, string(data.begin(), data.begin() + message.size()))
+            << "mode " << mode.block_mode;
+    }
+}
+
+TEST_F(AesOperationTest, InPlaceErrors) {
+    const uint8_t nonce[12] = {};
+    AuthorizationSet nonce_params(AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce, 12));
+    AuthorizationSet no_params;
+    uint8_t data[64] = {};
+    size_t output_length;
+    AuthorizationSet out_params;
+
+    // Padding changes the length, so isn't supported.
+    OperationPtr op =
+        Begin(KM_PURPOSE_ENCRYPT, KM_MODE_ECB, KM_PAD_PKCS7, AuthorizationSet(), &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, op->UpdateInPlace(no_params, data, 16, nullptr));
+
+    // ECB and CBC need whole blocks.
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_ECB, KM_PAD_NONE, AuthorizationSet(), &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, op->UpdateInPlace(no_params, data, 15, nullptr));
+
+    // No room for the tag.
+    op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(KM_ERROR_INSUFFICIENT_BUFFER_SPACE,
+              op->FinishInPlace(no_params, data, 40, 55, nullptr, &output_length));
+    EXPECT_EQ(KM_ERROR_OK, op->FinishInPlace(no_params, data, 40, 56, nullptr, &output_length));
+    EXPECT_EQ(56U, output_length);
+
+    // Corrupt tag.
+    data[55] ^= 1;
+    op = Begin(KM_PURPOSE_DECRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+              op->FinishInPlace(no_params, data, 56, 56, nullptr, &output_length));
+
+    // Decryption can't continue in place once UpdateInto() is holding back possible tag bytes.
+    op = Begin(KM_PURPOSE_DECRYPT, KM_MODE_GCM, KM_PAD_NONE, nonce_params, &out_params);
+    ASSERT_TRUE(op);
+    uint8_t out[64];
+    size_t written, consumed;
+    EXPECT_EQ(KM_ERROR_OK, op->UpdateInto(no_params, Buffer(data, 8), nullptr, out, sizeof(out),
+                                          &written, &consumed));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, op->UpdateInPlace(no_params, data + 8, 16, nullptr));
+}
+
+TEST_F(AesOperationTest, ChaCha20Poly1305Rfc8439Vector) {
+    // RFC 8439 section 2.8.2.
+    for (size_t i = 0; i < sizeof(key_bytes_); ++i)
+        key_bytes_[i] = static_cast<uint8_t>(0x80 + i);
+    string nonce = hex2str("070000004041424344454647");
+    AuthorizationSet nonce_params(
+        AuthorizationSetBuilder().Authorization(TAG_NONCE, nonce.data(), nonce.size()));
+    string aad = hex2str("50515253c0c1c2c3c4c5c6c7");
+    AuthorizationSet aad_params(
+        AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, aad.data(), aad.size()));
+    string message = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+                     "for the future, sunscreen would be it.";
+    string expected = hex2str("d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+                              "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+                              "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+                              "3ff4def08e4b7a9de576d26586cec64b6116"
+                              "1ae10b594f09e26a7e902ecbd0600691");
+
+    AuthorizationSet out_params;
+    OperationPtr op = Begin(KM_PURPOSE_ENCRYPT, KM_MODE_CHACHA20_POLY1305, KM_PAD_NONE,
+                            nonce_params, &out_params);
+    ASSERT_TRUE(op);
+    EXPECT_EQ(expected, ProcessBuffered(op.get(), message, aad_params));
+
+    // Restarting reuses the key with a fresh message state.
+    ASSERT_EQ(KM_ERROR_OK, op->Restart(nonce_params, &out_params));
+    EXPECT_EQ(expected, ProcessInto(op.get(), message, 7, aad_params));
+
+    op = Begin(KM_PURPOSE_DECRYPT, KM_MODE_CHACHA20_POLY1305, KM_PAD_NONE, nonce_params,
+               &out_params);
+    ASSERT_TRUE(op);
+    for (size_t chunk_size : {1, 15, 64, 65, 1000}) {
+        ASSERT_EQ(KM_ERROR_OK, op->Restart(nonce_params, &out_params));
+        EXPECT_EQ(message, ProcessInto(op.get(), expected, chunk_size, aad_params))
+            << "chunk " << chunk_size;
+    }
+}
+
+/**
+ * Base for tests of commands that only AndroidKeymaster offers (batches, vendor algorithms and the
+ * like), which drive a PureSoftKeymasterContext through request and response messages rather than
+ * a keymaster2 device.  As in Keymaster2Test, operations use the most recently generated or
+ * imported key.
+ */
+class PureSoftKeymasterTest : public testing::Test {
+  protected:
+    PureSoftKeymasterTest() : keymaster_(new PureSoftKeymasterContext, 16) {}
+
+    keymaster_error_t GenerateKey(const AuthorizationSetBuilder& builder) {
+        GenerateKeyRequest request;
+        request.key_description.Reinitialize(builder.build());
+        request.key_description.push_back(TAG_NO_AUTH_REQUIRED);
+        GenerateKeyResponse response;
+        keymaster_.GenerateKey(request, &response);
+        if (response.error == KM_ERROR_OK) {
+            key_blob_ = KeymasterKeyBlob(response.key_blob);
+            enforced_.Reinitialize(response.enforced);
+            unenforced_.Reinitialize(response.unenforced);
+        }
+        return response.error;
+    }
+
+    // Generates a key and returns its blob, for tests that use several keys at once.
+    KeymasterKeyBlob GenerateKeyBlob(const AuthorizationSetBuilder& builder) {
+        EXPECT_EQ(KM_ERROR_OK, GenerateKey(builder));
+        return key_blob_;
+    }
+
+    keymaster_error_t ImportKey(const AuthorizationSetBuilder& builder,
+                                keymaster_key_format_t format, const string& key_material) {
+        ImportKeyRequest request;
+        request.key_description.Reinitialize(builder.build());
+        request.key_description.push_back(TAG_NO_AUTH_REQUIRED);
+        request.key_format = format;
+        request.SetKeyMaterial(key_material.data(), key_material.size());
+        ImportKeyResponse response;
+        keymaster_.ImportKey(request, &response);
+        if (response.error == KM_ERROR_OK) {
+            key_blob_ = KeymasterKeyBlob(response.key_blob);
+            enforced_.Reinitialize(response.enforced);
+            unenforced_.Reinitialize(response.unenforced);
+        }
+        return response.error;
+    }
+
+    keymaster_error_t ExportKey(keymaster_key_format_t format, string* export_data) {
+        ExportKeyRequest request;
+        request.key_format = format;
+        request.SetKeyMaterial(key_blob_);
+        ExportKeyResponse response;
+        keymaster_.ExportKey(request, &response);
+        if (response.error == KM_ERROR_OK)
+            *export_data = string(reinterpret_cast<const char*>(response.key_data),
+                                  response.key_data_length);
+        return response.error;
+    }
+
+    keymaster_error_t BeginOperation(keymaster_purpose_t purpose, const AuthorizationSet& input_set,
+                                     AuthorizationSet* output_set = nullptr) {
+        BeginOperationRequest request;
+        request.purpose = purpose;
+        request.SetKeyMaterial(key_blob_);
+        request.additional_params = input_set;
+        BeginOperationResponse response;
+        keymaster_.BeginOperation(request, &response);
+        op_handle_ = response.op_handle;
+        if (response.error == KM_ERROR_OK && output_set) *output_set = response.output_params;
+        return response.error;
+    }
+
+    keymaster_error_t UpdateOperation(const string& message, string* output) {
+        UpdateOperationRequest request;
+        request.op_handle = op_handle_;
+        request.input.Reinitialize(message.data(), message.size());
+        UpdateOperationResponse response;
+        keymaster_.UpdateOperation(request, &response);
+        if (response.error == KM_ERROR_OK) {
+            EXPECT_EQ(message.size(), response.input_consumed);
+            if (output) output->append(ToString(response.output));
+        }
+        return response.error;
+    }
+
+    keymaster_error_t FinishOperation(const string& input, const string& signature,
+                                      string* output) {
+        return FinishOperation(AuthorizationSet(), input, signature, output);
+    }
+    keymaster_error_t FinishOperation(const AuthorizationSet& additional_params,
+                                      const string& input, const string& signature,
+                                      string* output) {
+        FinishOperationRequest request;
+        request.op_handle = op_handle_;
+        request.additional_params = additional_params;
+        request.input.Reinitialize(input.data(), input.size());
+        request.signature.Reinitialize(signature.data(), signature.size());
+        FinishOperationResponse response;
+        keymaster_.FinishOperation(request, &response);
+        if (response.error == KM_ERROR_OK && output) output->append(ToString(response.output));
+        return response.error;
+    }
+
+    // Runs \p message through a single-shot operation, returning the first error from Begin or
+    // Finish.  \p output, if given, is replaced with the operation's output.
+    keymaster_error_t ProcessMessage(keymaster_purpose_t purpose,
+                                     const AuthorizationSet& begin_params, const string& message,
+                                     const string& signature, string* output) {
+        if (output) output->clear();
+        keymaster_error_t error = BeginOperation(purpose, begin_params);
+        if (error != KM_ERROR_OK) return error;
+        return FinishOperation(message, signature, output);
+    }
+
+    static string ToString(const Buffer& buffer) {
+        return string(reinterpret_cast<const char*>(buffer.peek_read()), buffer.available_read());
+    }
+
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_blob_;
+    AuthorizationSet enforced_;
+    AuthorizationSet unenforced_;
+    keymaster_operation_handle_t op_handle_ = 0;
+};
+
+class BatchAeadOperationTest : public PureSoftKeymasterTest {
+  protected:
+    void GenerateGcmKey(AuthorizationSetBuilder builder) {
+        ASSERT_EQ(KM_ERROR_OK, GenerateKey(builder.AesEncryptionKey(128)
+                                               .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                               .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                               .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    }
+
+    void InitRequest(keymaster_purpose_t purpose, size_t num_records,
+                     BatchAeadOperationRequest* request) {
+        request->purpose = purpose;
+        request->SetKeyMaterial(key_blob_);
+        request->additional_params.Reinitialize(
+            AuthorizationSet(AuthorizationSetBuilder()
+                                 .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                 .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                 .Authorization(TAG_MAC_LENGTH, 128)));
+        ASSERT_TRUE(request->AllocateRecords(num_records));
+    }
+};
+
+TEST_F(BatchAeadOperationTest, RoundTrip) {
+    GenerateGcmKey(AuthorizationSetBuilder().Authorization(TAG_CALLER_NONCE));
+    const char* messages[] = {"first", "", "third message, somewhat longer than a block"};
+    const uint8_t caller_nonce[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+
+    BatchAeadOperationRequest encrypt_request;
+    InitRequest(KM_PURPOSE_ENCRYPT, 3, &encrypt_request);
+    for (size_t i = 0; i < 3; ++i) {
+        encrypt_request.records[i].aad.Reinitialize("aad", i);
+        encrypt_request.records[i].input.Reinitialize(messages[i], strlen(messages[i]));
+    }
+    encrypt_request.records[1].nonce.Reinitialize(caller_nonce, sizeof(caller_nonce));
+
+    BatchAeadOperationResponse encrypted;
+    keymaster_.BatchAeadOperation(encrypt_request, &encrypted);
+    ASSERT_EQ(KM_ERROR_OK, encrypted.error);
+    ASSERT_EQ(3U, encrypted.num_results);
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(KM_ERROR_OK, encrypted.results[i].error);
+        EXPECT_EQ(12U, encrypted.results[i].nonce.available_read());
+        EXPECT_EQ(strlen(messages[i]) + 16, encrypted.results[i].output.available_read());
+    }
+    EXPECT_EQ(string(reinterpret_cast<const char*>(caller_nonce), sizeof(caller_nonce)),
+              ToString(encrypted.results[1].nonce));
+    EXPECT_NE(ToString(encrypted.results[0].nonce), ToString(encrypted.results[2].nonce));
+
+    BatchAeadOperationRequest decrypt_request;
+    InitRequest(KM_PURPOSE_DECRYPT, 3, &decrypt_request);
+    for (size_t i = 0; i < 3; ++i) {
+        decrypt_request.records[i].nonce.Reinitialize(encrypted.results[i].nonce);
+        decrypt_request.records[i].aad.Reinitialize("aad", i);
+        decrypt_request.records[i].input.Reinitialize(encrypted.results[i].output);
+    }
+    // Corrupt the tag of the middle record only.
+    string corrupt = ToString(encrypted.results[1].output);
+    corrupt[corrupt.size() - 1] ^= 1;
+    decrypt_request.records[1].input.Reinitialize(corrupt.data(), corrupt.size());
+
+    BatchAeadOperationResponse decrypted;
+    keymaster_.BatchAeadOperation(decrypt_request, &decrypted);
+    ASSERT_EQ(KM_ERROR_OK, decrypted.error);
+    ASSERT_EQ(3U, decrypted.num_results);
+    EXPECT_EQ(KM_ERROR_OK, decrypted.results[0].error);
+    EXPECT_EQ(messages[0], ToString(decrypted.results[0].output));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, decrypted.results[1].error);
+    EXPECT_EQ(KM_ERROR_OK, decrypted.results[2].error);
+    EXPECT_EQ(messages[2], ToString(decrypted.results[2].output));
+}
+
+TEST_F(BatchAeadOperationTest, EnforcesNonceRules) {
+    GenerateGcmKey(AuthorizationSetBuilder());
+    const uint8_t nonce[12] = {};
+
+    BatchAeadOperationRequest request;
+    InitRequest(KM_PURPOSE_ENCRYPT, 2, &request);
+    request.records[0].nonce.Reinitialize(nonce, sizeof(nonce));
+    request.records[1].input.Reinitialize("data", 4);
+
+    BatchAeadOperationResponse response;
+    keymaster_.BatchAeadOperation(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_EQ(KM_ERROR_CALLER_NONCE_PROHIBITED, response.results[0].error);
+    EXPECT_EQ(KM_ERROR_OK, response.results[1].error);
+
+    // Decryption needs a nonce of the right length for every record.
+    BatchAeadOperationRequest decrypt_request;
+    InitRequest(KM_PURPOSE_DECRYPT, 3, &decrypt_request);
+    decrypt_request.records[0].nonce.Reinitialize(nonce, 8);
+    decrypt_request.records[2].nonce.Reinitialize(response.results[1].nonce);
+    decrypt_request.records[2].input.Reinitialize(response.results[1].output);
+
+    BatchAeadOperationResponse decrypted;
+    keymaster_.BatchAeadOperation(decrypt_request, &decrypted);
+    ASSERT_EQ(KM_ERROR_OK, decrypted.error);
+    EXPECT_EQ(KM_ERROR_INVALID_NONCE, decrypted.results[0].error);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, decrypted.results[1].error);
+    EXPECT_EQ(KM_ERROR_OK, decrypted.results[2].error);
+    EXPECT_EQ("data", ToString(decrypted.results[2].output));
+}
+
+TEST_F(BatchAeadOperationTest, EachRecordCountsAsAUse) {
+    GenerateGcmKey(AuthorizationSetBuilder().Authorization(TAG_MAX_USES_PER_BOOT, 3));
+
+    BatchAeadOperationRequest request;
+    InitRequest(KM_PURPOSE_ENCRYPT, 4, &request);
+    BatchAeadOperationResponse response;
+    keymaster_.BatchAeadOperation(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(4U, response.num_results);
+    EXPECT_EQ(KM_ERROR_OK, response.results[0].error);
+    EXPECT_EQ(KM_ERROR_OK, response.results[1].error);
+    EXPECT_EQ(KM_ERROR_OK, response.results[2].error);
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED, response.results[3].error);
+}
+
+TEST_F(BatchAeadOperationTest, RejectsOtherModes) {
+    GenerateGcmKey(AuthorizationSetBuilder());
+
+    BatchAeadOperationRequest request;
+    InitRequest(KM_PURPOSE_ENCRYPT, 1, &request);
+    request.additional_params.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)));
+    BatchAeadOperationResponse response;
+    keymaster_.BatchAeadOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_BLOCK_MODE, response.error);
+}
+
+class BatchVerifySignaturesTest : public PureSoftKeymasterTest {
+  protected:
+    string Sign(const AuthorizationSet& params, const string& message) {
+        string signature;
+        EXPECT_EQ(KM_ERROR_OK, ProcessMessage(KM_PURPOSE_SIGN, params, message, "", &signature));
+        return signature;
+    }
+
+    // Verifies each (input, signature) pair in one batch, returning the per-record results.
+    vector<keymaster_error_t> BatchVerify(const AuthorizationSet& params,
+                                          const vector<std::pair<string, string>>& pairs,
+                                          keymaster_error_t* error) {
+        BatchVerifySignaturesRequest request;
+        request.SetKeyMaterial(key_blob_);
+        request.additional_params = params;
+        EXPECT_TRUE(request.AllocateRecords(pairs.size()));
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            request.records[i].input.Reinitialize(pairs[i].first.data(), pairs[i].first.size());
+            request.records[i].signature.Reinitialize(pairs[i].second.data(),
+                                                      pairs[i].second.size());
+        }
+
+        BatchVerifySignaturesResponse response;
+        keymaster_.BatchVerifySignatures(request, &response);
+        *error = response.error;
+        return vector<keymaster_error_t>(response.results,
+                                         response.results + response.num_results);
+    }
+};
+
+TEST_F(BatchVerifySignaturesTest, RsaMixedResults) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+    string signature1 = Sign(params, "first entry");
+    string signature2 = Sign(params, "second entry");
+    string corrupted = signature2;
+    corrupted[corrupted.size() / 2] ^= 1;
+
+    keymaster_error_t error;
+    vector<keymaster_error_t> results = BatchVerify(params,
+                                                    {{"first entry", signature1},
+                                                     {"second entry", signature1},
+                                                     {"second entry", corrupted},
+                                                     {"second entry", ""},
+                                                     {"second entry", signature2}},
+                                                    &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(5U, results.size());
+    EXPECT_EQ(KM_ERROR_OK, results[0]);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, results[1]);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, results[2]);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, results[3]);
+    // Failures don't affect the records after them.
+    EXPECT_EQ(KM_ERROR_OK, results[4]);
+}
+
+TEST_F(BatchVerifySignaturesTest, EcdsaMessagesAndDigests) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Digest(KM_DIGEST_SHA_2_256)));
+    AuthorizationSet sha256_params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+    AuthorizationSet none_params(AuthorizationSetBuilder().Digest(KM_DIGEST_NONE));
+
+    vector<string> messages = {"log entry 1", "log entry 2", "log entry 3"};
+    vector<std::pair<string, string>> message_pairs;
+    vector<std::pair<string, string>> digest_pairs;
+    for (const string& message : messages) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const uint8_t*>(message.data()), message.size(), digest);
+        string digest_string(reinterpret_cast<const char*>(digest), sizeof(digest));
+        string signature = Sign(sha256_params, message);
+        message_pairs.push_back({message, signature});
+        digest_pairs.push_back({digest_string, signature});
+    }
+    message_pairs.push_back({"log entry 4", message_pairs[0].second});
+    digest_pairs.push_back({digest_pairs[1].first, digest_pairs[2].second});
+
+    // A signature over a message verifies against its digest with KM_DIGEST_NONE.
+    keymaster_error_t error;
+    for (auto* test : {&message_pairs, &digest_pairs}) {
+        const AuthorizationSet& params = test == &message_pairs ? sha256_params : none_params;
+        vector<keymaster_error_t> results = BatchVerify(params, *test, &error);
+        ASSERT_EQ(KM_ERROR_OK, error);
+        ASSERT_EQ(4U, results.size());
+        EXPECT_EQ(KM_ERROR_OK, results[0]);
+        EXPECT_EQ(KM_ERROR_OK, results[1]);
+        EXPECT_EQ(KM_ERROR_OK, results[2]);
+        EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, results[3]);
+    }
+}
+
+TEST_F(BatchVerifySignaturesTest, EachRecordCountsAsAUse) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Authorization(TAG_MAX_USES_PER_BOOT, 3)));
+    AuthorizationSet params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+    string signature = Sign(params, "message");
+
+    keymaster_error_t error;
+    vector<keymaster_error_t> results =
+        BatchVerify(params, {{"message", signature}, {"message", signature}, {"message", ""}},
+                    &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(3U, results.size());
+    // Signing used the first of the three uses.
+    EXPECT_EQ(KM_ERROR_OK, results[0]);
+    EXPECT_EQ(KM_ERROR_OK, results[1]);
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED, results[2]);
+}
+
+TEST_F(BatchVerifySignaturesTest, RejectsSymmetricKeys) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .HmacKey(128)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 256)));
+    keymaster_error_t error;
+    vector<keymaster_error_t> results = BatchVerify(
+        AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)),
+        {{"message", "mac"}}, &error);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, error);
+    EXPECT_TRUE(results.empty());
+}
+
+class BatchComputeMacsTest : public PureSoftKeymasterTest {
+  protected:
+    KeymasterKeyBlob GenerateHmacKey(keymaster_digest_t digest) {
+        return GenerateKeyBlob(AuthorizationSetBuilder()
+                                   .HmacKey(256)
+                                   .Digest(digest)
+                                   .Authorization(TAG_MIN_MAC_LENGTH, 128));
+    }
+
+    // MACs \p message under \p key_blob, which becomes the current key.
+    string Mac(const KeymasterKeyBlob& key_blob, const string& message) {
+        key_blob_ = key_blob;
+        string mac;
+        EXPECT_EQ(KM_ERROR_OK, ProcessMessage(KM_PURPOSE_SIGN, mac_params_, message, "", &mac));
+        return mac;
+    }
+
+    // MACs each (key, message) pair in one batch, returning the per-record results.
+    void BatchMac(const AuthorizationSet& params,
+                  const vector<std::pair<const KeymasterKeyBlob*, string>>& records,
+                  BatchComputeMacsResponse* response) {
+        BatchComputeMacsRequest request;
+        request.additional_params = params;
+        ASSERT_TRUE(request.AllocateRecords(records.size()));
+        for (size_t i = 0; i < records.size(); ++i) {
+            request.records[i].SetKeyMaterial(*records[i].first);
+            request.records[i].input.Reinitialize(records[i].second.data(),
+                                                  records[i].second.size());
+        }
+        keymaster_.BatchComputeMacs(request, response);
+    }
+
+    static string MacOf(const MacRecordResult& result) {
+        return string(reinterpret_cast<const char*>(result.mac.peek_read()),
+                      result.mac.available_read());
+    }
+
+    AuthorizationSet mac_params_{AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 128)};
+};
+
+TEST_F(BatchComputeMacsTest, MatchesIndividualOperations) {
+    KeymasterKeyBlob sha256_key = GenerateHmacKey(KM_DIGEST_SHA_2_256);
+    KeymasterKeyBlob sha1_key = GenerateHmacKey(KM_DIGEST_SHA1);
+    KeymasterKeyBlob sha512_key = GenerateHmacKey(KM_DIGEST_SHA_2_512);
+    KeymasterKeyBlob aes_key = GenerateKeyBlob(AuthorizationSetBuilder()
+                                                   .AesEncryptionKey(128)
+                                                   .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                                                   .Padding(KM_PAD_NONE));
+
+    BatchComputeMacsResponse response;
+    BatchMac(mac_params_,
+             {{&sha256_key, "message 1"},
+              {&sha1_key, "message 2"},
+              {&aes_key, "message 3"},
+              {&sha512_key, "message 4"},
+              {&sha256_key, "message 5"}},
+             &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(5U, response.num_results);
+    EXPECT_EQ(KM_ERROR_OK, response.results[0].error);
+    EXPECT_EQ(Mac(sha256_key, "message 1"), MacOf(response.results[0]));
+    EXPECT_EQ(KM_ERROR_OK, response.results[1].error);
+    EXPECT_EQ(Mac(sha1_key, "message 2"), MacOf(response.results[1]));
+    // A bad record doesn't affect the ones after it.
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, response.results[2].error);
+    EXPECT_EQ(0U, response.results[2].mac.available_read());
+    EXPECT_EQ(KM_ERROR_OK, response.results[3].error);
+    EXPECT_EQ(Mac(sha512_key, "message 4"), MacOf(response.results[3]));
+    EXPECT_EQ(KM_ERROR_OK, response.results[4].error);
+    EXPECT_EQ(Mac(sha256_key, "message 5"), MacOf(response.results[4]));
+}
+
+TEST_F(BatchComputeMacsTest, ValidatesLikeBeginOperation) {
+    KeymasterKeyBlob key = GenerateHmacKey(KM_DIGEST_SHA_2_256);
+    KeymasterKeyBlob corrupted = key;
+    corrupted.writable_data()[corrupted.key_material_size / 2] ^= 1;
+
+    BatchComputeMacsResponse response;
+    BatchMac(AuthorizationSet(), {{&key, "message"}}, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(1U, response.num_results);
+    EXPECT_EQ(KM_ERROR_MISSING_MAC_LENGTH, response.results[0].error);
+
+    BatchMac(AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 96)),
+             {{&key, "message"}, {&corrupted, "message"}}, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(2U, response.num_results);
+    EXPECT_EQ(KM_ERROR_INVALID_MAC_LENGTH, response.results[0].error);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, response.results[1].error);
+}
+
+TEST_F(BatchComputeMacsTest, EachRecordCountsAsAUse) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AuthorizationSetBuilder()
+                                               .HmacKey(256)
+                                               .Digest(KM_DIGEST_SHA_2_256)
+                                               .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                               .Authorization(TAG_MAX_USES_PER_BOOT, 2));
+
+    BatchComputeMacsResponse response;
+    BatchMac(mac_params_, {{&key, "a"}, {&key, "b"}, {&key, "c"}}, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(3U, response.num_results);
+    EXPECT_EQ(KM_ERROR_OK, response.results[0].error);
+    EXPECT_EQ(KM_ERROR_OK, response.results[1].error);
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED, response.results[2].error);
+}
+
+TEST_F(BatchComputeMacsTest, UsesContextCache) {
+    HmacContextCache cache(4);
+    HmacKeyFactory::set_context_cache(&cache);
+    auto disable_cache = finally([&]() { HmacKeyFactory::set_context_cache(nullptr); });
+
+    // HMAC-SHA256 records bypass HmacOperation's context, so use another digest.
+    KeymasterKeyBlob key1 = GenerateHmacKey(KM_DIGEST_SHA_2_512);
+    KeymasterKeyBlob key2 = GenerateHmacKey(KM_DIGEST_SHA_2_512);
+    BatchComputeMacsResponse response;
+    BatchMac(mac_params_, {{&key1, "a"}, {&key2, "b"}, {&key1, "c"}, {&key2, "d"}}, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(4U, response.num_results);
+    EXPECT_EQ(2U, cache.size());
+
+    HmacKeyFactory::set_context_cache(nullptr);
+    EXPECT_EQ(Mac(key1, "a"), MacOf(response.results[0]));
+    EXPECT_EQ(Mac(key2, "b"), MacOf(response.results[1]));
+    EXPECT_EQ(Mac(key1, "c"), MacOf(response.results[2]));
+    EXPECT_EQ(Mac(key2, "d"), MacOf(response.results[3]));
+}
+
+TEST_F(BatchComputeMacsTest, ComputesSha256RecordsInLanes) {
+    // Enough records to refill every lane a few times, with messages spanning several blocks and
+    // a key longer than the SHA-256 block size, interleaved with records that take other paths.
+    KeymasterKeyBlob short_key = GenerateHmacKey(KM_DIGEST_SHA_2_256);
+    KeymasterKeyBlob long_key = GenerateKeyBlob(AuthorizationSetBuilder()
+                                                    .HmacKey(1024)
+                                                    .Digest(KM_DIGEST_SHA_2_256)
+                                                    .Authorization(TAG_MIN_MAC_LENGTH, 128));
+    KeymasterKeyBlob sha1_key = GenerateHmacKey(KM_DIGEST_SHA1);
+    KeymasterKeyBlob corrupted = short_key;
+    corrupted.writable_data()[corrupted.key_material_size / 2] ^= 1;
+
+    vector<std::pair<const KeymasterKeyBlob*, string>> records;
+    for (size_t i = 0; i < 3 * HmacSha256Lanes() + 1; ++i) {
+        const KeymasterKeyBlob* key = (i % 5 == 4) ? &sha1_key : (i % 3) ? &short_key : &long_key;
+        if (i == 7) key = &corrupted;
+        records.push_back({key, string(i * 37 % 200, static_cast<char>('a' + i))});
+    }
+
+    BatchComputeMacsResponse response;
+    BatchMac(mac_params_, records, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(records.size(), response.num_results);
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (i == 7) {
+            EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, response.results[i].error);
+            continue;
+        }
+        EXPECT_EQ(KM_ERROR_OK, response.results[i].error) << "record " << i;
+        EXPECT_EQ(Mac(*records[i].first, records[i].second), MacOf(response.results[i]))
+            << "record " << i;
+    }
+}
+
+class SegmentedInputTest : public PureSoftKeymasterTest {
+  protected:
+    keymaster_error_t UpdateSegments(const vector<string>& segments, string* output,
+                                     const AuthorizationSet& params = AuthorizationSet()) {
+        UpdateOperationRequest request;
+        request.op_handle = op_handle_;
+        request.additional_params = params;
+        EXPECT_TRUE(request.AllocateInputSegments(segments.size()));
+        size_t total = 0;
+        for (size_t i = 0; i < segments.size(); ++i) {
+            request.input_segments[i].Reinitialize(segments[i].data(), segments[i].size());
+            total += segments[i].size();
+        }
+
+        UpdateOperationResponse response;
+        keymaster_.UpdateOperation(request, &response);
+        if (response.error == KM_ERROR_OK) {
+            EXPECT_EQ(total, response.input_consumed);
+            output->append(ToString(response.output));
+        }
+        return response.error;
+    }
+
+    keymaster_error_t FinishSegments(const vector<string>& segments, string* output,
+                                     const AuthorizationSet& params = AuthorizationSet(),
+                                     const string& signature = "") {
+        FinishOperationRequest request;
+        request.op_handle = op_handle_;
+        request.additional_params = params;
+        request.signature.Reinitialize(signature.data(), signature.size());
+        EXPECT_TRUE(request.AllocateInputSegments(segments.size()));
+        for (size_t i = 0; i < segments.size(); ++i)
+            request.input_segments[i].Reinitialize(segments[i].data(), segments[i].size());
+
+        FinishOperationResponse response;
+        keymaster_.FinishOperation(request, &response);
+        if (response.error == KM_ERROR_OK && output) output->append(ToString(response.output));
+        return response.error;
+    }
+};
+
+TEST_F(SegmentedInputTest, AesEcbMatchesContiguous) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_PKCS7)));
+    AuthorizationSet params(AuthorizationSetBuilder().EcbMode().Padding(KM_PAD_PKCS7));
+    vector<string> pieces = {"header", "", "a payload that spans several AES blocks", "x",
+                             "trailer"};
+    string message;
+    for (const string& piece : pieces)
+        message += piece;
+
+    string expected;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+    ASSERT_EQ(KM_ERROR_OK, FinishOperation(message, "", &expected));
+
+    // Partial blocks are carried from one segment to the next, and between requests.
+    string ciphertext;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+    ASSERT_EQ(KM_ERROR_OK, UpdateSegments({pieces[0], pieces[1], pieces[2]}, &ciphertext));
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({pieces[3], pieces[4]}, &ciphertext));
+    EXPECT_EQ(expected, ciphertext);
+
+    string plaintext;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, params));
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({ciphertext.substr(0, 7), ciphertext.substr(7, 20),
+                                           ciphertext.substr(27)},
+                                          &plaintext));
+    EXPECT_EQ(message, plaintext);
+}
+
+TEST_F(SegmentedInputTest, GcmTagSplitAcrossSegments) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                .Padding(KM_PAD_NONE)
+                                .Authorization(TAG_MAC_LENGTH, 128));
+    AuthorizationSet aad(AuthorizationSetBuilder().Authorization(TAG_ASSOCIATED_DATA, "aad", 3));
+    string message = "first second third";
+
+    AuthorizationSet begin_output;
+    string ciphertext;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params, &begin_output));
+    ASSERT_EQ(KM_ERROR_OK, UpdateSegments({"first ", "second"}, &ciphertext, aad));
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({" third"}, &ciphertext));
+    ASSERT_EQ(message.size() + 16, ciphertext.size());
+
+    keymaster_blob_t nonce;
+    ASSERT_TRUE(begin_output.GetTagValue(TAG_NONCE, &nonce));
+    AuthorizationSet decrypt_params(params);
+    decrypt_params.push_back(TAG_NONCE, nonce.data, nonce.data_length);
+
+    string plaintext;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, decrypt_params));
+    ASSERT_EQ(KM_ERROR_OK, FinishOperation(aad, ciphertext, "", &plaintext));
+    EXPECT_EQ(message, plaintext);
+
+    size_t data_length = message.size();
+    plaintext.clear();
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, decrypt_params));
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({ciphertext.substr(0, data_length + 6),
+                                           ciphertext.substr(data_length + 6, 4),
+                                           ciphertext.substr(data_length + 10)},
+                                          &plaintext, aad));
+    EXPECT_EQ(message, plaintext);
+}
+
+TEST_F(SegmentedInputTest, HmacMatchesContiguous) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .HmacKey(256)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 256)));
+    AuthorizationSet params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256));
+
+    string expected;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, params));
+    ASSERT_EQ(KM_ERROR_OK, FinishOperation("abcdef", "", &expected));
+
+    string mac;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, params));
+    ASSERT_EQ(KM_ERROR_OK, UpdateSegments({"a", "", "bc"}, &mac));
+    EXPECT_EQ(0U, mac.size());
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({"d", "ef"}, &mac));
+    EXPECT_EQ(expected, mac);
+}
+
+TEST_F(SegmentedInputTest, RsaSignAndVerify) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+
+    // PKCS#1 v1.5 signatures are deterministic, so segmenting mustn't change the result.
+    string expected;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, params));
+    ASSERT_EQ(KM_ERROR_OK, FinishOperation("header, payload, trailer", "", &expected));
+
+    string signature;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, params));
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({"header, ", "payload, ", "trailer"}, &signature));
+    EXPECT_EQ(expected, signature);
+
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_VERIFY, params));
+    EXPECT_EQ(KM_ERROR_OK,
+              FinishSegments({"header, payload", ", trailer"}, nullptr, AuthorizationSet(),
+                             signature));
+}
+
+TEST_F(SegmentedInputTest, EcdsaSignAndVerify) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_SHA_2_256)));
+    AuthorizationSet params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+
+    string signature;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_SIGN, params));
+    ASSERT_EQ(KM_ERROR_OK, UpdateSegments({"header, ", "payload, "}, &signature));
+    ASSERT_EQ(KM_ERROR_OK, FinishSegments({"trailer"}, &signature));
+
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_VERIFY, params));
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation("header, payload, trailer", signature, nullptr));
+
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_VERIFY, params));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+              FinishSegments({"header, ", "trailer"}, nullptr, AuthorizationSet(), signature));
+}
+
+TEST_F(SegmentedInputTest, RejectsInputWithSegments) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_NONE)));
+    AuthorizationSet params(AuthorizationSetBuilder().EcbMode().Padding(KM_PAD_NONE));
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+
+    UpdateOperationRequest request;
+    request.op_handle = op_handle_;
+    request.input.Reinitialize("0123456789abcdef", 16);
+    ASSERT_TRUE(request.AllocateInputSegments(1));
+    request.input_segments[0].Reinitialize("0123456789abcdef", 16);
+    UpdateOperationResponse response;
+    keymaster_.UpdateOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, response.error);
+}
+
+class BulkDataChannelTest : public PureSoftKeymasterTest {
+  protected:
+    BulkDataChannelTest() : channel_(&keymaster_) {}
+
+    void SetUp() override {
+        int fd = BulkDataChannel::CreateMemfd("bulk_data_channel_test", kRegionSize);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(KM_ERROR_OK, channel_.Map(fd, kRegionSize));
+        close(fd);
+    }
+
+    string Region(size_t offset, size_t length) {
+        return string(reinterpret_cast<const char*>(channel_.data() + offset), length);
+    }
+
+    static const size_t kRegionSize = 256 * 1024;
+
+    BulkDataChannel channel_;
+};
+
+const size_t BulkDataChannelTest::kRegionSize;
+
+TEST_F(BulkDataChannelTest, CtrMatchesMessagePath) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_CALLER_NONCE)));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)
+                                .Padding(KM_PAD_NONE)
+                                .Authorization(TAG_NONCE, "0123456789abcdef", 16));
+    string message(100000, 0);
+    for (size_t i = 0; i < message.size(); ++i)
+        message[i] = static_cast<char>(i * 13);
+
+    string expected;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+    ASSERT_EQ(KM_ERROR_OK, FinishOperation(message, "", &expected));
+
+    const size_t offset = 1000;
+    memcpy(channel_.data() + offset, message.data(), message.size());
+    AuthorizationSet output_params;
+    size_t output_length;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+    ASSERT_EQ(KM_ERROR_OK, channel_.Update(op_handle_, AuthorizationSet(), offset, 4097,
+                                           &output_params));
+    ASSERT_EQ(KM_ERROR_OK,
+              channel_.Finish(op_handle_, AuthorizationSet(), offset + 4097,
+                              message.size() - 4097, message.size() - 4097, &output_params,
+                              &output_length));
+    EXPECT_EQ(message.size() - 4097, output_length);
+    EXPECT_EQ(expected, Region(offset, message.size()));
+    EXPECT_FALSE(keymaster_.has_operation(op_handle_));
+}
+
+TEST_F(BulkDataChannelTest, GcmRoundTrip) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_MIN_MAC_LENGTH, 128)));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                .Padding(KM_PAD_NONE)
+                                .Authorization(TAG_MAC_LENGTH, 128));
+    const string message = "Bulk data, encrypted where it lies.";
+    memcpy(channel_.data(), message.data(), message.size());
+
+    AuthorizationSet begin_output, output_params;
+    size_t output_length;
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params, &begin_output));
+    ASSERT_EQ(KM_ERROR_OK, channel_.Finish(op_handle_, AuthorizationSet(), 0, message.size(),
+                                           message.size() + 16, &output_params,
+                                           &output_length));
+    ASSERT_EQ(message.size() + 16, output_length);
+    EXPECT_NE(message, Region(0, message.size()));
+
+    keymaster_blob_t nonce;
+    ASSERT_TRUE(begin_output.GetTagValue(TAG_NONCE, &nonce));
+    params.push_back(TAG_NONCE, nonce.data, nonce.data_length);
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_DECRYPT, params));
+    ASSERT_EQ(KM_ERROR_OK, channel_.Finish(op_handle_, AuthorizationSet(), 0, output_length,
+                                           output_length, &output_params, &output_length));
+    EXPECT_EQ(message.size(), output_length);
+    EXPECT_EQ(message, Region(0, message.size()));
+}
+
+TEST_F(BulkDataChannelTest, RejectsRangesOutsideRegion) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_NONE)));
+    AuthorizationSet params(AuthorizationSetBuilder().EcbMode().Padding(KM_PAD_NONE));
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+
+    AuthorizationSet output_params;
+    size_t output_length;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, channel_.Update(op_handle_, AuthorizationSet(),
+                                                         kRegionSize - 16, 32, &output_params));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              channel_.Update(op_handle_, AuthorizationSet(), SIZE_MAX, 16, &output_params));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              channel_.Finish(op_handle_, AuthorizationSet(), 0, 32, 16, &output_params,
+                              &output_length));
+    // Nothing reached the operation.
+    EXPECT_TRUE(keymaster_.has_operation(op_handle_));
+
+    channel_.Unmap();
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              channel_.Update(op_handle_, AuthorizationSet(), 0, 16, &output_params));
+}
+
+TEST_F(BulkDataChannelTest, PaddingFallsBackToMessages) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_PKCS7)));
+    AuthorizationSet params(AuthorizationSetBuilder().EcbMode().Padding(KM_PAD_PKCS7));
+    ASSERT_EQ(KM_ERROR_OK, BeginOperation(KM_PURPOSE_ENCRYPT, params));
+
+    AuthorizationSet output_params;
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED,
+              channel_.Update(op_handle_, AuthorizationSet(), 0, 16, &output_params));
+
+    // The operation is still usable through the message API.
+    string ciphertext;
+    EXPECT_EQ(KM_ERROR_OK, FinishOperation("0123456789abcdef", "", &ciphertext));
+    EXPECT_EQ(32U, ciphertext.size());
+}
+
+TEST_F(BulkDataChannelTest, RejectsSizeBeyondDescriptor) {
+    int fd = BulkDataChannel::CreateMemfd("bulk_data_channel_test", kRegionSize);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, channel_.Map(fd, kRegionSize + 4096));
+    EXPECT_EQ(nullptr, channel_.data());
+    close(fd);
+}
+
+TEST_F(BulkDataChannelTest, RejectsTruncatableDescriptor) {
+    // The channel's own memfds can't be truncated under the mapping.
+    int fd = BulkDataChannel::CreateMemfd("bulk_data_channel_test", kRegionSize);
+    ASSERT_GE(fd, 0);
+    EXPECT_NE(0, ftruncate(fd, 0));
+    close(fd);
+
+    // A descriptor without the seals could be, so it is refused even though it is long enough.
+    FILE* file = tmpfile();
+    ASSERT_TRUE(file != nullptr);
+    ASSERT_EQ(0, ftruncate(fileno(file), kRegionSize));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, channel_.Map(fileno(file), kRegionSize));
+    EXPECT_EQ(nullptr, channel_.data());
+    fclose(file);
+}
+
+class RsaKeyCacheTest : public testing::Test {
+  protected:
+    RsaKeyCacheTest() : factory_(nullptr /* blob_maker */) {}
+
+    void TearDown() override { RsaKeyFactory::set_key_cache(nullptr); }
+
+    static KeymasterKeyBlob GenerateKeyMaterial() {
+        BIGNUM_Ptr exponent(BN_new());
+        RSA_Ptr rsa(RSA_new());
+        EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+        if (!exponent.get() || !rsa.get() || !pkey.get() || !BN_set_word(exponent.get(), 65537) ||
+            !RSA_generate_key_ex(rsa.get(), 1024, exponent.get(), nullptr /* callback */) ||
+            !EVP_PKEY_set1_RSA(pkey.get(), rsa.get()))
+            return KeymasterKeyBlob();
+
+        int length = i2d_PrivateKey(pkey.get(), nullptr);
+        if (length <= 0) return KeymasterKeyBlob();
+        KeymasterKeyBlob key_material(length);
+        uint8_t* tmp = key_material.writable_data();
+        i2d_PrivateKey(pkey.get(), &tmp);
+        return key_material;
+    }
+
+    UniquePtr<Key> LoadKey(const KeymasterKeyBlob& key_material) {
+        AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                         .RsaKey(1024, 65537)
+                                         .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                         .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                         .Digest(KM_DIGEST_SHA_2_256)
+                                         .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+        UniquePtr<Key> key;
+        EXPECT_EQ(KM_ERROR_OK,
+                  factory_.LoadKey(KeymasterKeyBlob(key_material), AuthorizationSet(),
+                                   move(hw_enforced), AuthorizationSet(), &key));
+        return key;
+    }
+
+    static RSA* rsa(const UniquePtr<Key>& key) { return static_cast<RsaKey&>(*key).key(); }
+
+    keymaster_error_t Run(keymaster_purpose_t purpose, UniquePtr<Key> key, const string& message,
+                          string* signature) {
+        if (!key) return KM_ERROR_UNKNOWN_ERROR;
+        AuthorizationSet begin_params(AuthorizationSetBuilder()
+                                          .Digest(KM_DIGEST_SHA_2_256)
+                                          .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+        keymaster_error_t error;
+        OperationPtr op = factory_.GetOperationFactory(purpose)->CreateOperation(
+            move(*key), begin_params, &error);
+        if (!op) return error;
+
+        AuthorizationSet output_params;
+        Buffer output;
+        size_t input_consumed;
+        error = op->Begin(begin_params, &output_params);
+        if (error == KM_ERROR_OK)
+            error = op->Update(AuthorizationSet(), Buffer(message.data(), message.size()),
+                               &output_params, &output, &input_consumed);
+        if (error != KM_ERROR_OK) return error;
+
+        Buffer signature_buffer;
+        if (purpose == KM_PURPOSE_VERIFY)
+            signature_buffer.Reinitialize(signature->data(), signature->size());
+        error = op->Finish(AuthorizationSet(), Buffer(), signature_buffer, &output_params, &output);
+        if (error == KM_ERROR_OK && purpose == KM_PURPOSE_SIGN)
+            signature->assign(reinterpret_cast<const char*>(output.peek_read()),
+                              output.available_read());
+        return error;
+    }
+
+    RsaKeyFactory factory_;
+};
+
+TEST_F(RsaKeyCacheTest, SharesDecodedKey) {
+    KeymasterKeyBlob key_material = GenerateKeyMaterial();
+    ASSERT_TRUE(key_material.key_material);
+
+    // Without a cache, every load decodes its own key.
+    UniquePtr<Key> uncached1 = LoadKey(key_material);
+    UniquePtr<Key> uncached2 = LoadKey(key_material);
+    ASSERT_TRUE(uncached1 && uncached2);
+    EXPECT_NE(rsa(uncached1), rsa(uncached2));
+
+    RsaKeyCache cache(2);
+    RsaKeyFactory::set_key_cache(&cache);
+    UniquePtr<Key> key1 = LoadKey(key_material);
+    UniquePtr<Key> key2 = LoadKey(key_material);
+    ASSERT_TRUE(key1 && key2);
+    EXPECT_EQ(rsa(key1), rsa(key2));
+    EXPECT_EQ(1U, cache.size());
+
+    // Each key keeps its own copy of the key material.
+    EXPECT_EQ(key_material.key_material_size, key2->key_material().key_material_size);
+    EXPECT_NE(key1->key_material().key_material, key2->key_material().key_material);
+
+    // Keys outlive their cache entries.
+    cache.Clear();
+    EXPECT_EQ(0U, cache.size());
+    string signature;
+    EXPECT_EQ(KM_ERROR_OK, Run(KM_PURPOSE_SIGN, move(key1), "message", &signature));
+    EXPECT_EQ(KM_ERROR_OK, Run(KM_PURPOSE_VERIFY, move(key2), "message", &signature));
+}
+
+TEST_F(RsaKeyCacheTest, SignAndVerifyWithCachedKey) {
+    KeymasterKeyBlob key_material = GenerateKeyMaterial();
+    ASSERT_TRUE(key_material.key_material);
+
+    RsaKeyCache cache(1);
+    RsaKeyFactory::set_key_cache(&cache);
+    string message = "Hello World!";
+    string signature;
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_EQ(KM_ERROR_OK, Run(KM_PURPOSE_SIGN, LoadKey(key_material), message, &signature));
+        EXPECT_EQ(KM_ERROR_OK,
+                  Run(KM_PURPOSE_VERIFY, LoadKey(key_material), message, &signature));
+    }
+
+    // Signatures made with the cached key verify without it, and vice versa.
+    RsaKeyFactory::set_key_cache(nullptr);
+    EXPECT_EQ(KM_ERROR_OK, Run(KM_PURPOSE_VERIFY, LoadKey(key_material), message, &signature));
+    signature.clear();
+    ASSERT_EQ(KM_ERROR_OK, Run(KM_PURPOSE_SIGN, LoadKey(key_material), message, &signature));
+    RsaKeyFactory::set_key_cache(&cache);
+    EXPECT_EQ(KM_ERROR_OK, Run(KM_PURPOSE_VERIFY, LoadKey(key_material), message, &signature));
+}
+
+TEST_F(RsaKeyCacheTest, EvictsLeastRecentlyUsed) {
+    KeymasterKeyBlob material1 = GenerateKeyMaterial();
+    KeymasterKeyBlob material2 = GenerateKeyMaterial();
+    KeymasterKeyBlob material3 = GenerateKeyMaterial();
+    ASSERT_TRUE(material1.key_material && material2.key_material && material3.key_material);
+
+    RsaKeyCache cache(2);
+    RsaKeyFactory::set_key_cache(&cache);
+    UniquePtr<Key> key1 = LoadKey(material1);
+    UniquePtr<Key> key2 = LoadKey(material2);
+    ASSERT_TRUE(key1 && key2);
+    EXPECT_NE(rsa(key1), rsa(key2));
+
+    // Touch the first key, so that loading a third evicts the second.
+    UniquePtr<Key> key = LoadKey(material1);
+    EXPECT_EQ(rsa(key1), rsa(key));
+    key = LoadKey(material3);
+    EXPECT_EQ(2U, cache.size());
+
+    key = LoadKey(material1);
+    EXPECT_EQ(rsa(key1), rsa(key));
+    key = LoadKey(material2);
+    EXPECT_NE(rsa(key2), rsa(key));
+}
+
+static void ExpectRsaKeyMaterial(const KeymasterKeyBlob& key_material, uint32_t key_size,
+                                 uint64_t public_exponent) {
+    const uint8_t* tmp = key_material.key_material;
+    EVP_PKEY_Ptr pkey(
+        d2i_PrivateKey(EVP_PKEY_RSA, nullptr /* pkey */, &tmp, key_material.key_material_size));
+    ASSERT_TRUE(pkey.get());
+    RSA_Ptr rsa(EVP_PKEY_get1_RSA(pkey.get()));
+    ASSERT_TRUE(rsa.get());
+    EXPECT_EQ(key_size, RSA_size(rsa.get()) * 8);
+    EXPECT_EQ(public_exponent, BN_get_word(rsa->e));
+}
+
+TEST(PthreadRsaKeyPoolTest, ServesAndRefillsConfiguredKeys) {
+    const PthreadRsaKeyPool::KeySpec specs[] = {{1024, 65537, 2}, {768, 3, 1}};
+    PthreadRsaKeyPool pool(specs, array_length(specs), 2 /* threads */);
+    pool.WaitUntilFull();
+    EXPECT_EQ(2U, pool.available(1024, 65537));
+    EXPECT_EQ(1U, pool.available(768, 3));
+    EXPECT_EQ(3U, pool.stats().generated);
+
+    KeymasterKeyBlob key1, key2;
+    ASSERT_TRUE(pool.Take(1024, 65537, &key1));
+    ASSERT_TRUE(pool.Take(1024, 65537, &key2));
+    ExpectRsaKeyMaterial(key1, 1024, 65537);
+    ExpectRsaKeyMaterial(key2, 1024, 65537);
+    EXPECT_FALSE(key1.key_material_size == key2.key_material_size &&
+                 memcmp(key1.key_material, key2.key_material, key1.key_material_size) == 0);
+
+    KeymasterKeyBlob key3;
+    ASSERT_TRUE(pool.Take(768, 3, &key3));
+    ExpectRsaKeyMaterial(key3, 768, 3);
+
+    KeymasterKeyBlob unconfigured;
+    EXPECT_FALSE(pool.Take(1024, 3, &unconfigured));
+    EXPECT_EQ(nullptr, unconfigured.key_material);
+
+    // Taken keys are replaced.
+    pool.WaitUntilFull();
+    EXPECT_EQ(2U, pool.available(1024, 65537));
+    EXPECT_EQ(1U, pool.available(768, 3));
+
+    PthreadRsaKeyPool::Stats stats = pool.stats();
+    EXPECT_EQ(3U, stats.hits);
+    EXPECT_EQ(1U, stats.misses);
+    EXPECT_EQ(6U, stats.generated);
+}
+
+TEST(PthreadRsaKeyPoolTest, WithoutThreadsEveryTakeMisses) {
+    const PthreadRsaKeyPool::KeySpec specs[] = {{1024, 65537, 2}};
+    PthreadRsaKeyPool pool(specs, array_length(specs), 0 /* threads */);
+    pool.WaitUntilFull();
+
+    KeymasterKeyBlob key;
+    EXPECT_FALSE(pool.Take(1024, 65537, &key));
+    EXPECT_EQ(1U, pool.stats().misses);
+    EXPECT_EQ(0U, pool.stats().generated);
+}
+
+TEST(PthreadRsaKeyPoolTest, GenerateKeyTakesFromPool) {
+    const PthreadRsaKeyPool::KeySpec specs[] = {{1024, 65537, 1}};
+    PthreadRsaKeyPool pool(specs, array_length(specs), 1 /* threads */);
+    pool.WaitUntilFull();
+    RsaKeyFactory::set_key_pool(&pool);
+    auto disable_pool = finally([&]() { RsaKeyFactory::set_key_pool(nullptr); });
+
+    AndroidKeymaster keymaster(new PureSoftKeymasterContext, 16);
+    for (uint32_t key_size : {1024, 1024, 512}) {
+        GenerateKeyRequest request;
+        request.key_description.Reinitialize(
+            AuthorizationSet(AuthorizationSetBuilder()
+                                 .RsaSigningKey(key_size, 65537)
+                                 .Digest(KM_DIGEST_NONE)
+                                 .Padding(KM_PAD_NONE)
+                                 .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response;
+        keymaster.GenerateKey(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error) << key_size;
+
+        uint32_t actual_size;
+        EXPECT_TRUE(response.enforced.GetTagValue(TAG_KEY_SIZE, &actual_size) ||
+                    response.unenforced.GetTagValue(TAG_KEY_SIZE, &actual_size));
+        EXPECT_EQ(key_size, actual_size);
+    }
+
+    // The second 1024-bit key may or may not have been ready; the 512-bit key never is.
+    PthreadRsaKeyPool::Stats stats = pool.stats();
+    EXPECT_GE(stats.hits, 1U);
+    EXPECT_EQ(3U, stats.hits + stats.misses);
+}
+
+TEST(EcGroupTest, SharedPerCurve) {
+    const struct {
+        keymaster_ec_curve_t curve;
+        size_t key_size;
+    } curves[] = {{KM_EC_CURVE_P_224, 224},
+                  {KM_EC_CURVE_P_256, 256},
+                  {KM_EC_CURVE_P_384, 384},
+                  {KM_EC_CURVE_P_521, 521}};
+    for (auto& entry : curves) {
+        const EC_GROUP* group = ec_get_group(entry.curve);
+        ASSERT_TRUE(group);
+        EXPECT_EQ(group, ec_get_group(entry.curve));
+        size_t key_size;
+        ASSERT_EQ(KM_ERROR_OK, ec_get_group_size(group, &key_size));
+        EXPECT_EQ(entry.key_size, key_size);
+    }
+    EXPECT_EQ(nullptr, ec_get_group(static_cast<keymaster_ec_curve_t>(-1)));
+}
+
+// RFC 8032 section 7.1, TEST 2.
+static const char kEd25519Seed[] =
+    "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb";
+static const char kEd25519PublicKey[] =
+    "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c";
+static const char kEd25519Message[] = "72";
+static const char kEd25519Signature[] =
+    "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da085ac1e43e15996e458f3613d0f1"
+    "1d8c387b2eaeb4302aeeb00d291612bb0c00";
+
+class Ed25519Test : public PureSoftKeymasterTest {
+  protected:
+    static AuthorizationSetBuilder KeyDescription() {
+        return AuthorizationSetBuilder()
+            .Authorization(TAG_ALGORITHM, KM_ALGORITHM_ED25519)
+            .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+            .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY);
+    }
+
+    // As ProcessMessage, but splits the message across an update and the finish, to exercise
+    // buffering.
+    keymaster_error_t Process(keymaster_purpose_t purpose, const AuthorizationSet& params,
+                              const string& message, const string& signature, string* output) {
+        if (output) output->clear();
+        keymaster_error_t error = BeginOperation(purpose, params);
+        if (error == KM_ERROR_OK)
+            error = UpdateOperation(message.substr(0, message.size() / 2), output);
+        if (error == KM_ERROR_OK)
+            error = FinishOperation(message.substr(message.size() / 2), signature, output);
+        return error;
+    }
+
+    keymaster_error_t Sign(const string& message, string* signature) {
+        return Process(KM_PURPOSE_SIGN, AuthorizationSet(), message, "", signature);
+    }
+
+    keymaster_error_t Verify(const string& message, const string& signature) {
+        return Process(KM_PURPOSE_VERIFY, AuthorizationSet(), message, signature, nullptr);
+    }
+};
+
+TEST_F(Ed25519Test, SignAndVerify) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(KeyDescription()));
+    EXPECT_TRUE(unenforced_.Contains(TAG_KEY_SIZE, 256));
+
+    string message = "Ed25519 signs the message itself";
+    string signature;
+    ASSERT_EQ(KM_ERROR_OK, Sign(message, &signature));
+    EXPECT_EQ(64U, signature.size());
+    EXPECT_EQ(KM_ERROR_OK, Verify(message, signature));
+
+    string corrupted = signature;
+    corrupted[10] ^= 1;
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify(message, corrupted));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify(message + "!", signature));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify(message, signature.substr(1)));
+}
+
+TEST_F(Ed25519Test, KeyAndParameterRestrictions) {
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE,
+              GenerateKey(KeyDescription().Authorization(TAG_KEY_SIZE, 255)));
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(KeyDescription().Authorization(TAG_KEY_SIZE, 256)));
+
+    string output;
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_DIGEST,
+              Process(KM_PURPOSE_SIGN,
+                      AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)),
+                      "message", "", &output));
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_PURPOSE,
+              Process(KM_PURPOSE_ENCRYPT, AuthorizationSet(), "message", "", &output));
+}
+
+TEST_F(Ed25519Test, MessageSizeLimit) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(KeyDescription()));
+
+    string message(Ed25519Operation::kMaxMessageSize, 'a');
+    string signature;
+    ASSERT_EQ(KM_ERROR_OK, Sign(message, &signature));
+    EXPECT_EQ(KM_ERROR_OK, Verify(message, signature));
+
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, Sign(message + "a", &signature));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, Verify(message + "a", signature));
+}
+
+TEST_F(Ed25519Test, Rfc8032Vector) {
+    string seed = hex2str(kEd25519Seed);
+    string expected_public_key = hex2str(kEd25519PublicKey);
+    string message = hex2str(kEd25519Message);
+    string expected_signature = hex2str(kEd25519Signature);
+
+    // The same key, raw and as RFC 8410 PKCS#8.
+    string pkcs8 = hex2str("302e020100300506032b657004220420") + seed;
+    const std::pair<keymaster_key_format_t, string> imports[] = {{KM_KEY_FORMAT_RAW, seed},
+                                                                 {KM_KEY_FORMAT_PKCS8, pkcs8}};
+    for (auto& import : imports) {
+        ASSERT_EQ(KM_ERROR_OK, ImportKey(KeyDescription(), import.first, import.second));
+
+        string signature;
+        ASSERT_EQ(KM_ERROR_OK, Sign(message, &signature));
+        EXPECT_EQ(expected_signature, signature);
+        EXPECT_EQ(KM_ERROR_OK, Verify(message, expected_signature));
+
+        string exported;
+        ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509, &exported));
+        EXPECT_EQ(hex2str("302a300506032b6570032100") + expected_public_key, exported);
+    }
+
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              ImportKey(KeyDescription(), KM_KEY_FORMAT_RAW, seed.substr(1)));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              ImportKey(KeyDescription(), KM_KEY_FORMAT_PKCS8, pkcs8 + "x"));
+    EXPECT_EQ(KM_ERROR_IMPORT_PARAMETER_MISMATCH,
+              ImportKey(KeyDescription().Authorization(TAG_KEY_SIZE, 128), KM_KEY_FORMAT_RAW,
+                        seed));
+}
+
+TEST_F(Ed25519Test, Attestation) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(KeyDescription()));
+
+    AttestKeyRequest request;
+    request.SetKeyMaterial(key_blob_);
+    request.attest_params.push_back(TAG_ATTESTATION_CHALLENGE, "challenge", 9);
+    request.attest_params.push_back(TAG_ATTESTATION_APPLICATION_ID, "attest_app_id", 13);
+    AttestKeyResponse response;
+    keymaster_.AttestKey(request, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(3U, response.certificate_chain.entry_count);
+
+    // The chain is the EC attestation chain, which signs the certificate for the Ed25519 key.
+    EXPECT_TRUE(verify_chain(response.certificate_chain));
+    EXPECT_TRUE(verify_attestation_record("challenge", "attest_app_id", unenforced_, enforced_,
+                                          3 /* keymaster version */, KM_SECURITY_LEVEL_SOFTWARE,
+                                          response.certificate_chain.entries[0]));
+
+    string exported;
+    ASSERT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509, &exported));
+    X509_Ptr cert(parse_cert_blob(response.certificate_chain.entries[0]));
+    ASSERT_TRUE(cert.get());
+    uint8_t* spki = nullptr;
+    int spki_length = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert.get()), &spki);
+    ASSERT_GT(spki_length, 0);
+    EXPECT_EQ(exported, string(reinterpret_cast<char*>(spki), spki_length));
+    OPENSSL_free(spki);
+}
+
+TEST_F(BatchVerifySignaturesTest, Ed25519) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .Authorization(TAG_ALGORITHM, KM_ALGORITHM_ED25519)
+                                           .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                           .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)));
+    AuthorizationSet params;
+    string signature1 = Sign(params, "first entry");
+    string signature2 = Sign(params, "second entry");
+
+    keymaster_error_t error;
+    vector<keymaster_error_t> results = BatchVerify(
+        params,
+        {{"first entry", signature1}, {"first entry", signature2}, {"second entry", signature2}},
+        &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(3U, results.size());
+    EXPECT_EQ(KM_ERROR_OK, results[0]);
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, results[1]);
+    EXPECT_EQ(KM_ERROR_OK, results[2]);
+}
+
+class PrehashedSignatureTest : public PureSoftKeymasterTest {
+  protected:
+    // Checks that signatures over |message| and over its SHA-256 digest with TAG_PREHASHED are
+    // interchangeable.
+    void CheckInterchangeable(const AuthorizationSet& params) {
+        string message = "message to be signed";
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const uint8_t*>(message.data()), message.size(), digest);
+        string digest_string(reinterpret_cast<const char*>(digest), sizeof(digest));
+        AuthorizationSet prehashed_params(params);
+        prehashed_params.push_back(TAG_PREHASHED);
+
+        string signature;
+        ASSERT_EQ(KM_ERROR_OK, ProcessMessage(KM_PURPOSE_SIGN, prehashed_params, digest_string,
+                                              "", &signature));
+        EXPECT_EQ(KM_ERROR_OK,
+                  ProcessMessage(KM_PURPOSE_VERIFY, params, message, signature, nullptr));
+        EXPECT_EQ(KM_ERROR_OK, ProcessMessage(KM_PURPOSE_VERIFY, prehashed_params, digest_string,
+                                              signature, nullptr));
+
+        ASSERT_EQ(KM_ERROR_OK, ProcessMessage(KM_PURPOSE_SIGN, params, message, "", &signature));
+        EXPECT_EQ(KM_ERROR_OK, ProcessMessage(KM_PURPOSE_VERIFY, prehashed_params, digest_string,
+                                              signature, nullptr));
+        digest_string[0] ^= 1;
+        EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED,
+                  ProcessMessage(KM_PURPOSE_VERIFY, prehashed_params, digest_string, signature,
+                                 nullptr));
+    }
+};
+
+TEST_F(PrehashedSignatureTest, RsaPkcs1) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)));
+    CheckInterchangeable(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)));
+}
+
+TEST_F(PrehashedSignatureTest, RsaPss) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Padding(KM_PAD_RSA_PSS)));
+    CheckInterchangeable(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Padding(KM_PAD_RSA_PSS)));
+}
+
+TEST_F(PrehashedSignatureTest, Ecdsa) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_SHA_2_256)));
+    CheckInterchangeable(AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)));
+}
+
+TEST_F(PrehashedSignatureTest, WrongDigestLength) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(1024, 65537)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN)
+                                .Authorization(TAG_PREHASHED));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH,
+              ProcessMessage(KM_PURPOSE_SIGN, params, string(31, 'a'), "", nullptr));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH,
+              ProcessMessage(KM_PURPOSE_SIGN, params, string(33, 'a'), "", nullptr));
+
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_SHA_2_256)));
+    params.Reinitialize(AuthorizationSet(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_PREHASHED)));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH,
+              ProcessMessage(KM_PURPOSE_SIGN, params, string(31, 'a'), "", nullptr));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH,
+              ProcessMessage(KM_PURPOSE_SIGN, params, string(33, 'a'), "", nullptr));
+}
+
+TEST_F(PrehashedSignatureTest, RequiresDigest) {
+    ASSERT_EQ(KM_ERROR_OK, GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Digest(KM_DIGEST_SHA_2_256)));
+    AuthorizationSet params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_NONE).Authorization(TAG_PREHASHED));
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_DIGEST,
+              ProcessMessage(KM_PURPOSE_SIGN, params, string(32, 'a'), "", nullptr));
+}
+
+class KeyAgreementTest : public PureSoftKeymasterTest {
+  protected:
+    static AuthorizationSetBuilder AgreementKey(uint32_t key_size) {
+        return AuthorizationSetBuilder().EcdsaKey(key_size).Authorization(TAG_PURPOSE,
+                                                                          KM_PURPOSE_AGREE_KEY);
+    }
+
+    // Returns the key's public point, uncompressed, as a peer would receive it.
+    string PublicValue(const KeymasterKeyBlob& key_blob) {
+        key_blob_ = key_blob;
+        string der;
+        EXPECT_EQ(KM_ERROR_OK, ExportKey(KM_KEY_FORMAT_X509, &der));
+
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(der.data());
+        unique_ptr<EVP_PKEY, EVP_PKEY_Delete> pkey(
+            d2i_PUBKEY(nullptr /* alloc new */, &p, der.size()));
+        if (!pkey) return "";
+        unique_ptr<EC_KEY, EC_KEY_Delete> ec_key(EVP_PKEY_get1_EC_KEY(pkey.get()));
+        if (!ec_key) return "";
+        uint8_t point[1 + 2 * 66];
+        size_t length = EC_POINT_point2oct(EC_KEY_get0_group(ec_key.get()),
+                                           EC_KEY_get0_public_key(ec_key.get()),
+                                           POINT_CONVERSION_UNCOMPRESSED, point, sizeof(point),
+                                           nullptr /* ctx */);
+        return string(reinterpret_cast<const char*>(point), length);
+    }
+
+    // Runs a single-shot agreement, returning the first error from Begin or Finish.
+    keymaster_error_t Agree(const KeymasterKeyBlob& key_blob, const AuthorizationSet& params,
+                            const string& peer_public_value, string* secret) {
+        key_blob_ = key_blob;
+        return ProcessMessage(KM_PURPOSE_AGREE_KEY, params, peer_public_value, "", secret);
+    }
+
+    void BatchAgree(const KeymasterKeyBlob& key_blob, const AuthorizationSet& params,
+                    const vector<string>& peer_public_values, BatchAgreeKeysResponse* response) {
+        BatchAgreeKeysRequest request;
+        request.SetKeyMaterial(key_blob);
+        request.additional_params = params;
+        ASSERT_TRUE(request.AllocatePeerPublicValues(peer_public_values.size()));
+        for (size_t i = 0; i < peer_public_values.size(); ++i)
+            request.peer_public_values[i].Reinitialize(peer_public_values[i].data(),
+                                                       peer_public_values[i].size());
+        keymaster_.BatchAgreeKeys(request, response);
+    }
+};
+
+TEST_F(KeyAgreementTest, AgreesWithPeer) {
+    const struct {
+        uint32_t key_size;
+        keymaster_ec_curve_t curve;
+    } curves[] = {{224, KM_EC_CURVE_P_224},
+                  {256, KM_EC_CURVE_P_256},
+                  {384, KM_EC_CURVE_P_384},
+                  {521, KM_EC_CURVE_P_521}};
+    for (const auto& curve : curves) {
+        KeymasterKeyBlob key = GenerateKeyBlob(AgreementKey(curve.key_size));
+        UniquePtr<NistCurveKeyExchange> peer(
+            NistCurveKeyExchange::GenerateKeyExchange(curve.curve));
+        ASSERT_TRUE(peer.get());
+        Buffer peer_public_value;
+        ASSERT_TRUE(peer->public_value(&peer_public_value));
+
+        string secret;
+        ASSERT_EQ(KM_ERROR_OK, Agree(key, AuthorizationSet(), ToString(peer_public_value),
+                                     &secret));
+        EXPECT_EQ((curve.key_size + 7) / 8, secret.size());
+
+        string public_value = PublicValue(key);
+        Buffer expected;
+        ASSERT_TRUE(peer->CalculateSharedKey(
+            reinterpret_cast<const uint8_t*>(public_value.data()), public_value.size(),
+            &expected));
+        EXPECT_EQ(ToString(expected), secret) << curve.key_size;
+    }
+}
+
+TEST_F(KeyAgreementTest, TwoKeysAgree) {
+    KeymasterKeyBlob key1 = GenerateKeyBlob(AgreementKey(256));
+    KeymasterKeyBlob key2 = GenerateKeyBlob(AgreementKey(256));
+    string secret1, secret2;
+    ASSERT_EQ(KM_ERROR_OK, Agree(key1, AuthorizationSet(), PublicValue(key2), &secret1));
+    ASSERT_EQ(KM_ERROR_OK, Agree(key2, AuthorizationSet(), PublicValue(key1), &secret2));
+    EXPECT_EQ(32U, secret1.size());
+    EXPECT_EQ(secret1, secret2);
+}
+
+TEST_F(KeyAgreementTest, DerivesWithKdf) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AgreementKey(256));
+    KeymasterKeyBlob peer = GenerateKeyBlob(AgreementKey(256));
+    string peer_public_value = PublicValue(peer);
+    string secret;
+    ASSERT_EQ(KM_ERROR_OK, Agree(key, AuthorizationSet(), peer_public_value, &secret));
+    const uint8_t* secret_bytes = reinterpret_cast<const uint8_t*>(secret.data());
+
+    string salt = "salt";
+    string info = "context info";
+    string derived;
+    ASSERT_EQ(KM_ERROR_OK,
+              Agree(key,
+                    AuthorizationSet(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                         .Authorization(TAG_KDF_SALT, salt.data(), salt.size())
+                                         .Authorization(TAG_KDF_INFO, info.data(), info.size())
+                                         .Authorization(TAG_KDF_OUTPUT_LENGTH, 320)),
+                    peer_public_value, &derived));
+    Rfc5869Sha256Kdf hkdf;
+    uint8_t expected[40];
+    ASSERT_TRUE(hkdf.Init(secret_bytes, secret.size(),
+                          reinterpret_cast<const uint8_t*>(salt.data()), salt.size()));
+    ASSERT_TRUE(hkdf.GenerateKey(reinterpret_cast<const uint8_t*>(info.data()), info.size(),
+                                 expected, sizeof(expected)));
+    EXPECT_EQ(string(reinterpret_cast<const char*>(expected), sizeof(expected)), derived);
+
+    ASSERT_EQ(KM_ERROR_OK,
+              Agree(key,
+                    AuthorizationSet(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_ISO18033_2_KDF2_SHA256)
+                                         .Authorization(TAG_KDF_INFO, info.data(), info.size())
+                                         .Authorization(TAG_KDF_OUTPUT_LENGTH, 128)),
+                    peer_public_value, &derived));
+    Kdf2 kdf2;
+    ASSERT_TRUE(kdf2.Init(KM_DIGEST_SHA_2_256, secret_bytes, secret.size()));
+    ASSERT_TRUE(kdf2.GenerateKey(reinterpret_cast<const uint8_t*>(info.data()), info.size(),
+                                 expected, 16));
+    EXPECT_EQ(string(reinterpret_cast<const char*>(expected), 16), derived);
+}
+
+TEST_F(KeyAgreementTest, KdfRestrictedByKey) {
+    KeymasterKeyBlob key =
+        GenerateKeyBlob(AgreementKey(256).Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256));
+    string peer_public_value = PublicValue(GenerateKeyBlob(AgreementKey(256)));
+
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KDF,
+              Agree(key, AuthorizationSet(), peer_public_value, nullptr));
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KDF,
+              Agree(key,
+                    AuthorizationSet(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_ISO18033_2_KDF1_SHA1)
+                                         .Authorization(TAG_KDF_OUTPUT_LENGTH, 128)),
+                    peer_public_value, nullptr));
+    EXPECT_EQ(KM_ERROR_OK,
+              Agree(key,
+                    AuthorizationSet(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                         .Authorization(TAG_KDF_OUTPUT_LENGTH, 128)),
+                    peer_public_value, nullptr));
+}
+
+TEST_F(KeyAgreementTest, InvalidParameters) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AgreementKey(256));
+    string peer_public_value = PublicValue(GenerateKeyBlob(AgreementKey(256)));
+
+    // Not a whole number of bytes, missing, and given without a KDF.
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Agree(key,
+                    AuthorizationSet(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                         .Authorization(TAG_KDF_OUTPUT_LENGTH, 100)),
+                    peer_public_value, nullptr));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Agree(key,
+                    AuthorizationSet(
+                        AuthorizationSetBuilder().Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)),
+                    peer_public_value, nullptr));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Agree(key,
+                    AuthorizationSet(
+                        AuthorizationSetBuilder().Authorization(TAG_KDF_OUTPUT_LENGTH, 128)),
+                    peer_public_value, nullptr));
+    // ISO 18033-2 KDFs have no salt.
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Agree(key,
+                    AuthorizationSet(AuthorizationSetBuilder()
+                                         .Authorization(TAG_KDF, KM_KDF_ISO18033_2_KDF1_SHA256)
+                                         .Authorization(TAG_KDF_SALT, "salt", 4)
+                                         .Authorization(TAG_KDF_OUTPUT_LENGTH, 128)),
+                    peer_public_value, nullptr));
+
+    // Output is limited to 255 blocks of the KDF's digest.
+    const std::pair<keymaster_kdf_t, uint32_t> limits[] = {
+        {KM_KDF_RFC5869_SHA256, 255 * 32},
+        {KM_KDF_ISO18033_2_KDF1_SHA1, 255 * 20},
+        {KM_KDF_ISO18033_2_KDF1_SHA256, 255 * 32},
+        {KM_KDF_ISO18033_2_KDF2_SHA1, 255 * 20},
+        {KM_KDF_ISO18033_2_KDF2_SHA256, 255 * 32},
+    };
+    for (auto& limit : limits) {
+        auto params = [&](uint32_t output_bytes) {
+            return AuthorizationSet(AuthorizationSetBuilder()
+                                        .Authorization(TAG_KDF, limit.first)
+                                        .Authorization(TAG_KDF_OUTPUT_LENGTH, output_bytes * 8));
+        };
+        string derived;
+        EXPECT_EQ(KM_ERROR_OK, Agree(key, params(limit.second), peer_public_value, &derived));
+        EXPECT_EQ(limit.second, derived.size());
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+                  Agree(key, params(limit.second + 1), peer_public_value, nullptr));
+    }
+}
+
+TEST_F(KeyAgreementTest, InvalidPeerPublicValue) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AgreementKey(256));
+    string peer_public_value = PublicValue(GenerateKeyBlob(AgreementKey(256)));
+
+    string off_curve = peer_public_value;
+    off_curve[off_curve.size() - 1] ^= 1;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, Agree(key, AuthorizationSet(), off_curve, nullptr));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Agree(key, AuthorizationSet(), peer_public_value.substr(1), nullptr));
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH,
+              Agree(key, AuthorizationSet(), peer_public_value + "x", nullptr));
+
+    // A point on another curve.
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Agree(key, AuthorizationSet(), PublicValue(GenerateKeyBlob(AgreementKey(224))),
+                    nullptr));
+}
+
+TEST_F(KeyAgreementTest, RequiresPurpose) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AuthorizationSetBuilder().EcdsaSigningKey(256));
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PURPOSE,
+              Agree(key, AuthorizationSet(), PublicValue(GenerateKeyBlob(AgreementKey(256))),
+                    nullptr));
+
+    KeymasterKeyBlob rsa_key = GenerateKeyBlob(
+        AuthorizationSetBuilder().RsaKey(1024, 65537).Authorization(TAG_PURPOSE,
+                                                                    KM_PURPOSE_AGREE_KEY));
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_PURPOSE,
+              Agree(rsa_key, AuthorizationSet(), PublicValue(GenerateKeyBlob(AgreementKey(256))),
+                    nullptr));
+}
+
+TEST_F(KeyAgreementTest, BatchMatchesIndividualOperations) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AgreementKey(256));
+    string peer1 = PublicValue(GenerateKeyBlob(AgreementKey(256)));
+    string peer2 = PublicValue(GenerateKeyBlob(AgreementKey(256)));
+    string off_curve = peer1;
+    off_curve[off_curve.size() - 1] ^= 1;
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Authorization(TAG_KDF, KM_KDF_RFC5869_SHA256)
+                                .Authorization(TAG_KDF_INFO, "info", 4)
+                                .Authorization(TAG_KDF_OUTPUT_LENGTH, 256));
+
+    BatchAgreeKeysResponse response;
+    BatchAgree(key, params, {peer1, off_curve, peer1 + "x", peer2}, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(4U, response.num_results);
+
+    string expected;
+    ASSERT_EQ(KM_ERROR_OK, Agree(key, params, peer1, &expected));
+    EXPECT_EQ(KM_ERROR_OK, response.results[0].error);
+    EXPECT_EQ(expected, ToString(response.results[0].secret));
+    // Bad values don't affect the ones after them.
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, response.results[1].error);
+    EXPECT_EQ(0U, response.results[1].secret.available_read());
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, response.results[2].error);
+    ASSERT_EQ(KM_ERROR_OK, Agree(key, params, peer2, &expected));
+    EXPECT_EQ(KM_ERROR_OK, response.results[3].error);
+    EXPECT_EQ(expected, ToString(response.results[3].secret));
+}
+
+TEST_F(KeyAgreementTest, BatchEachValueCountsAsAUse) {
+    KeymasterKeyBlob key =
+        GenerateKeyBlob(AgreementKey(256).Authorization(TAG_MAX_USES_PER_BOOT, 2));
+    string peer = PublicValue(GenerateKeyBlob(AgreementKey(256)));
+
+    BatchAgreeKeysResponse response;
+    BatchAgree(key, AuthorizationSet(), {peer, peer, peer}, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(3U, response.num_results);
+    EXPECT_EQ(KM_ERROR_OK, response.results[0].error);
+    EXPECT_EQ(KM_ERROR_OK, response.results[1].error);
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED, response.results[2].error);
+}
+
+TEST_F(KeyAgreementTest, BatchRejectsOtherAlgorithms) {
+    KeymasterKeyBlob key = GenerateKeyBlob(AuthorizationSetBuilder().RsaSigningKey(1024, 65537));
+    BatchAgreeKeysResponse response;
+    BatchAgree(key, AuthorizationSet(), {"peer"}, &response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, response.error);
+    EXPECT_EQ(0U, response.num_results);
+}
+
 }  // namespace test
 }  // namespace keymaster
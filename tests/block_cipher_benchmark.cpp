@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput benchmark for the AES and 3DES operations.
+ *
+ * For every block mode and padding the operation factories support, at each key size, encrypts
+ * and decrypts messages of 16 bytes to 16 MiB as a single Begin/Update/Finish sequence, at two
+ * levels:
+ *
+ *   op: directly through the key factory and Operation, as the keymaster implementation does
+ *       internally.
+ *   km: through AndroidKeymaster's BeginOperation/UpdateOperation/FinishOperation, including key
+ *       blob parsing, enforcement and the copies made by the request and response messages.
+ *
+ * Each cell reports throughput and the mean time for the whole sequence, which for small messages
+ * is almost entirely per-call overhead.  Combinations an operation factory rejects (for example
+ * padding with CTR mode) are skipped.
+ *
+ * Usage: block_cipher_benchmark [bytes-per-cell]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/km_openssl/aes_key.h>
+#include <keymaster/km_openssl/software_random_source.h>
+#include <keymaster/km_openssl/triple_des_key.h>
+#include <keymaster/operation.h>
+
+namespace keymaster {
+namespace test {
+
+static const size_t kPayloadSizes[] = {16, 256, 4096, 65536, 1024 * 1024, 16 * 1024 * 1024};
+
+// Bounds the number of sequences timed per cell, so that small payloads don't take forever.
+static const size_t kMaxRounds = 2000;
+
+static const uint8_t kNonce[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static const char* algorithm_name(keymaster_algorithm_t algorithm) {
+    return algorithm == KM_ALGORITHM_AES ? "AES" : "3DES";
+}
+
+static const char* block_mode_name(keymaster_block_mode_t block_mode) {
+    if (block_mode == KM_MODE_CHACHA20_POLY1305) return "CHACHA20-POLY1305";
+    switch (block_mode) {
+    case KM_MODE_ECB:
+        return "ECB";
+    case KM_MODE_CBC:
+        return "CBC";
+    case KM_MODE_CTR:
+        return "CTR";
+    case KM_MODE_GCM:
+        return "GCM";
+    }
+    return "?";
+}
+
+static bool is_aead(keymaster_block_mode_t block_mode) {
+    return block_mode == KM_MODE_GCM || block_mode == KM_MODE_CHACHA20_POLY1305;
+}
+
+struct CipherCase {
+    keymaster_algorithm_t algorithm;
+    uint32_t key_size_bits;
+    keymaster_block_mode_t block_mode;
+    keymaster_padding_t padding;
+
+    size_t key_size_bytes() const {
+        return algorithm == KM_ALGORITHM_AES ? key_size_bits / 8 : key_size_bits / 7;
+    }
+
+    size_t nonce_length() const {
+        if (block_mode == KM_MODE_ECB) return 0;
+        if (is_aead(block_mode)) return 12;
+        return algorithm == KM_ALGORITHM_AES ? 16 : 8;
+    }
+
+    AuthorizationSet KeyDescription() const {
+        AuthorizationSet description(AuthorizationSetBuilder()
+                                         .Authorization(TAG_ALGORITHM, algorithm)
+                                         .Authorization(TAG_KEY_SIZE, key_size_bits)
+                                         .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                         .Authorization(TAG_PURPOSE, KM_PURPOSE_DECRYPT)
+                                         .Authorization(TAG_BLOCK_MODE, block_mode)
+                                         .Authorization(TAG_PADDING, padding)
+                                         .Authorization(TAG_CALLER_NONCE)
+                                         .Authorization(TAG_NO_AUTH_REQUIRED));
+        if (is_aead(block_mode)) description.push_back(TAG_MIN_MAC_LENGTH, 128);
+        return description;
+    }
+
+    // Every message uses the same caller-supplied nonce, so that ciphertexts are reproducible.
+    AuthorizationSet BeginParams() const {
+        AuthorizationSet params(AuthorizationSetBuilder()
+                                    .Authorization(TAG_BLOCK_MODE, block_mode)
+                                    .Authorization(TAG_PADDING, padding));
+        if (nonce_length()) params.push_back(TAG_NONCE, kNonce, nonce_length());
+        if (is_aead(block_mode)) params.push_back(TAG_MAC_LENGTH, 128);
+        return params;
+    }
+};
+
+/**
+ * Runs operations directly on the key factories.
+ */
+class OperationLevel {
+  public:
+    OperationLevel()
+        : aes_factory_(nullptr /* blob_maker */, &random_source_),
+          triple_des_factory_(nullptr /* blob_maker */, &random_source_) {
+        memset(key_bytes_, 0x5a, sizeof(key_bytes_));
+    }
+
+    const KeyFactory& factory(keymaster_algorithm_t algorithm) const {
+        if (algorithm == KM_ALGORITHM_AES) return aes_factory_;
+        return triple_des_factory_;
+    }
+
+    keymaster_error_t Run(const CipherCase& test, keymaster_purpose_t purpose,
+                          const AuthorizationSet& begin_params, const Buffer& input,
+                          Buffer* output) const {
+        UniquePtr<Key> key;
+        keymaster_error_t error = factory(test.algorithm)
+                                      .LoadKey(KeymasterKeyBlob(key_bytes_, test.key_size_bytes()),
+                                               AuthorizationSet(), test.KeyDescription(),
+                                               AuthorizationSet(), &key);
+        if (error != KM_ERROR_OK) return error;
+
+        OperationPtr op = factory(test.algorithm)
+                              .GetOperationFactory(purpose)
+                              ->CreateOperation(move(*key), begin_params, &error);
+        if (!op) return error;
+
+        AuthorizationSet output_params;
+        error = op->Begin(begin_params, &output_params);
+        if (error != KM_ERROR_OK) return error;
+
+        AuthorizationSet no_params;
+        size_t input_consumed;
+        output->Clear();
+        error = op->Update(no_params, input, &output_params, output, &input_consumed);
+        if (error != KM_ERROR_OK) return error;
+        if (input_consumed != input.available_read()) return KM_ERROR_INVALID_INPUT_LENGTH;
+        return op->Finish(no_params, Buffer(), Buffer(), &output_params, output);
+    }
+
+    const uint8_t* key_bytes() const { return key_bytes_; }
+
+  private:
+    SoftwareRandomSource random_source_;
+    AesKeyFactory aes_factory_;
+    TripleDesKeyFactory triple_des_factory_;
+    uint8_t key_bytes_[32];
+};
+
+/**
+ * Runs operations through the AndroidKeymaster message interface, using the same key material as
+ * OperationLevel so that the two produce the same ciphertexts.
+ */
+class KeymasterLevel {
+  public:
+    KeymasterLevel() : keymaster_(new PureSoftKeymasterContext, 16 /* operation_table_size */) {}
+
+    keymaster_error_t ImportKey(const CipherCase& test, const uint8_t* key_bytes) {
+        ImportKeyRequest request;
+        request.key_description.Reinitialize(test.KeyDescription());
+        request.key_format = KM_KEY_FORMAT_RAW;
+        request.SetKeyMaterial(key_bytes, test.key_size_bytes());
+        ImportKeyResponse response;
+        keymaster_.ImportKey(request, &response);
+        if (response.error != KM_ERROR_OK) return response.error;
+        key_blob_ = KeymasterKeyBlob(response.key_blob);
+        return key_blob_.key_material ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    // Building the requests is timed too, since a real caller's messages are deserialized into
+    // new request objects, copying the payload.
+    keymaster_error_t Run(keymaster_purpose_t purpose, const AuthorizationSet& begin_params,
+                          const Buffer& input, size_t* output_length) {
+        BeginOperationRequest begin_request;
+        begin_request.purpose = purpose;
+        begin_request.SetKeyMaterial(key_blob_);
+        begin_request.additional_params.Reinitialize(begin_params);
+        BeginOperationResponse begin_response;
+        keymaster_.BeginOperation(begin_request, &begin_response);
+        if (begin_response.error != KM_ERROR_OK) return begin_response.error;
+
+        UpdateOperationRequest update_request;
+        update_request.op_handle = begin_response.op_handle;
+        if (!update_request.input.Reinitialize(input.peek_read(), input.available_read()))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        UpdateOperationResponse update_response;
+        keymaster_.UpdateOperation(update_request, &update_response);
+        if (update_response.error != KM_ERROR_OK) return update_response.error;
+        if (update_response.input_consumed != input.available_read())
+            return KM_ERROR_INVALID_INPUT_LENGTH;
+
+        FinishOperationRequest finish_request;
+        finish_request.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response;
+        keymaster_.FinishOperation(finish_request, &finish_response);
+        if (finish_response.error != KM_ERROR_OK) return finish_response.error;
+
+        *output_length =
+            update_response.output.available_read() + finish_response.output.available_read();
+        return KM_ERROR_OK;
+    }
+
+  private:
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_blob_;
+};
+
+struct CellResult {
+    bool ok;
+    double mb_per_s;
+    double us_per_sequence;
+};
+
+static size_t RoundsFor(size_t payload_size, size_t target_bytes) {
+    size_t rounds = target_bytes / payload_size;
+    if (rounds < 1) return 1;
+    return rounds > kMaxRounds ? kMaxRounds : rounds;
+}
+
+static CellResult Summarize(size_t payload_size, size_t rounds, uint64_t elapsed_ns) {
+    CellResult result;
+    result.ok = true;
+    double seconds = static_cast<double>(elapsed_ns) / 1e9;
+    result.mb_per_s = static_cast<double>(payload_size) * rounds / (1024 * 1024) / seconds;
+    result.us_per_sequence = static_cast<double>(elapsed_ns) / 1000 / rounds;
+    return result;
+}
+
+static CellResult TimeOperationLevel(const OperationLevel& level, const CipherCase& test,
+                                     keymaster_purpose_t purpose,
+                                     const AuthorizationSet& begin_params, const Buffer& input,
+                                     size_t expected_output, size_t target_bytes) {
+    CellResult failed = {false, 0, 0};
+    Buffer output;
+    size_t rounds = RoundsFor(input.available_read(), target_bytes);
+
+    // The first, untimed, round also sizes the output buffer.
+    if (level.Run(test, purpose, begin_params, input, &output) != KM_ERROR_OK) return failed;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < rounds; ++i) {
+        if (level.Run(test, purpose, begin_params, input, &output) != KM_ERROR_OK ||
+            output.available_read() != expected_output)
+            return failed;
+    }
+    return Summarize(input.available_read(), rounds, now_ns() - start);
+}
+
+static CellResult TimeKeymasterLevel(KeymasterLevel* level, keymaster_purpose_t purpose,
+                                     const AuthorizationSet& begin_params, const Buffer& input,
+                                     size_t expected_output, size_t target_bytes) {
+    CellResult failed = {false, 0, 0};
+    size_t rounds = RoundsFor(input.available_read(), target_bytes);
+
+    size_t output_length;
+    if (level->Run(purpose, begin_params, input, &output_length) != KM_ERROR_OK) return failed;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < rounds; ++i) {
+        if (level->Run(purpose, begin_params, input, &output_length) != KM_ERROR_OK ||
+            output_length != expected_output)
+            return failed;
+    }
+    return Summarize(input.available_read(), rounds, now_ns() - start);
+}
+
+static void PrintCell(const CellResult& result) {
+    if (result.ok)
+        printf("  %9.1f %9.1f", result.mb_per_s, result.us_per_sequence);
+    else
+        printf("  %19s", "FAILED");
+}
+
+static bool RunCase(const OperationLevel& op_level, const CipherCase& test, const uint8_t* message,
+                    size_t target_bytes) {
+    AuthorizationSet begin_params = test.BeginParams();
+
+    // Skip combinations the operations reject, such as padding in a stream mode.
+    {
+        Buffer output;
+        if (op_level.Run(test, KM_PURPOSE_ENCRYPT, begin_params, Buffer(message, 16), &output) !=
+            KM_ERROR_OK)
+            return true;
+    }
+
+    KeymasterLevel km_level;
+    if (km_level.ImportKey(test, op_level.key_bytes()) != KM_ERROR_OK) {
+        printf("%s-%u %s padding %d: key import failed\n", algorithm_name(test.algorithm),
+               test.key_size_bits, block_mode_name(test.block_mode), test.padding);
+        return false;
+    }
+
+    printf("\n%s-%u %s %s\n", algorithm_name(test.algorithm), test.key_size_bits,
+           block_mode_name(test.block_mode), test.padding == KM_PAD_PKCS7 ? "PKCS7" : "NONE");
+    printf("%9s  %19s  %19s  %19s  %19s\n", "", "op encrypt", "op decrypt", "km encrypt",
+           "km decrypt");
+    printf("%9s  %9s %9s  %9s %9s  %9s %9s  %9s %9s\n", "bytes", "MB/s", "us/call", "MB/s",
+           "us/call", "MB/s", "us/call", "MB/s", "us/call");
+
+    bool success = true;
+    for (size_t i = 0; i < array_length(kPayloadSizes); ++i) {
+        const size_t payload_size = kPayloadSizes[i];
+        Buffer plaintext(message, payload_size);
+        Buffer ciphertext;
+        if (op_level.Run(test, KM_PURPOSE_ENCRYPT, begin_params, plaintext, &ciphertext) !=
+            KM_ERROR_OK) {
+            printf("%9zu  encryption failed\n", payload_size);
+            success = false;
+            continue;
+        }
+
+        CellResult results[] = {
+            TimeOperationLevel(op_level, test, KM_PURPOSE_ENCRYPT, begin_params, plaintext,
+                               ciphertext.available_read(), target_bytes),
+            TimeOperationLevel(op_level, test, KM_PURPOSE_DECRYPT, begin_params, ciphertext,
+                               payload_size, target_bytes),
+            TimeKeymasterLevel(&km_level, KM_PURPOSE_ENCRYPT, begin_params, plaintext,
+                               ciphertext.available_read(), target_bytes),
+            TimeKeymasterLevel(&km_level, KM_PURPOSE_DECRYPT, begin_params, ciphertext,
+                               payload_size, target_bytes),
+        };
+        printf("%9zu", payload_size);
+        for (size_t j = 0; j < array_length(results); ++j) {
+            PrintCell(results[j]);
+            success &= results[j].ok;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    return success;
+}
+
+static bool RunAlgorithm(const OperationLevel& op_level, keymaster_algorithm_t algorithm,
+                         const uint32_t* key_sizes, size_t key_size_count, const uint8_t* message,
+                         size_t target_bytes) {
+    const OperationFactory* op_factory =
+        op_level.factory(algorithm).GetOperationFactory(KM_PURPOSE_ENCRYPT);
+    size_t block_mode_count, padding_count;
+    const keymaster_block_mode_t* block_modes = op_factory->SupportedBlockModes(&block_mode_count);
+    const keymaster_padding_t* paddings = op_factory->SupportedPaddingModes(&padding_count);
+
+    bool success = true;
+    for (size_t i = 0; i < key_size_count; ++i)
+        for (size_t j = 0; j < block_mode_count; ++j)
+            for (size_t k = 0; k < padding_count; ++k) {
+                CipherCase test = {algorithm, key_sizes[i], block_modes[j], paddings[k]};
+                success &= RunCase(op_level, test, message, target_bytes);
+            }
+    return success;
+}
+
+}  // namespace test
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    using namespace keymaster;
+    using namespace keymaster::test;
+
+    size_t target_bytes = 16 * 1024 * 1024;
+    if (argc > 1)
+        target_bytes = strtoul(argv[1], nullptr, 10);
+
+    const size_t max_payload = kPayloadSizes[array_length(kPayloadSizes) - 1];
+    UniquePtr<uint8_t[]> message(new uint8_t[max_payload]);
+    for (size_t i = 0; i < max_payload; ++i)
+        message[i] = static_cast<uint8_t>(i * 7);
+
+    OperationLevel op_level;
+    static const uint32_t aes_key_sizes[] = {128, 192, 256};
+    static const uint32_t triple_des_key_sizes[] = {168};
+    bool success = RunAlgorithm(op_level, KM_ALGORITHM_AES, aes_key_sizes,
+                                array_length(aes_key_sizes), message.get(), target_bytes);
+    success &= RunAlgorithm(op_level, KM_ALGORITHM_TRIPLE_DES, triple_des_key_sizes,
+                            array_length(triple_des_key_sizes), message.get(), target_bytes);
+    return success ? 0 : 1;
+}
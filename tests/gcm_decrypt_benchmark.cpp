@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmark for streaming AES-GCM decryption.
+ *
+ * Decrypts the same message repeatedly, feeding it to the operation in fixed-size chunks through
+ * UpdateInto(), and reports throughput and the mean cost of each update for every chunk size.
+ * Small chunks are dominated by per-update overhead, including holding back the candidate tag.
+ *
+ * Usage: gcm_decrypt_benchmark [bytes-per-chunk-size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/km_openssl/aes_key.h>
+#include <keymaster/km_openssl/software_random_source.h>
+#include <keymaster/operation.h>
+
+namespace keymaster {
+namespace test {
+
+static const size_t kMessageSize = 1024 * 1024;
+static const size_t kChunkSizes[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+static const uint8_t kNonce[12] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class GcmBenchmark {
+  public:
+    GcmBenchmark() : factory_(nullptr /* blob_maker */, &random_source_) {
+        memset(key_bytes_, 0x5a, sizeof(key_bytes_));
+        begin_params_.Reinitialize(AuthorizationSet(AuthorizationSetBuilder()
+                                                        .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                                        .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                                        .Authorization(TAG_MAC_LENGTH, 128)
+                                                        .Authorization(TAG_NONCE, kNonce, 12)));
+    }
+
+    OperationPtr Begin(keymaster_purpose_t purpose) {
+        AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                         .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                         .Authorization(TAG_KEY_SIZE, 128)
+                                         .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                         .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                         .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                         .Authorization(TAG_CALLER_NONCE));
+        UniquePtr<Key> key;
+        keymaster_error_t error =
+            factory_.LoadKey(KeymasterKeyBlob(key_bytes_, sizeof(key_bytes_)), AuthorizationSet(),
+                             move(hw_enforced), AuthorizationSet(), &key);
+        if (error != KM_ERROR_OK) return nullptr;
+
+        OperationPtr op = factory_.GetOperationFactory(purpose)->CreateOperation(
+            move(*key), begin_params_, &error);
+        if (!op) return nullptr;
+        AuthorizationSet output_params;
+        if (op->Begin(begin_params_, &output_params) != KM_ERROR_OK) return nullptr;
+        return op;
+    }
+
+    // Splits |input| into Buffers of at most |chunk_size| bytes.  Done ahead of time so that
+    // copying the input into Buffers isn't measured.
+    static Buffer* Split(const uint8_t* input, size_t input_length, size_t chunk_size,
+                         size_t* chunk_count) {
+        *chunk_count = (input_length + chunk_size - 1) / chunk_size;
+        Buffer* chunks = new Buffer[*chunk_count];
+        for (size_t i = 0; i < *chunk_count; ++i) {
+            size_t pos = i * chunk_size;
+            chunks[i].Reinitialize(input + pos, std::min(chunk_size, input_length - pos));
+        }
+        return chunks;
+    }
+
+    // Runs |chunks| through |op|, writing the result to |output|, which must be large enough for
+    // it.  Returns the number of bytes written, or 0 on failure.
+    static size_t Process(Operation* op, const Buffer* chunks, size_t chunk_count,
+                          uint8_t* output, size_t output_size) {
+        size_t written = 0;
+        AuthorizationSet no_params;
+        for (size_t i = 0; i < chunk_count; ++i) {
+            size_t chunk_written, consumed;
+            if (op->UpdateInto(no_params, chunks[i], nullptr /* output_params */, output + written,
+                               output_size - written, &chunk_written, &consumed) != KM_ERROR_OK)
+                return 0;
+            written += chunk_written;
+        }
+
+        size_t final_written;
+        if (op->FinishInto(no_params, Buffer(), Buffer(), nullptr /* output_params */,
+                           output + written, output_size - written,
+                           &final_written) != KM_ERROR_OK)
+            return 0;
+        return written + final_written;
+    }
+
+  private:
+    SoftwareRandomSource random_source_;
+    AesKeyFactory factory_;
+    uint8_t key_bytes_[16];
+    AuthorizationSet begin_params_;
+};
+
+static bool RunChunkSize(GcmBenchmark* benchmark, const uint8_t* ciphertext,
+                         size_t ciphertext_length, size_t chunk_size, size_t target_bytes,
+                         uint8_t* output, size_t output_size) {
+    size_t rounds = target_bytes / kMessageSize;
+    if (rounds == 0) rounds = 1;
+
+    size_t chunk_count;
+    UniquePtr<Buffer[]> chunks(
+        GcmBenchmark::Split(ciphertext, ciphertext_length, chunk_size, &chunk_count));
+
+    uint64_t elapsed_ns = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        OperationPtr op = benchmark->Begin(KM_PURPOSE_DECRYPT);
+        if (!op) return false;
+
+        uint64_t start = now_ns();
+        size_t written =
+            GcmBenchmark::Process(op.get(), chunks.get(), chunk_count, output, output_size);
+        elapsed_ns += now_ns() - start;
+        if (written != kMessageSize) {
+            fprintf(stderr, "Decryption with %zu-byte chunks failed\n", chunk_size);
+            return false;
+        }
+    }
+
+    size_t updates = rounds * chunk_count;
+    double seconds = static_cast<double>(elapsed_ns) / 1e9;
+    printf("%6zu-byte chunks  %9.1f MB/s  %9.1f ns/update\n", chunk_size,
+           static_cast<double>(rounds * kMessageSize) / (1024 * 1024) / seconds,
+           static_cast<double>(elapsed_ns) / updates);
+    return true;
+}
+
+}  // namespace test
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    using namespace keymaster;
+    using namespace keymaster::test;
+
+    size_t target_bytes = 64 * 1024 * 1024;
+    if (argc > 1)
+        target_bytes = strtoul(argv[1], nullptr, 10);
+
+    GcmBenchmark benchmark;
+    const size_t output_size = kMessageSize + 64;
+    UniquePtr<uint8_t[]> plaintext(new uint8_t[kMessageSize]);
+    UniquePtr<uint8_t[]> ciphertext(new uint8_t[output_size]);
+    UniquePtr<uint8_t[]> output(new uint8_t[output_size]);
+    for (size_t i = 0; i < kMessageSize; ++i)
+        plaintext[i] = static_cast<uint8_t>(i * 7);
+
+    Buffer message(plaintext.get(), kMessageSize);
+    OperationPtr op = benchmark.Begin(KM_PURPOSE_ENCRYPT);
+    size_t ciphertext_length =
+        op ? GcmBenchmark::Process(op.get(), &message, 1, ciphertext.get(), output_size) : 0;
+    if (ciphertext_length == 0) {
+        fprintf(stderr, "Encryption failed\n");
+        return 1;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < array_length(kChunkSizes); ++i)
+        success &= RunChunkSize(&benchmark, ciphertext.get(), ciphertext_length, kChunkSizes[i],
+                                target_bytes, output.get(), output_size);
+    return success ? 0 : 1;
+}
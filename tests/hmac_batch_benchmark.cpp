@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmark for multi-buffer HMAC-SHA256, as used by AndroidKeymaster::BatchComputeMacs().
+ *
+ * For several message sizes and batch sizes, compares ComputeHmacSha256s() on the whole batch
+ * with one-shot HMAC() on each message in turn.  Throughput should grow with the batch size until
+ * every lane is busy, then level off at roughly HmacSha256Lanes() times the per-lane rate.  The
+ * 1024-byte messages are past the lane cutoff, so those batches should match HMAC().
+ *
+ * Usage: hmac_batch_benchmark [macs-per-measurement]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/km_openssl/hmac_sha256_multibuffer.h>
+
+namespace keymaster {
+namespace test {
+
+static const size_t kKeySize = 32;
+static const size_t kMessageSizes[] = {32, 256, 1024};
+static const size_t kBatchSizes[] = {1, 2, 4, 8, 16, 64};
+static const size_t kMaxMessageSize = 1024;
+static const size_t kMaxBatchSize = 64;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class HmacBatchBenchmark {
+  public:
+    HmacBatchBenchmark() {
+        for (size_t i = 0; i < kMaxBatchSize; ++i) {
+            memset(keys_[i], static_cast<int>(i), kKeySize);
+            memset(messages_[i], static_cast<int>(0x80 + i), kMaxMessageSize);
+        }
+    }
+
+    // Returns MACs per second for |rounds| batches of |batch_size| messages, or 0 if any MAC
+    // disagrees with HMAC().
+    double TimeBatches(size_t message_size, size_t batch_size, size_t rounds) {
+        for (size_t i = 0; i < batch_size; ++i) {
+            jobs_[i].key = keys_[i];
+            jobs_[i].key_length = kKeySize;
+            jobs_[i].message = messages_[i];
+            jobs_[i].message_length = message_size;
+        }
+
+        uint64_t start = now_ns();
+        for (size_t round = 0; round < rounds; ++round)
+            ComputeHmacSha256s(jobs_, batch_size);
+        uint64_t elapsed = now_ns() - start;
+
+        uint8_t expected[EVP_MAX_MD_SIZE];
+        unsigned int expected_length;
+        for (size_t i = 0; i < batch_size; ++i) {
+            if (!HMAC(EVP_sha256(), keys_[i], kKeySize, messages_[i], message_size, expected,
+                      &expected_length) ||
+                expected_length != kHmacSha256Size ||
+                memcmp(expected, jobs_[i].mac, kHmacSha256Size) != 0)
+                return 0;
+        }
+        return static_cast<double>(rounds * batch_size) * 1e9 / elapsed;
+    }
+
+    // Returns MACs per second for |macs| one-shot HMAC() calls.
+    double TimeOneShot(size_t message_size, size_t macs) {
+        uint8_t mac[EVP_MAX_MD_SIZE];
+        unsigned int mac_length;
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < macs; ++i) {
+            size_t record = i % kMaxBatchSize;
+            if (!HMAC(EVP_sha256(), keys_[record], kKeySize, messages_[record], message_size, mac,
+                      &mac_length))
+                return 0;
+        }
+        return static_cast<double>(macs) * 1e9 / (now_ns() - start);
+    }
+
+  private:
+    uint8_t keys_[kMaxBatchSize][kKeySize];
+    uint8_t messages_[kMaxBatchSize][kMaxMessageSize];
+    HmacSha256Job jobs_[kMaxBatchSize];
+};
+
+}  // namespace test
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    using namespace keymaster;
+    using namespace keymaster::test;
+
+    size_t macs = 400000;
+    if (argc > 1)
+        macs = strtoul(argv[1], nullptr, 10);
+
+    UniquePtr<HmacBatchBenchmark> benchmark(new HmacBatchBenchmark);
+
+    printf("HMAC-SHA256, %zu lanes, %zu MACs per measurement\n", HmacSha256Lanes(), macs);
+    printf("%8s  %5s  %12s  %13s  %7s\n", "msg size", "batch", "batch MACs/s", "HMAC() MACs/s",
+           "speedup");
+    bool success = true;
+    for (size_t message_size : kMessageSizes) {
+        double one_shot = benchmark->TimeOneShot(message_size, macs);
+        for (size_t batch_size : kBatchSizes) {
+            size_t rounds = macs / batch_size;
+            if (rounds == 0) rounds = 1;
+            double batched = benchmark->TimeBatches(message_size, batch_size, rounds);
+            if (batched == 0 || one_shot == 0) {
+                fprintf(stderr, "%zu-byte batch of %zu produced a wrong MAC\n", message_size,
+                        batch_size);
+                success = false;
+                continue;
+            }
+            printf("%8zu  %5zu  %12.0f  %13.0f  %6.2fx\n", message_size, batch_size, batched,
+                   one_shot, batched / one_shot);
+        }
+    }
+    return success ? 0 : 1;
+}
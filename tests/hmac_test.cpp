@@ -15,13 +15,17 @@
  */
 
 #include <keymaster/km_openssl/hmac.h>
+#include <keymaster/km_openssl/hmac_sha256_multibuffer.h>
 
 #include <gtest/gtest.h>
 #include <string.h>
 
+#include <vector>
+
 #include "android_keymaster_test_utils.h"
 
 using std::string;
+using std::vector;
 
 namespace keymaster {
 
@@ -80,5 +84,45 @@ TEST(HmacTest, SHA256) {
     }
 }
 
+TEST(HmacTest, SHA256MultiBuffer) {
+    // The test vectors, then enough more jobs to fill every lane twice over, with keys on both
+    // sides of the block size and messages on both sides of the lane cutoff, checked against
+    // HmacSha256.
+    vector<string> keys;
+    vector<string> messages;
+    for (size_t i = 0; i < 2; i++) {
+        keys.push_back(hex2str(kHmacTests[i].key));
+        messages.push_back(kHmacTests[i].data);
+    }
+    for (size_t i = 0; i < 2 * HmacSha256Lanes() + 3; i++) {
+        keys.push_back(string(1 + i * 11 % 140, static_cast<char>(i)));
+        messages.push_back(string(i * 97 % 700, static_cast<char>(0x80 + i)));
+    }
+
+    vector<HmacSha256Job> jobs(keys.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].key = reinterpret_cast<const uint8_t*>(keys[i].data());
+        jobs[i].key_length = keys[i].size();
+        jobs[i].message = reinterpret_cast<const uint8_t*>(messages[i].data());
+        jobs[i].message_length = messages[i].size();
+    }
+    ComputeHmacSha256s(jobs.data(), jobs.size());
+
+    EXPECT_EQ(0, memcmp(kHmacTests[0].digest, jobs[0].mac, kHmacSha256Size));
+    EXPECT_EQ(0, memcmp(kHmacTests[1].digest, jobs[1].mac, kHmacSha256Size));
+    for (size_t i = 0; i < jobs.size(); i++) {
+        HmacSha256 hmac;
+        ASSERT_TRUE(hmac.Init(jobs[i].key, jobs[i].key_length));
+        EXPECT_TRUE(hmac.Verify(jobs[i].message, jobs[i].message_length, jobs[i].mac,
+                                kHmacSha256Size))
+            << "job " << i;
+    }
+
+    // A single job takes the scalar path.
+    HmacSha256Job single = jobs[2];
+    ComputeHmacSha256s(&single, 1);
+    EXPECT_EQ(0, memcmp(jobs[2].mac, single.mac, kHmacSha256Size));
+}
+
 }  // namespace test
 }  // namespace keymaster
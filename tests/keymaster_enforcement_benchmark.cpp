@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmark for the KeymasterEnforcement hot path.
+ *
+ * Drives AuthorizeOperation through Begin, Update and Finish for a set of key authorization
+ * profiles and key-ID populations, and reports the mean cost and heap allocation count of each
+ * call.  Time is supplied by a fake clock that advances one second per round, so rate-limit table
+ * expiry and auth-token timeout checks are exercised deterministically.
+ *
+ * Usage: keymaster_enforcement_benchmark [ops-per-profile]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <new>
+
+#include <hardware/hw_auth_token.h>
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/km_openssl/soft_keymaster_enforcement.h>
+
+// Count every heap allocation made by the process, so the benchmark can report allocations/op.
+static size_t allocation_count = 0;
+
+static void* counted_malloc(size_t size) {
+    ++allocation_count;
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+    void* p = counted_malloc(size);
+    if (!p)
+        abort();
+    return p;
+}
+void* operator new[](size_t size) {
+    void* p = counted_malloc(size);
+    if (!p)
+        abort();
+    return p;
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_malloc(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_malloc(size);
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace keymaster {
+namespace test {
+
+static const uint64_t kStartTimeMs = 1000000;
+static const uint64_t kUserSecureId = 9;
+static const keymaster_operation_handle_t kOpHandle = 99;
+
+class FakeClock : public EnforcementClock {
+  public:
+    explicit FakeClock(uint64_t now_ms) : now_ms_(now_ms) {}
+
+    uint64_t now_ms() const override { return now_ms_; }
+    uint64_t tolerance_ms() const override { return 0; }
+    void advance_ms(uint64_t ms) { now_ms_ += ms; }
+
+  private:
+    uint64_t now_ms_;
+};
+
+class BenchmarkEnforcement : public SoftKeymasterEnforcement {
+  public:
+    BenchmarkEnforcement(const FakeClock* clock, uint32_t max_keys)
+        : SoftKeymasterEnforcement(max_keys, max_keys) {
+        set_clock(clock);
+    }
+
+    bool auth_token_timed_out(const hw_auth_token_t& token, uint32_t timeout,
+                              uint64_t current_time_ms) const override {
+        return current_time_ms + get_current_time_tolerance_ms() >
+               ntoh(token.timestamp) + static_cast<uint64_t>(timeout) * 1000;
+    }
+};
+
+enum Profile {
+    PROFILE_PLAIN,
+    PROFILE_RATE_LIMITED,
+    PROFILE_COUNT_LIMITED,
+    PROFILE_AUTH_TIMEOUT,
+    PROFILE_AUTH_PER_OP,
+};
+
+static const struct {
+    Profile profile;
+    const char* name;
+} kProfiles[] = {
+    {PROFILE_PLAIN, "plain"},
+    {PROFILE_RATE_LIMITED, "rate-limited"},
+    {PROFILE_COUNT_LIMITED, "count-limited"},
+    {PROFILE_AUTH_TIMEOUT, "auth-timeout"},
+    {PROFILE_AUTH_PER_OP, "auth-per-op"},
+};
+
+static const uint32_t kKeyCounts[] = {1, 10, 100, 1000, 10000};
+
+static AuthorizationSet KeyAuthorizations(Profile profile) {
+    AuthorizationSetBuilder builder;
+    builder.Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+        .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+        .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+        .Authorization(TAG_KEY_SIZE, 256);
+
+    switch (profile) {
+    case PROFILE_PLAIN:
+        builder.Authorization(TAG_NO_AUTH_REQUIRED);
+        break;
+    case PROFILE_RATE_LIMITED:
+        builder.Authorization(TAG_NO_AUTH_REQUIRED).Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 1);
+        break;
+    case PROFILE_COUNT_LIMITED:
+        builder.Authorization(TAG_NO_AUTH_REQUIRED)
+            .Authorization(TAG_MAX_USES_PER_BOOT, UINT32_MAX);
+        break;
+    case PROFILE_AUTH_TIMEOUT:
+        builder.Authorization(TAG_USER_SECURE_ID, kUserSecureId)
+            .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY)
+            .Authorization(TAG_AUTH_TIMEOUT, 300);
+        break;
+    case PROFILE_AUTH_PER_OP:
+        builder.Authorization(TAG_USER_SECURE_ID, kUserSecureId)
+            .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY);
+        break;
+    }
+    return AuthorizationSet(builder);
+}
+
+static AuthorizationSet OperationParams(const FakeClock& clock) {
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.challenge = kOpHandle;
+    token.user_id = kUserSecureId;
+    token.authenticator_type = hton(static_cast<uint32_t>(HW_AUTH_PASSWORD));
+    token.timestamp = hton(clock.now_ms());
+
+    AuthorizationSet params;
+    params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    return params;
+}
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct PhaseStats {
+    uint64_t elapsed_ns = 0;
+    size_t allocations = 0;
+    size_t calls = 0;
+};
+
+// Runs one authorization per key and accumulates its cost into |stats|.  Returns false if any
+// authorization was denied.
+static bool RunPhase(BenchmarkEnforcement* enforcement, const AuthProxy& auths,
+                     const AuthorizationSet& op_params, uint32_t key_count, bool is_begin,
+                     PhaseStats* stats) {
+    keymaster_error_t result = KM_ERROR_OK;
+    size_t allocations_before = allocation_count;
+    uint64_t start = now_ns();
+    for (uint32_t key = 0; key < key_count && result == KM_ERROR_OK; ++key)
+        result = enforcement->AuthorizeOperation(KM_PURPOSE_ENCRYPT, key + 1, auths, op_params,
+                                                 kOpHandle, is_begin);
+    stats->elapsed_ns += now_ns() - start;
+    stats->allocations += allocation_count - allocations_before;
+    stats->calls += key_count;
+
+    if (result != KM_ERROR_OK) {
+        fprintf(stderr, "Authorization failed with error %d\n", result);
+        return false;
+    }
+    return true;
+}
+
+static void Report(const char* profile, uint32_t key_count, const char* phase,
+                   const PhaseStats& stats) {
+    printf("%-14s %6u keys  %-7s %10.1f ns/op %8.2f allocs/op\n", profile, key_count, phase,
+           static_cast<double>(stats.elapsed_ns) / stats.calls,
+           static_cast<double>(stats.allocations) / stats.calls);
+}
+
+static bool RunProfile(Profile profile, const char* name, uint32_t key_count, size_t target_ops) {
+    FakeClock clock(kStartTimeMs);
+    BenchmarkEnforcement enforcement(&clock, key_count);
+    AuthorizationSet hw_enforced(KeyAuthorizations(profile));
+    AuthorizationSet sw_enforced;
+    AuthProxy auths(hw_enforced, sw_enforced);
+
+    size_t rounds = target_ops / key_count;
+    if (rounds == 0)
+        rounds = 1;
+
+    PhaseStats begin, update, finish;
+    // Round zero populates the rate-limit and usage-count tables and is not measured.
+    for (size_t round = 0; round <= rounds; ++round) {
+        AuthorizationSet op_params(OperationParams(clock));
+        PhaseStats warmup;
+        bool measure = round > 0;
+        if (!RunPhase(&enforcement, auths, op_params, key_count, true /* is_begin */,
+                      measure ? &begin : &warmup) ||
+            !RunPhase(&enforcement, auths, op_params, key_count, false /* is_begin */,
+                      measure ? &update : &warmup) ||
+            !RunPhase(&enforcement, auths, op_params, key_count, false /* is_begin */,
+                      measure ? &finish : &warmup)) {
+            fprintf(stderr, "%s profile with %u keys failed in round %zu\n", name, key_count,
+                    round);
+            return false;
+        }
+        clock.advance_ms(1000);
+    }
+
+    Report(name, key_count, "begin", begin);
+    Report(name, key_count, "update", update);
+    Report(name, key_count, "finish", finish);
+    return true;
+}
+
+}  // namespace test
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    using namespace keymaster;
+    using namespace keymaster::test;
+
+    size_t target_ops = 20000;
+    if (argc > 1)
+        target_ops = strtoul(argv[1], nullptr, 10);
+
+    bool success = true;
+    for (size_t i = 0; i < array_length(kProfiles); ++i)
+        for (size_t j = 0; j < array_length(kKeyCounts); ++j)
+            success &= RunProfile(kProfiles[i].profile, kProfiles[i].name, kKeyCounts[j],
+                                  target_ops);
+    return success ? 0 : 1;
+}
@@ -16,10 +16,14 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include <openssl/hmac.h>
+
 #include <keymaster/android_keymaster.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/km_openssl/ckdf.h>
 #include <keymaster/km_openssl/soft_keymaster_enforcement.h>
 
 #include "android_keymaster_test_utils.h"
@@ -30,7 +34,11 @@ namespace test {
 class TestKeymasterEnforcement : public SoftKeymasterEnforcement {
   public:
     TestKeymasterEnforcement()
-        : SoftKeymasterEnforcement(3, 3), current_time_(10000), report_token_valid_(true) {}
+        : SoftKeymasterEnforcement(3, 3), current_time_(10000), report_token_valid_(true) {
+        // Real-world time is kept as an offset from the relative clock, so date checks can use
+        // the request's time snapshot.
+        boot_date_ms_ = static_cast<uint64_t>(time(NULL)) * 1000 - get_current_time_ms();
+    }
 
     keymaster_error_t AuthorizeOperation(const keymaster_purpose_t purpose, const km_id_t keyid,
                                          const AuthProxy& auth_set) {
@@ -41,18 +49,15 @@ class TestKeymasterEnforcement : public SoftKeymasterEnforcement {
     using KeymasterEnforcement::AuthorizeOperation;
 
     uint64_t get_current_time_ms() const override { return current_time_ * 1000; }
-    bool activation_date_valid(uint64_t activation_date) const override {
-        // Convert java date to time_t, non-portably.
-        time_t activation_time = activation_date / 1000;
-        return difftime(time(NULL), activation_time) >= 0;
+    bool activation_date_valid(uint64_t activation_date, uint64_t current_time_ms) const override {
+        return boot_date_ms_ + current_time_ms >= activation_date;
     }
-    bool expiration_date_passed(uint64_t expiration_date) const override {
-        // Convert jave date to time_t, non-portably.
-        time_t expiration_time = expiration_date / 1000;
-        return difftime(time(NULL), expiration_time) > 0;
+    bool expiration_date_passed(uint64_t expiration_date, uint64_t current_time_ms) const override {
+        return boot_date_ms_ + current_time_ms > expiration_date;
     }
-    bool auth_token_timed_out(const hw_auth_token_t& token, uint32_t timeout) const override {
-        return current_time_ > ntoh(token.timestamp) + timeout;
+    bool auth_token_timed_out(const hw_auth_token_t& token, uint32_t timeout,
+                              uint64_t current_time_ms) const override {
+        return current_time_ms / 1000 > ntoh(token.timestamp) + timeout;
     }
     bool ValidateTokenSignature(const hw_auth_token_t&) const override {
         return report_token_valid_;
@@ -66,6 +71,7 @@ class TestKeymasterEnforcement : public SoftKeymasterEnforcement {
 
   private:
     uint32_t current_time_;
+    uint64_t boot_date_ms_;
     bool report_token_valid_;
 };
 
@@ -917,6 +923,199 @@ TEST_F(KeymasterBaseTest, TestTimedAuthMissingToken) {
                                       op_params, token.challenge, true /* is_begin_operation */));
 }
 
+TEST_F(KeymasterBaseTest, TestDecisionTraceRecordsRejection) {
+    keymaster_key_param_t params[] = {
+        Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES), Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN),
+        Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 10),
+    };
+    AuthorizationSet auth_set(params, array_length(params));
+
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty)));
+    kmen.tick();
+    EXPECT_EQ(KM_ERROR_KEY_RATE_LIMIT_EXCEEDED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty)));
+
+    EnforcementDecision records[EnforcementDecisionTrace::kCapacity];
+    ASSERT_EQ(2U, kmen.decision_trace().Snapshot(records, array_length(records)));
+
+    EXPECT_EQ(0xaU, records[0].key_id);
+    EXPECT_EQ(KM_ERROR_OK, records[0].result);
+    EXPECT_EQ(KM_TAG_INVALID, records[0].deciding_tag);
+    EXPECT_EQ(10000000U, records[0].timestamp_ms);
+
+    EXPECT_EQ(0xaU, records[1].key_id);
+    EXPECT_EQ(KM_PURPOSE_SIGN, records[1].purpose);
+    EXPECT_TRUE(records[1].is_begin_operation);
+    EXPECT_EQ(KM_ERROR_KEY_RATE_LIMIT_EXCEEDED, records[1].result);
+    EXPECT_EQ(KM_TAG_MIN_SECONDS_BETWEEN_OPS, records[1].deciding_tag);
+    EXPECT_EQ(10001000U, records[1].timestamp_ms);
+}
+
+TEST_F(KeymasterBaseTest, TestDecisionTraceWraps) {
+    keymaster_key_param_t params[] = {
+        Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN),
+    };
+    AuthorizationSet auth_set(params, array_length(params));
+
+    const size_t decision_count = EnforcementDecisionTrace::kCapacity + 5;
+    for (size_t i = 0; i < decision_count; ++i)
+        EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PURPOSE,
+                  kmen.AuthorizeOperation(KM_PURPOSE_DECRYPT, i /* key_id */,
+                                          AuthProxy(auth_set, empty)));
+    EXPECT_EQ(decision_count, kmen.decision_trace().total_recorded());
+
+    EnforcementDecision records[EnforcementDecisionTrace::kCapacity];
+    ASSERT_EQ(EnforcementDecisionTrace::kCapacity,
+              kmen.decision_trace().Snapshot(records, array_length(records)));
+    for (size_t i = 0; i < EnforcementDecisionTrace::kCapacity; ++i) {
+        EXPECT_EQ(i + 5, records[i].key_id);
+        EXPECT_EQ(KM_TAG_PURPOSE, records[i].deciding_tag);
+    }
+
+    // Smaller snapshots return the most recent decisions.
+    ASSERT_EQ(2U, kmen.decision_trace().Snapshot(records, 2));
+    EXPECT_EQ(decision_count - 2, records[0].key_id);
+    EXPECT_EQ(decision_count - 1, records[1].key_id);
+}
+
+TEST_F(KeymasterBaseTest, TestDecisionTraceSerialization) {
+    keymaster_key_param_t params[] = {
+        Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN), Authorization(TAG_USER_SECURE_ID, 1),
+        Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY),
+    };
+    AuthorizationSet auth_set(params, array_length(params));
+
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty), empty,
+                                      1 /* op_handle */, false /* is_begin_operation */));
+
+    EnforcementDecision records[EnforcementDecisionTrace::kCapacity];
+    size_t count = kmen.decision_trace().Snapshot(records, array_length(records));
+    ASSERT_EQ(1U, count);
+
+    size_t size = EnforcementDecisionTrace::SerializedSize(count);
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size,
+              EnforcementDecisionTrace::Serialize(records, count, buf.get(), buf.get() + size));
+
+    EnforcementDecision decoded[1];
+    size_t decoded_count = array_length(decoded);
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(
+        EnforcementDecisionTrace::Deserialize(&p, buf.get() + size, decoded, &decoded_count));
+    ASSERT_EQ(1U, decoded_count);
+    EXPECT_EQ(buf.get() + size, p);
+    EXPECT_EQ(0xaU, decoded[0].key_id);
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED, decoded[0].result);
+    EXPECT_EQ(KM_TAG_USER_SECURE_ID, decoded[0].deciding_tag);
+    EXPECT_FALSE(decoded[0].is_begin_operation);
+    // Update and Finish don't read the clock.
+    EXPECT_EQ(0U, decoded[0].timestamp_ms);
+
+    // Truncated input must be rejected.
+    p = buf.get();
+    decoded_count = array_length(decoded);
+    EXPECT_FALSE(
+        EnforcementDecisionTrace::Deserialize(&p, buf.get() + size - 1, decoded, &decoded_count));
+
+    char line[128];
+    EXPECT_LT(0, EnforcementDecisionTrace::Format(decoded[0], line, sizeof(line)));
+    EXPECT_TRUE(strstr(line, "update/finish") != nullptr);
+}
+
+TEST_F(KeymasterBaseTest, TestVerifyAuthorizationMacUsesSharedKey) {
+    HmacSharingParametersArray params;
+    params.params_array = new HmacSharingParameters[1];
+    params.num_params = 1;
+    ASSERT_EQ(KM_ERROR_OK, kmen.GetHmacSharingParameters(&params.params_array[0]));
+
+    VerifyAuthorizationRequest request;
+    request.challenge = 42;
+    VerifyAuthorizationResponse unshared = kmen.VerifyAuthorization(request);
+    ASSERT_EQ(KM_ERROR_OK, unshared.error);
+
+    KeymasterBlob sharing_check;
+    ASSERT_EQ(KM_ERROR_OK, kmen.ComputeSharedHmac(params, &sharing_check));
+
+    // Derive the shared key independently and compute the expected token MAC with it.
+    const uint8_t zero_key[32] = {};
+    const char* shared_hmac_label = "KeymasterSharedMac";
+    keymaster_blob_t context[] = {
+        params.params_array[0].seed,
+        {params.params_array[0].nonce, sizeof(params.params_array[0].nonce)},
+    };
+    KeymasterKeyBlob shared_key(32);
+    ASSERT_EQ(KM_ERROR_OK,
+              ckdf(KeymasterKeyBlob(zero_key, sizeof(zero_key)),
+                   KeymasterBlob(reinterpret_cast<const uint8_t*>(shared_hmac_label),
+                                 strlen(shared_hmac_label)),
+                   context, array_length(context), &shared_key));
+
+    // Two tokens in a row must both be MACed from a fresh copy of the keyed context.
+    for (int i = 0; i < 2; ++i) {
+        VerifyAuthorizationResponse response = kmen.VerifyAuthorization(request);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+
+        const char* label = "Auth Verification";
+        Buffer data(128);
+        data.write(reinterpret_cast<const uint8_t*>(label), strlen(label));
+        data.write(reinterpret_cast<const uint8_t*>(&response.token.challenge),
+                   sizeof(response.token.challenge));
+        data.write(reinterpret_cast<const uint8_t*>(&response.token.timestamp),
+                   sizeof(response.token.timestamp));
+        data.write(reinterpret_cast<const uint8_t*>(&response.token.security_level),
+                   sizeof(response.token.security_level));
+
+        uint8_t expected_mac[EVP_MAX_MD_SIZE];
+        unsigned expected_mac_len;
+        ASSERT_TRUE(HMAC(EVP_sha256(), shared_key.key_material, shared_key.key_material_size,
+                         data.peek_read(), data.available_read(), expected_mac,
+                         &expected_mac_len));
+        ASSERT_EQ(expected_mac_len, response.token.mac.data_length);
+        EXPECT_EQ(0, memcmp(expected_mac, response.token.mac.data, expected_mac_len));
+
+        // Re-keying must have replaced the context used before the shared key was computed.
+        EXPECT_NE(0, memcmp(unshared.token.mac.data, response.token.mac.data, expected_mac_len));
+    }
+}
+
+TEST_F(KeymasterBaseTest, TestBatchVerifyAuthorization) {
+    BatchVerifyAuthorizationRequest request;
+    const uint64_t challenges[] = {7, 8, 9};
+    ASSERT_TRUE(request.SetChallenges(challenges, array_length(challenges)));
+
+    uint64_t before = BoottimeClock().now_ms();
+    BatchVerifyAuthorizationResponse response = kmen.BatchVerifyAuthorization(request);
+    uint64_t after = BoottimeClock().now_ms();
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    ASSERT_EQ(array_length(challenges), response.num_tokens);
+
+    for (size_t i = 0; i < response.num_tokens; ++i) {
+        const VerificationToken& token = response.tokens[i];
+        EXPECT_EQ(challenges[i], token.challenge);
+        EXPECT_LE(before, token.timestamp);
+        EXPECT_GE(after, token.timestamp);
+        EXPECT_EQ(KM_SECURITY_LEVEL_SOFTWARE, token.security_level);
+
+        // Each token must be identical to the one produced by a single request.
+        VerifyAuthorizationRequest single_request;
+        single_request.challenge = challenges[i];
+        VerifyAuthorizationResponse single_response = kmen.VerifyAuthorization(single_request);
+        ASSERT_EQ(KM_ERROR_OK, single_response.error);
+        EXPECT_EQ(single_response.token.timestamp, token.timestamp);
+        ASSERT_EQ(single_response.token.mac.data_length, token.mac.data_length);
+        EXPECT_EQ(0, memcmp(single_response.token.mac.data, token.mac.data, token.mac.data_length));
+    }
+}
+
+TEST_F(KeymasterBaseTest, TestBatchVerifyAuthorizationEmpty) {
+    BatchVerifyAuthorizationRequest request;
+    BatchVerifyAuthorizationResponse response = kmen.BatchVerifyAuthorization(request);
+    EXPECT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_EQ(0U, response.num_tokens);
+}
+
 TEST_F(KeymasterBaseTest, TestCreateKeyId) {
     keymaster_key_blob_t blob = {reinterpret_cast<const uint8_t*>("foobar"), 6};
 
@@ -925,5 +1124,98 @@ TEST_F(KeymasterBaseTest, TestCreateKeyId) {
     EXPECT_NE(0U, key_id);
 }
 
+class FakeEnforcementClock : public EnforcementClock {
+  public:
+    uint64_t now_ms() const override {
+        ++reads_;
+        return now_ms_;
+    }
+    uint64_t tolerance_ms() const override { return tolerance_ms_; }
+
+    void advance_ms(uint64_t ms) { now_ms_ += ms; }
+    void set_tolerance_ms(uint64_t ms) { tolerance_ms_ = ms; }
+    size_t reads() const { return reads_; }
+
+  private:
+    uint64_t now_ms_ = 5000000;
+    uint64_t tolerance_ms_ = 0;
+    mutable size_t reads_ = 0;
+};
+
+TEST(SoftKeymasterEnforcementClockTest, RateLimitUsesInjectedClock) {
+    FakeEnforcementClock clock;
+    SoftKeymasterEnforcement enforcement(3, 3);
+    enforcement.set_clock(&clock);
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                  .Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 2));
+    AuthorizationSet empty;
+
+    EXPECT_EQ(KM_ERROR_OK, enforcement.AuthorizeOperation(KM_PURPOSE_ENCRYPT, 1 /* key_id */,
+                                                          AuthProxy(auth_set, empty), empty,
+                                                          0 /* op_handle */, true /* is_begin */));
+    // The rate-limit check, table update and decision trace share one clock read.
+    EXPECT_EQ(1U, clock.reads());
+
+    clock.advance_ms(1999);
+    EXPECT_EQ(KM_ERROR_KEY_RATE_LIMIT_EXCEEDED,
+              enforcement.AuthorizeOperation(KM_PURPOSE_ENCRYPT, 1 /* key_id */,
+                                             AuthProxy(auth_set, empty), empty, 0 /* op_handle */,
+                                             true /* is_begin */));
+    clock.advance_ms(1);
+    EXPECT_EQ(KM_ERROR_OK, enforcement.AuthorizeOperation(KM_PURPOSE_ENCRYPT, 1 /* key_id */,
+                                                          AuthProxy(auth_set, empty), empty,
+                                                          0 /* op_handle */, true /* is_begin */));
+    EXPECT_EQ(3U, clock.reads());
+
+    // Verification tokens are stamped from CLOCK_BOOTTIME, not the injected clock.
+    VerifyAuthorizationRequest request;
+    uint64_t before = BoottimeClock().now_ms();
+    uint64_t timestamp = enforcement.VerifyAuthorization(request).token.timestamp;
+    EXPECT_LE(before, timestamp);
+    EXPECT_GE(BoottimeClock().now_ms(), timestamp);
+}
+
+TEST(SoftKeymasterEnforcementClockTest, RateLimitAddsClockTolerance) {
+    FakeEnforcementClock clock;
+    clock.set_tolerance_ms(10);
+    SoftKeymasterEnforcement enforcement(3, 3);
+    enforcement.set_clock(&clock);
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                  .Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 2));
+    AuthorizationSet empty;
+
+    EXPECT_EQ(KM_ERROR_OK, enforcement.AuthorizeOperation(KM_PURPOSE_ENCRYPT, 1 /* key_id */,
+                                                          AuthProxy(auth_set, empty), empty,
+                                                          0 /* op_handle */, true /* is_begin */));
+
+    // With a lagging clock, exactly the minimum interval might really be a little less.
+    clock.advance_ms(2009);
+    EXPECT_EQ(KM_ERROR_KEY_RATE_LIMIT_EXCEEDED,
+              enforcement.AuthorizeOperation(KM_PURPOSE_ENCRYPT, 1 /* key_id */,
+                                             AuthProxy(auth_set, empty), empty, 0 /* op_handle */,
+                                             true /* is_begin */));
+    clock.advance_ms(1);
+    EXPECT_EQ(KM_ERROR_OK, enforcement.AuthorizeOperation(KM_PURPOSE_ENCRYPT, 1 /* key_id */,
+                                                          AuthProxy(auth_set, empty), empty,
+                                                          0 /* op_handle */, true /* is_begin */));
+}
+
+TEST(SoftKeymasterEnforcementClockTest, CoarseClock) {
+    CoarseMonotonicClock coarse;
+    BoottimeClock boottime;
+    EXPECT_GT(coarse.tolerance_ms(), 0U);
+    EXPECT_EQ(0U, boottime.tolerance_ms());
+
+    uint64_t first = coarse.now_ms();
+    EXPECT_NE(0U, first);
+    EXPECT_LE(first, coarse.now_ms());
+}
+
 }; /* namespace test */
 }; /* namespace keymaster */
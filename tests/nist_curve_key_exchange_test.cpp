@@ -97,7 +97,7 @@ TEST(NistCurveKeyExchange, InvalidPublicKey) {
 TEST(NistCurveKeyExchange, TestInfinity) {
     for (auto& curve : kEcCurves) {
         /* Obtain the point at infinity */
-        EC_GROUP* group = ec_get_group(curve);
+        const EC_GROUP* group = ec_get_group(curve);
         EC_POINT* point_at_infinity = EC_POINT_new(group);
         EC_POINT_set_to_infinity(group, point_at_infinity);
         EXPECT_EQ(1, EC_POINT_is_on_curve(group, point_at_infinity, nullptr));